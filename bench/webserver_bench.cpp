@@ -0,0 +1,546 @@
+//
+// Created by Haotian on 2026/10/19.
+//
+
+// Load generator: starts an HttpServer in this process and drives it over loopback with an
+// epoll-based HTTP/1.1 client, then reports throughput and latency percentiles.
+//
+//   webserver_bench [--connections 64] [--pipeline 1] [--keep-alive 1] [--payload 64]
+//                   [--duration 5] [--threads 2] [--port 18080] [--path /payload]
+//                   [--io-threads 0] [--pin 0] [--idle 0] [--max-idle-bytes 0] [--proxy 0]
+//
+// --path other than /payload requests that url instead, e.g. a static file under the working directory.
+//
+// --proxy 1 puts a second server on port + 1 that answers /payload, and the one under load forwards
+// /payload to it (see HttpServer::add_proxy()), so the numbers are those of the proxy path.
+//
+// --idle N measures memory instead of speed: N keep-alive connections make one request each and
+// then stay open, and the growth of the resident set of the process is reported per connection.
+// With --max-idle-bytes the run fails when that is above the limit. The client side keeps an fd and
+// a few bytes per connection, allocated before the first measurement; socket buffers live in the
+// kernel and are not part of the resident set. Both ends are in this process, so N connections
+// take 2N descriptors (see ulimit -n), and they come from 127.0.0.x addresses so more than one
+// range of ephemeral ports is available.
+
+#include "http/HttpServer.h"
+
+#ifdef LINUX
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <string>
+#include <thread>
+#include <vector>
+#include <netinet/tcp.h>
+#include <sys/resource.h>
+
+struct BenchOptions {
+    int connections = 64;
+    int pipeline = 1;
+    bool keep_alive = true;
+    size_t payload = 64;
+    double duration = 5;
+    int threads = 2;
+    int port = 18080;
+    std::string path = "/payload";
+    // Server side, see ThreadTopology
+    int io_threads = 0;
+    bool pin = false;
+    // Idle connections to measure memory with, 0 runs the load test
+    int idle = 0;
+    int64_t max_idle_bytes = 0;
+    // Serve /payload through a reverse proxy to a second server
+    bool proxy = false;
+};
+
+struct BenchResult {
+    uint64_t responses = 0;
+    uint64_t errors = 0;
+    uint64_t bytes = 0;
+    std::vector<int64_t> latencies{};
+};
+
+static int64_t now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+class BenchConnection {
+    const BenchOptions &m_options;
+    const std::string &m_request;
+    int m_fd = -1;
+    std::string m_input{};
+    std::string m_output{};
+    size_t m_output_sent = 0;
+    // Send times of the requests waiting for a response, oldest first
+    std::deque<int64_t> m_in_flight{};
+
+public:
+    BenchConnection(const BenchOptions &options, const std::string &request)
+        : m_options(options), m_request(request) {
+    }
+
+    [[nodiscard]] int fd() const {
+        return m_fd;
+    }
+
+    bool open(const int epoll_fd) {
+        m_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        if (m_fd == -1) return false;
+        int one = 1;
+        setsockopt(m_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        sockaddr_in address{};
+        address.sin_family = AF_INET;
+        address.sin_port = htons(m_options.port);
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (connect(m_fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) == -1 && errno != EINPROGRESS) {
+            ::close(m_fd);
+            m_fd = -1;
+            return false;
+        }
+        epoll_event event{};
+        event.events = EPOLLIN | EPOLLOUT | EPOLLET;
+        event.data.ptr = this;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, m_fd, &event);
+        m_input.clear();
+        m_output.clear();
+        m_output_sent = 0;
+        m_in_flight.clear();
+        fill_pipeline();
+        return true;
+    }
+
+    void close() {
+        if (m_fd != -1) ::close(m_fd);
+        m_fd = -1;
+    }
+
+    // Queue requests until the pipeline is full, a closing connection carries one request only
+    void fill_pipeline() {
+        const int depth = m_options.keep_alive ? m_options.pipeline : 1;
+        while (static_cast<int>(m_in_flight.size()) < depth) {
+            m_output += m_request;
+            m_in_flight.push_back(now_ns());
+        }
+    }
+
+    /// @return false when the connection has to be replaced
+    bool flush() {
+        while (m_output_sent < m_output.size()) {
+            const auto ret = send(m_fd, m_output.data() + m_output_sent, m_output.size() - m_output_sent,
+                                  MSG_NOSIGNAL);
+            if (ret < 0) return errno == EAGAIN || errno == EWOULDBLOCK;
+            m_output_sent += ret;
+        }
+        m_output.clear();
+        m_output_sent = 0;
+        return true;
+    }
+
+    /// Read and account responses.
+    /// @return false when the connection has to be replaced
+    bool receive(BenchResult &result, const bool is_running) {
+        char buffer[64 * 1024];
+        while (true) {
+            const auto ret = recv(m_fd, buffer, sizeof(buffer), 0);
+            if (ret > 0) {
+                m_input.append(buffer, ret);
+                continue;
+            }
+            if (ret == 0) break;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            result.errors++;
+            return false;
+        }
+
+        while (!m_in_flight.empty()) {
+            const auto header_end = m_input.find("\r\n\r\n");
+            if (header_end == std::string::npos) break;
+            size_t content_length = 0;
+            const auto length_at = m_input.find("Content-Length:");
+            if (length_at != std::string::npos && length_at < header_end) {
+                content_length = strtoull(m_input.c_str() + length_at + 15, nullptr, 10);
+            }
+            const size_t total = header_end + 4 + content_length;
+            if (m_input.size() < total) break;
+
+            if (m_input.compare(0, 12, "HTTP/1.1 200") != 0) result.errors++;
+            result.responses++;
+            result.bytes += total;
+            result.latencies.emplace_back(now_ns() - m_in_flight.front());
+            m_in_flight.pop_front();
+            m_input.erase(0, total);
+        }
+        if (!m_options.keep_alive) return !m_in_flight.empty();
+        if (is_running) fill_pipeline();
+        return flush();
+    }
+};
+
+static void run_client(const BenchOptions &options, const int connections, const int64_t deadline,
+                       BenchResult &result) {
+    std::string request = options.path;
+    if (options.path == "/payload") request += "?size=" + std::to_string(options.payload);
+    request = "GET " + request + " HTTP/1.1\r\nHost: localhost\r\n";
+    if (!options.keep_alive) request += "Connection: close\r\n";
+    request += "\r\n";
+
+    const int epoll_fd = epoll_create1(0);
+    std::vector<std::unique_ptr<BenchConnection> > pool;
+    for (int i = 0; i < connections; i++) {
+        pool.emplace_back(std::make_unique<BenchConnection>(options, request));
+        if (!pool.back()->open(epoll_fd)) result.errors++;
+    }
+
+    std::vector<epoll_event> events(1024);
+    while (now_ns() < deadline) {
+        const int count = epoll_wait(epoll_fd, events.data(), static_cast<int>(events.size()), 100);
+        for (int i = 0; i < count; i++) {
+            auto *connection = static_cast<BenchConnection *>(events[i].data.ptr);
+            bool is_alive = (events[i].events & EPOLLERR) == 0;
+            if (is_alive && (events[i].events & EPOLLOUT)) is_alive = connection->flush();
+            if (is_alive && (events[i].events & (EPOLLIN | EPOLLHUP))) {
+                is_alive = connection->receive(result, true);
+            }
+            if (!is_alive) {
+                // Without keep-alive this is the normal end of a connection
+                connection->close();
+                if (!connection->open(epoll_fd)) result.errors++;
+            }
+        }
+    }
+    for (auto &connection: pool) connection->close();
+    close(epoll_fd);
+}
+
+// Client end of an idle connection, kept small so it hardly shows in the measurement
+struct IdleConnection {
+    int fd = -1;
+    // Bytes of the request sent so far
+    uint16_t sent = 0;
+    // How much of the \r\n\r\n ending the response header has been seen
+    uint8_t header_end = 0;
+    bool is_done = false;
+};
+
+static int64_t resident_bytes() {
+    FILE *file = fopen("/proc/self/statm", "r");
+    if (file == nullptr) return 0;
+    long long pages = 0, resident = 0;
+    const int count = fscanf(file, "%lld %lld", &pages, &resident);
+    fclose(file);
+    return count == 2 ? resident * sysconf(_SC_PAGESIZE) : 0;
+}
+
+static bool open_idle(const BenchOptions &options, const int epoll_fd, const int index, IdleConnection &connection) {
+    connection.fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (connection.fd == -1) return false;
+    // A source address per 16k connections, the ephemeral ports of one would run out
+    int one = 1;
+    setsockopt(connection.fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &one, sizeof(one));
+    sockaddr_in source{};
+    source.sin_family = AF_INET;
+    source.sin_addr.s_addr = htonl(INADDR_LOOPBACK + 1 + index / 16384);
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(options.port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(connection.fd, reinterpret_cast<sockaddr *>(&source), sizeof(source)) == -1
+        || (connect(connection.fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) == -1
+            && errno != EINPROGRESS)) {
+        ::close(connection.fd);
+        connection.fd = -1;
+        return false;
+    }
+    epoll_event event{};
+    event.events = EPOLLIN | EPOLLOUT | EPOLLET;
+    event.data.u32 = index;
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, connection.fd, &event);
+    return true;
+}
+
+/// Send the request and read the response as far as the socket allows.
+/// @return false when the connection failed
+static bool serve_idle(IdleConnection &connection, const std::string &request) {
+    while (connection.sent < request.size()) {
+        const auto ret = send(connection.fd, request.data() + connection.sent, request.size() - connection.sent,
+                              MSG_NOSIGNAL);
+        if (ret < 0) return errno == EAGAIN || errno == EWOULDBLOCK;
+        connection.sent += ret;
+    }
+    // The body is empty, the response ends with its header
+    static constexpr char END[] = "\r\n\r\n";
+    char buffer[4096];
+    while (!connection.is_done) {
+        const auto ret = recv(connection.fd, buffer, sizeof(buffer), 0);
+        if (ret == 0) return false;
+        if (ret < 0) return errno == EAGAIN || errno == EWOULDBLOCK;
+        for (ssize_t i = 0; i < ret && !connection.is_done; i++) {
+            if (buffer[i] == END[connection.header_end]) connection.header_end++;
+            else connection.header_end = buffer[i] == '\r' ? 1 : 0;
+            connection.is_done = connection.header_end == 4;
+        }
+    }
+    return true;
+}
+
+/// Open the idle connections and report the memory they take on the server.
+/// @return exit code of the bench
+static int run_idle(const BenchOptions &options) {
+    // Two descriptors per connection, as many as allowed
+    rlimit limit{};
+    getrlimit(RLIMIT_NOFILE, &limit);
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+    if (static_cast<rlim_t>(options.idle) * 2 + 64 > limit.rlim_cur) {
+        fprintf(stderr, "%d connections need %d descriptors, the limit is %llu\n", options.idle,
+                options.idle * 2 + 64, static_cast<unsigned long long>(limit.rlim_cur));
+        return 1;
+    }
+
+    const std::string request = "GET /payload?size=0 HTTP/1.1\r\nHost: localhost\r\n\r\n";
+    std::vector<IdleConnection> connections(options.idle);
+    std::vector<epoll_event> events(1024);
+    const int epoll_fd = epoll_create1(0);
+    // Let the server settle after the first request before taking the baseline
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    const int64_t before = resident_bytes();
+
+    // A bounded number of handshakes at a time, so the listen backlog never overflows
+    constexpr int MAX_OPENING = 512;
+    int opened = 0, opening = 0, done = 0, failed = 0;
+    const int64_t started_at = now_ns();
+    while (done + failed < options.idle) {
+        while (opened < options.idle && opening < MAX_OPENING) {
+            if (open_idle(options, epoll_fd, opened, connections[opened])) opening++;
+            else failed++;
+            opened++;
+        }
+        const int count = epoll_wait(epoll_fd, events.data(), static_cast<int>(events.size()), 1000);
+        if (count == 0 && now_ns() - started_at > 60 * 1000000000LL) break;
+        for (int i = 0; i < count; i++) {
+            IdleConnection &connection = connections[events[i].data.u32];
+            if (connection.is_done || connection.fd == -1) continue;
+            if ((events[i].events & EPOLLERR) != 0 || !serve_idle(connection, request)) {
+                ::close(connection.fd);
+                connection.fd = -1;
+                failed++;
+                opening--;
+            } else if (connection.is_done) {
+                done++;
+                opening--;
+            }
+        }
+    }
+    const double elapsed = static_cast<double>(now_ns() - started_at) / 1e9;
+    // The server frees what a connection no longer needs once the response is out
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    const int64_t after = resident_bytes();
+    const int64_t per_connection = done > 0 ? (after - before) / done : 0;
+
+    printf("idle connections %d of %d, %d failed, opened in %.1f s\n", done, options.idle, failed, elapsed);
+    printf("resident    %.1f MiB before, %.1f MiB after\n", static_cast<double>(before) / (1024 * 1024),
+           static_cast<double>(after) / (1024 * 1024));
+    printf("per idle connection %lld B\n", static_cast<long long>(per_connection));
+    fflush(stdout);
+
+    for (auto &connection: connections) {
+        if (connection.fd != -1) ::close(connection.fd);
+    }
+    close(epoll_fd);
+    if (done < options.idle) return 2;
+    if (options.max_idle_bytes > 0 && per_connection > options.max_idle_bytes) {
+        fprintf(stderr, "%lld B per idle connection, the limit is %lld B\n", static_cast<long long>(per_connection),
+                static_cast<long long>(options.max_idle_bytes));
+        return 2;
+    }
+    return 0;
+}
+
+static void print_usage() {
+    printf("webserver_bench [--connections N] [--pipeline N] [--keep-alive 0|1] [--payload BYTES]\n"
+        "                [--duration SECONDS] [--threads N] [--port PORT] [--path URL]\n"
+        "                [--io-threads N] [--pin 0|1] [--idle N] [--max-idle-bytes BYTES] [--proxy 0|1]\n");
+}
+
+static bool parse_options(const int argc, char **argv, BenchOptions &options) {
+    for (int i = 1; i < argc; i++) {
+        const std::string name = argv[i];
+        if (name == "--help" || i + 1 >= argc) return false;
+        const char *value = argv[++i];
+        if (name == "--connections") options.connections = atoi(value);
+        else if (name == "--pipeline") options.pipeline = atoi(value);
+        else if (name == "--keep-alive") options.keep_alive = atoi(value) != 0;
+        else if (name == "--payload") options.payload = strtoull(value, nullptr, 10);
+        else if (name == "--duration") options.duration = atof(value);
+        else if (name == "--threads") options.threads = atoi(value);
+        else if (name == "--port") options.port = atoi(value);
+        else if (name == "--path") options.path = value;
+        else if (name == "--io-threads") options.io_threads = atoi(value);
+        else if (name == "--pin") options.pin = atoi(value) != 0;
+        else if (name == "--idle") options.idle = atoi(value);
+        else if (name == "--max-idle-bytes") options.max_idle_bytes = strtoll(value, nullptr, 10);
+        else if (name == "--proxy") options.proxy = atoi(value) != 0;
+        else return false;
+    }
+    return options.connections > 0 && options.pipeline > 0 && options.threads > 0 && options.duration > 0
+           && options.idle >= 0;
+}
+
+static bool wait_until_serving(const BenchOptions &options) {
+    const std::string request = "GET /payload?size=1 HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n";
+    for (int attempt = 0; attempt < 100; attempt++) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        const int fd = socket(AF_INET, SOCK_STREAM, 0);
+        sockaddr_in address{};
+        address.sin_family = AF_INET;
+        address.sin_port = htons(options.port);
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if (connect(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) == 0 &&
+            send(fd, request.data(), request.size(), MSG_NOSIGNAL) > 0) {
+            char buffer[256];
+            if (recv(fd, buffer, sizeof(buffer), 0) > 0) {
+                close(fd);
+                return true;
+            }
+        }
+        close(fd);
+    }
+    return false;
+}
+
+int main(const int argc, char **argv) {
+    BenchOptions options{};
+    if (!parse_options(argc, argv, options)) {
+        print_usage();
+        return 1;
+    }
+
+    HttpServer server(options.port);
+    ThreadTopology topology{};
+    topology.io_threads = options.io_threads;
+    topology.pin_threads = options.pin;
+    server.set_thread_topology(topology);
+    if (options.idle > 0) {
+        // Nothing may close the connections while they are counted
+        ConnectionTimeouts timeouts{};
+        timeouts.keep_alive = 0;
+        server.set_timeouts(timeouts);
+        ConnectionLimits limits{};
+        limits.max_connections = options.idle + 64;
+        server.set_connection_limits(limits);
+    }
+    // One body per size, shared by every response
+    SafeMap<size_t, std::shared_ptr<std::string> > payloads{};
+    const auto serve_payload = [&payloads](HttpServer &origin, HttpRequest &request, HttpResponse &response) {
+        if (request.url != "/payload") {
+            origin.default_callback(request, response);
+            return;
+        }
+        const auto it = request.parameters.find("size");
+        const size_t size = it == request.parameters.end() ? 0 : strtoull(it->second.c_str(), nullptr, 10);
+        if (!payloads.contains_key(size)) {
+            payloads.insert(size, std::make_shared<std::string>(size, 'x'));
+        }
+        response.set_body(payloads[size]);
+        response.insert("Content-Type", "text/plain");
+    };
+    server.set_callback([&server, &serve_payload](HttpRequest &request, HttpResponse &response) {
+        serve_payload(server, request, response);
+    });
+    // The upstream of the proxy, with a thread topology of its own
+    HttpServer upstream(options.port + 1);
+    std::thread upstream_thread{};
+    if (options.proxy) {
+        upstream.set_thread_topology(topology);
+        upstream.set_callback([&upstream, &serve_payload](HttpRequest &request, HttpResponse &response) {
+            serve_payload(upstream, request, response);
+        });
+        upstream_thread = std::thread([&upstream]() {
+            upstream.start_server();
+        });
+        ProxyConfig proxy{};
+        proxy.servers.emplace_back("127.0.0.1:" + std::to_string(options.port + 1));
+        proxy.max_idle_connections = options.connections;
+        if (!server.add_proxy("/payload", proxy)) return 1;
+    }
+    std::thread server_thread([&server]() {
+        server.start_server();
+    });
+    if (!wait_until_serving(options)) {
+        fprintf(stderr, "Server did not come up on port %d\n", options.port);
+        return 1;
+    }
+    if (options.idle > 0) {
+        const int code = run_idle(options);
+        server.stop_server();
+        server_thread.join();
+        if (options.proxy) {
+            upstream.stop_server();
+            upstream_thread.join();
+        }
+        return code;
+    }
+
+    const int64_t started_at = now_ns();
+    const int64_t deadline = started_at + static_cast<int64_t>(options.duration * 1e9);
+    std::vector<BenchResult> results(options.threads);
+    std::vector<std::thread> clients;
+    for (int i = 0; i < options.threads; i++) {
+        const int connections = options.connections / options.threads + (i < options.connections % options.threads);
+        clients.emplace_back([&options, connections, deadline, &result = results[i]]() {
+            run_client(options, connections, deadline, result);
+        });
+    }
+    for (auto &client: clients) client.join();
+    const double elapsed = static_cast<double>(now_ns() - started_at) / 1e9;
+
+    server.stop_server();
+    server_thread.join();
+    if (options.proxy) {
+        upstream.stop_server();
+        upstream_thread.join();
+    }
+
+    BenchResult total{};
+    for (auto &result: results) {
+        total.responses += result.responses;
+        total.errors += result.errors;
+        total.bytes += result.bytes;
+        total.latencies.insert(total.latencies.end(), result.latencies.begin(), result.latencies.end());
+    }
+    std::sort(total.latencies.begin(), total.latencies.end());
+    const auto percentile = [&total](const double p) {
+        if (total.latencies.empty()) return 0.0;
+        const auto index = std::min(total.latencies.size() - 1,
+                                    static_cast<size_t>(p * static_cast<double>(total.latencies.size())));
+        return static_cast<double>(total.latencies[index]) / 1e3;
+    };
+
+    printf("connections %d, pipeline %d, keep-alive %d, payload %zu B, %d client threads, %.1f s%s\n",
+           options.connections, options.keep_alive ? options.pipeline : 1, options.keep_alive ? 1 : 0,
+           options.payload, options.threads, elapsed, options.proxy ? ", through the proxy" : "");
+    printf("requests/s  %.0f\n", static_cast<double>(total.responses) / elapsed);
+    printf("MiB/s       %.1f\n", static_cast<double>(total.bytes) / elapsed / (1024 * 1024));
+    printf("latency us  p50 %.1f  p99 %.1f  p999 %.1f  max %.1f\n",
+           percentile(0.5), percentile(0.99), percentile(0.999), percentile(1.0));
+    printf("responses   %llu, errors %llu\n", static_cast<unsigned long long>(total.responses),
+           static_cast<unsigned long long>(total.errors));
+    fflush(stdout);
+    return total.errors == 0 ? 0 : 2;
+}
+
+#else
+
+#include <cstdio>
+
+int main() {
+    printf("webserver_bench needs epoll and runs on Linux only\n");
+    return 0;
+}
+
+#endif
@@ -0,0 +1,225 @@
+//
+// Created by Haotian on 2026/10/19.
+//
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <functional>
+#include <new>
+#include <unordered_map>
+#include <utility>
+#include <stringzilla.hpp>
+
+/// Monotonic memory for the objects of one request. Allocation bumps a pointer, freeing is a no-op
+/// (except for the latest allocation, which is given back so a growing string reuses its space),
+/// and reset() drops everything at once. Blocks are recycled through a per-thread pool, so once a
+/// thread has warmed up, serving a request does not touch the global heap.
+class Arena {
+    static constexpr size_t BLOCK_SIZE = 16 * 1024;
+    // Standard blocks cached per thread
+    static constexpr size_t MAX_POOLED_BLOCKS = 256;
+
+    struct Block {
+        Block *next;
+        size_t size;
+    };
+
+    struct BlockPool {
+        Block *blocks = nullptr;
+        size_t count = 0;
+
+        ~BlockPool() {
+            while (blocks != nullptr) {
+                Block *next = blocks->next;
+                std::free(blocks);
+                blocks = next;
+            }
+        }
+    };
+
+    static BlockPool &get_pool() {
+        thread_local BlockPool pool{};
+        return pool;
+    }
+
+    Block *m_blocks = nullptr;
+    char *m_current = nullptr;
+    char *m_end = nullptr;
+
+    static char *begin_of(Block *block) {
+        return reinterpret_cast<char *>(block) + sizeof(Block);
+    }
+
+    static Block *new_block(const size_t min_size) {
+        auto &pool = get_pool();
+        if (min_size <= BLOCK_SIZE - sizeof(Block) && pool.blocks != nullptr) {
+            Block *block = pool.blocks;
+            pool.blocks = block->next;
+            pool.count--;
+            return block;
+        }
+        const size_t size = std::max(BLOCK_SIZE, min_size + sizeof(Block));
+        auto *block = static_cast<Block *>(std::malloc(size));
+        if (block == nullptr) throw std::bad_alloc();
+        block->size = size;
+        return block;
+    }
+
+    static void free_block(Block *block) {
+        auto &pool = get_pool();
+        if (block->size == BLOCK_SIZE && pool.count < MAX_POOLED_BLOCKS) {
+            block->next = pool.blocks;
+            pool.blocks = block;
+            pool.count++;
+            return;
+        }
+        std::free(block);
+    }
+
+    static Arena *&current_slot() {
+        thread_local Arena *current = nullptr;
+        return current;
+    }
+
+public:
+    Arena() = default;
+
+    Arena(const Arena &other) = delete;
+
+    Arena &operator=(const Arena &other) = delete;
+
+    ~Arena() {
+        reset();
+    }
+
+    void *allocate(const size_t size, const size_t alignment = alignof(std::max_align_t)) {
+        auto address = reinterpret_cast<uintptr_t>(m_current);
+        address = (address + alignment - 1) & ~(alignment - 1);
+        if (m_current == nullptr || address + size > reinterpret_cast<uintptr_t>(m_end)) {
+            Block *block = new_block(size + alignment);
+            block->next = m_blocks;
+            m_blocks = block;
+            m_current = begin_of(block);
+            m_end = reinterpret_cast<char *>(block) + block->size;
+            address = (reinterpret_cast<uintptr_t>(m_current) + alignment - 1) & ~(alignment - 1);
+        }
+        m_current = reinterpret_cast<char *>(address + size);
+        return reinterpret_cast<void *>(address);
+    }
+
+    /// Only the latest allocation is given back, anything else stays until reset().
+    void deallocate(void *pointer, const size_t size) {
+        if (static_cast<char *>(pointer) + size == m_current) {
+            m_current = static_cast<char *>(pointer);
+        }
+    }
+
+    /// Release everything allocated so far. Objects living in the arena must be gone by then.
+    void reset() {
+        while (m_blocks != nullptr) {
+            Block *next = m_blocks->next;
+            free_block(m_blocks);
+            m_blocks = next;
+        }
+        m_current = nullptr;
+        m_end = nullptr;
+    }
+
+    /// The arena ArenaAllocator allocates from on this thread, nullptr for the global heap
+    static Arena *current() {
+        return current_slot();
+    }
+
+    friend class ArenaScope;
+};
+
+/// Makes an arena the current one of this thread for the lifetime of the scope.
+class ArenaScope {
+    Arena *m_previous;
+
+public:
+    explicit ArenaScope(Arena &arena)
+        : ArenaScope(&arena) {
+    }
+
+    /// nullptr makes the global heap current, e.g. for code that must not allocate from an arena
+    explicit ArenaScope(Arena *arena)
+        : m_previous(Arena::current_slot()) {
+        Arena::current_slot() = arena;
+    }
+
+    ArenaScope(const ArenaScope &other) = delete;
+
+    ArenaScope &operator=(const ArenaScope &other) = delete;
+
+    ~ArenaScope() {
+        Arena::current_slot() = m_previous;
+    }
+};
+
+/// Stateless allocator taking memory from the current arena of the thread, or from the global heap
+/// outside of any ArenaScope. Each allocation remembers where it came from, so it may be freed
+/// under any scope. Stateless because sz::basic_string does not support anything else.
+template<typename T>
+struct ArenaAllocator {
+    using value_type = T;
+    using is_always_equal = std::true_type;
+
+    // Keeps the payload aligned like malloc
+    struct alignas(alignof(std::max_align_t)) Header {
+        Arena *arena;
+    };
+
+    ArenaAllocator() noexcept = default;
+
+    template<typename U>
+    ArenaAllocator(const ArenaAllocator<U> &) noexcept {
+    }
+
+    T *allocate(const size_t count) {
+        static_assert(alignof(T) <= alignof(std::max_align_t), "Over-aligned types are not supported");
+        const size_t size = sizeof(Header) + count * sizeof(T);
+        Arena *arena = Arena::current();
+        void *memory = arena != nullptr ? arena->allocate(size) : ::operator new(size);
+        static_cast<Header *>(memory)->arena = arena;
+        return reinterpret_cast<T *>(static_cast<Header *>(memory) + 1);
+    }
+
+    void deallocate(T *pointer, const size_t count) noexcept {
+        auto *header = reinterpret_cast<Header *>(pointer) - 1;
+        if (header->arena == nullptr) {
+            ::operator delete(header);
+        } else {
+            header->arena->deallocate(header, sizeof(Header) + count * sizeof(T));
+        }
+    }
+
+    template<typename U>
+    bool operator==(const ArenaAllocator<U> &) const noexcept {
+        return true;
+    }
+
+    template<typename U>
+    bool operator!=(const ArenaAllocator<U> &) const noexcept {
+        return false;
+    }
+};
+
+using ArenaString = sz::basic_string<char, ArenaAllocator<char> >;
+
+struct ArenaStringHash {
+    size_t operator()(const ArenaString &value) const noexcept {
+        return sz::string_view(value).hash();
+    }
+};
+
+template<typename V>
+using ArenaMap = std::unordered_map<ArenaString, V, ArenaStringHash, std::equal_to<ArenaString>,
+    ArenaAllocator<std::pair<const ArenaString, V> > >;
+
+#endif //ARENA_H
@@ -0,0 +1,93 @@
+//
+// Created by Haotian on 2026/10/19.
+//
+
+#ifndef BUFFER_WRITER_H
+#define BUFFER_WRITER_H
+
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <string_view>
+#include <vector>
+
+#include "../tcp/multiplexing/Multiplexing.h"
+
+/// Composes bytes into SocketBuffers and appends the filled ones to a list of SendBuffers, so what
+/// is written ends up in as few sends as possible. SocketBuffers come from a per-thread pool: a
+/// buffer is free again once the pool holds the only reference, i.e. its bytes have been sent, so
+/// a steady stream of responses reuses the same few buffers.
+class BufferWriter {
+    // SocketBuffers recycled per thread
+    static constexpr size_t MAX_POOLED_BUFFERS = 64;
+
+    std::vector<SendBuffer> &m_buffers;
+    std::shared_ptr<SocketBuffer> m_current{};
+
+    static std::shared_ptr<SocketBuffer> acquire_buffer() {
+        thread_local std::vector<std::shared_ptr<SocketBuffer> > pool{};
+        thread_local size_t next = 0;
+        for (size_t i = 0; i < pool.size(); i++) {
+            auto &buffer = pool[(next + i) % pool.size()];
+            if (buffer.use_count() == 1) {
+                next = (next + i + 1) % pool.size();
+                buffer->size = 0;
+                buffer->p_current = buffer->buffer;
+                return buffer;
+            }
+        }
+        auto buffer = std::make_shared<SocketBuffer>();
+        if (pool.size() < MAX_POOLED_BUFFERS) pool.emplace_back(buffer);
+        return buffer;
+    }
+
+public:
+    explicit BufferWriter(std::vector<SendBuffer> &buffers)
+        : m_buffers(buffers) {
+    }
+
+    BufferWriter(const BufferWriter &other) = delete;
+
+    BufferWriter &operator=(const BufferWriter &other) = delete;
+
+    void put(const char *data, ssize_t length) {
+        while (length > 0) {
+            if (m_current == nullptr) m_current = acquire_buffer();
+            SocketBuffer &buffer = *m_current;
+            const ssize_t write_size = std::min(length, SocketBuffer::MAX_SIZE - buffer.size);
+            memcpy(buffer.p_current, data, write_size);
+            buffer.size += write_size;
+            buffer.p_current += write_size;
+            data += write_size;
+            length -= write_size;
+            if (buffer.size == SocketBuffer::MAX_SIZE) flush();
+        }
+    }
+
+    void put(const std::string_view str) {
+        put(str.data(), static_cast<ssize_t>(str.size()));
+    }
+
+    /// Room left in the current buffer, what can still be put without starting another send
+    [[nodiscard]] ssize_t room() const {
+        return m_current == nullptr ? 0 : SocketBuffer::MAX_SIZE - m_current->size;
+    }
+
+    /// Queue what has been put so far
+    void flush() {
+        if (m_current != nullptr && m_current->size > 0) {
+            m_buffers.emplace_back(m_current);
+        }
+        m_current = nullptr;
+    }
+
+    /// Queue a buffer by reference after what has been put so far. With more_before, the bytes in
+    /// front of it may wait to share a packet with it (see SendBuffer::more).
+    void append(const SendBuffer &buffer, const bool more_before = false) {
+        flush();
+        if (more_before && !m_buffers.empty()) m_buffers.back().more = true;
+        m_buffers.emplace_back(buffer);
+    }
+};
+
+#endif //BUFFER_WRITER_H
@@ -6,6 +6,7 @@
 #define FILE_SYSTEM_H
 
 #include <stringzilla.hpp>
+#include <ctime>
 #include <filesystem>
 
 namespace fs = std::filesystem;
@@ -19,66 +20,51 @@ class FileSystem {
         return system_clock::to_time_t(sctp);
     }
 
-    static std::string time_to_gmt_string(const std::time_t time) {
-        // Convert time_t to GMT time
-        const std::tm *gmt_time = std::gmtime(&time);
-        static char buffer[30];
-
-        // RFC 1123 Format
-        std::strftime(buffer, sizeof(buffer), "%a, %d %b %Y %H:%M:%S GMT", gmt_time);
-
-        return {buffer};
-    }
-
 public:
     FileSystem() = delete;
 
     static std::string get_last_modified(const std::string &path) {
         const fs::path fs_path(path);
         const auto time = last_write_time(fs_path);
-        const auto time_t = to_time_t(time);
-        return time_to_gmt_string(time_t);
+        char buffer[32];
+        return {buffer, format_http_date(to_time_t(time), buffer, sizeof(buffer))};
+    }
+
+    /// RFC 1123 date as used by Last-Modified, e.g. "Mon, 19 Oct 2026 12:47:14 GMT".
+    /// @return the length written to buffer, which should hold 30 bytes
+    static size_t format_http_date(const std::time_t time, char *buffer, const size_t size) {
+        std::tm gmt_time{};
+#ifdef WINDOWS
+        gmtime_s(&gmt_time, &time);
+#else
+        gmtime_r(&time, &gmt_time);
+#endif
+        return std::strftime(buffer, size, "%a, %d %b %Y %H:%M:%S GMT", &gmt_time);
     }
 
     static bool is_directory(const std::string &path) {
         return fs::is_directory(path);
     }
 
+    /// Collapse runs of separators into the first one. Request paths are normalized completely
+    /// by UrlHelper::decode_path already, this is for paths put together from pieces.
     template<typename Str = std::string>
     static Str normalize_path(const Str &path) {
-        Str result;
-        bool is_directory = false;
-        const size_t length = path.length();
-
-        for (size_t i = 0; i < length; ++i) {
-            if (path[i] == '/' || path[i] == '\\') {
-                // 如果当前字符和上一个字符都是 '/'，则跳过
-                if (!result.empty() && result.back() == '/') {
-                    continue;
-                }
-            }
-            result += path[i];
-        }
-
-        // 检查是否为目录路径
-        if (!result.empty() && result.back() == '/') {
-            is_directory = true;
-        } else if (!result.empty() && path.back() == '/') {
-            result += '/';
-            is_directory = true;
+        Str result(path);
+        char *output = result.data();
+        size_t length = 0;
+        for (size_t i = 0; i < path.size(); ++i) {
+            const char ch = path[i];
+            if ((ch == '/' || ch == '\\') && length > 0 && output[length - 1] == '/') continue;
+            output[length++] = ch;
         }
-
-        // 移除末尾的 '/' 除非它是目录路径
-        if (!is_directory && !result.empty() && result.back() == '/') {
-            result.pop_back();
-        }
-
-        return std::move(result);
+        result.resize(length);
+        return result;
     }
 
     static bool contains_pattern(const sz::string_view &path, const sz::string_view &pattern) {
-        const sz::string_view norm_path = normalize_path<sz::string>(path);
-        const sz::string_view norm_pattern = normalize_path<sz::string>(pattern);
+        const sz::string norm_path = normalize_path<sz::string>(path);
+        const sz::string norm_pattern = normalize_path<sz::string>(pattern);
         return norm_path.starts_with(norm_pattern);
     }
 };
@@ -0,0 +1,318 @@
+//
+// Created by Haotian on 2026/10/19.
+//
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/// Log-bucketed latency histogram in nanoseconds (HDR style): every power of two is split into
+/// SUB_BUCKETS linear buckets, so a value is known within 1/SUB_BUCKETS of itself at any scale.
+/// Written by one thread only, read by anyone.
+class LatencyHistogram {
+public:
+    static constexpr int SUB_BITS = 2;
+    static constexpr int SUB_BUCKETS = 1 << SUB_BITS;
+    static constexpr int OCTAVES = 64 - SUB_BITS;
+    static constexpr int BUCKETS = (OCTAVES + 1) * SUB_BUCKETS;
+
+private:
+    std::atomic<uint64_t> m_buckets[BUCKETS]{};
+    std::atomic<uint64_t> m_count{0};
+    std::atomic<uint64_t> m_sum{0};
+
+    // Single writer: a plain load and store is enough, no locked instruction needed
+    static void bump(std::atomic<uint64_t> &value, const uint64_t delta) {
+        value.store(value.load(std::memory_order_relaxed) + delta, std::memory_order_relaxed);
+    }
+
+public:
+    static int bucket_of(const uint64_t value) {
+        if (value < SUB_BUCKETS) return static_cast<int>(value);
+        const int octave = 63 - __builtin_clzll(value) - SUB_BITS + 1;
+        return octave * SUB_BUCKETS + static_cast<int>((value >> (octave - 1)) & (SUB_BUCKETS - 1));
+    }
+
+    /// Smallest value that falls into bucket
+    static uint64_t lower_bound(const int bucket) {
+        if (bucket < SUB_BUCKETS) return bucket;
+        const int octave = bucket / SUB_BUCKETS;
+        return (static_cast<uint64_t>(SUB_BUCKETS + bucket % SUB_BUCKETS)) << (octave - 1);
+    }
+
+    void record(const uint64_t value) {
+        bump(m_buckets[bucket_of(value)], 1);
+        bump(m_count, 1);
+        bump(m_sum, value);
+    }
+
+    /// Add this histogram into the plain arrays of a snapshot
+    void add_to(std::vector<uint64_t> &buckets, uint64_t &count, uint64_t &sum) const {
+        for (int i = 0; i < BUCKETS; i++) buckets[i] += m_buckets[i].load(std::memory_order_relaxed);
+        count += m_count.load(std::memory_order_relaxed);
+        sum += m_sum.load(std::memory_order_relaxed);
+    }
+};
+
+enum class Counter {
+    CONNECTIONS_ACCEPTED,
+    CONNECTIONS_REJECTED,
+    CONNECTIONS_CLOSED,
+    CONNECTIONS_TIMED_OUT,
+    // A connection used up its read budget and was put back behind the others
+    READ_YIELDS,
+    TLS_HANDSHAKES,
+    // Handshakes that resumed an earlier session, by session id or ticket
+    TLS_RESUMPTIONS,
+    TLS_HANDSHAKE_FAILURES,
+    // Handshakes after which the kernel took over encryption (kTLS)
+    KTLS_CONNECTIONS,
+    WEBSOCKET_UPGRADES,
+    // Complete WebSocket messages received, fragments put together
+    WEBSOCKET_MESSAGES,
+    // Broadcast messages queued to a subscriber, or skipped / disconnected for having too much queued
+    BROADCAST_DELIVERIES,
+    BROADCAST_DROPS,
+    BROADCAST_DISCONNECTS,
+    // Requests forwarded to an upstream server, over a new or a pooled connection
+    PROXY_REQUESTS,
+    PROXY_CONNECTS,
+    PROXY_REUSES,
+    // Upstream connections that were refused, broke or timed out before a response, or sent a malformed one
+    PROXY_FAILURES,
+    // Body bytes moved between a client and an upstream server with splice(), never copied to user space
+    PROXY_SPLICED_BYTES,
+    REQUESTS,
+    RESPONSES_1XX,
+    RESPONSES_2XX,
+    RESPONSES_3XX,
+    RESPONSES_4XX,
+    RESPONSES_5XX,
+    BYTES_SENT,
+    COUNT
+};
+
+enum class Latency {
+    // From accept() until the I/O thread sees the connection first
+    ACCEPT,
+    // From the first byte of a request until it is parsed
+    PARSE,
+    // Time spent in the callback producing the response
+    HANDLER,
+    // From the response being queued until its last byte is handed to the kernel
+    SEND,
+    COUNT
+};
+
+/// Server metrics. Every thread writes to a slot of its own, padded to whole cache lines, so the
+/// I/O threads never share a line; a scrape adds the slots up.
+class Metrics {
+    static constexpr int COUNTERS = static_cast<int>(Counter::COUNT);
+    static constexpr int LATENCIES = static_cast<int>(Latency::COUNT);
+
+    struct alignas(64) Slot {
+        std::atomic<uint64_t> counters[COUNTERS]{};
+        LatencyHistogram latencies[LATENCIES]{};
+    };
+
+    std::mutex m_mutex{};
+    // Slots outlive their threads, the counts of a finished thread still belong to the totals.
+    std::vector<std::unique_ptr<Slot> > m_slots{};
+
+    Metrics() = default;
+
+    Slot &get_slot() {
+        thread_local Slot *slot = nullptr;
+        if (slot == nullptr) {
+            auto owned = std::make_unique<Slot>();
+            slot = owned.get();
+            std::lock_guard lock(m_mutex);
+            m_slots.emplace_back(std::move(owned));
+        }
+        return *slot;
+    }
+
+    static void append_counter(std::string &output, const char *name, const char *help, const uint64_t value,
+                               const char *type = "counter") {
+        char line[64];
+        output += "# HELP ";
+        output += name;
+        output += ' ';
+        output += help;
+        output += "\n# TYPE ";
+        output += name;
+        output += ' ';
+        output += type;
+        output += '\n';
+        output += name;
+        snprintf(line, sizeof(line), " %llu\n", static_cast<unsigned long long>(value));
+        output += line;
+    }
+
+    // Cumulative buckets at every power of two from 1 us up, in seconds as Prometheus expects
+    static void append_histogram(std::string &output, const char *name, const char *help,
+                                 const std::vector<uint64_t> &buckets, const uint64_t count, const uint64_t sum) {
+        char line[128];
+        output += "# HELP ";
+        output += name;
+        output += ' ';
+        output += help;
+        output += "\n# TYPE ";
+        output += name;
+        output += " histogram\n";
+        uint64_t cumulative = 0;
+        int bucket = 0;
+        for (uint64_t bound_ns = 1024; bound_ns <= (1ull << 36); bound_ns <<= 1) {
+            while (bucket < LatencyHistogram::BUCKETS && LatencyHistogram::lower_bound(bucket) < bound_ns) {
+                cumulative += buckets[bucket++];
+            }
+            snprintf(line, sizeof(line), "%s_bucket{le=\"%.9g\"} %llu\n", name, static_cast<double>(bound_ns) / 1e9,
+                     static_cast<unsigned long long>(cumulative));
+            output += line;
+        }
+        snprintf(line, sizeof(line), "%s_bucket{le=\"+Inf\"} %llu\n", name, static_cast<unsigned long long>(count));
+        output += line;
+        snprintf(line, sizeof(line), "%s_sum %.9f\n", name, static_cast<double>(sum) / 1e9);
+        output += line;
+        snprintf(line, sizeof(line), "%s_count %llu\n", name, static_cast<unsigned long long>(count));
+        output += line;
+    }
+
+public:
+    Metrics(const Metrics &other) = delete;
+
+    Metrics &operator=(const Metrics &other) = delete;
+
+    static Metrics *get_metrics() {
+        static auto *instance = new Metrics();
+        return instance;
+    }
+
+    static int64_t now() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    void add(const Counter counter, const uint64_t delta = 1) {
+        auto &value = get_slot().counters[static_cast<int>(counter)];
+        value.store(value.load(std::memory_order_relaxed) + delta, std::memory_order_relaxed);
+    }
+
+    /// @param started_at a value of now()
+    void record_since(const Latency latency, const int64_t started_at) {
+        const int64_t elapsed = now() - started_at;
+        get_slot().latencies[static_cast<int>(latency)].record(elapsed > 0 ? elapsed : 0);
+    }
+
+    void record(const Latency latency, const uint64_t nanoseconds) {
+        get_slot().latencies[static_cast<int>(latency)].record(nanoseconds);
+    }
+
+    [[nodiscard]] uint64_t get(const Counter counter) {
+        uint64_t total = 0;
+        std::lock_guard lock(m_mutex);
+        for (const auto &slot: m_slots) {
+            total += slot->counters[static_cast<int>(counter)].load(std::memory_order_relaxed);
+        }
+        return total;
+    }
+
+    /// Everything in the Prometheus text format (version 0.0.4)
+    std::string to_prometheus() {
+        uint64_t counters[COUNTERS]{};
+        std::vector<std::vector<uint64_t> > buckets(LATENCIES, std::vector<uint64_t>(LatencyHistogram::BUCKETS));
+        uint64_t counts[LATENCIES]{}, sums[LATENCIES]{}; {
+            std::lock_guard lock(m_mutex);
+            for (const auto &slot: m_slots) {
+                for (int i = 0; i < COUNTERS; i++) counters[i] += slot->counters[i].load(std::memory_order_relaxed);
+                for (int i = 0; i < LATENCIES; i++) slot->latencies[i].add_to(buckets[i], counts[i], sums[i]);
+            }
+        }
+        const auto counter = [&counters](Counter which) {
+            return counters[static_cast<int>(which)];
+        };
+
+        std::string output;
+        output.reserve(16 * 1024);
+        append_counter(output, "webserver_connections_accepted_total", "Connections accepted.",
+                       counter(Counter::CONNECTIONS_ACCEPTED));
+        append_counter(output, "webserver_connections_rejected_total", "Connections refused by a connection limit.",
+                       counter(Counter::CONNECTIONS_REJECTED));
+        append_counter(output, "webserver_connections_timed_out_total", "Connections closed by a timeout.",
+                       counter(Counter::CONNECTIONS_TIMED_OUT));
+        const auto closed = counter(Counter::CONNECTIONS_CLOSED);
+        const auto accepted = counter(Counter::CONNECTIONS_ACCEPTED);
+        append_counter(output, "webserver_connections_open", "Connections open right now.",
+                       accepted > closed ? accepted - closed : 0, "gauge");
+        append_counter(output, "webserver_read_yields_total",
+                       "Reads cut short to let the other connections of the thread run.",
+                       counter(Counter::READ_YIELDS));
+        append_counter(output, "webserver_tls_handshakes_total", "TLS handshakes completed.",
+                       counter(Counter::TLS_HANDSHAKES));
+        append_counter(output, "webserver_tls_resumptions_total", "TLS handshakes that resumed a session.",
+                       counter(Counter::TLS_RESUMPTIONS));
+        append_counter(output, "webserver_tls_handshake_failures_total", "TLS handshakes that failed.",
+                       counter(Counter::TLS_HANDSHAKE_FAILURES));
+        append_counter(output, "webserver_ktls_connections_total",
+                       "TLS connections encrypted by the kernel after the handshake.",
+                       counter(Counter::KTLS_CONNECTIONS));
+        append_counter(output, "webserver_websocket_upgrades_total", "Connections upgraded to WebSocket.",
+                       counter(Counter::WEBSOCKET_UPGRADES));
+        append_counter(output, "webserver_websocket_messages_total", "WebSocket messages received.",
+                       counter(Counter::WEBSOCKET_MESSAGES));
+        append_counter(output, "webserver_broadcast_deliveries_total", "Broadcast messages queued to a subscriber.",
+                       counter(Counter::BROADCAST_DELIVERIES));
+        append_counter(output, "webserver_broadcast_drops_total",
+                       "Broadcast messages skipped for a subscriber with too much queued.",
+                       counter(Counter::BROADCAST_DROPS));
+        append_counter(output, "webserver_broadcast_disconnects_total",
+                       "Subscribers disconnected for having too much queued.",
+                       counter(Counter::BROADCAST_DISCONNECTS));
+        append_counter(output, "webserver_proxy_requests_total", "Requests forwarded to an upstream server.",
+                       counter(Counter::PROXY_REQUESTS));
+        append_counter(output, "webserver_proxy_connects_total", "Connections opened to upstream servers.",
+                       counter(Counter::PROXY_CONNECTS));
+        append_counter(output, "webserver_proxy_reuses_total",
+                       "Requests sent over a pooled keep-alive upstream connection.",
+                       counter(Counter::PROXY_REUSES));
+        append_counter(output, "webserver_proxy_failures_total",
+                       "Upstream connections that failed before a complete response header.",
+                       counter(Counter::PROXY_FAILURES));
+        append_counter(output, "webserver_proxy_spliced_bytes_total",
+                       "Body bytes moved between connections with splice().",
+                       counter(Counter::PROXY_SPLICED_BYTES));
+        append_counter(output, "webserver_requests_total", "Requests parsed.", counter(Counter::REQUESTS));
+        append_counter(output, "webserver_sent_bytes_total", "Response bytes queued for sending.",
+                       counter(Counter::BYTES_SENT));
+
+        output += "# HELP webserver_responses_total Responses by status class.\n"
+                "# TYPE webserver_responses_total counter\n";
+        for (int i = 0; i < 5; i++) {
+            char line[64];
+            snprintf(line, sizeof(line), "webserver_responses_total{code=\"%dxx\"} %llu\n", i + 1,
+                     static_cast<unsigned long long>(counters[static_cast<int>(Counter::RESPONSES_1XX) + i]));
+            output += line;
+        }
+
+        static constexpr const char *NAMES[LATENCIES][2] = {
+            {"webserver_accept_seconds", "From accept until the I/O thread takes the connection."},
+            {"webserver_parse_seconds", "From the first byte of a request until it is parsed."},
+            {"webserver_handler_seconds", "Time spent producing a response."},
+            {"webserver_send_seconds", "From a response being queued until it is sent."},
+        };
+        for (int i = 0; i < LATENCIES; i++) {
+            append_histogram(output, NAMES[i][0], NAMES[i][1], buckets[i], counts[i], sums[i]);
+        }
+        return output;
+    }
+};
+
+#endif //METRICS_H
@@ -0,0 +1,109 @@
+//
+// Created by Haotian on 2026/10/19.
+//
+
+#ifndef OPEN_FILE_H
+#define OPEN_FILE_H
+
+#include <string>
+#include <ctime>
+#include <cstdint>
+
+#include "Predefined.h"
+
+#ifdef WINDOWS
+#include <codecvt>
+#include <locale>
+#include <fstream>
+#include <vector>
+#endif
+
+#ifdef LINUX
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#endif
+
+/// A regular file kept open together with what fstat said about it. On Linux the body of a response
+/// is sent straight from the descriptor with sendfile, and every queued response holds a reference,
+/// so a file dropped from the cache is only closed once the last byte of it has been sent.
+/// Windows has no sendfile, the content is read into memory instead.
+class OpenFile {
+    int64_t m_size = 0;
+    std::time_t m_last_modified = 0;
+#ifdef LINUX
+    int m_fd = -1;
+#endif
+#ifdef WINDOWS
+    std::vector<char> m_content{};
+    bool m_good = false;
+#endif
+
+public:
+#ifdef LINUX
+    /// Take over fd, which file_stat describes.
+    OpenFile(const int fd, const struct stat &file_stat)
+        : m_size(file_stat.st_size), m_last_modified(file_stat.st_mtime), m_fd(fd) {
+    }
+#endif
+#ifdef WINDOWS
+    explicit OpenFile(const std::string &utf8_filename) {
+        std::wstring_convert<std::codecvt_utf8<wchar_t> > converter{};
+        std::ifstream file(converter.from_bytes(utf8_filename).c_str(), std::ios::binary);
+        if (!file.is_open()) return;
+        file.seekg(0, std::ios::end);
+        m_content.resize(file.tellg());
+        file.seekg(0, std::ios::beg);
+        file.read(m_content.data(), static_cast<std::streamsize>(m_content.size()));
+        m_size = static_cast<int64_t>(m_content.size());
+        m_good = file.good();
+    }
+
+    [[nodiscard]] const char *data() const {
+        return m_content.data();
+    }
+#endif
+
+    OpenFile(const OpenFile &other) = delete;
+
+    OpenFile &operator=(const OpenFile &other) = delete;
+
+    ~OpenFile() {
+#ifdef LINUX
+        if (m_fd >= 0) close(m_fd);
+#endif
+    }
+
+    /// Ask the kernel to read [offset, offset + length) ahead, used before serving a range.
+    void advise_range(const int64_t offset, const int64_t length) const {
+#ifdef LINUX
+        if (length <= 0) return;
+        posix_fadvise(m_fd, offset, length, POSIX_FADV_WILLNEED);
+#endif
+    }
+
+    [[nodiscard]] bool good() const {
+#ifdef LINUX
+        return m_fd >= 0;
+#endif
+#ifdef WINDOWS
+        return m_good;
+#endif
+    }
+
+#ifdef LINUX
+    [[nodiscard]] int fd() const {
+        return m_fd;
+    }
+#endif
+
+    [[nodiscard]] int64_t size() const {
+        return m_size;
+    }
+
+    [[nodiscard]] std::time_t last_modified() const {
+        return m_last_modified;
+    }
+};
+
+#endif //OPEN_FILE_H
@@ -0,0 +1,134 @@
+//
+// Created by Haotian on 2026/10/19.
+//
+
+#ifndef RATE_LIMITER_H
+#define RATE_LIMITER_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+
+/// Token bucket limiter (limit_req) over a fixed-size table of keys.
+///
+/// Each key holds one bucket, stored as its "theoretical arrival time" (GCRA): the bucket is full when
+/// tat <= now, every request moves tat one interval further, and a request is refused while tat is
+/// more than burst intervals ahead of now. That is a token bucket of `burst` tokens refilled at `rate`
+/// per second, kept in 8 bytes per key.
+///
+/// Keys are 64-bit hashes. The table is split into shards, each with its own spin lock, and every
+/// shard into sets of WAYS entries. A key may only live in its own set, so a lookup touches one cache
+/// line. When a set is full, the entry with the oldest tat is replaced: that is the bucket which has
+/// been idle the longest (approximately LRU), and once tat is in the past the bucket is full anyway,
+/// so forgetting it changes nothing. Memory is fixed no matter how many distinct keys show up.
+class RateLimiter {
+    static constexpr int WAYS = 4;
+    static constexpr int SHARD_BITS = 6;
+    static constexpr int SHARD_COUNT = 1 << SHARD_BITS;
+
+    struct Entry {
+        uint64_t key = 0;
+        // Nanoseconds on the limiter's clock, 0 marks an empty entry
+        int64_t tat = 0;
+    };
+
+    // One cache line
+    struct alignas(64) Set {
+        Entry entries[WAYS]{};
+    };
+
+    struct alignas(64) Shard {
+        std::atomic_flag lock = ATOMIC_FLAG_INIT;
+    };
+
+    const int64_t m_interval_ns;
+    const int64_t m_burst_ns;
+    const std::chrono::steady_clock::time_point m_start;
+    uint64_t m_set_mask;
+    std::unique_ptr<Set[]> m_sets;
+    Shard m_shards[SHARD_COUNT]{};
+
+    [[nodiscard]] int64_t now() const {
+        // Start at one interval so that tat of a used entry is never 0
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                   std::chrono::steady_clock::now() - m_start).count() + m_interval_ns;
+    }
+
+public:
+    /// @param rate requests allowed per second on average
+    /// @param burst requests allowed back to back on top of the rate
+    /// @param capacity keys kept at most, rounded up to a power of two
+    RateLimiter(const double rate, const int64_t burst, const size_t capacity = 1 << 16)
+        : m_interval_ns(static_cast<int64_t>(1e9 / rate)),
+          m_burst_ns(burst * m_interval_ns),
+          m_start(std::chrono::steady_clock::now()) {
+        size_t set_count = SHARD_COUNT;
+        while (set_count * WAYS < capacity) set_count <<= 1;
+        m_set_mask = set_count - 1;
+        m_sets = std::make_unique<Set[]>(set_count);
+    }
+
+    RateLimiter(const RateLimiter &other) = delete;
+
+    RateLimiter &operator=(const RateLimiter &other) = delete;
+
+    /// Take one token from the bucket of key.
+    /// @param retry_after_ms when refused, how long until a token is available
+    /// @return whether the request may proceed
+    bool try_acquire(const uint64_t key, int64_t &retry_after_ms) {
+        const int64_t current = now();
+        const uint64_t set_index = key & m_set_mask;
+        // The low bits of the set index also pick the shard, so a set always has the same lock.
+        auto &shard = m_shards[set_index & (SHARD_COUNT - 1)];
+        Entry *entries = m_sets[set_index].entries;
+
+        while (shard.lock.test_and_set(std::memory_order_acquire)) {
+        }
+        Entry *entry = nullptr;
+        Entry *victim = &entries[0];
+        for (int i = 0; i < WAYS; i++) {
+            if (entries[i].key == key && entries[i].tat != 0) {
+                entry = &entries[i];
+                break;
+            }
+            if (entries[i].tat < victim->tat) victim = &entries[i];
+        }
+        if (entry == nullptr) {
+            entry = victim;
+            entry->key = key;
+            entry->tat = current;
+        }
+
+        const int64_t tat = entry->tat > current ? entry->tat : current;
+        const int64_t allowed_at = tat - m_burst_ns;
+        const bool allowed = current >= allowed_at;
+        if (allowed) {
+            entry->tat = tat + m_interval_ns;
+        }
+        shard.lock.clear(std::memory_order_release);
+
+        retry_after_ms = allowed ? 0 : (allowed_at - current + 999999) / 1000000;
+        return allowed;
+    }
+
+    /// Mix bits of a small key (such as an IPv4 address) so that they spread over the sets.
+    static uint64_t hash(uint64_t value) {
+        // splitmix64 finalizer
+        value += 0x9e3779b97f4a7c15ull;
+        value = (value ^ (value >> 30)) * 0xbf58476d1ce4e5b9ull;
+        value = (value ^ (value >> 27)) * 0x94d049bb133111ebull;
+        return value ^ (value >> 31);
+    }
+
+    static uint64_t hash(const char *data, const size_t length) {
+        // FNV-1a, finalized with the mixer above
+        uint64_t value = 0xcbf29ce484222325ull;
+        for (size_t i = 0; i < length; i++) {
+            value = (value ^ static_cast<unsigned char>(data[i])) * 0x100000001b3ull;
+        }
+        return hash(value);
+    }
+};
+
+#endif //RATE_LIMITER_H
@@ -8,6 +8,9 @@
 
 template<class T>
 class SendQueue {
+    // Entries a drained queue keeps room for, anything beyond goes back to the heap
+    static constexpr size_t KEPT_CAPACITY = 8;
+
     std::vector<T> m_data{};
     // Point to the next available data index
     int m_next_data_idx = 0;
@@ -23,12 +26,12 @@ public:
         m_next_data_idx++;
     }
 
-    void add_data(T &data) {
+    void add_data(const T &data) {
         m_data.push_back(data);
     }
 
     void add_range(const std::vector<T> &data) {
-        m_data.insert(m_data.begin(), data.begin(), data.end());
+        m_data.insert(m_data.end(), data.begin(), data.end());
     }
 
     void submit() {
@@ -39,12 +42,40 @@ public:
         m_data.clear();
         m_next_data_idx = 0;
         m_ready_to_send_idx = 0;
+        if (m_data.capacity() > KEPT_CAPACITY) std::vector<T>().swap(m_data);
     }
 
     [[nodiscard]] bool empty() const {
         return m_next_data_idx >= m_ready_to_send_idx;
     }
 
+    /// Drop what has been sent, so the data it references can be released before the connection closes.
+    void release_sent() {
+        if (m_next_data_idx == 0) return;
+        m_data.erase(m_data.begin(), m_data.begin() + m_next_data_idx);
+        m_ready_to_send_idx -= m_next_data_idx;
+        m_next_data_idx = 0;
+        // A burst leaves a large array behind
+        if (m_data.empty() && m_data.capacity() > KEPT_CAPACITY) std::vector<T>().swap(m_data);
+    }
+
+    /// Drop what has been sent while more still waits, for a connection that never quite catches up.
+    /// Only once the sent part is at least as long as the rest, so the copying stays linear overall.
+    void compact() {
+        if (m_next_data_idx > 0 && static_cast<size_t>(m_next_data_idx) * 2 >= m_data.size()) release_sent();
+    }
+
+    /// Give all room back once everything has been sent, for a connection that waits a while
+    void release_memory() {
+        if (!m_data.empty()) return;
+        std::vector<T>().swap(m_data);
+    }
+
+    /// Entries held, whether sent or not
+    [[nodiscard]] size_t size() const {
+        return m_data.size();
+    }
+
     [[nodiscard]] bool has_uncommitted_data() const {
         return m_ready_to_send_idx < m_data.size();
     }
@@ -0,0 +1,102 @@
+//
+// Created by Haotian on 2026/10/19.
+//
+
+#ifndef SHA1_H
+#define SHA1_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+/// SHA-1 (RFC 3174), only as far as protocols still ask for it: the WebSocket handshake hashes a
+/// key of the client with it. Not for anything that needs a secure hash.
+class Sha1 {
+    uint32_t m_state[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+    unsigned char m_block[64]{};
+    size_t m_block_size = 0;
+    uint64_t m_length = 0;
+
+    static uint32_t rotate(const uint32_t value, const int bits) {
+        return value << bits | value >> (32 - bits);
+    }
+
+    void process_block(const unsigned char *block) {
+        uint32_t w[80];
+        for (int i = 0; i < 16; i++) {
+            w[i] = static_cast<uint32_t>(block[i * 4]) << 24 | static_cast<uint32_t>(block[i * 4 + 1]) << 16
+                   | static_cast<uint32_t>(block[i * 4 + 2]) << 8 | block[i * 4 + 3];
+        }
+        for (int i = 16; i < 80; i++) {
+            w[i] = rotate(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+        }
+        uint32_t a = m_state[0], b = m_state[1], c = m_state[2], d = m_state[3], e = m_state[4];
+        for (int i = 0; i < 80; i++) {
+            uint32_t f, k;
+            if (i < 20) {
+                f = (b & c) | (~b & d);
+                k = 0x5A827999;
+            } else if (i < 40) {
+                f = b ^ c ^ d;
+                k = 0x6ED9EBA1;
+            } else if (i < 60) {
+                f = (b & c) | (b & d) | (c & d);
+                k = 0x8F1BBCDC;
+            } else {
+                f = b ^ c ^ d;
+                k = 0xCA62C1D6;
+            }
+            const uint32_t temp = rotate(a, 5) + f + e + k + w[i];
+            e = d;
+            d = c;
+            c = rotate(b, 30);
+            b = a;
+            a = temp;
+        }
+        m_state[0] += a;
+        m_state[1] += b;
+        m_state[2] += c;
+        m_state[3] += d;
+        m_state[4] += e;
+    }
+
+public:
+    static constexpr size_t DIGEST_SIZE = 20;
+
+    void update(const void *data, size_t size) {
+        auto bytes = static_cast<const unsigned char *>(data);
+        m_length += size;
+        while (size > 0) {
+            const size_t length = std::min(size, sizeof(m_block) - m_block_size);
+            memcpy(m_block + m_block_size, bytes, length);
+            m_block_size += length;
+            bytes += length;
+            size -= length;
+            if (m_block_size == sizeof(m_block)) {
+                process_block(m_block);
+                m_block_size = 0;
+            }
+        }
+    }
+
+    /// Write the digest of everything updated so far to out, after which the object is spent
+    void finish(unsigned char out[DIGEST_SIZE]) {
+        const uint64_t bits = m_length * 8;
+        constexpr unsigned char padding = 0x80;
+        update(&padding, 1);
+        constexpr unsigned char zero = 0;
+        while (m_block_size != 56) update(&zero, 1);
+        unsigned char length[8];
+        for (int i = 0; i < 8; i++) length[i] = static_cast<unsigned char>(bits >> (56 - i * 8));
+        update(length, sizeof(length));
+        for (int i = 0; i < 5; i++) {
+            out[i * 4] = static_cast<unsigned char>(m_state[i] >> 24);
+            out[i * 4 + 1] = static_cast<unsigned char>(m_state[i] >> 16);
+            out[i * 4 + 2] = static_cast<unsigned char>(m_state[i] >> 8);
+            out[i * 4 + 3] = static_cast<unsigned char>(m_state[i]);
+        }
+    }
+};
+
+#endif //SHA1_H
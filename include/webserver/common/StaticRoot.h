@@ -0,0 +1,240 @@
+//
+// Created by Haotian on 2026/10/19.
+//
+
+#ifndef STATIC_ROOT_H
+#define STATIC_ROOT_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <iterator>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+#include "FileSystem.h"
+#include "OpenFile.h"
+#include "Predefined.h"
+#include "../log/Logger.h"
+
+#ifdef LINUX
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/openat2.h>
+#endif
+
+/// Tunables of the cache of resolved paths, see StaticRoot::set_cache
+struct StaticCacheConfig {
+    // Paths remembered at most, the least recently used are forgotten first. Each cached file keeps
+    // a descriptor open, so this should stay well below RLIMIT_NOFILE. 0 disables the cache.
+    size_t capacity = 4096;
+    // How long an entry, a missing file included, is trusted before the path is resolved again
+    int64_t valid_ms = 5000;
+};
+
+/// A directory served as static files. Request paths are resolved against a descriptor of the
+/// directory with openat2(RESOLVE_BENEATH), so the kernel refuses anything that would leave it,
+/// through ".." or through a symlink. Resolved paths are kept in an LRU cache shared by all I/O
+/// threads together with the open descriptor and its stat: a hit costs no open, fstat or close.
+///
+/// Kernels before 5.6 have no openat2. There it falls back to openat, which relies on the path
+/// having been normalized (UrlHelper::decode_path) and follows symlinks like before.
+class StaticRoot {
+public:
+    enum class Kind {
+        NOT_FOUND,
+        FILE,
+        DIRECTORY
+    };
+
+    struct Entry {
+        Kind kind = Kind::NOT_FOUND;
+        // Set for a regular file, shared with every response sending it
+        std::shared_ptr<OpenFile> file{};
+    };
+
+private:
+    struct CacheSlot {
+        std::string path;
+        Entry entry;
+        int64_t expires_at;
+    };
+
+    std::string m_root;
+#ifdef LINUX
+    int m_root_fd = -1;
+    std::atomic<bool> m_has_openat2{true};
+#endif
+    // Off until set_cache()
+    StaticCacheConfig m_config{0};
+
+    std::mutex m_mutex{};
+    // Most recently used first
+    std::list<CacheSlot> m_lru{};
+    // Keys are views of CacheSlot::path, list nodes never move
+    std::unordered_map<std::string_view, std::list<CacheSlot>::iterator> m_index{};
+
+    static int64_t now_ms() {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+#ifdef LINUX
+    // O_NONBLOCK keeps a FIFO placed under the root from blocking the I/O thread, regular files
+    // ignore it.
+    static constexpr int OPEN_FLAGS = O_RDONLY | O_CLOEXEC | O_NOCTTY | O_NONBLOCK;
+
+    int open_beneath(const char *relative_path) {
+        if (m_has_openat2.load(std::memory_order_relaxed)) {
+            open_how how{};
+            how.flags = OPEN_FLAGS;
+            how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS;
+            const long fd = syscall(SYS_openat2, m_root_fd, relative_path, &how, sizeof(how));
+            if (fd >= 0 || errno != ENOSYS) return static_cast<int>(fd);
+            m_has_openat2.store(false, std::memory_order_relaxed);
+            Logger::get_logger()->warn("openat2 is not supported, static files are resolved with openat");
+        }
+        return openat(m_root_fd, relative_path, OPEN_FLAGS);
+    }
+#endif
+
+    // One open and fstat, the descriptor of a regular file stays open in the entry. cacheable is
+    // false when the lookup failed for a reason that may go away, like running out of descriptors.
+    Entry resolve(const std::string_view path, bool &cacheable) {
+        Entry entry{};
+        cacheable = true;
+        // "/a/b" relative to the root is "a/b", "/" is the root itself
+        const std::string relative = path.size() > 1 ? std::string(path.substr(1)) : std::string(".");
+#ifdef LINUX
+        if (m_root_fd < 0) return entry;
+        const int fd = open_beneath(relative.c_str());
+        if (fd < 0) {
+            // EXDEV is openat2 refusing to leave the root
+            cacheable = errno == ENOENT || errno == ENOTDIR || errno == EXDEV || errno == ELOOP
+                        || errno == EACCES || errno == ENAMETOOLONG;
+            return entry;
+        }
+        struct stat file_stat{};
+        if (fstat(fd, &file_stat) != 0) {
+            cacheable = false;
+        } else if (S_ISREG(file_stat.st_mode)) {
+            entry.kind = Kind::FILE;
+            entry.file = std::make_shared<OpenFile>(fd, file_stat);
+            return entry;
+        } else if (S_ISDIR(file_stat.st_mode)) {
+            entry.kind = Kind::DIRECTORY;
+        }
+        close(fd);
+#endif
+#ifdef WINDOWS
+        const std::string filename = m_root + "/" + relative;
+        if (FileSystem::is_directory(filename)) {
+            entry.kind = Kind::DIRECTORY;
+            return entry;
+        }
+        auto file = std::make_shared<OpenFile>(filename);
+        if (file->good()) {
+            entry.kind = Kind::FILE;
+            entry.file = std::move(file);
+        }
+#endif
+        return entry;
+    }
+
+    // Slots leaving the cache are moved to dropped and destroyed once the lock is released, closing
+    // a descriptor does not have to hold up the other threads.
+    bool find_cached(const std::string_view path, Entry &entry, std::list<CacheSlot> &dropped) {
+        std::lock_guard lock(m_mutex);
+        const auto it = m_index.find(path);
+        if (it == m_index.end()) return false;
+        if (it->second->expires_at <= now_ms()) {
+            dropped.splice(dropped.end(), m_lru, it->second);
+            m_index.erase(it);
+            return false;
+        }
+        m_lru.splice(m_lru.begin(), m_lru, it->second);
+        entry = it->second->entry;
+        return true;
+    }
+
+    void insert_cached(const std::string_view path, const Entry &entry, std::list<CacheSlot> &dropped) {
+        std::lock_guard lock(m_mutex);
+        if (m_config.capacity == 0) return;
+        const auto it = m_index.find(path);
+        if (it != m_index.end()) {
+            // Resolved by another thread meanwhile
+            dropped.splice(dropped.end(), m_lru, it->second);
+            m_index.erase(it);
+        }
+        m_lru.push_front(CacheSlot{std::string(path), entry, now_ms() + m_config.valid_ms});
+        m_index.emplace(m_lru.front().path, m_lru.begin());
+        while (m_lru.size() > m_config.capacity) {
+            m_index.erase(m_lru.back().path);
+            dropped.splice(dropped.end(), m_lru, std::prev(m_lru.end()));
+        }
+    }
+
+public:
+    explicit StaticRoot(std::string root)
+        : m_root(std::move(root)) {
+#ifdef LINUX
+        m_root_fd = open(m_root.c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC);
+        if (m_root_fd < 0) {
+            Logger::get_logger()->error("Failed to open static root %s", m_root.c_str());
+        }
+#endif
+    }
+
+    StaticRoot(const StaticRoot &other) = delete;
+
+    StaticRoot &operator=(const StaticRoot &other) = delete;
+
+    ~StaticRoot() {
+#ifdef LINUX
+        if (m_root_fd >= 0) close(m_root_fd);
+#endif
+    }
+
+    /// Cache resolved paths, a capacity of 0 turns the cache off and empties it. Call before serving.
+    void set_cache(const StaticCacheConfig &config) {
+        std::lock_guard lock(m_mutex);
+        m_config = config;
+        if (m_config.capacity == 0) {
+            m_index.clear();
+            m_lru.clear();
+        }
+#ifdef LINUX
+        rlimit limit{};
+        if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY
+            && m_config.capacity >= limit.rlim_cur / 2) {
+            Logger::get_logger()->warn("Static cache capacity %zu leaves few of the %llu descriptors for connections",
+                                       m_config.capacity, static_cast<unsigned long long>(limit.rlim_cur));
+        }
+#endif
+    }
+
+    /// Look up a normalized request path, e.g. "/images/a.png".
+    Entry lookup(const std::string_view path) {
+        Entry entry{};
+        std::list<CacheSlot> dropped{};
+        if (find_cached(path, entry, dropped)) return entry;
+        bool cacheable;
+        entry = resolve(path, cacheable);
+        if (cacheable) insert_cached(path, entry, dropped);
+        return entry;
+    }
+
+    [[nodiscard]] const std::string &path() const {
+        return m_root;
+    }
+};
+
+#endif //STATIC_ROOT_H
@@ -0,0 +1,195 @@
+//
+// Created by Haotian on 2026/10/19.
+//
+
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <chrono>
+#include <cstdint>
+
+/// Intrusive link of a timer. The owner embeds it, so arming and cancelling never allocate.
+struct TimerNode {
+    TimerNode *prev = nullptr;
+    TimerNode *next = nullptr;
+    uint64_t expire_tick = 0;
+    void *owner = nullptr;
+
+    [[nodiscard]] bool is_armed() const {
+        return prev != nullptr;
+    }
+};
+
+/// Hierarchical timer wheel: LEVELS wheels of SLOTS buckets each, a bucket of level n covers
+/// SLOTS^n ticks. Arm and cancel are O(1) list operations; timers far in the future are moved
+/// down one level each time the level below wraps around. Not thread safe, every I/O thread owns one.
+class TimerWheel {
+    static constexpr int SLOT_BITS = 6;
+    static constexpr int SLOTS = 1 << SLOT_BITS;
+    static constexpr uint64_t SLOT_MASK = SLOTS - 1;
+    static constexpr int LEVELS = 4;
+
+    // Sentinels of the circular lists, one per bucket
+    TimerNode m_slots[LEVELS][SLOTS]{};
+    // Bit i is set when bucket i of a level is not empty
+    uint64_t m_occupied[LEVELS]{};
+    uint64_t m_current_tick = 0;
+    size_t m_count = 0;
+    const int64_t m_tick_ms;
+    const std::chrono::steady_clock::time_point m_start;
+
+    void link(TimerNode *node) {
+        const uint64_t delta = node->expire_tick > m_current_tick ? node->expire_tick - m_current_tick : 0;
+        int level = 0;
+        while (level < LEVELS - 1 && delta >= (1ull << (SLOT_BITS * (level + 1)))) {
+            level++;
+        }
+        // Deadlines beyond the last level wait in its farthest bucket and are re-linked from there.
+        uint64_t tick = node->expire_tick;
+        const uint64_t max_delta = (1ull << (SLOT_BITS * LEVELS)) - 1;
+        if (delta > max_delta) tick = m_current_tick + max_delta;
+        const auto slot = (tick >> (SLOT_BITS * level)) & SLOT_MASK;
+
+        TimerNode *head = &m_slots[level][slot];
+        node->prev = head->prev;
+        node->next = head;
+        head->prev->next = node;
+        head->prev = node;
+        m_occupied[level] |= 1ull << slot;
+    }
+
+    static void unlink(TimerNode *node) {
+        node->prev->next = node->next;
+        node->next->prev = node->prev;
+        node->prev = nullptr;
+        node->next = nullptr;
+    }
+
+    void update_occupied(const int level, const uint64_t slot) {
+        const TimerNode &head = m_slots[level][slot];
+        if (head.next == &head) {
+            m_occupied[level] &= ~(1ull << slot);
+        }
+    }
+
+    // Move every timer of one bucket of a higher level down to where it belongs now.
+    void cascade(const int level) {
+        const auto slot = (m_current_tick >> (SLOT_BITS * level)) & SLOT_MASK;
+        TimerNode &head = m_slots[level][slot];
+        TimerNode *node = head.next;
+        head.next = &head;
+        head.prev = &head;
+        m_occupied[level] &= ~(1ull << slot);
+        while (node != &head) {
+            TimerNode *next = node->next;
+            link(node);
+            node = next;
+        }
+    }
+
+    [[nodiscard]] uint64_t to_tick(const int64_t ms) const {
+        return static_cast<uint64_t>(ms / m_tick_ms);
+    }
+
+public:
+    explicit TimerWheel(const int64_t tick_ms = 100)
+        : m_tick_ms(tick_ms), m_start(std::chrono::steady_clock::now()) {
+        for (auto &level: m_slots) {
+            for (auto &head: level) {
+                head.prev = &head;
+                head.next = &head;
+            }
+        }
+    }
+
+    TimerWheel(const TimerWheel &other) = delete;
+
+    TimerWheel &operator=(const TimerWheel &other) = delete;
+
+    /// Milliseconds since the wheel was created
+    [[nodiscard]] int64_t now() const {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now() - m_start).count();
+    }
+
+    /// (Re)arm node to expire timeout_ms from now. Rounded up to the next tick.
+    void arm(TimerNode *node, const int64_t timeout_ms) {
+        if (node->is_armed()) cancel(node);
+        node->expire_tick = to_tick(now() + timeout_ms + m_tick_ms - 1);
+        if (node->expire_tick <= m_current_tick) node->expire_tick = m_current_tick + 1;
+        link(node);
+        m_count++;
+    }
+
+    void cancel(TimerNode *node) {
+        if (!node->is_armed()) return;
+        const TimerNode *next = node->next;
+        unlink(node);
+        m_count--;
+        // A sentinel is always inside m_slots, which tells us which bucket may have become empty.
+        const auto first = &m_slots[0][0];
+        if (next >= first && next < first + LEVELS * SLOTS) {
+            const auto index = next - first;
+            update_occupied(static_cast<int>(index / SLOTS), index % SLOTS);
+        }
+    }
+
+    /// Fire every timer whose deadline has passed. on_expired receives the TimerNode, which is
+    /// already disarmed, so it may be re-armed or the owner destroyed from inside the callback.
+    template<typename Callback>
+    void advance(Callback &&on_expired) {
+        const uint64_t target = to_tick(now());
+        while (m_current_tick < target) {
+            m_current_tick++;
+            // Cascade higher levels whenever the level below wraps around
+            for (int level = 1; level < LEVELS; level++) {
+                if ((m_current_tick & ((1ull << (SLOT_BITS * level)) - 1)) != 0) break;
+                cascade(level);
+            }
+            const auto slot = m_current_tick & SLOT_MASK;
+            TimerNode &head = m_slots[0][slot];
+            while (head.next != &head) {
+                TimerNode *node = head.next;
+                unlink(node);
+                m_count--;
+                // Parked beyond the last level, not due yet.
+                if (node->expire_tick > m_current_tick) {
+                    link(node);
+                    m_count++;
+                    continue;
+                }
+                on_expired(node);
+            }
+            update_occupied(0, slot);
+            if (m_count == 0) {
+                m_current_tick = target;
+            }
+        }
+    }
+
+    /// How long epoll_wait may sleep before the next timer could fire, -1 if no timer is armed.
+    [[nodiscard]] int next_timeout() const {
+        if (m_count == 0) return -1;
+        uint64_t ticks;
+        const auto position = m_current_tick & SLOT_MASK;
+        // Rotate so that bit 0 is the next bucket of level 0
+        const uint64_t rotated = position == SLOT_MASK
+                                     ? m_occupied[0]
+                                     : m_occupied[0] >> (position + 1) | m_occupied[0] << (SLOTS - position - 1);
+        if (rotated != 0) {
+            ticks = __builtin_ctzll(rotated) + 1;
+        } else {
+            // Nothing on level 0, wake up when the next cascade happens.
+            ticks = SLOTS - position;
+        }
+        const int64_t deadline = static_cast<int64_t>((m_current_tick + ticks) * m_tick_ms);
+        const int64_t timeout = deadline - now();
+        return timeout > 0 ? static_cast<int>(timeout) : 0;
+    }
+
+    [[nodiscard]] size_t size() const {
+        return m_count;
+    }
+};
+
+#endif //TIMER_WHEEL_H
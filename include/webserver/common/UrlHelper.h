@@ -4,30 +4,202 @@
 
 #ifndef URL_DECODER_H
 #define URL_DECODER_H
+#include <cstdint>
+#include <cstring>
 #include <string>
-#include <sstream>
+#include <string_view>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/// Percent-decoding of request targets. Nothing here allocates or throws: output goes to a buffer
+/// of the caller, which must hold at least as many bytes as the input, and malformed input is
+/// reported through the return value.
 class UrlHelper {
+    // Value of a hex digit, -1 for anything else
+    static constexpr int8_t HEX_VALUES[256] = {
+        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+        0, 1, 2, 3, 4, 5, 6, 7, 8, 9, -1, -1, -1, -1, -1, -1,
+        -1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+        -1, 10, 11, 12, 13, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    };
+
+    /// Position of the first of the characters A, B, C in [begin, end), end if there is none.
+    /// Sixteen bytes are compared at a time where SSE2 is available.
+    template<char A, char B, char C>
+    static const char *find_any(const char *begin, const char *end) {
+#if defined(__SSE2__)
+        const __m128i a = _mm_set1_epi8(A);
+        const __m128i b = _mm_set1_epi8(B);
+        const __m128i c = _mm_set1_epi8(C);
+        while (end - begin >= 16) {
+            const __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(begin));
+            const __m128i hits = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, a), _mm_cmpeq_epi8(chunk, b)),
+                                              _mm_cmpeq_epi8(chunk, c));
+            const int mask = _mm_movemask_epi8(hits);
+            if (mask != 0) return begin + __builtin_ctz(mask);
+            begin += 16;
+        }
+#endif
+        while (begin < end && *begin != A && *begin != B && *begin != C) begin++;
+        return begin;
+    }
+
+    /// Decode the escape at p, which points to '%'.
+    /// @return the byte, or -1 if fewer than two hex digits follow
+    static int decode_escape(const char *p, const char *end) {
+        if (end - p < 3) return -1;
+        const int high = HEX_VALUES[static_cast<unsigned char>(p[1])];
+        const int low = HEX_VALUES[static_cast<unsigned char>(p[2])];
+        if (high < 0 || low < 0) return -1;
+        return high << 4 | low;
+    }
+
+    // Close the segment that starts at segment_begin and ends at length: drop it if it is empty
+    // or ".", drop it and the one before if it is "..". False when ".." would leave the root.
+    static bool close_segment(const char *output, size_t &length, size_t &segment_begin) {
+        const size_t size = length - segment_begin;
+        const char *segment = output + segment_begin;
+        if (size == 0 || (size == 1 && segment[0] == '.')) {
+            length = segment_begin;
+            return true;
+        }
+        if (size == 2 && segment[0] == '.' && segment[1] == '.') {
+            // segment_begin - 1 is the '/' in front of this segment
+            if (segment_begin <= 1) return false;
+            size_t parent = segment_begin - 1;
+            while (parent > 0 && output[parent - 1] != '/') parent--;
+            length = parent;
+            segment_begin = parent;
+            return true;
+        }
+        return true;
+    }
+
 public:
-    template<typename Str = std::string>
-    static Str decode(const Str &encoded_url) {
-        Str decoded_url;
-        std::istringstream stream(encoded_url);
-        char ch;
+    /// Decode the path of a request target and normalize it in the same pass: "//" collapses,
+    /// "." and ".." segments are resolved, '\' separates like '/'. Escapes are decoded before
+    /// segments are looked at, so "%2e%2e%2f" cannot climb out of the root.
+    /// @param output room for path.size() bytes
+    /// @return false if the path does not start with '/', has a malformed escape, encodes a NUL
+    ///         or goes above the root
+    static bool decode_path(const std::string_view path, char *output, size_t &length) {
+        const char *p = path.data();
+        const char *end = p + path.size();
+        if (p == end || *p != '/') return false;
+        length = 0;
+        output[length++] = '/';
+        p++;
+        size_t segment_begin = length;
+        while (true) {
+            // Plain bytes up to the next escape or separator are copied as they are
+            const char *next = find_any<'%', '/', '\\'>(p, end);
+            memcpy(output + length, p, next - p);
+            length += next - p;
+            p = next;
+            if (p == end) break;
 
-        while (stream.get(ch)) {
+            int ch = static_cast<unsigned char>(*p);
             if (ch == '%') {
-                // If current is %, read two next hex number.
-                char hex1, hex2;
-                stream.get(hex1);
-                stream.get(hex2);
-                const int value = std::stoi(Str(1, hex1) + Str(1, hex2), nullptr, 16);
-                ch = static_cast<char>(value);
+                ch = decode_escape(p, end);
+                if (ch <= 0) return false;
+                p += 3;
+            } else {
+                p++;
+            }
+            if (ch == '/' || ch == '\\') {
+                if (!close_segment(output, length, segment_begin)) return false;
+                if (length == segment_begin) {
+                    // Empty, "." or ".." segment: the '/' in front of it is still there
+                    continue;
+                }
+                output[length++] = '/';
+                segment_begin = length;
+                continue;
             }
-            decoded_url += ch;
+            output[length++] = static_cast<char>(ch);
         }
+        // A trailing "." or ".." leaves the path pointing at a directory, ending with '/'
+        return close_segment(output, length, segment_begin);
+    }
+
+    /// Decode a query or form component, '+' stands for a space.
+    /// @param output room for component.size() bytes
+    /// @return false on a malformed escape
+    static bool decode_component(const std::string_view component, char *output, size_t &length) {
+        const char *p = component.data();
+        const char *end = p + component.size();
+        length = 0;
+        while (true) {
+            const char *next = find_any<'%', '+', '%'>(p, end);
+            memcpy(output + length, p, next - p);
+            length += next - p;
+            p = next;
+            if (p == end) return true;
+            if (*p == '+') {
+                output[length++] = ' ';
+                p++;
+                continue;
+            }
+            const int ch = decode_escape(p, end);
+            if (ch < 0) return false;
+            output[length++] = static_cast<char>(ch);
+            p += 3;
+        }
+    }
+
+    /// Append a decoded path to output as a request target again: bytes other than unreserved
+    /// characters, sub-delimiters, ':', '@' and '/' are escaped.
+    static void encode_path(const std::string_view path, std::string &output) {
+        static constexpr char HEX_DIGITS[] = "0123456789ABCDEF";
+        for (const char ch: path) {
+            const auto byte = static_cast<unsigned char>(ch);
+            if ((byte >= 'a' && byte <= 'z') || (byte >= 'A' && byte <= 'Z') || (byte >= '0' && byte <= '9')
+                || (byte != 0 && strchr("-._~!$&'()*+,;=:@/", byte) != nullptr)) {
+                output.push_back(ch);
+                continue;
+            }
+            output.push_back('%');
+            output.push_back(HEX_DIGITS[byte >> 4]);
+            output.push_back(HEX_DIGITS[byte & 0xF]);
+        }
+    }
 
-        return std::move(decoded_url);
+    /// Percent-decode a whole string. A malformed escape is kept as it is.
+    template<typename Str = std::string>
+    static Str decode(const Str &encoded_url) {
+        Str decoded_url;
+        const std::string_view input(encoded_url.data(), encoded_url.size());
+        size_t begin = 0;
+        while (begin < input.size()) {
+            const size_t escape = input.find('%', begin);
+            const size_t plain_end = escape == std::string_view::npos ? input.size() : escape;
+            decoded_url.append(input.data() + begin, plain_end - begin);
+            if (plain_end == input.size()) break;
+            const int ch = decode_escape(input.data() + escape, input.data() + input.size());
+            if (ch < 0) {
+                decoded_url.append(input.data() + escape, 1);
+                begin = escape + 1;
+            } else {
+                const char byte = static_cast<char>(ch);
+                decoded_url.append(&byte, 1);
+                begin = escape + 3;
+            }
+        }
+        return decoded_url;
     }
 };
 
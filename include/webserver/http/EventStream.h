@@ -0,0 +1,133 @@
+//
+// Created by Haotian on 2026/10/19.
+//
+
+#ifndef EVENT_STREAM_H
+#define EVENT_STREAM_H
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+
+#include "HttpRequest.h"
+#include "../tcp/TcpServer.h"
+
+class EventStream;
+
+/// What an event stream route does with its clients, see HttpServer::add_event_stream(). The
+/// callbacks run on the I/O thread of the connection.
+struct EventStreamHandler {
+    // The request is only valid during the call, e.g. to read Last-Event-ID
+    std::function<void(const std::shared_ptr<EventStream> &, HttpRequest &)> on_open{};
+    std::function<void(const std::shared_ptr<EventStream> &)> on_close{};
+};
+
+/// A text/event-stream response (Server-Sent Events) that stays open: the handler keeps the
+/// stream and pushes events whenever it has some, from any thread. Nothing else is kept for the
+/// connection while it waits, the request and its parser are gone by then.
+class EventStream : public std::enable_shared_from_this<EventStream> {
+    TcpServer &m_server;
+    const ConnectionHandle m_handle;
+    const EventStreamHandler &m_handler;
+    std::atomic<bool> m_is_open{true};
+
+    static SendBuffer to_buffer(const std::shared_ptr<const std::string> &event) {
+        return {event, event->data(), static_cast<ssize_t>(event->size())};
+    }
+
+    // Every line of value as a field of its own, the client joins them with newlines again. Like the
+    // client, a line ends at "\r\n", "\r" or "\n": a bare "\r" left in would start a field of the caller's text.
+    static void append_lines(std::string &event, const std::string_view name, std::string_view value) {
+        while (true) {
+            const size_t end = value.find_first_of("\r\n");
+            event.append(name);
+            event.append(": ");
+            event.append(value.substr(0, end));
+            event.push_back('\n');
+            if (end == std::string_view::npos) return;
+            const bool is_crlf = value[end] == '\r' && end + 1 < value.size() && value[end + 1] == '\n';
+            value.remove_prefix(end + (is_crlf ? 2 : 1));
+        }
+    }
+
+    // A field that holds a single line, line breaks in value are dropped
+    static void append_field(std::string &event, const std::string_view name, const std::string_view value) {
+        event.append(name);
+        event.append(": ");
+        for (const char ch: value) {
+            if (ch != '\r' && ch != '\n') event.push_back(ch);
+        }
+        event.push_back('\n');
+    }
+
+public:
+    EventStream(TcpServer &server, AsyncSocket *socket, const EventStreamHandler &handler)
+        : m_server(server), m_handle(socket), m_handler(handler) {
+    }
+
+    EventStream(const EventStream &other) = delete;
+
+    EventStream &operator=(const EventStream &other) = delete;
+
+    /// An encoded event, to be passed to send() or Broadcaster::publish() as often as needed.
+    /// Empty event and id are left out, line breaks in them are dropped. id becomes the Last-Event-ID of
+    /// a reconnecting client.
+    static std::shared_ptr<const std::string> make_event(const std::string_view data,
+                                                         const std::string_view event = {},
+                                                         const std::string_view id = {}) {
+        auto result = std::make_shared<std::string>();
+        result->reserve(data.size() + event.size() + id.size() + 24);
+        if (!event.empty()) append_field(*result, "event", event);
+        if (!id.empty()) append_field(*result, "id", id);
+        append_lines(*result, "data", data);
+        result->push_back('\n');
+        return result;
+    }
+
+    /// A comment, ignored by the client. Sent now and then, it keeps proxies from closing the stream.
+    static std::shared_ptr<const std::string> make_comment(const std::string_view text = {}) {
+        auto result = std::make_shared<std::string>();
+        append_lines(*result, "", text);
+        result->push_back('\n');
+        return result;
+    }
+
+    [[nodiscard]] const ConnectionHandle &get_handle() const {
+        return m_handle;
+    }
+
+    [[nodiscard]] bool is_open() const {
+        return m_is_open;
+    }
+
+    /// Queue an event made by make_event(), from any thread. False once the stream is closed, though
+    /// an event may still be dropped if the client goes away before it is queued.
+    bool send(const std::shared_ptr<const std::string> &event) {
+        return m_is_open && m_server.send(m_handle, to_buffer(event));
+    }
+
+    bool send(const std::string_view data, const std::string_view event = {}, const std::string_view id = {}) {
+        return m_is_open && send(make_event(data, event, id));
+    }
+
+    /// End the stream from any thread, once what has been queued is sent
+    bool close() {
+        if (!m_is_open.exchange(false)) return false;
+        const auto close_read = [](AsyncSocket *socket) { socket->close_read(); };
+        if (ServingScope::is_serving(m_handle.socket)) {
+            close_read(m_handle.socket);
+            return true;
+        }
+        return m_server.post(m_handle, close_read);
+    }
+
+    /// The connection has closed, whoever closed it
+    void on_connection_closed() {
+        m_is_open = false;
+        if (m_handler.on_close) m_handler.on_close(shared_from_this());
+    }
+};
+
+#endif //EVENT_STREAM_H
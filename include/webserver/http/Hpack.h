@@ -0,0 +1,471 @@
+//
+// Created by Haotian on 2026/10/19.
+//
+
+#ifndef HPACK_H
+#define HPACK_H
+
+#include <algorithm>
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+/// Huffman code of HPACK (RFC 7541, Appendix B). The code is canonical, so the code lengths are all
+/// that has to be written down: the codes follow from them, and decoding compares the next bits
+/// against the last code of each length instead of walking a tree bit by bit.
+class HpackHuffman {
+    static constexpr int SYMBOLS = 257;
+    static constexpr int EOS = 256;
+    static constexpr int MIN_LENGTH = 5;
+    static constexpr int MAX_LENGTH = 30;
+
+    static constexpr uint8_t LENGTHS[SYMBOLS] = {
+        13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+        28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+        6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+        5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+        13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+        7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+        15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+        6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+        20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+        24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+        22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+        21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+        26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+        19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+        20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+        26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+        30,
+    };
+
+    struct Tables {
+        uint32_t codes[SYMBOLS]{};
+        // Symbols ordered by code
+        uint16_t symbols[SYMBOLS]{};
+        // Per length: first code, one past the last code, and where its symbols start in symbols
+        uint32_t first[MAX_LENGTH + 1]{};
+        uint32_t limit[MAX_LENGTH + 1]{};
+        uint16_t offset[MAX_LENGTH + 1]{};
+    };
+
+    static constexpr Tables build_tables() {
+        Tables tables{};
+        int count = 0;
+        uint32_t code = 0;
+        for (int length = MIN_LENGTH; length <= MAX_LENGTH; length++) {
+            tables.first[length] = code;
+            tables.offset[length] = static_cast<uint16_t>(count);
+            for (int symbol = 0; symbol < SYMBOLS; symbol++) {
+                if (LENGTHS[symbol] != length) continue;
+                tables.codes[symbol] = code++;
+                tables.symbols[count++] = static_cast<uint16_t>(symbol);
+            }
+            tables.limit[length] = code;
+            code <<= 1;
+        }
+        return tables;
+    }
+
+    static const Tables &tables() {
+        static constexpr Tables TABLES = build_tables();
+        return TABLES;
+    }
+
+public:
+    /// Bytes the Huffman encoding of str takes
+    static size_t encoded_size(const std::string_view str) {
+        size_t bits = 0;
+        for (const char ch: str) bits += LENGTHS[static_cast<unsigned char>(ch)];
+        return (bits + 7) / 8;
+    }
+
+    static void encode(const std::string_view str, std::string &out) {
+        const Tables &table = tables();
+        uint64_t accumulator = 0;
+        int bits = 0;
+        for (const char ch: str) {
+            const auto symbol = static_cast<unsigned char>(ch);
+            accumulator = accumulator << LENGTHS[symbol] | table.codes[symbol];
+            bits += LENGTHS[symbol];
+            while (bits >= 8) {
+                bits -= 8;
+                out += static_cast<char>(accumulator >> bits);
+            }
+        }
+        // Padded with the most significant bits of EOS, which are all ones
+        if (bits > 0) {
+            out += static_cast<char>(accumulator << (8 - bits) | 0xff >> bits);
+        }
+    }
+
+    /// @return false if data is not a valid encoding: EOS inside, or padding that is longer than
+    ///         7 bits or not all ones
+    static bool decode(const uint8_t *data, const size_t size, std::string &out) {
+        const Tables &table = tables();
+        const uint8_t *end = data + size;
+        uint64_t accumulator = 0;
+        int bits = 0;
+        while (true) {
+            while (bits <= 56 && data < end) {
+                accumulator = accumulator << 8 | *data++;
+                bits += 8;
+            }
+            // The code of each length is a prefix of the ones after it, the first match is the symbol
+            bool is_decoded = false;
+            for (int length = MIN_LENGTH; length <= MAX_LENGTH && length <= bits; length++) {
+                const auto code = static_cast<uint32_t>(accumulator >> (bits - length)) & ((1u << length) - 1);
+                if (code >= table.limit[length]) continue;
+                const uint16_t symbol = table.symbols[table.offset[length] + code - table.first[length]];
+                if (symbol == EOS) return false;
+                out += static_cast<char>(symbol);
+                bits -= length;
+                is_decoded = true;
+                break;
+            }
+            if (is_decoded) continue;
+            // Out of input: what is left has to be padding
+            const uint64_t mask = (uint64_t{1} << bits) - 1;
+            return bits < 8 && (accumulator & mask) == mask;
+        }
+    }
+};
+
+/// Static and dynamic table of HPACK (RFC 7541, section 2.3). Indices 1 to 61 are the static table,
+/// the dynamic table follows with its newest entry first.
+class HpackTable {
+public:
+    static constexpr size_t STATIC_SIZE = 61;
+    // What an entry costs on top of its name and value
+    static constexpr size_t ENTRY_OVERHEAD = 32;
+    static constexpr size_t DEFAULT_CAPACITY = 4096;
+
+private:
+    struct Field {
+        std::string name;
+        std::string value;
+    };
+
+    static constexpr std::string_view STATIC_TABLE[STATIC_SIZE][2] = {
+        {":authority", ""},
+        {":method", "GET"},
+        {":method", "POST"},
+        {":path", "/"},
+        {":path", "/index.html"},
+        {":scheme", "http"},
+        {":scheme", "https"},
+        {":status", "200"},
+        {":status", "204"},
+        {":status", "206"},
+        {":status", "304"},
+        {":status", "400"},
+        {":status", "404"},
+        {":status", "500"},
+        {"accept-charset", ""},
+        {"accept-encoding", "gzip, deflate"},
+        {"accept-language", ""},
+        {"accept-ranges", ""},
+        {"accept", ""},
+        {"access-control-allow-origin", ""},
+        {"age", ""},
+        {"allow", ""},
+        {"authorization", ""},
+        {"cache-control", ""},
+        {"content-disposition", ""},
+        {"content-encoding", ""},
+        {"content-language", ""},
+        {"content-length", ""},
+        {"content-location", ""},
+        {"content-range", ""},
+        {"content-type", ""},
+        {"cookie", ""},
+        {"date", ""},
+        {"etag", ""},
+        {"expect", ""},
+        {"expires", ""},
+        {"from", ""},
+        {"host", ""},
+        {"if-match", ""},
+        {"if-modified-since", ""},
+        {"if-none-match", ""},
+        {"if-range", ""},
+        {"if-unmodified-since", ""},
+        {"last-modified", ""},
+        {"link", ""},
+        {"location", ""},
+        {"max-forwards", ""},
+        {"proxy-authenticate", ""},
+        {"proxy-authorization", ""},
+        {"range", ""},
+        {"referer", ""},
+        {"refresh", ""},
+        {"retry-after", ""},
+        {"server", ""},
+        {"set-cookie", ""},
+        {"strict-transport-security", ""},
+        {"transfer-encoding", ""},
+        {"user-agent", ""},
+        {"vary", ""},
+        {"via", ""},
+        {"www-authenticate", ""},
+    };
+
+    std::deque<Field> m_entries{};
+    size_t m_size = 0;
+    size_t m_capacity = DEFAULT_CAPACITY;
+
+    // First static index of each name, the entries of one name are next to each other
+    static const std::unordered_map<std::string_view, size_t> &static_names() {
+        static const std::unordered_map<std::string_view, size_t> names = []() {
+            std::unordered_map<std::string_view, size_t> map{};
+            for (size_t i = STATIC_SIZE; i > 0; i--) map[STATIC_TABLE[i - 1][0]] = i;
+            return map;
+        }();
+        return names;
+    }
+
+    void evict_to(const size_t size) {
+        while (m_size > size) {
+            m_size -= entry_size(m_entries.back().name, m_entries.back().value);
+            m_entries.pop_back();
+        }
+    }
+
+public:
+    static size_t entry_size(const std::string_view name, const std::string_view value) {
+        return name.size() + value.size() + ENTRY_OVERHEAD;
+    }
+
+    /// @param index 1-based over both tables
+    /// @return false if there is no such entry
+    bool get(const size_t index, std::string_view &name, std::string_view &value) const {
+        if (index == 0) return false;
+        if (index <= STATIC_SIZE) {
+            name = STATIC_TABLE[index - 1][0];
+            value = STATIC_TABLE[index - 1][1];
+            return true;
+        }
+        if (index - STATIC_SIZE > m_entries.size()) return false;
+        const auto &entry = m_entries[index - STATIC_SIZE - 1];
+        name = entry.name;
+        value = entry.value;
+        return true;
+    }
+
+    /// Insert at the front, evicting from the back. An entry bigger than the table empties it.
+    void add(const std::string_view name, const std::string_view value) {
+        const size_t size = entry_size(name, value);
+        if (size > m_capacity) {
+            evict_to(0);
+            return;
+        }
+        evict_to(m_capacity - size);
+        m_entries.push_front(Field{std::string(name), std::string(value)});
+        m_size += size;
+    }
+
+    void set_capacity(const size_t capacity) {
+        m_capacity = capacity;
+        evict_to(capacity);
+    }
+
+    [[nodiscard]] size_t capacity() const {
+        return m_capacity;
+    }
+
+    /// Index of the field, or of its name alone when is_exact comes back false. 0 if neither is known.
+    [[nodiscard]] size_t find(const std::string_view name, const std::string_view value, bool &is_exact) const {
+        is_exact = false;
+        size_t name_index = 0;
+        const auto &names = static_names();
+        if (const auto it = names.find(name); it != names.end()) {
+            name_index = it->second;
+            for (size_t i = name_index; i <= STATIC_SIZE && STATIC_TABLE[i - 1][0] == name; i++) {
+                if (STATIC_TABLE[i - 1][1] == value) {
+                    is_exact = true;
+                    return i;
+                }
+            }
+        }
+        for (size_t i = 0; i < m_entries.size(); i++) {
+            if (m_entries[i].name != name) continue;
+            if (m_entries[i].value == value) {
+                is_exact = true;
+                return STATIC_SIZE + i + 1;
+            }
+            if (name_index == 0) name_index = STATIC_SIZE + i + 1;
+        }
+        return name_index;
+    }
+};
+
+/// Decodes the header blocks of one connection. The dynamic table carries over from block to block,
+/// so every block has to be decoded, in order, even those of requests that are refused.
+class HpackDecoder {
+    // Starts at the default size, the encoder does not know our SETTINGS before it has received them
+    HpackTable m_table{};
+    // What we announced as SETTINGS_HEADER_TABLE_SIZE
+    size_t m_announced_capacity;
+    // The most the encoder may ask for: the default stays allowed until our SETTINGS are acknowledged
+    size_t m_max_capacity;
+    std::string m_name{};
+    std::string m_value{};
+
+    static bool decode_integer(const uint8_t *&p, const uint8_t *end, const int prefix_bits, size_t &value) {
+        if (p == end) return false;
+        const size_t mask = (1u << prefix_bits) - 1;
+        value = *p++ & mask;
+        if (value < mask) return true;
+        for (int shift = 0; shift <= 28; shift += 7) {
+            if (p == end) return false;
+            const uint8_t byte = *p++;
+            value += static_cast<size_t>(byte & 0x7f) << shift;
+            if ((byte & 0x80) == 0) return true;
+        }
+        // Longer than any sensible size or index
+        return false;
+    }
+
+    static bool decode_string(const uint8_t *&p, const uint8_t *end, std::string &out) {
+        if (p == end) return false;
+        const bool is_huffman = (*p & 0x80) != 0;
+        size_t length;
+        if (!decode_integer(p, end, 7, length) || length > static_cast<size_t>(end - p)) return false;
+        out.clear();
+        if (is_huffman) {
+            if (!HpackHuffman::decode(p, length, out)) return false;
+        } else {
+            out.assign(reinterpret_cast<const char *>(p), length);
+        }
+        p += length;
+        return true;
+    }
+
+public:
+    explicit HpackDecoder(const size_t announced_capacity = HpackTable::DEFAULT_CAPACITY)
+        : m_announced_capacity(announced_capacity),
+          m_max_capacity(std::max(announced_capacity, HpackTable::DEFAULT_CAPACITY)) {
+    }
+
+    /// Our SETTINGS have been acknowledged, the announced size is the limit from now on. A bigger table
+    /// shrinks right away, the same as the size update the encoder has to start its next block with.
+    void on_settings_acknowledged() {
+        m_max_capacity = m_announced_capacity;
+        if (m_table.capacity() > m_max_capacity) m_table.set_capacity(m_max_capacity);
+    }
+
+    /// Decode a complete header block, on_field(name, value) is called for each field in order.
+    /// @return false on a compression error, after which the connection cannot go on
+    template<typename OnField>
+    bool decode(const uint8_t *data, const size_t size, OnField &&on_field) {
+        const uint8_t *p = data;
+        const uint8_t *end = data + size;
+        bool has_field = false;
+        while (p < end) {
+            const uint8_t byte = *p;
+            size_t index;
+            if (byte & 0x80) {
+                // Indexed field
+                std::string_view name, value;
+                if (!decode_integer(p, end, 7, index) || !m_table.get(index, name, value)) return false;
+                m_name.assign(name);
+                m_value.assign(value);
+            } else if ((byte & 0xe0) == 0x20) {
+                // Dynamic table size update, only in front of the fields
+                size_t capacity;
+                if (has_field || !decode_integer(p, end, 5, capacity) || capacity > m_max_capacity) return false;
+                m_table.set_capacity(capacity);
+                continue;
+            } else {
+                // Literal, with incremental indexing (01), without indexing (0000) or never indexed (0001)
+                const bool is_indexed = (byte & 0xc0) == 0x40;
+                if (!decode_integer(p, end, is_indexed ? 6 : 4, index)) return false;
+                if (index == 0) {
+                    if (!decode_string(p, end, m_name)) return false;
+                } else {
+                    std::string_view name, value;
+                    if (!m_table.get(index, name, value)) return false;
+                    m_name.assign(name);
+                }
+                if (!decode_string(p, end, m_value)) return false;
+                if (is_indexed) m_table.add(m_name, m_value);
+            }
+            has_field = true;
+            on_field(std::string_view(m_name), std::string_view(m_value));
+        }
+        return true;
+    }
+};
+
+/// Encodes the header blocks of one connection, see HpackDecoder.
+class HpackEncoder {
+    HpackTable m_table{};
+    // A smaller table has to be announced at the start of the next block
+    bool m_has_size_update = false;
+
+    static void encode_integer(std::string &out, const uint8_t flags, const int prefix_bits, size_t value) {
+        const size_t mask = (1u << prefix_bits) - 1;
+        if (value < mask) {
+            out += static_cast<char>(flags | value);
+            return;
+        }
+        out += static_cast<char>(flags | mask);
+        value -= mask;
+        while (value >= 0x80) {
+            out += static_cast<char>((value & 0x7f) | 0x80);
+            value >>= 7;
+        }
+        out += static_cast<char>(value);
+    }
+
+    // Huffman coded where that is shorter
+    static void encode_string(std::string &out, const std::string_view str) {
+        const size_t huffman_size = HpackHuffman::encoded_size(str);
+        if (huffman_size < str.size()) {
+            encode_integer(out, 0x80, 7, huffman_size);
+            HpackHuffman::encode(str, out);
+        } else {
+            encode_integer(out, 0x00, 7, str.size());
+            out.append(str);
+        }
+    }
+
+public:
+    /// The peer decodes with a table of at most capacity bytes (its SETTINGS_HEADER_TABLE_SIZE).
+    /// We never use more than the default, a larger table only costs memory here.
+    void set_max_capacity(const size_t capacity) {
+        const size_t new_capacity = std::min(capacity, HpackTable::DEFAULT_CAPACITY);
+        if (new_capacity == m_table.capacity()) return;
+        m_table.set_capacity(new_capacity);
+        m_has_size_update = true;
+    }
+
+    /// Append a field to the block in out. may_index puts it into the dynamic table, which pays off
+    /// for fields that repeat from response to response with the same value.
+    void encode(const std::string_view name, const std::string_view value, std::string &out,
+                const bool may_index = true) {
+        if (m_has_size_update) {
+            encode_integer(out, 0x20, 5, m_table.capacity());
+            m_has_size_update = false;
+        }
+        bool is_exact;
+        const size_t index = m_table.find(name, value, is_exact);
+        if (is_exact) {
+            encode_integer(out, 0x80, 7, index);
+            return;
+        }
+        const bool is_indexed = may_index && HpackTable::entry_size(name, value) <= m_table.capacity() / 4;
+        if (is_indexed) {
+            encode_integer(out, 0x40, 6, index);
+        } else {
+            encode_integer(out, 0x00, 4, index);
+        }
+        if (index == 0) encode_string(out, name);
+        encode_string(out, value);
+        if (is_indexed) m_table.add(name, value);
+    }
+};
+
+#endif //HPACK_H
@@ -0,0 +1,937 @@
+//
+// Created by Haotian on 2026/10/19.
+//
+
+#ifndef HTTP2_CONNECTION_H
+#define HTTP2_CONNECTION_H
+
+#include <algorithm>
+#include <charconv>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "Hpack.h"
+#include "HttpRequestParser.h"
+#include "HttpResponse.h"
+#include "../common/BufferWriter.h"
+
+/// What the server announces in its SETTINGS, and how much it frames at once
+struct Http2Settings {
+    // Streams a client may have open at the same time
+    uint32_t max_concurrent_streams = 256;
+    // Request body bytes a client may send ahead, per stream and over the whole connection
+    uint32_t stream_window = 1 << 20;
+    uint32_t connection_window = 16 << 20;
+    // HPACK dynamic table for request headers
+    uint32_t header_table_size = 4096;
+    // Request header fields at most, counted as name + value + 32 bytes each
+    uint32_t max_header_list_size = 64 * 1024;
+    // Response body bytes framed per turn. The rest follows once the socket has sent them, so a
+    // connection with large bodies does not queue them all at once.
+    uint32_t write_budget = 256 * 1024;
+};
+
+/// HTTP/2 over cleartext (h2c, RFC 9113) on one connection: framing, HPACK, stream multiplexing,
+/// flow control in both directions and the stream priorities of RFC 7540.
+///
+/// Every stream assembles its request with an HttpRequestParser of its own and is handed to the
+/// handler once END_STREAM has arrived, so callbacks get the same HttpRequest as over HTTP/1.1.
+/// Header names are given their HTTP/1.1 spelling, "content-type" arrives as "Content-Type". The
+/// response HEADERS are framed right away, the body as far as the flow control windows and the
+/// write budget allow. The rest goes out when a WINDOW_UPDATE arrives or on_drained() is called.
+class Http2Connection {
+public:
+    // false if the request has to go over HTTP/1.1 instead: its stream is reset with HTTP_1_1_REQUIRED,
+    // which clients answer by retrying it on an HTTP/1.1 connection
+    using Handler = std::function<bool(HttpRequestParser &, HttpResponse &)>;
+
+    enum class ErrorCode : uint32_t {
+        NO_ERROR = 0x0,
+        PROTOCOL_ERROR = 0x1,
+        INTERNAL_ERROR = 0x2,
+        FLOW_CONTROL_ERROR = 0x3,
+        SETTINGS_TIMEOUT = 0x4,
+        STREAM_CLOSED = 0x5,
+        FRAME_SIZE_ERROR = 0x6,
+        REFUSED_STREAM = 0x7,
+        CANCEL = 0x8,
+        COMPRESSION_ERROR = 0x9,
+        CONNECT_ERROR = 0xa,
+        ENHANCE_YOUR_CALM = 0xb,
+        INADEQUATE_SECURITY = 0xc,
+        HTTP_1_1_REQUIRED = 0xd
+    };
+
+    static constexpr std::string_view PREFACE = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+
+private:
+    enum class FrameType : uint8_t {
+        DATA = 0x0,
+        HEADERS = 0x1,
+        PRIORITY = 0x2,
+        RST_STREAM = 0x3,
+        SETTINGS = 0x4,
+        PUSH_PROMISE = 0x5,
+        PING = 0x6,
+        GOAWAY = 0x7,
+        WINDOW_UPDATE = 0x8,
+        CONTINUATION = 0x9
+    };
+
+    enum class Setting : uint16_t {
+        HEADER_TABLE_SIZE = 0x1,
+        ENABLE_PUSH = 0x2,
+        MAX_CONCURRENT_STREAMS = 0x3,
+        INITIAL_WINDOW_SIZE = 0x4,
+        MAX_FRAME_SIZE = 0x5,
+        MAX_HEADER_LIST_SIZE = 0x6
+    };
+
+    static constexpr uint8_t FLAG_END_STREAM = 0x1;
+    static constexpr uint8_t FLAG_ACK = 0x1;
+    static constexpr uint8_t FLAG_END_HEADERS = 0x4;
+    static constexpr uint8_t FLAG_PADDED = 0x8;
+    static constexpr uint8_t FLAG_PRIORITY = 0x20;
+
+    static constexpr size_t FRAME_HEADER_SIZE = 9;
+    static constexpr int64_t DEFAULT_WINDOW = 65535;
+    static constexpr int64_t MAX_WINDOW = 0x7fffffff;
+    // We never announce a bigger SETTINGS_MAX_FRAME_SIZE, so this is also the largest frame we accept
+    static constexpr uint32_t DEFAULT_FRAME_SIZE = 16384;
+    static constexpr uint32_t MAX_FRAME_SIZE = 0xffffff;
+    static constexpr uint32_t DEFAULT_WEIGHT = 16;
+    // Bound on walks up the priority tree
+    static constexpr int MAX_PRIORITY_DEPTH = 64;
+
+    struct Stream {
+        uint32_t id = 0;
+        HttpRequestParser parser{};
+        // END_STREAM has been received, the request is complete
+        bool is_remote_closed = false;
+        int64_t send_window = DEFAULT_WINDOW;
+        int64_t recv_window = DEFAULT_WINDOW;
+        // Body bytes received and not yet given back with a WINDOW_UPDATE
+        int64_t recv_unacked = 0;
+        // The response body, sent up to body.sent
+        SendBuffer body{};
+        // RFC 7540 priority: the stream it depends on, 0 for the root
+        uint32_t parent = 0;
+        uint32_t weight = DEFAULT_WEIGHT;
+    };
+
+    struct Priority {
+        uint32_t parent = 0;
+        uint32_t weight = DEFAULT_WEIGHT;
+        bool is_exclusive = false;
+    };
+
+    Http2Settings m_settings;
+    Handler m_handler;
+    HpackDecoder m_decoder;
+    HpackEncoder m_encoder{};
+
+    // Settings of the peer
+    int64_t m_peer_initial_window = DEFAULT_WINDOW;
+    uint32_t m_peer_max_frame_size = DEFAULT_FRAME_SIZE;
+
+    // Bytes of the client preface seen so far, and whether its SETTINGS frame followed
+    size_t m_preface_received = 0;
+    bool m_has_peer_settings = false;
+    // An incomplete frame, until the rest arrives
+    std::string m_input{};
+
+    std::unordered_map<uint32_t, std::unique_ptr<Stream> > m_streams{};
+    // Streams with a body left to send, in the order they got one
+    std::vector<uint32_t> m_sending{};
+    uint32_t m_last_stream_id = 0;
+
+    // Connection-level flow control
+    int64_t m_send_window = DEFAULT_WINDOW;
+    int64_t m_recv_window = DEFAULT_WINDOW;
+    int64_t m_recv_unacked = 0;
+
+    // HEADERS and its CONTINUATION frames, until END_HEADERS
+    std::string m_header_block{};
+    bool m_is_expecting_continuation = false;
+    uint32_t m_header_stream = 0;
+    uint8_t m_header_flags = 0;
+    Priority m_header_priority{};
+
+    // Streams above this one are ignored after a GOAWAY
+    bool m_is_going_away = false;
+    uint32_t m_go_away_stream_id = 0;
+    bool m_has_failed = false;
+
+    // Scratch space reused from request to request
+    std::string m_block{};
+    std::string m_name{};
+    std::string m_method{};
+    std::string m_path{};
+    std::string m_authority{};
+    std::string m_cookie{};
+
+    static uint32_t read_u32(const uint8_t *p) {
+        return static_cast<uint32_t>(p[0]) << 24 | static_cast<uint32_t>(p[1]) << 16
+               | static_cast<uint32_t>(p[2]) << 8 | p[3];
+    }
+
+    static void put_u32(char *p, const uint32_t value) {
+        p[0] = static_cast<char>(value >> 24);
+        p[1] = static_cast<char>(value >> 16);
+        p[2] = static_cast<char>(value >> 8);
+        p[3] = static_cast<char>(value);
+    }
+
+    static void put_frame_header(BufferWriter &out, const size_t length, const FrameType type, const uint8_t flags,
+                                 const uint32_t stream_id) {
+        char header[FRAME_HEADER_SIZE];
+        header[0] = static_cast<char>(length >> 16);
+        header[1] = static_cast<char>(length >> 8);
+        header[2] = static_cast<char>(length);
+        header[3] = static_cast<char>(type);
+        header[4] = static_cast<char>(flags);
+        put_u32(header + 5, stream_id & 0x7fffffff);
+        out.put(header, FRAME_HEADER_SIZE);
+    }
+
+    static void put_setting(BufferWriter &out, const Setting id, const uint32_t value) {
+        char setting[6];
+        setting[0] = static_cast<char>(static_cast<uint16_t>(id) >> 8);
+        setting[1] = static_cast<char>(static_cast<uint16_t>(id));
+        put_u32(setting + 2, value);
+        out.put(setting, sizeof(setting));
+    }
+
+    static void put_window_update(BufferWriter &out, const uint32_t stream_id, const int64_t increment) {
+        char payload[4];
+        put_u32(payload, static_cast<uint32_t>(increment));
+        put_frame_header(out, sizeof(payload), FrameType::WINDOW_UPDATE, 0, stream_id);
+        out.put(payload, sizeof(payload));
+    }
+
+    // Padding of a PADDED frame is dropped. False if it is longer than the frame.
+    static bool strip_padding(const uint8_t flags, const uint8_t *&payload, uint32_t &length) {
+        if ((flags & FLAG_PADDED) == 0) return true;
+        if (length < 1 || payload[0] >= length) return false;
+        length -= 1 + payload[0];
+        payload++;
+        return true;
+    }
+
+    static bool decode_base64url(const std::string_view input, std::string &out) {
+        uint32_t accumulator = 0;
+        int bits = 0;
+        for (const char ch: input) {
+            int value;
+            if (ch >= 'A' && ch <= 'Z') value = ch - 'A';
+            else if (ch >= 'a' && ch <= 'z') value = ch - 'a' + 26;
+            else if (ch >= '0' && ch <= '9') value = ch - '0' + 52;
+            else if (ch == '-' || ch == '+') value = 62;
+            else if (ch == '_' || ch == '/') value = 63;
+            else if (ch == '=') break;
+            else return false;
+            accumulator = accumulator << 6 | value;
+            bits += 6;
+            if (bits >= 8) {
+                bits -= 8;
+                out += static_cast<char>(accumulator >> bits);
+            }
+        }
+        return true;
+    }
+
+    // HTTP/1.1 spelling of a lowercase field name: "content-type" is "Content-Type"
+    static void to_http1_name(const std::string_view name, std::string &out) {
+        out.assign(name);
+        bool is_word_start = true;
+        for (char &ch: out) {
+            if (is_word_start && ch >= 'a' && ch <= 'z') ch = static_cast<char>(ch - 'a' + 'A');
+            is_word_start = ch == '-';
+        }
+    }
+
+    static void to_lower(const std::string_view name, std::string &out) {
+        out.assign(name);
+        for (char &ch: out) {
+            if (ch >= 'A' && ch <= 'Z') ch = static_cast<char>(ch - 'A' + 'a');
+        }
+    }
+
+    // Hop-by-hop fields have no place in HTTP/2 (RFC 9113, section 8.2.2)
+    static bool is_connection_specific(const std::string_view name) {
+        return name == "connection" || name == "keep-alive" || name == "proxy-connection"
+               || name == "transfer-encoding" || name == "upgrade";
+    }
+
+    // Fields whose value changes from response to response only waste the dynamic table
+    static bool is_worth_indexing(const std::string_view name) {
+        return name != "content-length" && name != "content-range" && name != "last-modified"
+               && name != "date" && name != "etag" && name != "set-cookie" && name != "location"
+               && name != "expires" && name != "age";
+    }
+
+    Stream *find_stream(const uint32_t id) const {
+        const auto it = m_streams.find(id);
+        return it == m_streams.end() ? nullptr : it->second.get();
+    }
+
+    void fail(BufferWriter &out, const ErrorCode code) {
+        if (m_has_failed) return;
+        char payload[8];
+        put_u32(payload, m_last_stream_id);
+        put_u32(payload + 4, static_cast<uint32_t>(code));
+        put_frame_header(out, sizeof(payload), FrameType::GOAWAY, 0, 0);
+        out.put(payload, sizeof(payload));
+        m_has_failed = true;
+        m_streams.clear();
+        m_sending.clear();
+    }
+
+    void close_stream(const uint32_t id) {
+        const auto it = m_streams.find(id);
+        if (it == m_streams.end()) return;
+        // Dependents move up to the parent of the closed stream
+        const uint32_t parent = it->second->parent;
+        for (auto &[other_id, other]: m_streams) {
+            if (other->parent == id) other->parent = parent;
+        }
+        m_streams.erase(it);
+    }
+
+    void reset_stream(BufferWriter &out, const uint32_t id, const ErrorCode code) {
+        char payload[4];
+        put_u32(payload, static_cast<uint32_t>(code));
+        put_frame_header(out, sizeof(payload), FrameType::RST_STREAM, 0, id);
+        out.put(payload, sizeof(payload));
+        close_stream(id);
+    }
+
+    [[nodiscard]] bool is_descendant(uint32_t id, const uint32_t ancestor) const {
+        for (int depth = 0; id != 0 && depth < MAX_PRIORITY_DEPTH; depth++) {
+            const Stream *stream = find_stream(id);
+            if (stream == nullptr) return false;
+            if (stream->parent == ancestor) return true;
+            id = stream->parent;
+        }
+        return false;
+    }
+
+    void set_priority(Stream &stream, const Priority &priority) {
+        uint32_t parent = priority.parent;
+        // A stream that is not in the tree gives no priority (RFC 7540, section 5.3.1)
+        if (parent != 0 && find_stream(parent) == nullptr) {
+            stream.parent = 0;
+            stream.weight = DEFAULT_WEIGHT;
+            return;
+        }
+        // Depending on its own dependent: the dependent moves up first (RFC 7540, section 5.3.3)
+        if (parent != 0 && is_descendant(parent, stream.id)) {
+            find_stream(parent)->parent = stream.parent;
+        }
+        if (priority.is_exclusive) {
+            for (auto &[id, other]: m_streams) {
+                if (other->parent == parent && id != stream.id) other->parent = stream.id;
+            }
+        }
+        stream.parent = parent;
+        stream.weight = priority.weight;
+    }
+
+    // Whether a stream may send now: it has data and window, and no stream it depends on could
+    // use the bandwidth instead
+    [[nodiscard]] bool is_schedulable(const Stream &stream) const {
+        if (stream.body.is_finished() || stream.send_window <= 0) return false;
+        uint32_t id = stream.parent;
+        for (int depth = 0; id != 0 && depth < MAX_PRIORITY_DEPTH; depth++) {
+            const Stream *ancestor = find_stream(id);
+            if (ancestor == nullptr) break;
+            if (!ancestor->body.is_finished() && ancestor->send_window > 0) return false;
+            id = ancestor->parent;
+        }
+        return true;
+    }
+
+    bool apply_settings(const uint8_t *payload, const uint32_t length, BufferWriter *out) {
+        for (uint32_t i = 0; i + 6 <= length; i += 6) {
+            const auto id = static_cast<Setting>(payload[i] << 8 | payload[i + 1]);
+            const uint32_t value = read_u32(payload + i + 2);
+            switch (id) {
+                case Setting::HEADER_TABLE_SIZE:
+                    m_encoder.set_max_capacity(value);
+                    break;
+                case Setting::ENABLE_PUSH:
+                    if (value > 1) {
+                        if (out != nullptr) fail(*out, ErrorCode::PROTOCOL_ERROR);
+                        return false;
+                    }
+                    break;
+                case Setting::INITIAL_WINDOW_SIZE: {
+                    if (value > MAX_WINDOW) {
+                        if (out != nullptr) fail(*out, ErrorCode::FLOW_CONTROL_ERROR);
+                        return false;
+                    }
+                    // Applies to the windows of the open streams too
+                    const int64_t delta = static_cast<int64_t>(value) - m_peer_initial_window;
+                    for (auto &[stream_id, stream]: m_streams) {
+                        stream->send_window += delta;
+                        if (stream->send_window > MAX_WINDOW) {
+                            if (out != nullptr) fail(*out, ErrorCode::FLOW_CONTROL_ERROR);
+                            return false;
+                        }
+                    }
+                    m_peer_initial_window = value;
+                    break;
+                }
+                case Setting::MAX_FRAME_SIZE:
+                    if (value < DEFAULT_FRAME_SIZE || value > MAX_FRAME_SIZE) {
+                        if (out != nullptr) fail(*out, ErrorCode::PROTOCOL_ERROR);
+                        return false;
+                    }
+                    m_peer_max_frame_size = value;
+                    break;
+                default:
+                    // MAX_CONCURRENT_STREAMS and MAX_HEADER_LIST_SIZE concern pushes and requests we never make
+                    break;
+            }
+        }
+        return true;
+    }
+
+    void write_headers(BufferWriter &out, const uint32_t stream_id, const HttpResponse &resp, const bool end_stream) {
+        m_block.clear();
+        char number[24];
+        auto end = std::to_chars(number, number + sizeof(number), static_cast<int>(resp.get_status())).ptr;
+        m_encoder.encode(":status", std::string_view(number, end - number), m_block);
+        for (const auto &[name, value]: resp.get_headers()) {
+            to_lower(std::string_view(name.data(), name.size()), m_name);
+            if (is_connection_specific(m_name) || m_name == "content-length") continue;
+            m_encoder.encode(m_name, std::string_view(value.data(), value.size()), m_block,
+                             is_worth_indexing(m_name));
+        }
+        end = std::to_chars(number, number + sizeof(number), resp.get_body_size()).ptr;
+        m_encoder.encode("content-length", std::string_view(number, end - number), m_block, false);
+
+        // A block bigger than a frame continues in CONTINUATION frames
+        size_t offset = 0;
+        do {
+            const size_t length = std::min<size_t>(m_block.size() - offset, m_peer_max_frame_size);
+            const bool is_first = offset == 0;
+            uint8_t flags = offset + length == m_block.size() ? FLAG_END_HEADERS : 0;
+            if (is_first && end_stream) flags |= FLAG_END_STREAM;
+            put_frame_header(out, length, is_first ? FrameType::HEADERS : FrameType::CONTINUATION, flags, stream_id);
+            out.put(m_block.data() + offset, static_cast<ssize_t>(length));
+            offset += length;
+        } while (offset < m_block.size());
+    }
+
+    // Hand the request to the handler and frame the response. parser is the one of the stream, or
+    // that of the HTTP/1.1 connection for the request that asked for the upgrade.
+    void respond(Stream &stream, HttpRequestParser &parser, BufferWriter &out) {
+        SendBuffer body;
+        bool is_answered; {
+            // The response headers live in the arena of the request, like over HTTP/1.1
+            HttpResponse resp(&parser.arena());
+            is_answered = m_handler(parser, resp);
+            if (is_answered) {
+                write_headers(out, stream.id, resp, resp.get_body_size() == 0);
+                body = resp.take_body();
+            }
+        }
+        parser.reset();
+        if (!is_answered) {
+            reset_stream(out, stream.id, ErrorCode::HTTP_1_1_REQUIRED);
+            return;
+        }
+        if (body.size == 0) {
+            close_stream(stream.id);
+            return;
+        }
+        body.sent = 0;
+        stream.body = std::move(body);
+        // A body that fits into one frame goes out at once instead of keeping its stream open
+        if (m_has_peer_settings && stream.body.size <= std::min({
+                stream.send_window, m_send_window, static_cast<int64_t>(m_peer_max_frame_size)
+            }) && is_schedulable(stream)) {
+            write_data_frame(out, stream, stream.body.size);
+            close_stream(stream.id);
+            return;
+        }
+        m_sending.emplace_back(stream.id);
+    }
+
+    void end_request(Stream &stream, BufferWriter &out) {
+        stream.is_remote_closed = true;
+        if (!stream.parser.finish_request()) {
+            reset_stream(out, stream.id, ErrorCode::PROTOCOL_ERROR);
+            return;
+        }
+        respond(stream, stream.parser, out);
+    }
+
+    void write_data_frame(BufferWriter &out, Stream &stream, const int64_t length) {
+        SendBuffer &body = stream.body;
+        const bool is_last = body.sent + length == body.size;
+        put_frame_header(out, length, FrameType::DATA, is_last ? FLAG_END_STREAM : 0, stream.id);
+        if (body.is_file()) {
+            out.append(SendBuffer::from_file(body.owner, body.file_fd, body.file_offset + body.sent, length), true);
+        } else {
+            out.put(body.data + body.sent, length);
+        }
+        body.sent += length;
+        stream.send_window -= length;
+        m_send_window -= length;
+    }
+
+    // Weighted round robin over the streams that may send: per round a stream frames one
+    // DATA frame for every 16 of its weight, so weight 256 gets 16 times the share of weight 16.
+    void write_data(BufferWriter &out) {
+        // After an upgrade, bodies wait for the client preface: its SETTINGS may change the windows
+        if (!m_has_peer_settings) return;
+        int64_t budget = m_settings.write_budget;
+        while (budget > 0 && m_send_window > 0 && !m_sending.empty()) {
+            bool has_progress = false;
+            for (const uint32_t id: m_sending) {
+                Stream *stream = find_stream(id);
+                if (stream == nullptr || !is_schedulable(*stream)) continue;
+                for (uint32_t frames = (stream->weight + 15) / 16; frames > 0 && budget > 0; frames--) {
+                    const int64_t length = std::min({
+                        stream->body.size - stream->body.sent, stream->send_window, m_send_window,
+                        static_cast<int64_t>(m_peer_max_frame_size)
+                    });
+                    if (length <= 0) break;
+                    write_data_frame(out, *stream, length);
+                    budget -= length;
+                    has_progress = true;
+                }
+            }
+            // Streams done with their body are done altogether, their request ended before
+            size_t kept = 0;
+            for (const uint32_t id: m_sending) {
+                const Stream *stream = find_stream(id);
+                if (stream == nullptr) continue;
+                if (stream->body.is_finished()) {
+                    close_stream(id);
+                    continue;
+                }
+                m_sending[kept++] = id;
+            }
+            m_sending.resize(kept);
+            if (!has_progress) break;
+        }
+    }
+
+    // Decode the collected header block. New streams get their request from it, an open stream
+    // gets its trailers, which are dropped.
+    void end_header_block(BufferWriter &out) {
+        const uint32_t id = m_header_stream;
+        const uint8_t flags = m_header_flags;
+        m_is_expecting_continuation = false;
+        const auto *block = reinterpret_cast<const uint8_t *>(m_header_block.data());
+
+        if (Stream *stream = find_stream(id); stream != nullptr) {
+            if (!m_decoder.decode(block, m_header_block.size(), [](std::string_view, std::string_view) {
+            })) {
+                fail(out, ErrorCode::COMPRESSION_ERROR);
+                return;
+            }
+            if (stream->is_remote_closed) {
+                reset_stream(out, id, ErrorCode::STREAM_CLOSED);
+            } else if ((flags & FLAG_END_STREAM) == 0) {
+                reset_stream(out, id, ErrorCode::PROTOCOL_ERROR);
+            } else {
+                end_request(*stream, out);
+            }
+            return;
+        }
+        if (id % 2 == 0 || id <= m_last_stream_id) {
+            fail(out, id % 2 == 0 ? ErrorCode::PROTOCOL_ERROR : ErrorCode::STREAM_CLOSED);
+            return;
+        }
+        m_last_stream_id = id;
+
+        auto stream = std::make_unique<Stream>();
+        stream->id = id;
+        stream->send_window = m_peer_initial_window;
+        stream->recv_window = m_settings.stream_window;
+        HttpRequestParser &parser = stream->parser;
+        m_method.clear();
+        m_path.clear();
+        m_authority.clear();
+        m_cookie.clear();
+        bool has_scheme = false;
+        bool has_begun = false;
+        bool is_malformed = false;
+        size_t list_size = 0;
+        // Pseudo-header fields come first, the request starts with the first regular field
+        const auto begin_request = [&]() {
+            has_begun = true;
+            if (m_method.empty() || m_path.empty() || !has_scheme
+                || !parser.begin_request(m_method, m_path, "HTTP/2.0")) {
+                is_malformed = true;
+                return;
+            }
+            if (!m_authority.empty()) parser.add_header("Host", m_authority);
+        };
+        const bool is_decoded = m_decoder.decode(block, m_header_block.size(), [&](const std::string_view name,
+                                                     const std::string_view value) {
+            list_size += HpackTable::entry_size(name, value);
+            if (list_size > m_settings.max_header_list_size) is_malformed = true;
+            if (is_malformed) return;
+            if (!name.empty() && name[0] == ':') {
+                std::string *field = nullptr;
+                if (name == ":method") field = &m_method;
+                else if (name == ":path") field = &m_path;
+                else if (name == ":authority") field = &m_authority;
+                else if (name == ":scheme" && !has_scheme) has_scheme = true;
+                else is_malformed = true;
+                if (has_begun || (field != nullptr && !field->empty())) is_malformed = true;
+                if (field != nullptr) field->assign(value);
+                return;
+            }
+            if (!has_begun) begin_request();
+            if (is_malformed) return;
+            for (const char ch: name) {
+                if (ch >= 'A' && ch <= 'Z') is_malformed = true;
+            }
+            if (is_connection_specific(name) || (name == "te" && value != "trailers")) is_malformed = true;
+            if (is_malformed) return;
+            // Cookies may be split over several fields (RFC 9113, section 8.2.3)
+            if (name == "cookie") {
+                if (!m_cookie.empty()) m_cookie += "; ";
+                m_cookie.append(value);
+                return;
+            }
+            to_http1_name(name, m_name);
+            if (!parser.add_header(m_name, sz::string_view(value.data(), value.size()))) is_malformed = true;
+        });
+        if (!is_decoded) {
+            fail(out, ErrorCode::COMPRESSION_ERROR);
+            return;
+        }
+        if (m_is_going_away && id > m_go_away_stream_id) return;
+        if (m_streams.size() >= m_settings.max_concurrent_streams) {
+            reset_stream(out, id, ErrorCode::REFUSED_STREAM);
+            return;
+        }
+        if (!has_begun) begin_request();
+        if (!is_malformed && !m_cookie.empty()) parser.add_header("Cookie", m_cookie);
+        if (is_malformed) {
+            reset_stream(out, id, ErrorCode::PROTOCOL_ERROR);
+            return;
+        }
+        Stream &added = *m_streams.emplace(id, std::move(stream)).first->second;
+        set_priority(added, m_header_priority);
+        if (flags & FLAG_END_STREAM) end_request(added, out);
+    }
+
+    void on_data(BufferWriter &out, const uint8_t flags, const uint32_t stream_id, const uint8_t *payload,
+                 uint32_t length) {
+        if (stream_id == 0) return fail(out, ErrorCode::PROTOCOL_ERROR);
+        // Flow control counts the whole frame, padding included
+        const uint32_t frame_length = length;
+        if (frame_length > m_recv_window) return fail(out, ErrorCode::FLOW_CONTROL_ERROR);
+        m_recv_window -= frame_length;
+        m_recv_unacked += frame_length;
+        if (m_recv_unacked >= m_settings.connection_window / 2) {
+            put_window_update(out, 0, m_recv_unacked);
+            m_recv_window += m_recv_unacked;
+            m_recv_unacked = 0;
+        }
+        if (!strip_padding(flags, payload, length)) return fail(out, ErrorCode::PROTOCOL_ERROR);
+
+        Stream *stream = find_stream(stream_id);
+        if (stream == nullptr || stream->is_remote_closed) {
+            if (stream_id > m_last_stream_id) return fail(out, ErrorCode::PROTOCOL_ERROR);
+            return reset_stream(out, stream_id, ErrorCode::STREAM_CLOSED);
+        }
+        if (frame_length > stream->recv_window) return reset_stream(out, stream_id, ErrorCode::FLOW_CONTROL_ERROR);
+        stream->recv_window -= frame_length;
+        stream->parser.append_body(reinterpret_cast<const char *>(payload), length);
+        if (flags & FLAG_END_STREAM) return end_request(*stream, out);
+        stream->recv_unacked += frame_length;
+        if (stream->recv_unacked >= m_settings.stream_window / 2) {
+            put_window_update(out, stream_id, stream->recv_unacked);
+            stream->recv_window += stream->recv_unacked;
+            stream->recv_unacked = 0;
+        }
+    }
+
+    void on_headers(BufferWriter &out, const uint8_t flags, const uint32_t stream_id, const uint8_t *payload,
+                    uint32_t length) {
+        if (stream_id == 0) return fail(out, ErrorCode::PROTOCOL_ERROR);
+        if (!strip_padding(flags, payload, length)) return fail(out, ErrorCode::PROTOCOL_ERROR);
+        m_header_priority = Priority{};
+        if (flags & FLAG_PRIORITY) {
+            if (length < 5) return fail(out, ErrorCode::FRAME_SIZE_ERROR);
+            const uint32_t dependency = read_u32(payload);
+            m_header_priority.parent = dependency & 0x7fffffff;
+            m_header_priority.is_exclusive = (dependency & 0x80000000) != 0;
+            m_header_priority.weight = payload[4] + 1u;
+            if (m_header_priority.parent == stream_id) m_header_priority = Priority{};
+            payload += 5;
+            length -= 5;
+        }
+        m_header_block.assign(reinterpret_cast<const char *>(payload), length);
+        m_header_stream = stream_id;
+        m_header_flags = flags;
+        m_is_expecting_continuation = true;
+        if (flags & FLAG_END_HEADERS) end_header_block(out);
+    }
+
+    void on_continuation(BufferWriter &out, const uint8_t flags, const uint8_t *payload, const uint32_t length) {
+        if (!m_is_expecting_continuation) return fail(out, ErrorCode::PROTOCOL_ERROR);
+        m_header_block.append(reinterpret_cast<const char *>(payload), length);
+        // An endless header block would otherwise pile up here before anything can be checked
+        if (m_header_block.size() > m_settings.max_header_list_size + DEFAULT_FRAME_SIZE) {
+            return fail(out, ErrorCode::ENHANCE_YOUR_CALM);
+        }
+        if (flags & FLAG_END_HEADERS) end_header_block(out);
+    }
+
+    void on_priority(BufferWriter &out, const uint32_t stream_id, const uint8_t *payload, const uint32_t length) {
+        if (stream_id == 0) return fail(out, ErrorCode::PROTOCOL_ERROR);
+        if (length != 5) return reset_stream(out, stream_id, ErrorCode::FRAME_SIZE_ERROR);
+        Priority priority{};
+        const uint32_t dependency = read_u32(payload);
+        priority.parent = dependency & 0x7fffffff;
+        priority.is_exclusive = (dependency & 0x80000000) != 0;
+        priority.weight = payload[4] + 1u;
+        if (priority.parent == stream_id) return reset_stream(out, stream_id, ErrorCode::PROTOCOL_ERROR);
+        // Streams that are not open are not tracked, their priority would not be used anyway
+        if (Stream *stream = find_stream(stream_id); stream != nullptr) set_priority(*stream, priority);
+    }
+
+    void on_rst_stream(BufferWriter &out, const uint32_t stream_id, const uint32_t length) {
+        if (stream_id == 0 || stream_id > m_last_stream_id) return fail(out, ErrorCode::PROTOCOL_ERROR);
+        if (length != 4) return fail(out, ErrorCode::FRAME_SIZE_ERROR);
+        close_stream(stream_id);
+    }
+
+    void on_settings(BufferWriter &out, const uint8_t flags, const uint32_t stream_id, const uint8_t *payload,
+                     const uint32_t length) {
+        if (stream_id != 0) return fail(out, ErrorCode::PROTOCOL_ERROR);
+        if (flags & FLAG_ACK) {
+            if (length != 0) return fail(out, ErrorCode::FRAME_SIZE_ERROR);
+            // We send SETTINGS once, in start()
+            m_decoder.on_settings_acknowledged();
+            return;
+        }
+        if (length % 6 != 0) return fail(out, ErrorCode::FRAME_SIZE_ERROR);
+        if (!apply_settings(payload, length, &out)) return;
+        m_has_peer_settings = true;
+        put_frame_header(out, 0, FrameType::SETTINGS, FLAG_ACK, 0);
+    }
+
+    void on_ping(BufferWriter &out, const uint8_t flags, const uint32_t stream_id, const uint8_t *payload,
+                 const uint32_t length) {
+        if (stream_id != 0) return fail(out, ErrorCode::PROTOCOL_ERROR);
+        if (length != 8) return fail(out, ErrorCode::FRAME_SIZE_ERROR);
+        if (flags & FLAG_ACK) return;
+        put_frame_header(out, length, FrameType::PING, FLAG_ACK, 0);
+        out.put(reinterpret_cast<const char *>(payload), length);
+    }
+
+    void on_window_update(BufferWriter &out, const uint32_t stream_id, const uint8_t *payload, const uint32_t length) {
+        if (length != 4) return fail(out, ErrorCode::FRAME_SIZE_ERROR);
+        const uint32_t increment = read_u32(payload) & 0x7fffffff;
+        if (stream_id == 0) {
+            if (increment == 0) return fail(out, ErrorCode::PROTOCOL_ERROR);
+            m_send_window += increment;
+            if (m_send_window > MAX_WINDOW) fail(out, ErrorCode::FLOW_CONTROL_ERROR);
+            return;
+        }
+        Stream *stream = find_stream(stream_id);
+        if (stream == nullptr) {
+            if (stream_id > m_last_stream_id) fail(out, ErrorCode::PROTOCOL_ERROR);
+            return;
+        }
+        if (increment == 0) return reset_stream(out, stream_id, ErrorCode::PROTOCOL_ERROR);
+        stream->send_window += increment;
+        if (stream->send_window > MAX_WINDOW) reset_stream(out, stream_id, ErrorCode::FLOW_CONTROL_ERROR);
+    }
+
+    void process_frame(BufferWriter &out, const FrameType type, const uint8_t flags, const uint32_t stream_id,
+                       const uint8_t *payload, const uint32_t length) {
+        // The client preface ends with a SETTINGS frame
+        if (!m_has_peer_settings && type != FrameType::SETTINGS) return fail(out, ErrorCode::PROTOCOL_ERROR);
+        // Nothing may come between HEADERS and its CONTINUATION frames
+        if (m_is_expecting_continuation && (type != FrameType::CONTINUATION || stream_id != m_header_stream)) {
+            return fail(out, ErrorCode::PROTOCOL_ERROR);
+        }
+        switch (type) {
+            case FrameType::DATA:
+                return on_data(out, flags, stream_id, payload, length);
+            case FrameType::HEADERS:
+                return on_headers(out, flags, stream_id, payload, length);
+            case FrameType::PRIORITY:
+                return on_priority(out, stream_id, payload, length);
+            case FrameType::RST_STREAM:
+                return on_rst_stream(out, stream_id, length);
+            case FrameType::SETTINGS:
+                return on_settings(out, flags, stream_id, payload, length);
+            case FrameType::PUSH_PROMISE:
+                // Only servers push
+                return fail(out, ErrorCode::PROTOCOL_ERROR);
+            case FrameType::PING:
+                return on_ping(out, flags, stream_id, payload, length);
+            case FrameType::GOAWAY:
+                // The streams in flight are still answered, the client will not open more
+                if (stream_id != 0) fail(out, ErrorCode::PROTOCOL_ERROR);
+                return;
+            case FrameType::WINDOW_UPDATE:
+                return on_window_update(out, stream_id, payload, length);
+            case FrameType::CONTINUATION:
+                return on_continuation(out, flags, payload, length);
+            default:
+                // Unknown frame types are ignored
+                return;
+        }
+    }
+
+    // Process the complete frames in data, return how many bytes were used
+    size_t process(const char *data, const size_t size, BufferWriter &out) {
+        size_t position = 0;
+        if (m_preface_received < PREFACE.size()) {
+            const size_t length = std::min(PREFACE.size() - m_preface_received, size);
+            if (memcmp(data, PREFACE.data() + m_preface_received, length) != 0) {
+                fail(out, ErrorCode::PROTOCOL_ERROR);
+                return size;
+            }
+            m_preface_received += length;
+            position = length;
+        }
+        while (!m_has_failed && size - position >= FRAME_HEADER_SIZE) {
+            const auto *header = reinterpret_cast<const uint8_t *>(data + position);
+            const uint32_t length = header[0] << 16 | header[1] << 8 | header[2];
+            if (length > DEFAULT_FRAME_SIZE) {
+                fail(out, ErrorCode::FRAME_SIZE_ERROR);
+                break;
+            }
+            if (size - position - FRAME_HEADER_SIZE < length) break;
+            process_frame(out, static_cast<FrameType>(header[3]), header[4], read_u32(header + 5) & 0x7fffffff,
+                          header + FRAME_HEADER_SIZE, length);
+            position += FRAME_HEADER_SIZE + length;
+        }
+        return m_has_failed ? size : position;
+    }
+
+public:
+    Http2Connection(const Http2Settings &settings, Handler handler)
+        : m_settings(settings), m_handler(std::move(handler)), m_decoder(settings.header_table_size) {
+    }
+
+    Http2Connection(const Http2Connection &other) = delete;
+
+    Http2Connection &operator=(const Http2Connection &other) = delete;
+
+    /// The server preface: our SETTINGS, and the connection window if it is larger than the default.
+    /// Written before anything else goes out on the connection.
+    void start(BufferWriter &out) {
+        put_frame_header(out, 5 * 6, FrameType::SETTINGS, 0, 0);
+        put_setting(out, Setting::MAX_CONCURRENT_STREAMS, m_settings.max_concurrent_streams);
+        put_setting(out, Setting::INITIAL_WINDOW_SIZE, m_settings.stream_window);
+        put_setting(out, Setting::HEADER_TABLE_SIZE, m_settings.header_table_size);
+        put_setting(out, Setting::MAX_HEADER_LIST_SIZE, m_settings.max_header_list_size);
+        put_setting(out, Setting::ENABLE_PUSH, 0);
+        if (m_settings.connection_window > DEFAULT_WINDOW) {
+            put_window_update(out, 0, m_settings.connection_window - DEFAULT_WINDOW);
+            m_recv_window = m_settings.connection_window;
+        }
+    }
+
+    /// Take the settings of an "Upgrade: h2c" request, the value of its HTTP2-Settings field.
+    /// @return false if they are malformed, the request is then answered over HTTP/1.1
+    bool accept_upgrade(const std::string_view http2_settings) {
+        std::string payload{};
+        if (!decode_base64url(http2_settings, payload) || payload.size() % 6 != 0) return false;
+        return apply_settings(reinterpret_cast<const uint8_t *>(payload.data()),
+                              static_cast<uint32_t>(payload.size()), nullptr);
+    }
+
+    /// Continue an upgraded connection after the 101 response: the server preface, then the
+    /// response to the request that asked for the upgrade as stream 1. The client preface is
+    /// still to come through feed().
+    void upgrade(HttpRequestParser &parser, BufferWriter &out) {
+        start(out);
+        m_last_stream_id = 1;
+        auto stream = std::make_unique<Stream>();
+        stream->id = 1;
+        stream->is_remote_closed = true;
+        stream->send_window = m_peer_initial_window;
+        Stream &added = *m_streams.emplace(1, std::move(stream)).first->second;
+        respond(added, parser, out);
+    }
+
+    /// Feed the next bytes of the connection. Responses, and whatever else the frames call for,
+    /// are written to out.
+    /// @return false on a connection error: GOAWAY has been written, the connection is to be
+    ///         closed once it is sent
+    bool feed(const char *data, const size_t size, BufferWriter &out) {
+        if (m_has_failed) return false;
+        if (m_input.empty()) {
+            const size_t used = process(data, size, out);
+            m_input.assign(data + used, size - used);
+        } else {
+            m_input.append(data, size);
+            const size_t used = process(m_input.data(), m_input.size(), out);
+            m_input.erase(0, used);
+        }
+        if (!m_has_failed) write_data(out);
+        return !m_has_failed;
+    }
+
+    /// Frame more of the pending bodies, once the socket has sent everything queued before
+    void on_drained(BufferWriter &out) {
+        if (!m_has_failed) write_data(out);
+    }
+
+    /// Announce that no new streams will be accepted, the ones in flight are still answered
+    void go_away(BufferWriter &out) {
+        if (m_is_going_away || m_has_failed) return;
+        m_is_going_away = true;
+        m_go_away_stream_id = m_last_stream_id;
+        char payload[8];
+        put_u32(payload, m_last_stream_id);
+        put_u32(payload + 4, static_cast<uint32_t>(ErrorCode::NO_ERROR));
+        put_frame_header(out, sizeof(payload), FrameType::GOAWAY, 0, 0);
+        out.put(payload, sizeof(payload));
+    }
+
+    [[nodiscard]] bool is_going_away() const {
+        return m_is_going_away;
+    }
+
+    /// Whether a connection error ended the connection, nothing but the GOAWAY is left to send
+    [[nodiscard]] bool has_failed() const {
+        return m_has_failed;
+    }
+
+    /// Whether a request is being received or a response is being sent
+    [[nodiscard]] bool has_streams() const {
+        return !m_streams.empty();
+    }
+
+    /// Whether data could be sent once the socket drains, as opposed to waiting for the peer
+    [[nodiscard]] bool has_pending_output() const {
+        return m_has_peer_settings && !m_sending.empty() && m_send_window > 0;
+    }
+
+    /// Whether data is too short to tell, but may be the start of the client connection preface
+    static bool may_be_preface(const std::string_view data) {
+        return data.size() < 3 && PREFACE.compare(0, data.size(), data) == 0;
+    }
+
+    /// Whether data starts like the client connection preface, i.e. an HTTP/2 connection with prior knowledge
+    static bool is_preface(const std::string_view data) {
+        const size_t length = std::min(data.size(), PREFACE.size());
+        return length >= 3 && data.substr(0, length) == PREFACE.substr(0, length);
+    }
+};
+
+#endif //HTTP2_CONNECTION_H
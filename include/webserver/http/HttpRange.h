@@ -7,8 +7,20 @@
 #include <stringzilla.hpp>
 
 class HttpRange {
-    // 16MiB
-    const int64_t MAX_RANGE_LENGTH = 16 * 1024 * 1024;
+    bool m_is_valid = false;
+
+    // Parse a non-negative decimal number, the whole view has to be digits.
+    static bool parse_position(const sz::string_view &text, int64_t &out) {
+        if (text.empty()) return false;
+        int64_t value = 0;
+        for (const char ch: text) {
+            if (ch < '0' || ch > '9') return false;
+            if (value > (INT64_MAX - (ch - '0')) / 10) return false;
+            value = value * 10 + (ch - '0');
+        }
+        out = value;
+        return true;
+    }
 
 public:
     // [begin, end]
@@ -17,21 +29,43 @@ public:
     int64_t length;
 
     // Format: Range:(unit=first byte pos)-[last byte pos]
+    // A range that cannot be parsed or does not overlap the content is left invalid, the bounds are
+    // clamped to the content otherwise, so [begin, end] is always safe to read when is_valid().
     explicit HttpRange(const char *range_command, const int64_t range_length = 0) : length(range_length) {
         // Range should start with "bytes="
         const sz::string_view range_command_str(range_command);
+        if (!range_command_str.starts_with("bytes=")) return;
         const auto range = range_command_str.remove_prefix("bytes=");
         const auto [before, _, after] = range.partition("-");
-        if (!before.strip(sz::whitespaces_set()).empty())
-            begin = std::stoll(before);
-        if (!after.strip(sz::whitespaces_set()).empty())
-            end = std::stoll(after);
+        const auto first = before.strip(sz::whitespaces_set());
+        const auto last = after.strip(sz::whitespaces_set());
+
+        if (!first.empty() && !parse_position(first, begin)) return;
+        if (!last.empty() && !parse_position(last, end)) return;
+
+        if (first.empty()) {
+            // Suffix range: "bytes=-500" are the last 500 bytes
+            if (last.empty() || end == 0) return;
+            begin = end >= range_length ? 0 : range_length - end;
+            end = range_length - 1;
+        } else if (last.empty() || end >= range_length) {
+            end = range_length - 1;
+        }
+        m_is_valid = begin <= end && begin < range_length;
+    }
+
+    [[nodiscard]] bool is_valid() const {
+        return m_is_valid;
+    }
 
-        if (begin == -1) begin = 0;
-        if (end == -1) end = range_length - 1;
+    [[nodiscard]] int64_t size() const {
+        return end - begin + 1;
     }
 
     [[nodiscard]] std::string to_string() const {
+        if (!m_is_valid) {
+            return "bytes */" + std::to_string(length);
+        }
         std::string result = "bytes " + std::to_string(begin) + "-" + std::to_string(end) + "/" +
                              std::to_string(length);
         return std::move(result);
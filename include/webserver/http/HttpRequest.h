@@ -5,17 +5,20 @@
 #ifndef HTTP_REQUEST_H
 #define HTTP_REQUEST_H
 
-#include <unordered_map>
-#include <stringzilla.hpp>
-
+#include "../common/Arena.h"
 
+/// Strings and maps of a request live in the arena of its connection while the server handles it,
+/// and are gone once the response is queued. Copy anything that has to outlive the callback: copies
+/// made there are on the heap. Moving out of a request takes its arena memory along, do not.
 struct HttpRequest {
-    using string = sz::string;
-    template<typename K, typename V>
-    using unordered_map = std::unordered_map<K, V>;
+    using string = ArenaString;
+    using string_map = ArenaMap<string>;
 
     string method{};
+    // Decoded and normalized path, always starting with '/'
     string url{};
+    // What follows '?' in the request target, as received
+    string query{};
     string protocol{};
 
     string refer{};
@@ -38,8 +41,8 @@ struct HttpRequest {
 
     string data{};
 
-    unordered_map<string, string> headers{};
-    unordered_map<string, string> parameters{};
+    string_map headers{};
+    string_map parameters{};
 
     void insert(const string &key, const string &value) {
         headers.emplace(key, value);
@@ -5,12 +5,12 @@
 #ifndef HTTP_REQUEST_PARSER_H
 #define HTTP_REQUEST_PARSER_H
 
+#include <charconv>
+#include <chrono>
 #include <string>
-#include <sstream>
 #include <stringzilla.hpp>
 
 #include "HttpRequest.h"
-#include "../common/FileSystem.h"
 #include "../common/UrlHelper.h"
 #include "../tcp/multiplexing/Multiplexing.h"
 
@@ -48,17 +48,33 @@ class HttpRequestParser {
         DONE
     };
 
+    using string_view = sz::string_view;
+
+    // Request header bigger than this is rejected.
+    static constexpr size_t MAX_HEADER_SIZE = 64 * 1024;
+
+    // Backs the strings and maps of request, emptied by reset()
+    Arena m_arena{};
+    // Scratch buffers on the heap, reused from request to request
     string temp{};
-    std::stringstream data_ss{};
-    size_t data_size = 0;
+    string m_name{};
+    string m_value{};
     ParseState state = ParseState::METHOD;
+    // Bytes of a request header that has not been completed yet
+    string m_header_buffer{};
+    // Bytes received after the current request, i.e. the beginning of a pipelined request
+    string m_pending{};
+    // Where feed_pending() moves m_pending to while it is parsed
+    string m_feeding{};
+    // When the first byte of the current request arrived
+    std::chrono::steady_clock::time_point m_started_at{};
 
     bool m_is_successful = false;
 
     bool m_need_more = true;
 
-    static bool read_util_char(const char end, int &idx, const SocketBuffer &buffer, string &out) {
-        const auto size = buffer.size;
+    static bool read_util_char(const char end, size_t &idx, const string_view &buffer, string &out) {
+        const auto size = buffer.size();
         if (idx >= size) {
             return false;
         }
@@ -69,7 +85,7 @@ class HttpRequestParser {
     }
 
 
-    void assign_header(const string &name, const string &value) {
+    bool assign_header(const string_view name, const string_view value) {
         if (name == "Refer") {
             request.refer = value;
         } else if (name == "Host") {
@@ -79,7 +95,9 @@ class HttpRequestParser {
         } else if (name == "Content-Type") {
             request.content_type = value;
         } else if (name == "Content-Length") {
-            request.content_length = std::stoi(value);
+            const auto [end, error] = std::from_chars(value.data(), value.data() + value.size(),
+                                                      request.content_length);
+            if (error != std::errc() || end != value.data() + value.size()) return false;
         } else if (name == "Accept") {
             request.accept = value;
         } else if (name == "Accept-Language") {
@@ -97,14 +115,35 @@ class HttpRequestParser {
         } else {
             request.insert(name, value);
         }
+        return true;
     }
 
-    bool parse_request_line(int &idx, const SocketBuffer &buffer) {
+    // Split the target at '?', decode and normalize the path, keep the query as it came.
+    bool parse_target(const string_view target) {
+        const auto query = target.find('?');
+        const auto path = query == string_view::npos ? target : target.substr(0, query);
+        size_t length;
+        request.url.resize(path.size());
+        if (!UrlHelper::decode_path({path.data(), path.size()}, request.url.data(), length)) return false;
+        request.url.resize(length);
+        if (query != string_view::npos) request.query = target.substr(query + 1);
+        return true;
+    }
+
+    static bool decode_component(const char *data, const size_t length, HttpRequest::string &out) {
+        size_t decoded_length;
+        out.resize(length);
+        if (!UrlHelper::decode_component({data, length}, out.data(), decoded_length)) return false;
+        out.resize(decoded_length);
+        return true;
+    }
+
+    bool parse_request_line(size_t &idx, const string_view &buffer) {
         if (state == ParseState::METHOD) {
             if (!read_util_char(' ', idx, buffer, temp)) {
                 RETURN_FAILED()
             }
-            request.method = temp;
+            request.method = temp.view();
             temp.clear();
             state = ParseState::URL;
             idx++;
@@ -113,7 +152,9 @@ class HttpRequestParser {
             if (!read_util_char(' ', idx, buffer, temp)) {
                 RETURN_FAILED()
             }
-            request.url = FileSystem::normalize_path(UrlHelper::decode(temp));
+            if (!parse_target(temp.view())) {
+                RETURN_FAILED()
+            }
             temp.clear();
             state = ParseState::PROTOCOL;
             idx++;
@@ -122,21 +163,21 @@ class HttpRequestParser {
             if (!read_util_char('\r', idx, buffer, temp)) {
                 RETURN_FAILED()
             }
-            request.protocol = temp;
+            request.protocol = temp.view();
             temp.clear();
             state = ParseState::HEADER;
         }
 
-        if (idx < buffer.size && buffer[idx++] != '\r') RETURN_FAILED()
-        if (idx < buffer.size && buffer[idx++] != '\n') RETURN_FAILED()
+        if (idx < buffer.size() && buffer[idx++] != '\r') RETURN_FAILED()
+        if (idx < buffer.size() && buffer[idx++] != '\n') RETURN_FAILED()
         if (state != ParseState::HEADER) RETURN_FAILED()
         return true;
     }
 
-    bool parse_headers(int &idx, const SocketBuffer &buffer) {
-        string name{};
-        string value{};
-        const auto size = buffer.size;
+    bool parse_headers(size_t &idx, const string_view &buffer) {
+        string &name = m_name;
+        string &value = m_value;
+        const auto size = buffer.size();
         while (idx < size && buffer[idx] != '\r') {
             name.clear();
             value.clear();
@@ -152,7 +193,7 @@ class HttpRequestParser {
             }
             if (idx < size && buffer[idx++] != '\r') RETURN_FAILED()
             if (idx < size && buffer[idx++] != '\n') RETURN_FAILED()
-            assign_header(name, value);
+            if (!assign_header(name.view(), value.view())) RETURN_FAILED()
         }
         if (idx < size && buffer[idx++] != '\r') RETURN_FAILED()
         if (idx < size && buffer[idx++] != '\n') RETURN_FAILED()
@@ -160,21 +201,18 @@ class HttpRequestParser {
         return true;
     }
 
-    bool parse_data(int &idx, const SocketBuffer &buffer) {
+    bool parse_data(size_t &idx, const string_view &buffer) {
         if (request.method == "GET") {
             state = ParseState::DONE;
             RETURN_SUCCESS()
         }
         if (request.method == "POST") {
-            const auto max_size = request.content_length;
-            while (data_size < max_size && idx < buffer.size) {
-                data_ss << buffer[idx++];
-                data_size++;
-            }
-            if (data_size < max_size) {
+            const auto received = std::min(request.content_length - request.data.size(), buffer.size() - idx);
+            request.data.append(buffer.data() + idx, received);
+            idx += received;
+            if (request.data.size() < request.content_length) {
                 RETURN_NEED_MORE()
             }
-            request.data = data_ss.str();
             state = ParseState::DONE;
             RETURN_SUCCESS()
         }
@@ -182,47 +220,38 @@ class HttpRequestParser {
     }
 
     bool parse_parameters(const char *parameters, const size_t length) {
-        std::stringstream ss{};
-        int idx = 0;
+        size_t idx = 0;
         while (idx < length) {
+            const size_t key_begin = idx;
             while (idx < length && parameters[idx] != '=') {
-                ss << parameters[idx++];
+                idx++;
             }
-            if (idx >= length || parameters[idx++] != '=') {
+            if (idx >= length) {
                 RETURN_FAILED()
             }
-            std::string key = ss.str();
-            ss.str("");
+            const size_t key_end = idx++;
+            const size_t value_begin = idx;
             while (idx < length && parameters[idx] != '&') {
-                ss << parameters[idx++];
+                idx++;
+            }
+            HttpRequest::string key{}, value{};
+            if (!decode_component(parameters + key_begin, key_end - key_begin, key) ||
+                !decode_component(parameters + value_begin, idx - value_begin, value)) {
+                RETURN_FAILED()
             }
-            if (idx < length && parameters[idx] == '&') idx++;
-            std::string value = ss.str();
-            ss.str("");
             request.parameters.emplace(std::move(key), std::move(value));
+            if (idx < length) idx++;
         }
         return true;
     }
 
     bool parse_parameters() {
         if (request.method == "GET") {
-            const string &url = request.url;
-            int idx = 0;
-            const auto size = url.length();
-            // Find '?'
-            while (idx < size && url[idx] != '?') {
-                idx++;
-            }
-
-            const auto old_url = request.url;
-            request.url = request.url.substr(0, idx);
-            if (idx < size && old_url[idx] == '?') idx++;
-            if (idx < size)
-                return parse_parameters(old_url.c_str() + idx, size - idx);
-        } else if (request.method == "POST") {
+            return parse_parameters(request.query.data(), request.query.size());
+        }
+        if (request.method == "POST") {
             if (request.content_type == "application/x-www-form-urlencoded") {
-                const string &url = request.data;
-                return parse_parameters(url.c_str(), url.length());
+                return parse_parameters(request.data.data(), request.data.size());
             }
         }
         return true;
@@ -231,32 +260,70 @@ class HttpRequestParser {
 public:
     HttpRequest request;
 
+    /// Get ready for the next request. Bytes of a pipelined request that have already arrived are kept.
+    /// The memory of request is released in one go, nothing may refer to it afterwards.
     void reset() {
         temp.clear();
-        data_ss.str("");
-        data_size = 0;
         state = ParseState::METHOD;
+        m_header_buffer.clear();
         m_is_successful = false;
         m_need_more = true;
         request = HttpRequest();
+        m_arena.reset();
+    }
+
+    /// Arena of the current request, for whatever else lives exactly as long as it
+    Arena &arena() {
+        return m_arena;
     }
 
     bool feed_data(const SocketBuffer &buffer) {
-        int idx = 0;
+        return feed_data(string_view(buffer.buffer, buffer.size));
+    }
+
+    /// Feed the next bytes of the connection. Returns true when a request is complete; false with
+    /// need_more() when it is not complete yet; false without need_more() when it is malformed.
+    bool feed_data(const string_view &buffer) {
+        ArenaScope scope(m_arena);
+        size_t idx = 0;
+        string_view data = buffer;
+        if (state == ParseState::METHOD && m_header_buffer.empty()) {
+            m_started_at = std::chrono::steady_clock::now();
+        }
         if (state != ParseState::DATA && state != ParseState::DONE) {
-            if (!parse_request_line(idx, buffer)) {
+            // The header is parsed once it is complete, a partial one is kept until the rest arrives.
+            size_t header_end;
+            if (m_header_buffer.empty() && (header_end = buffer.find("\r\n\r\n")) != string_view::npos) {
+                data = buffer;
+            } else {
+                const size_t skip = m_header_buffer.size() > 3 ? m_header_buffer.size() - 3 : 0;
+                m_header_buffer.append(buffer.data(), buffer.size());
+                data = m_header_buffer;
+                header_end = data.find("\r\n\r\n", skip);
+                if (header_end == string_view::npos) {
+                    if (m_header_buffer.size() > MAX_HEADER_SIZE) RETURN_FAILED()
+                    m_is_successful = false;
+                    m_need_more = true;
+                    return false;
+                }
+            }
+            const auto header = data.substr(0, header_end + 4);
+            if (!parse_request_line(idx, header)) {
                 RETURN_FAILED()
             }
-            if (!parse_headers(idx, buffer)) {
+            if (!parse_headers(idx, header)) {
                 RETURN_FAILED()
             }
         }
         if (state == ParseState::DATA) {
-            if (!parse_data(idx, buffer)) {
+            if (!parse_data(idx, data)) {
                 RETURN_FAILED()
             }
         }
         if (state == ParseState::DONE) {
+            if (idx < data.size()) {
+                m_pending.append(data.data() + idx, data.size() - idx);
+            }
             if (!parse_parameters()) {
                 RETURN_FAILED()
             }
@@ -265,9 +332,77 @@ public:
         return m_is_successful;
     }
 
+    /// Start a request that arrives as separate fields instead of bytes (HTTP/2). The request is
+    /// complete after finish_request(), the same checks apply as to feed_data().
+    /// @return false if the method is not supported or the target is malformed
+    bool begin_request(const string_view method, const string_view target, const string_view protocol) {
+        ArenaScope scope(m_arena);
+        m_started_at = std::chrono::steady_clock::now();
+        if (method != "GET" && method != "POST") return false;
+        request.method = method;
+        request.protocol = protocol;
+        state = ParseState::HEADER;
+        return parse_target(target);
+    }
+
+    /// @return false if the value is malformed, e.g. a Content-Length that is not a number
+    bool add_header(const string_view name, const string_view value) {
+        ArenaScope scope(m_arena);
+        return assign_header(name, value);
+    }
+
+    void append_body(const char *data, const size_t length) {
+        ArenaScope scope(m_arena);
+        state = ParseState::DATA;
+        request.data.append(data, length);
+    }
+
+    /// @return false if the body does not match its Content-Length or the parameters are malformed
+    bool finish_request() {
+        ArenaScope scope(m_arena);
+        state = ParseState::DONE;
+        if (request.content_length > 0 && request.data.size() != request.content_length) RETURN_FAILED()
+        if (!parse_parameters()) RETURN_FAILED()
+        RETURN_SUCCESS()
+    }
+
+    /// Bytes received after the current request, still to be parsed
+    string_view pending() const {
+        return m_pending;
+    }
+
+    /// Drop the pending bytes, when someone else parses them from now on (an upgraded connection)
+    void clear_pending() {
+        m_pending.clear();
+    }
+
+    /// Whether bytes of the next request have been received along with the current one
+    bool has_pending() const {
+        return !m_pending.empty();
+    }
+
+    /// Parse the bytes left over from the previous request, same results as feed_data
+    bool feed_pending() {
+        std::swap(m_pending, m_feeding);
+        m_pending.clear();
+        const bool is_successful = feed_data(string_view(m_feeding));
+        m_feeding.clear();
+        return is_successful;
+    }
+
+    /// Whether the header of the current request has been received completely
+    bool is_reading_body() const {
+        return state == ParseState::DATA;
+    }
+
     bool need_more() const {
         return m_need_more;
     }
+
+    /// When the first byte of the current request arrived
+    std::chrono::steady_clock::time_point started_at() const {
+        return m_started_at;
+    }
 };
 
 
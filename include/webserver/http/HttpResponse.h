@@ -4,91 +4,87 @@
 
 #ifndef HTTP_RESPONSE_H
 #define HTTP_RESPONSE_H
+#include <algorithm>
+#include <charconv>
 #include <string>
-#include <unordered_map>
+#include <string_view>
 #include <vector>
 #include <memory>
 
 #include "HttpStatus.h"
+#include "../common/Arena.h"
+#include "../common/BufferWriter.h"
+#include "../common/OpenFile.h"
 #include "../tcp/multiplexing/Multiplexing.h"
 
 
 class HttpResponse {
     using string = std::string;
-    template<typename K, typename V>
-    using unordered_map = std::unordered_map<K, V>;
     template<typename T>
     using vector = std::vector<T>;
     template<typename T>
     using shared_ptr = std::shared_ptr<T>;
 
-    unordered_map<string, string> headers{};
+    // Bodies up to this size are kept in the response and copied next to the header
+    static constexpr size_t MAX_INLINE_BODY_SIZE = 4096;
+
+    // Where the headers are allocated, the arena of the request when the server makes the response.
+    // Only opened while a header is stored: whatever a handler allocates itself stays on the heap.
+    Arena *m_arena = nullptr;
+    ArenaMap<ArenaString> headers{};
 
     HttpStatus m_status{};
-    string m_status_line{};
-    shared_ptr<string> m_body_str;
-    shared_ptr<vector<char> > m_body_vector;
+    // The body is referenced, not copied: whatever owns the bytes is kept alive until they are sent.
+    SendBuffer m_body{};
+    // A small body set by value, used instead of m_body while m_has_inline_body
+    string m_inline_body{};
+    bool m_has_inline_body = false;
+
+    void put_header(BufferWriter &output, const size_t length) const {
+        char number[24];
+        output.put("HTTP/1.1 ");
+        auto [end, error] = std::to_chars(number, number + sizeof(number), static_cast<int>(m_status));
+        output.put(number, end - number);
+        output.put(" ");
+        output.put(get_status_string(m_status));
+        output.put("\r\n");
 
-    template<typename StrLike>
-    static void put_string(const shared_ptr<vector<shared_ptr<SocketBuffer> > > &response, const StrLike &str,
-                           ssize_t length, SocketBuffer &buffer) {
-        auto str_begin = str.data();
-        // auto str_end = str.end();
-        ssize_t rest_size = length;
-        while (rest_size > 0) {
-            bool create_new = false;
-            long long int write_size;
-            if (rest_size + buffer.size > SocketBuffer::MAX_SIZE) {
-                write_size = SocketBuffer::MAX_SIZE - buffer.size;
-                create_new = true;
-            } else {
-                write_size = rest_size;
-            }
-            memcpy(buffer.p_current, str_begin, write_size);
-            buffer.size += write_size;
-            buffer.p_current += write_size;
-            str_begin += write_size;
-            if (create_new) {
-                // we need copy
-                auto new_buffer = std::make_shared<SocketBuffer>(buffer);
-                response->emplace_back(new_buffer);
-                buffer.p_current = buffer.buffer;
-                buffer.size = 0;
-            }
-            rest_size -= write_size;
+        for (const auto &pair: headers) {
+            if (pair.first == "Content-Length") continue;
+            output.put(pair.first);
+            output.put(": ");
+            output.put(pair.second);
+            output.put("\r\n");
         }
+        output.put("Content-Length: ");
+        end = std::to_chars(number, number + sizeof(number), length).ptr;
+        output.put(number, end - number);
+        output.put("\r\n\r\n");
     }
 
-    static void put_string(const shared_ptr<vector<shared_ptr<SocketBuffer> > > &response, const string &str,
-                           SocketBuffer &buffer) {
-        return put_string(response, str, str.length(), buffer);
-    }
-
-    static void put_string(const shared_ptr<vector<shared_ptr<SocketBuffer> > > &response, const vector<char> &str,
-                           SocketBuffer &buffer) {
-        return put_string(response, str, str.size(), buffer);
-    }
-
-    static bool endsWith(const std::string &str, const std::string &suffix) {
+    static bool endsWith(const std::string_view str, const std::string_view suffix) {
         if (suffix.length() > str.length()) { return false; }
 
         return (str.rfind(suffix) == (str.length() - suffix.length()));
     }
 
 public:
-    explicit HttpResponse() {
+    /// @param arena keeps the headers, it has to outlive the response; nullptr for the global heap
+    explicit HttpResponse(Arena *arena = nullptr)
+        : m_arena(arena) {
         set_status(HttpStatus::OK);
-        m_body_str = std::make_shared<string>();
-        m_body_vector = std::make_shared<vector<char> >();
     }
 
     void set_status(const HttpStatus &status) {
         m_status = status;
-        m_status_line = "HTTP/1.1 " + std::to_string(static_cast<int>(status)) + " " + get_status_string(status);
     }
 
-    void set_content_type_by_url(const string &url) {
-        string content_type = "text/html; charset=utf-8";
+    [[nodiscard]] HttpStatus get_status() const {
+        return m_status;
+    }
+
+    void set_content_type_by_url(const std::string_view url) {
+        const char *content_type;
         if (endsWith(url, ".png")) {
             content_type = "image/png";
         } else if (endsWith(url, ".jpg")) {
@@ -106,64 +102,108 @@ public:
     }
 
     void set_body(string &&body) {
-        m_body_str = std::make_shared<string>(body);
+        if (body.size() > MAX_INLINE_BODY_SIZE) {
+            set_body(std::make_shared<string>(std::move(body)));
+            return;
+        }
+        m_inline_body = std::move(body);
+        m_has_inline_body = true;
+        m_body = SendBuffer();
     }
 
     void set_body(const std::shared_ptr<string> &body) {
-        m_body_str = body;
+        m_body = SendBuffer(body, body->data(), static_cast<ssize_t>(body->size()));
+        m_has_inline_body = false;
     }
 
     void set_body(const std::shared_ptr<vector<char> > &body) {
-        m_body_vector = body;
+        m_body = SendBuffer(body, body->data(), static_cast<ssize_t>(body->size()));
+        m_has_inline_body = false;
     }
 
-    void insert(const string &key, const string &value) {
+    /// Use [offset, offset + length) of an open file as the body, sent with sendfile where there is one.
+    void set_body(const std::shared_ptr<OpenFile> &file, const int64_t offset, const int64_t length) {
+#ifdef LINUX
+        m_body = SendBuffer::from_file(file, file->fd(), offset, length);
+#endif
+#ifdef WINDOWS
+        m_body = SendBuffer(file, file->data() + offset, length);
+#endif
+        m_has_inline_body = false;
+    }
+
+    void insert(const std::string_view key, const std::string_view value) {
+        ArenaScope scope(m_arena);
         headers.emplace(key, value);
     }
 
-    string &operator[](const string &key) {
+    /// The value is assigned after the call, outside of the arena: prefer insert() on hot paths
+    ArenaString &operator[](const std::string_view key) {
+        ArenaScope scope(m_arena);
         return headers[key];
     }
 
-    template<typename StrLike>
-    shared_ptr<vector<shared_ptr<SocketBuffer> > > get_response(const StrLike &body, size_t length) const {
-        auto response = std::make_shared<vector<shared_ptr<SocketBuffer> > >();
-        SocketBuffer buffer{};
-        put_string(response, m_status_line, buffer);
-        put_string(response, "\r\n", buffer);
+    /// Headers set so far, Content-Length excluded
+    [[nodiscard]] const ArenaMap<ArenaString> &get_headers() const {
+        return headers;
+    }
 
-        for (const auto &pair: headers) {
-            if (pair.first == "Content-Length") continue;
-            put_string(response, pair.first, buffer);
-            put_string(response, ": ", buffer);
-            put_string(response, pair.second, buffer);
-            put_string(response, "\r\n", buffer);
-        }
-        put_string(response, "Content-Length: ", buffer);
-        put_string(response, std::to_string(length), buffer);
-        put_string(response, "\r\n", buffer);
-        put_string(response, "\r\n", buffer);
-        put_string(response, body, buffer);
-        if (buffer.p_current != buffer.buffer) {
-            buffer.size = buffer.p_current - buffer.buffer;
-            response->emplace_back(std::make_shared<SocketBuffer>(buffer));
+    [[nodiscard]] int64_t get_body_size() const {
+        return m_has_inline_body ? static_cast<int64_t>(m_inline_body.size()) : m_body.size;
+    }
+
+    /// Move the body out, for a protocol that frames it itself. A small body set by value is moved
+    /// into a string of its own, so the result stays valid after the response is gone.
+    SendBuffer take_body() {
+        if (m_has_inline_body) {
+            auto body = std::make_shared<string>(std::move(m_inline_body));
+            m_has_inline_body = false;
+            return {body, body->data(), static_cast<ssize_t>(body->size())};
         }
+        return std::move(m_body);
+    }
+
+    template<typename StrLike>
+    shared_ptr<vector<SendBuffer> > get_response(const StrLike &body, size_t length) const {
+        auto response = std::make_shared<vector<SendBuffer> >();
+        BufferWriter output(*response);
+        put_header(output, length);
+        output.put(body.data(), static_cast<ssize_t>(length));
+        output.flush();
         return response;
     }
 
-    shared_ptr<vector<shared_ptr<SocketBuffer> > > get_response(const vector<char> &body) const {
+    shared_ptr<vector<SendBuffer> > get_response(const vector<char> &body) const {
         return get_response(body, body.size());
     }
 
-    shared_ptr<vector<shared_ptr<SocketBuffer> > > get_response(const string &body) const {
+    shared_ptr<vector<SendBuffer> > get_response(const string &body) const {
         return get_response(body, body.length());
     }
 
-    shared_ptr<vector<shared_ptr<SocketBuffer> > > get_response() const {
-        if (!m_body_str->empty())
-            return get_response(*m_body_str);
-        else {
-            return get_response(*m_body_vector);
+    shared_ptr<vector<SendBuffer> > get_response() const {
+        auto response = std::make_shared<vector<SendBuffer> >();
+        get_response(*response);
+        return response;
+    }
+
+    /// Append the response to buffers, the header in pooled SocketBuffers and the body after it.
+    void get_response(vector<SendBuffer> &buffers) const {
+        BufferWriter output(buffers);
+        if (m_has_inline_body) {
+            put_header(output, m_inline_body.size());
+            output.put(m_inline_body);
+            output.flush();
+            return;
+        }
+        put_header(output, m_body.size);
+        // A body that fits next to the header goes out in the same write, a bigger one is queued by reference.
+        if (!m_body.is_file() && m_body.size <= output.room()) {
+            output.put(m_body.data, m_body.size);
+            output.flush();
+        } else {
+            // A file cannot be copied next to the header, it joins the header's packet instead
+            output.append(m_body, m_body.is_file() && m_body.size > 0);
         }
     }
 };
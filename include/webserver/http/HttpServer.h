@@ -4,18 +4,27 @@
 
 #ifndef HTTP_SERVER_H
 #define HTTP_SERVER_H
+#include <cctype>
 #include <utility>
 #include <stringzilla.hpp>
 
+#include "EventStream.h"
+#include "Http2Connection.h"
 #include "HttpRange.h"
 #include "HttpRequest.h"
 #include "HttpRequestParser.h"
 #include "HttpResponse.h"
-#include "../common/FileReader.h"
+#include "ReverseProxy.h"
+#include "WebSocket.h"
 #include "../common/FileSystem.h"
+#include "../common/Metrics.h"
+#include "../common/RateLimiter.h"
 #include "../tcp/TcpServer.h"
 #include "../common/SafeMap.h"
+#include "../common/StaticRoot.h"
 #include "../common/UrlHelper.h"
+#include "../tcp/Broadcaster.h"
+#include "../log/AccessLog.h"
 
 inline auto NOT_FOUND_HTML = R"(
 <!DOCTYPE html>
@@ -39,50 +48,537 @@ width: 100%; height: 100%; display: flex;
 
 using HttpCallback = std::function<void(HttpRequest &, HttpResponse &)>;
 
+/// Request rate limit (limit_req) on the requests whose url starts with route
+struct RateLimitRule {
+    enum class Key {
+        // One bucket per client address
+        CLIENT_IP,
+        // One bucket per url
+        ROUTE,
+        // One bucket per value of a header (one without a dedicated HttpRequest field),
+        // requests without the header fall back to the client address
+        HEADER
+    };
+
+    std::string route = "/";
+    Key key = Key::CLIENT_IP;
+    std::string header{};
+    // Requests per second
+    double rate = 10;
+    // Requests allowed back to back on top of the rate
+    int64_t burst = 0;
+    // Buckets kept at most, the least recently used ones are forgotten first
+    size_t capacity = 1 << 16;
+};
+
 class HttpServer {
     using string = std::string;
 
-    // If file size is bigger than this value, then it will not been cached.
-    const int MAX_CACHED_SIZE = 10 * 1024 * 1024;
+    // Parsers of idle connections cached per I/O thread
+    static constexpr size_t MAX_POOLED_PARSERS = 64;
+
+    // What a connection carries from one read to the next. AsyncSocket::context points to it.
+    struct HttpSession {
+        // Only held while a request is on its way in: taken from the pool of the thread when one
+        // starts and given back once the connection waits for the next, speaks something else or closes
+        std::unique_ptr<HttpRequestParser> parser{};
+        // Set once the connection speaks HTTP/2
+        std::unique_ptr<Http2Connection> http2{};
+        // Set once the connection has been upgraded to WebSocket
+        std::shared_ptr<WebSocket> websocket{};
+        // Set once the connection carries an event stream, input is ignored from then on
+        std::shared_ptr<EventStream> events{};
+        // Set while a request is forwarded to an upstream server, input goes to it until it is finished
+        std::shared_ptr<ProxyExchange> proxy{};
+        // The first bytes of the connection, while they are too few to tell HTTP/2 from HTTP/1.1
+        std::string first_bytes{};
+    };
 
     int m_port;
     TcpServer m_tcp_server;
     HttpCallback m_callback;
-    bool m_enable_cache = false;
-
-    SafeMap<socket_type, HttpRequestParser> m_request_parsers{};
-    SafeMap<string, std::vector<char> > m_file_cache{};
+    Broadcaster m_broadcaster{m_tcp_server};
+    ReverseProxy m_proxy{m_tcp_server};
+
+    SafeMap<socket_type, HttpSession> m_sessions{};
+    // Off until enable_http2()
+    bool m_is_http2_enabled = false;
+    Http2Settings m_http2_settings{};
+    // Where default_callback() serves files from
+    std::unique_ptr<StaticRoot> m_static_root = std::make_unique<StaticRoot>(".");
     std::unordered_map<string, HttpCallback> m_custom_request_callbacks{};
+    std::unordered_map<string, WebSocketHandler> m_websocket_routes{};
+    std::unordered_map<string, EventStreamHandler> m_event_stream_routes{};
+    std::vector<std::pair<RateLimitRule, std::unique_ptr<RateLimiter> > > m_rate_limits{};
+    std::unique_ptr<AccessLog> m_access_log{};
+    // Empty while the metrics endpoint is off
+    string m_metrics_route{};
+
+    static bool is_keep_alive(HttpRequest &req) {
+        const sz::string_view connection = req.headers.count("Connection") > 0
+                                               ? sz::string_view(req.headers["Connection"])
+                                               : sz::string_view();
+        // HTTP/1.1 keeps the connection unless asked not to, HTTP/1.0 only when asked to.
+        if (req.protocol == "HTTP/1.1") {
+            return connection != "close" && connection != "Close";
+        }
+        return connection == "keep-alive" || connection == "Keep-Alive";
+    }
+
+    static std::vector<std::unique_ptr<HttpRequestParser> > &get_parser_pool() {
+        thread_local std::vector<std::unique_ptr<HttpRequestParser> > pool{};
+        return pool;
+    }
+
+    static void acquire_parser(HttpSession &session) {
+        auto &pool = get_parser_pool();
+        if (pool.empty()) {
+            session.parser = std::make_unique<HttpRequestParser>();
+            return;
+        }
+        session.parser = std::move(pool.back());
+        pool.pop_back();
+    }
+
+    /// A connection between two requests keeps no parser. Only call it once the parser has been
+    /// reset and holds no pipelined bytes.
+    static void release_parser(HttpSession &session) {
+        if (session.parser == nullptr) return;
+        auto &pool = get_parser_pool();
+        if (pool.size() < MAX_POOLED_PARSERS) pool.emplace_back(std::move(session.parser));
+        else session.parser.reset();
+    }
+
+    HttpSession &get_session(AsyncSocket *socket) {
+        if (socket->context == nullptr) socket->context = &m_sessions[socket->get_socket()];
+        return *static_cast<HttpSession *>(socket->context);
+    }
 
     void on_received(AsyncSocket *socket, const SocketBuffer &buffer) {
         if (socket->is_read_closed() || socket->is_closed()) return;
         if (buffer.size == 0) return;
 
-        if (m_request_parsers.contains_key(socket->get_socket())) {
-            m_request_parsers.emplace(socket->get_socket(), HttpRequestParser());
+        auto &session = get_session(socket);
+        if (session.websocket != nullptr) {
+            session.websocket->feed(buffer.buffer, buffer.size);
+            return;
+        }
+        if (session.events != nullptr) return;
+        if (session.proxy != nullptr) {
+            session.proxy->feed(buffer.buffer, buffer.size);
+            return;
+        }
+        if (session.http2 != nullptr) {
+            on_http2_received(socket, session, buffer.buffer, buffer.size);
+            return;
+        }
+        if (m_is_http2_enabled && socket->get_phase() == AsyncSocket::Phase::CONNECTED) {
+            on_first_received(socket, session, std::string_view(buffer.buffer, buffer.size));
+            return;
+        }
+        on_http1_received(socket, session, buffer.buffer, buffer.size);
+    }
+
+    // HTTP/2 with prior knowledge starts with its preface instead of a request line
+    void on_first_received(AsyncSocket *socket, HttpSession &session, std::string_view data) {
+        if (!session.first_bytes.empty()) {
+            session.first_bytes.append(data);
+            data = session.first_bytes;
+        }
+        if (Http2Connection::may_be_preface(data)) {
+            if (session.first_bytes.empty()) session.first_bytes.assign(data);
+            return;
+        }
+        if (Http2Connection::is_preface(data)) {
+            session.http2 = make_http2_connection(socket);
+            thread_local std::vector<SendBuffer> socket_buffers{};
+            socket_buffers.clear();
+            BufferWriter output(socket_buffers);
+            session.http2->start(output);
+            output.flush();
+            socket->async_send(socket_buffers);
+            socket_buffers.clear();
+            on_http2_received(socket, session, data.data(), data.size());
+        } else {
+            on_http1_received(socket, session, data.data(), data.size());
         }
-        auto &parser = m_request_parsers[socket->get_socket()];
+        std::string().swap(session.first_bytes);
+    }
+
+    void on_http1_received(AsyncSocket *socket, HttpSession &session, const char *data, const size_t size) {
+        if (session.parser == nullptr) acquire_parser(session);
+        auto &parser = *session.parser;
 
         bool is_successful = false;
         if (parser.need_more()) {
-            is_successful = parser.feed_data(buffer);
+            is_successful = parser.feed_data(sz::string_view(data, size));
         }
 
-        if (!is_successful && !parser.need_more()) {
-            socket->async_close();
+        // One read may carry several pipelined requests, answer them in order.
+        while (true) {
+            if (!is_successful && !parser.need_more()) {
+                socket->async_close();
+                parser.clear_pending();
+                parser.reset();
+                release_parser(session);
+                return;
+            }
+            if (!is_successful) {
+                // A proxied body streams on from here instead of being collected
+                if (parser.is_reading_body() && !m_proxy.empty() && try_start_proxy(socket, session)) {
+                    parser.reset();
+                    release_parser(session);
+                    return;
+                }
+                socket->set_phase(parser.is_reading_body()
+                                      ? AsyncSocket::Phase::READ_BODY
+                                      : AsyncSocket::Phase::READ_HEADER);
+                return;
+            }
+
+            if ((!m_websocket_routes.empty() && try_upgrade_websocket(socket, session))
+                || (!m_event_stream_routes.empty() && try_start_event_stream(socket, session))
+                || (!m_proxy.empty() && try_start_proxy(socket, session))
+                || (m_is_http2_enabled && try_upgrade_http2(socket, session))) {
+                // Taken over: no more HTTP/1.1 requests are parsed here, or not until the proxied one is answered
+                session.parser->clear_pending();
+                session.parser->reset();
+                release_parser(session);
+                return;
+            }
+            const bool keep_alive = handle_request(socket, parser);
+            // The request and everything the handler put into the arena are dropped here.
             parser.reset();
+            if (!keep_alive) {
+                socket->close_read();
+                parser.clear_pending();
+                release_parser(session);
+                return;
+            }
+            if (!parser.has_pending()) {
+                socket->set_phase(AsyncSocket::Phase::IDLE);
+                release_parser(session);
+                return;
+            }
+            is_successful = parser.feed_pending();
         }
+    }
 
-        if (is_successful) {
-            HttpRequest req = parser.request;
-            HttpResponse resp{};
-            parser.reset();
-            if (m_callback) m_callback(req, resp);
+    /// Answer the request parser has completed and queue the response.
+    /// @return whether the connection stays open for another request
+    bool handle_request(AsyncSocket *socket, HttpRequestParser &parser) {
+        // Response headers go to the arena of the request. The callback runs outside of it, so what
+        // it copies or keeps of the request lives on the heap and survives parser.reset().
+        HttpRequest &req = parser.request;
+        HttpResponse resp(&parser.arena());
+        // While the server drains, every response is the last one of its connection.
+        const bool keep_alive = is_keep_alive(req) && !m_tcp_server.is_stopping();
+        if (!keep_alive) {
+            resp.insert("Connection", "close");
+        }
+        const auto handler_started_at = Metrics::now();
+        dispatch(socket, parser, resp);
+        Metrics::get_metrics()->record_since(Latency::HANDLER, handler_started_at);
+        send_response(socket, parser, resp);
+        return keep_alive;
+    }
+
+    /// Queue resp for the request parser has completed, and count and log it
+    void send_response(AsyncSocket *socket, HttpRequestParser &parser, HttpResponse &resp) {
+        // Reused by every response of this thread, the send queue keeps copies
+        thread_local std::vector<SendBuffer> socket_buffers{};
+        socket_buffers.clear();
+        resp.get_response(socket_buffers);
+        socket->async_send(socket_buffers);
+        int64_t bytes = 0;
+        for (const auto &buffer: socket_buffers) bytes += buffer.size;
+        record_response(resp.get_status(), bytes);
+        if (m_access_log) log_access(socket, parser.request, resp.get_status(), bytes, parser.started_at());
+        socket_buffers.clear();
+    }
+
+    // The upstream of a route added with add_proxy() that req is on, nullptr if there is none
+    ReverseProxy::Upstream *match_proxy(const HttpRequest &req) {
+        if (m_proxy.empty()) return nullptr;
+        if (!m_metrics_route.empty() && req.url == m_metrics_route.c_str()) return nullptr;
+        return m_proxy.match(req.url);
+    }
+
+    // A request on a route added with add_proxy(), once its header is complete: it goes to an
+    // upstream server along with what has come of its body, and the connection waits for the
+    // exchange to finish (see then_respond). false leaves the request to this server.
+    bool try_start_proxy(AsyncSocket *socket, HttpSession &session) {
+        HttpRequestParser &parser = *session.parser;
+        HttpRequest &req = parser.request;
+        ReverseProxy::Upstream *upstream = match_proxy(req);
+        // A chunked request body would have to be parsed, which the parser does not do either
+        if (upstream == nullptr || req.headers.count("Transfer-Encoding") > 0) return false;
+        Metrics::get_metrics()->add(Counter::REQUESTS);
+
+        HttpResponse resp(&parser.arena());
+        if (try_handle_rate_limit(socket, req, resp)) {
+            // The body may not have been read, so nothing after it can be told apart
+            resp.insert("Connection", "close");
+            send_response(socket, parser, resp);
+            socket->close_read();
+        } else {
+            const bool keep_alive = is_keep_alive(req) && !m_tcp_server.is_stopping();
+            session.proxy = m_proxy.start(socket, *upstream, req, {parser.pending().data(), parser.pending().size()},
+                                          keep_alive, parser.started_at());
+        }
+        return true;
+    }
+
+    /// The exchange has finished and the client has been sent all of its response: the connection
+    /// reads requests again, starting with what the client sent while it waited
+    void on_proxy_done(AsyncSocket *socket, HttpSession &session) {
+        const std::shared_ptr<ProxyExchange> proxy = std::move(session.proxy);
+        const auto status = static_cast<HttpStatus>(proxy->get_status());
+        record_response(status, proxy->get_bytes_sent());
+        if (m_access_log) {
+            const auto latency = std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - proxy->started_at()).count();
+            m_access_log->record(proxy->get_method(), proxy->get_url(), static_cast<int>(status),
+                                 proxy->get_bytes_sent(), latency, socket->get_peer_address().sin_addr.s_addr,
+                                 proxy->get_user_agent());
+        }
+        if (!proxy->is_keep_alive() || socket->is_read_closed() || m_tcp_server.is_stopping()) {
+            socket->close_read();
+            return;
+        }
+        socket->set_phase(AsyncSocket::Phase::IDLE);
+        socket->resume_read();
+        const std::string leftover = proxy->take_leftover();
+        if (!leftover.empty()) on_http1_received(socket, session, leftover.data(), leftover.size());
+    }
 
-            auto socket_buffers = resp.get_response();
-            socket->async_send(*socket_buffers);
+    /// Fill resp for the request parser has completed: metrics endpoint, rate limits, then the callback.
+    /// Shared by HTTP/1.1 and the streams of HTTP/2.
+    void dispatch(const AsyncSocket *socket, HttpRequestParser &parser, HttpResponse &resp) {
+        HttpRequest &req = parser.request;
+        auto *metrics = Metrics::get_metrics();
+        metrics->add(Counter::REQUESTS);
+        metrics->record(Latency::PARSE, std::chrono::duration_cast<std::chrono::nanoseconds>(
+                            std::chrono::steady_clock::now() - parser.started_at()).count());
+        if (!try_handle_metrics(req, resp) && !try_handle_rate_limit(socket, req, resp) && m_callback) {
+            m_callback(req, resp);
+        }
+    }
+
+    std::unique_ptr<Http2Connection> make_http2_connection(const AsyncSocket *socket) {
+        return std::make_unique<Http2Connection>(
+            m_http2_settings, [this, socket](HttpRequestParser &parser, HttpResponse &resp) {
+                // Only HTTP/1.x requests are forwarded, see add_proxy()
+                if (match_proxy(parser.request) != nullptr) return false;
+                const auto handler_started_at = Metrics::now();
+                dispatch(socket, parser, resp);
+                Metrics::get_metrics()->record_since(Latency::HANDLER, handler_started_at);
+                // Frame headers are not counted, the body is
+                record_response(resp.get_status(), resp.get_body_size());
+                if (m_access_log) {
+                    log_access(socket, parser.request, resp.get_status(), resp.get_body_size(), parser.started_at());
+                }
+                return true;
+            });
+    }
+
+    // "Upgrade: h2c" (RFC 7540, section 3.2): 101, then the request is answered as stream 1 of an
+    // HTTP/2 connection. false leaves the request to HTTP/1.1.
+    bool try_upgrade_http2(AsyncSocket *socket, HttpSession &session) {
+        HttpRequestParser &parser = *session.parser;
+        HttpRequest &req = parser.request;
+        const auto upgrade = req.headers.find("Upgrade");
+        const auto settings = req.headers.find("HTTP2-Settings");
+        if (upgrade == req.headers.end() || settings == req.headers.end() || upgrade->second != "h2c") return false;
+        // h2c is cleartext only (RFC 7540, section 3.2), over TLS HTTP/2 is negotiated with ALPN
+        if (socket->tls != nullptr) return false;
+        // Sent along with a body, the request would have to be read to its end first
+        if (parser.request.data.size() > 0 || m_tcp_server.is_stopping()) return false;
+        auto http2 = make_http2_connection(socket);
+        if (!http2->accept_upgrade(std::string_view(settings->second.data(), settings->second.size()))) {
+            return false;
+        }
+        session.http2 = std::move(http2);
+
+        thread_local std::vector<SendBuffer> socket_buffers{};
+        socket_buffers.clear();
+        BufferWriter output(socket_buffers);
+        output.put("HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n");
+        session.http2->upgrade(parser, output);
+        output.flush();
+        socket->async_send(socket_buffers);
+        socket_buffers.clear();
+        // What came after the request is the client preface
+        const std::string pending(parser.pending());
+        parser.clear_pending();
+        parser.reset();
+        on_http2_received(socket, session, pending.data(), pending.size());
+        return true;
+    }
+
+    static bool equals_ignore_case(const std::string_view a, const std::string_view b) {
+        return a.size() == b.size() && std::equal(a.begin(), a.end(), b.begin(), [](const char x, const char y) {
+            return std::tolower(static_cast<unsigned char>(x)) == std::tolower(static_cast<unsigned char>(y));
+        });
+    }
+
+    // "Upgrade: websocket" (RFC 6455, section 4.2) on a route added with add_websocket(): 101, and
+    // the connection carries frames from then on. false leaves the request to HTTP.
+    bool try_upgrade_websocket(AsyncSocket *socket, HttpSession &session) {
+        HttpRequestParser &parser = *session.parser;
+        HttpRequest &req = parser.request;
+        const auto upgrade = req.headers.find("Upgrade");
+        if (upgrade == req.headers.end()
+            || !equals_ignore_case({upgrade->second.data(), upgrade->second.size()}, "websocket")) {
+            return false;
+        }
+        const auto route = m_websocket_routes.find(string(req.url.data(), req.url.size()));
+        if (route == m_websocket_routes.end() || m_tcp_server.is_stopping()) return false;
+
+        const auto key = req.headers.find("Sec-WebSocket-Key");
+        const auto version = req.headers.find("Sec-WebSocket-Version");
+        string response;
+        HttpStatus status;
+        if (req.method != "GET" || key == req.headers.end() || version == req.headers.end()
+            || version->second != "13") {
+            // The version header tells a client speaking another one what to retry with
+            response = "HTTP/1.1 400 Bad Request\r\nSec-WebSocket-Version: 13\r\nConnection: close\r\n"
+                    "Content-Length: 0\r\n\r\n";
+            status = HttpStatus::BAD_REQUEST;
             socket->close_read();
+        } else {
+            response = "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+                    "Sec-WebSocket-Accept: ";
+            response += WebSocket::accept_key({key->second.data(), key->second.size()});
+            response += "\r\n\r\n";
+            status = HttpStatus::SWITCHING_PROTOCOLS;
+            session.websocket = std::make_shared<WebSocket>(m_tcp_server, socket, route->first, route->second);
+            socket->set_phase(AsyncSocket::Phase::UPGRADED);
         }
+        auto bytes = std::make_shared<string>(std::move(response));
+        socket->async_send(SendBuffer(bytes, bytes->data(), static_cast<ssize_t>(bytes->size())));
+        record_response(status, static_cast<int64_t>(bytes->size()));
+        if (m_access_log) log_access(socket, req, status, static_cast<int64_t>(bytes->size()), parser.started_at());
+        if (session.websocket == nullptr) return true;
+
+        // Frames may have come along with the request
+        const std::string pending(parser.pending());
+        session.websocket->open();
+        if (!pending.empty()) session.websocket->feed(pending.data(), pending.size());
+        return true;
+    }
+
+    // A GET on a route added with add_event_stream(): the response header goes out, and the body
+    // follows event by event for as long as the connection lasts. HTTP/1.1 only.
+    bool try_start_event_stream(AsyncSocket *socket, HttpSession &session) {
+        HttpRequestParser &parser = *session.parser;
+        HttpRequest &req = parser.request;
+        if (req.method != "GET" || m_tcp_server.is_stopping()) return false;
+        const auto route = m_event_stream_routes.find(string(req.url.data(), req.url.size()));
+        if (route == m_event_stream_routes.end()) return false;
+
+        // The body ends with the connection, so there is no length to tell
+        static const auto header = std::make_shared<const string>(
+            "HTTP/1.1 200 OK\r\nContent-Type: text/event-stream\r\nCache-Control: no-cache\r\n"
+            "X-Accel-Buffering: no\r\n\r\n");
+        socket->async_send(SendBuffer(header, header->data(), static_cast<ssize_t>(header->size())));
+        record_response(HttpStatus::OK, static_cast<int64_t>(header->size()));
+        if (m_access_log) {
+            log_access(socket, req, HttpStatus::OK, static_cast<int64_t>(header->size()), parser.started_at());
+        }
+
+        socket->set_phase(AsyncSocket::Phase::UPGRADED);
+        session.events = std::make_shared<EventStream>(m_tcp_server, socket, route->second);
+        if (route->second.on_open) route->second.on_open(session.events, req);
+        return true;
+    }
+
+    void on_http2_received(AsyncSocket *socket, HttpSession &session, const char *data, const size_t size) {
+        thread_local std::vector<SendBuffer> socket_buffers{};
+        socket_buffers.clear();
+        BufferWriter output(socket_buffers);
+        const bool is_successful = size == 0 || session.http2->feed(data, size, output);
+        // While the server drains, clients are told to open no more streams
+        if (m_tcp_server.is_stopping()) session.http2->go_away(output);
+        output.flush();
+        socket->async_send(socket_buffers);
+        socket_buffers.clear();
+        // After a connection error, the GOAWAY is sent and then the connection closed
+        if (!is_successful || (session.http2->is_going_away() && !session.http2->has_streams())) {
+            socket->close_read();
+            return;
+        }
+        socket->set_phase(session.http2->has_streams() ? AsyncSocket::Phase::READ_BODY : AsyncSocket::Phase::IDLE);
+    }
+
+    void on_http2_drained(AsyncSocket *socket, HttpSession &session) {
+        Http2Connection &http2 = *session.http2;
+        if (http2.has_pending_output()) {
+            thread_local std::vector<SendBuffer> socket_buffers{};
+            socket_buffers.clear();
+            BufferWriter output(socket_buffers);
+            http2.on_drained(output);
+            output.flush();
+            socket->async_send(socket_buffers);
+            socket_buffers.clear();
+        }
+        if (http2.has_streams()) return;
+        if (http2.is_going_away()) socket->close_read();
+        socket->set_phase(AsyncSocket::Phase::IDLE);
+    }
+
+    static void record_response(const HttpStatus status, const int64_t bytes) {
+        auto *metrics = Metrics::get_metrics();
+        metrics->add(Counter::BYTES_SENT, bytes);
+        const int status_class = static_cast<int>(status) / 100;
+        if (status_class >= 1 && status_class <= 5) {
+            metrics->add(static_cast<Counter>(static_cast<int>(Counter::RESPONSES_1XX) + status_class - 1));
+        }
+    }
+
+    bool try_handle_metrics(const HttpRequest &req, HttpResponse &resp) const {
+        if (m_metrics_route.empty() || req.url != m_metrics_route.c_str()) return false;
+        resp.set_body(Metrics::get_metrics()->to_prometheus());
+        resp.insert("Content-Type", "text/plain; version=0.0.4");
+        return true;
+    }
+
+    // Latency is counted from the first byte of the request until the response is queued.
+    void log_access(const AsyncSocket *socket, const HttpRequest &req, const HttpStatus status,
+                    const int64_t bytes, const std::chrono::steady_clock::time_point started_at) {
+        const auto latency = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - started_at).count();
+        m_access_log->record({req.method.data(), req.method.size()}, {req.url.data(), req.url.size()},
+                             static_cast<int>(status), bytes, latency,
+                             socket->get_peer_address().sin_addr.s_addr,
+                             {req.user_agent.data(), req.user_agent.size()});
+    }
+
+    bool try_handle_rate_limit(const AsyncSocket *socket, HttpRequest &req, HttpResponse &resp) {
+        for (const auto &[rule, limiter]: m_rate_limits) {
+            if (!req.url.starts_with(rule.route)) continue;
+
+            const uint32_t client_ip = socket->get_peer_address().sin_addr.s_addr;
+            uint64_t key = RateLimiter::hash(client_ip);
+            if (rule.key == RateLimitRule::Key::ROUTE) {
+                key = RateLimiter::hash(req.url.data(), req.url.size());
+            } else if (rule.key == RateLimitRule::Key::HEADER) {
+                const auto header = req.headers.find(rule.header);
+                if (header != req.headers.end()) {
+                    key = RateLimiter::hash(header->second.data(), header->second.size());
+                }
+            }
+
+            int64_t retry_after_ms;
+            if (!limiter->try_acquire(key, retry_after_ms)) {
+                resp.set_status(HttpStatus::TOO_MANY_REQUESTS);
+                resp.insert("Retry-After", std::to_string(std::max<int64_t>(1, (retry_after_ms + 999) / 1000)));
+                resp.insert("Content-Type", "text/plain; charset=utf-8");
+                resp.set_body(string("Too Many Requests"));
+                return true;
+            }
+        }
+        return false;
     }
 
     bool try_handle_custom_request(HttpRequest &req, HttpResponse &resp) {
@@ -93,8 +589,8 @@ class HttpServer {
         return false;
     }
 
-    static bool try_handle_not_found(const FileReader &reader, HttpRequest &req, HttpResponse &resp) {
-        if (!reader.good()) {
+    static bool try_handle_not_found(const StaticRoot::Entry &entry, HttpRequest &req, HttpResponse &resp) {
+        if (entry.kind != StaticRoot::Kind::FILE) {
             resp.set_status(HttpStatus::NOT_FOUND);
             resp.insert("Content-Type", "text/html; charset=utf-8");
             resp.set_body(string(NOT_FOUND_HTML));
@@ -103,36 +599,26 @@ class HttpServer {
         return false;
     }
 
-    static bool try_handle_range(FileReader &reader, HttpRequest &req, HttpResponse &resp) {
-        if (req.headers.count("Range") > 0) {
-            const HttpRange range(req.headers["Range"].c_str(), reader.size());
+    static bool try_handle_range(const std::shared_ptr<OpenFile> &file, HttpRequest &req, HttpResponse &resp) {
+        const auto header = req.headers.find("Range");
+        if (header != req.headers.end()) {
+            const HttpRange range(header->second.c_str(), file->size());
             const auto range_str = range.to_string();
-            resp.set_status(HttpStatus::PARTIAL_CONTENT);
             resp.insert("Accept-Ranges", "bytes");
             resp.insert("Content-Range", range_str);
-            resp.set_body(std::make_shared<std::vector<char> >(reader.read_range(range)));
-            Logger::get_logger()->info("Range: %s", req.headers["Range"].c_str());
+            WEBSERVER_LOG_DEBUG(Logger::get_logger(), "Range: %s", header->second.c_str());
+            if (!range.is_valid()) {
+                resp.set_status(HttpStatus::RANGE_NOT_SATISFIABLE);
+                return true;
+            }
+            resp.set_status(HttpStatus::PARTIAL_CONTENT);
+            file->advise_range(range.begin, range.size());
+            resp.set_body(file, range.begin, range.size());
             return true;
         }
         return false;
     }
 
-    void handle_cached_file(const std::string &filename, FileReader &reader, HttpRequest &req, HttpResponse &resp) {
-        // Try fetch data from cache
-        if (m_enable_cache && reader.size() <= MAX_CACHED_SIZE) {
-            if (!m_file_cache.contains_key(filename)) {
-                m_file_cache.insert(filename, reader.read_all());
-            }
-            std::vector<char> &content = m_file_cache[filename];
-            resp.set_body(std::make_shared<std::vector<char> >(content));
-        } else {
-            resp.set_body(std::make_shared<std::vector<char> >(reader.read_all()));
-        }
-
-        resp.set_status(HttpStatus::OK);
-        resp.set_content_type_by_url(req.url);
-    }
-
 public:
     explicit HttpServer(const int port)
         : m_port(port),
@@ -141,25 +627,151 @@ public:
         behavior.on_received = [this](AsyncSocket *socket, const SocketBuffer &buffer) {
             on_received(socket, buffer);
         };
+        // Only a proxied request body is spliced, see ReverseProxy::start()
+        behavior.on_spliced = [](AsyncSocket *socket, const SendBuffer &moved) {
+            const auto *session = static_cast<HttpSession *>(socket->context);
+            if (session != nullptr && session->proxy != nullptr) session->proxy->feed_spliced(moved);
+        };
         behavior.then_respond = [this](AsyncSocket *socket) {
-            socket->async_close();
+            auto *session = static_cast<HttpSession *>(socket->context);
+            if (session != nullptr && session->http2 != nullptr && !session->http2->has_failed()) {
+                on_http2_drained(socket, *session);
+                if (socket->send_queue.has_uncommitted_data()) return;
+            }
+            if (session != nullptr && session->proxy != nullptr) {
+                if (!session->proxy->is_finished()) {
+                    session->proxy->on_client_drained();
+                    return;
+                }
+                on_proxy_done(socket, *session);
+                if (socket->send_queue.has_uncommitted_data()) return;
+            }
+            // Keep-alive connections stay open for the next request
+            if (socket->is_read_closed()) {
+                socket->async_close();
+            }
+        };
+        behavior.on_closed = [this](AsyncSocket *socket) {
+            if (socket->context == nullptr) return;
+            const auto *session = static_cast<HttpSession *>(socket->context);
+            if (session->websocket != nullptr) session->websocket->on_connection_closed();
+            if (session->events != nullptr) session->events->on_connection_closed();
+            if (session->proxy != nullptr) session->proxy->on_client_closed();
+            m_sessions.remove(socket->get_socket());
         };
         m_tcp_server.set_callback(behavior);
         reset_callback();
     }
 
-    void enable_cache() {
-        m_enable_cache = true;
+    void set_timeouts(const ConnectionTimeouts &timeouts) {
+        m_tcp_server.set_timeouts(timeouts);
+    }
+
+    void set_connection_limits(const ConnectionLimits &limits) {
+        m_tcp_server.set_connection_limits(limits);
+    }
+
+    /// I/O thread count and CPU pinning, see ThreadTopology. Call before start_server().
+    void set_thread_topology(const ThreadTopology &topology) {
+        m_tcp_server.set_thread_topology(topology);
+    }
+
+    /// Stop gracefully on SIGTERM/SIGINT, a second signal closes everything at once.
+    void enable_signal_handling() {
+        m_tcp_server.enable_signal_handling();
+    }
+
+    /// SIGUSR2 starts this binary again on the same listening socket and drains this process.
+    /// With handoff_path, a server started with WEBSERVER_HANDOFF_PATH=handoff_path takes it over too.
+    void enable_hot_upgrade(const std::string &handoff_path = "") {
+        m_tcp_server.enable_hot_upgrade(handoff_path);
+    }
+
+    /// Write a line per request, see AccessLogConfig. Call before start_server().
+    void enable_access_log(const AccessLogConfig &config = {}) {
+        m_access_log = std::make_unique<AccessLog>(config);
+    }
+
+    /// Speak HTTP/2 over cleartext too: to clients that start with the HTTP/2 preface (prior
+    /// knowledge) and to HTTP/1.1 requests asking for "Upgrade: h2c". Call before start_server().
+    void enable_http2(const Http2Settings &settings = {}) {
+        m_is_http2_enabled = true;
+        m_http2_settings = settings;
+    }
+
+    /// Serve HTTPS. Unless config names its own ALPN protocols, h2 is offered next to http/1.1 when
+    /// enable_http2() has been called before. Call before start_server().
+    /// @return false, with the reason logged, if the certificate or key cannot be loaded
+    bool enable_tls(TlsConfig config) {
+        if (config.alpn_protocols.empty()) {
+            if (m_is_http2_enabled) config.alpn_protocols.emplace_back("h2");
+            config.alpn_protocols.emplace_back("http/1.1");
+        }
+        return m_tcp_server.enable_tls(config);
+    }
+
+    /// Serve the server metrics in Prometheus text format at route, ahead of any rate limit or callback.
+    void enable_metrics(const string &route = "/metrics") {
+        m_metrics_route = route;
+    }
+
+    /// Rules are checked in the order they were added, before any callback runs.
+    void add_rate_limit(const RateLimitRule &rule) {
+        m_rate_limits.emplace_back(rule, std::make_unique<RateLimiter>(rule.rate, rule.burst, rule.capacity));
+    }
+
+    /// Serve static files from root instead of the working directory. Call before start_server().
+    void set_static_root(const string &root) {
+        m_static_root = std::make_unique<StaticRoot>(root);
+    }
+
+    /// Keep resolved static paths and their open descriptors, see StaticCacheConfig.
+    void enable_cache(const StaticCacheConfig &config = {}) {
+        m_static_root->set_cache(config);
     }
 
     void disable_cache() {
-        m_enable_cache = false;
+        m_static_root->set_cache(StaticCacheConfig{0});
     }
 
     void add_custom_request_callback(const string &url, HttpCallback &&callback) {
         m_custom_request_callbacks.emplace(url, std::move(callback));
     }
 
+    /// Accept WebSocket upgrades at url, handled by handler. Call before start_server().
+    void add_websocket(const string &url, WebSocketHandler handler) {
+        m_websocket_routes[url] = std::move(handler);
+    }
+
+    /// Serve Server-Sent Events at url, handled by handler. Call before start_server().
+    void add_event_stream(const string &url, EventStreamHandler handler) {
+        m_event_stream_routes[url] = std::move(handler);
+    }
+
+    /// Forward requests whose url starts with prefix to the servers of config, see ReverseProxy. The
+    /// longest matching prefix wins. Call before start_server().
+    /// Only HTTP/1.x requests are forwarded: an HTTP/2 stream on a proxied route is reset with
+    /// HTTP_1_1_REQUIRED, which clients answer by sending the request again over HTTP/1.1.
+    /// @return false, with the reason logged, if a server cannot be resolved
+    bool add_proxy(const string &prefix, const ProxyConfig &config) {
+        return m_proxy.add_route(prefix, config);
+    }
+
+    /// Topics WebSocket and event stream connections can be subscribed to, see Broadcaster
+    Broadcaster &get_broadcaster() {
+        return m_broadcaster;
+    }
+
+    /// How subscribers that do not keep up are treated. Call before start_server().
+    void set_broadcast_config(const BroadcastConfig &config) {
+        m_broadcaster.set_config(config);
+    }
+
+    /// Run task on the I/O thread of a connection, from any thread, see TcpServer::post()
+    bool post(const ConnectionHandle &handle, std::function<void(AsyncSocket *)> &&task) {
+        return m_tcp_server.post(handle, std::move(task));
+    }
+
     void remove_custom_request_callback(const string &url) {
         m_custom_request_callbacks.erase(url);
     }
@@ -171,28 +783,35 @@ public:
     void default_callback(HttpRequest &req, HttpResponse &resp) {
         if (try_handle_custom_request(req, resp)) return;
 
-        const std::string url = req.url;
-        std::string filename = "./" + url;
-        if (FileSystem::is_directory(filename)) {
-            if (filename.back() != '/') {
-                resp.insert("Location", url + "/");
+        const std::string_view url(req.url.data(), req.url.size());
+        auto entry = m_static_root->lookup(url);
+        if (entry.kind == StaticRoot::Kind::DIRECTORY) {
+            if (url.back() != '/') {
+                HttpRequest::string location(url);
+                location += "/";
+                resp.insert("Location", location);
                 resp.set_status(HttpStatus::MOVED_PERMANENTLY);
                 return;
             }
-            filename += "/index.html";
-            filename = FileSystem::normalize_path(filename);
+            HttpRequest::string index(url);
+            index += "index.html";
+            entry = m_static_root->lookup(index);
         }
+        if (try_handle_not_found(entry, req, resp)) return;
 
-        FileReader reader(filename);
-        if (try_handle_not_found(reader, req, resp)) return;
-
-        resp.insert("Last-Modified", FileSystem::get_last_modified(filename));
+        char last_modified[32];
+        resp.insert("Last-Modified", {
+                        last_modified,
+                        FileSystem::format_http_date(entry.file->last_modified(), last_modified,
+                                                     sizeof(last_modified))
+                    });
 
         // Support for range
-        // For now, no cache for partial content.
-        if (try_handle_range(reader, req, resp)) return;
+        if (try_handle_range(entry.file, req, resp)) return;
 
-        handle_cached_file(filename, reader, req, resp);
+        resp.set_body(entry.file, 0, entry.file->size());
+        resp.set_status(HttpStatus::OK);
+        resp.set_content_type_by_url(url);
     }
 
     void reset_callback() {
@@ -4,19 +4,33 @@
 
 #ifndef HTTP_STATUS_H
 #define HTTP_STATUS_H
+#include <string>
+#include <unordered_map>
 
 enum class HttpStatus {
+    SWITCHING_PROTOCOLS = 101,
     OK = 200,
     NOT_FOUND = 404,
     PARTIAL_CONTENT = 206,
     MOVED_PERMANENTLY = 301,
+    BAD_REQUEST = 400,
+    RANGE_NOT_SATISFIABLE = 416,
+    TOO_MANY_REQUESTS = 429,
+    BAD_GATEWAY = 502,
+    SERVICE_UNAVAILABLE = 503,
 };
 
 inline std::unordered_map<HttpStatus, std::string> http_status_to_string = {
+    {HttpStatus::SWITCHING_PROTOCOLS, "Switching Protocols"},
     {HttpStatus::OK, "OK"},
     {HttpStatus::NOT_FOUND, "Not Found"},
     {HttpStatus::PARTIAL_CONTENT, "Partial Content"},
     {HttpStatus::MOVED_PERMANENTLY, "Moved Permanently"},
+    {HttpStatus::BAD_REQUEST, "Bad Request"},
+    {HttpStatus::RANGE_NOT_SATISFIABLE, "Range Not Satisfiable"},
+    {HttpStatus::TOO_MANY_REQUESTS, "Too Many Requests"},
+    {HttpStatus::BAD_GATEWAY, "Bad Gateway"},
+    {HttpStatus::SERVICE_UNAVAILABLE, "Service Unavailable"},
 };
 
 inline std::string &get_status_string(const HttpStatus status) {
@@ -0,0 +1,1081 @@
+//
+// Created by Haotian on 2026/10/19.
+//
+
+#ifndef REVERSE_PROXY_H
+#define REVERSE_PROXY_H
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <charconv>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "HttpRequest.h"
+#include "HttpStatus.h"
+#include "../common/Metrics.h"
+#include "../common/UrlHelper.h"
+#include "../log/Logger.h"
+#include "../tcp/TcpServer.h"
+
+#ifdef LINUX
+#include <arpa/inet.h>
+#include <netdb.h>
+#endif
+#ifdef WINDOWS
+#include <ws2tcpip.h>
+#endif
+
+/// Where a route added with HttpServer::add_proxy() forwards to, and how
+struct ProxyConfig {
+    enum class Balancing {
+        // Each server in turn
+        ROUND_ROBIN,
+        // The server with the fewest requests in flight
+        LEAST_CONNECTIONS
+    };
+
+    // "host:port" of every server, names are resolved once when the route is added
+    std::vector<std::string> servers{};
+    Balancing balancing = Balancing::ROUND_ROBIN;
+    // Idle keep-alive connections kept per server and I/O thread
+    size_t max_idle_connections = 32;
+    // Milliseconds from connecting (or reusing a connection) until the response header is complete
+    int64_t response_timeout = 60000;
+    // Milliseconds between two reads of a response body, or two writes of a request body
+    int64_t read_timeout = 60000;
+    // Milliseconds an idle pooled connection is kept
+    int64_t idle_timeout = 30000;
+    // Passive health check: a server that fails max_fails times in a row (refused, reset, timed out,
+    // or an unreadable response) is left out for fail_timeout milliseconds. 0 never leaves one out.
+    int max_fails = 3;
+    int64_t fail_timeout = 10000;
+    // Reading from one side stops while the other side has this much queued, so a body is never
+    // held in full, whatever its size
+    int64_t max_buffered_bytes = 256 * 1024;
+    // Move bodies between plain connections with splice() (Linux), never copying them to user space.
+    // Chunked responses, whose framing is followed, and bodies to or from a TLS client are copied.
+    bool splice = true;
+    // Pass the Host header of the client on, instead of the name of the server
+    bool preserve_host = true;
+};
+
+class ProxyExchange;
+
+/// Forwards HTTP/1.1 requests to upstream servers over connections driven by the I/O thread of the
+/// client, kept alive and pooled per server and thread. Bodies stream through in both directions
+/// with back-pressure: a side that cannot keep up pauses reading from the other.
+class ReverseProxy {
+    friend class ProxyExchange;
+
+public:
+    /// Servers of one route and what is known about them
+    struct Upstream {
+        struct Server {
+            sockaddr_in address{};
+            // As configured, the Host header unless the one of the client is passed on
+            std::string name{};
+            // Requests in flight, for LEAST_CONNECTIONS
+            std::atomic<int> active{0};
+            // Failures in a row, and the steady milliseconds until which the server is left out
+            std::atomic<int> fails{0};
+            std::atomic<int64_t> down_until{0};
+            // Idle connections per I/O thread, each list only touched by its thread
+            std::vector<std::vector<ConnectionHandle> > idle{};
+        };
+
+        std::string prefix{};
+        ProxyConfig config{};
+        std::vector<std::unique_ptr<Server> > servers{};
+        std::atomic<uint64_t> next{0};
+        // Callbacks and deadlines of the connections to the servers
+        OutboundBehavior behavior{};
+    };
+
+private:
+    TcpServer &m_server;
+    // Longest prefix first
+    std::vector<std::unique_ptr<Upstream> > m_routes{};
+    std::once_flag m_pools_once{};
+
+    static int64_t steady_now() {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    static bool resolve(const std::string &server, sockaddr_in &address) {
+        const size_t colon = server.rfind(':');
+        if (colon == std::string::npos || colon == 0) return false;
+        const std::string host = server.substr(0, colon);
+        int port = 0;
+        const auto [end, error] = std::from_chars(server.data() + colon + 1, server.data() + server.size(), port);
+        if (error != std::errc() || end != server.data() + server.size() || port <= 0 || port > 65535) return false;
+        addrinfo hints{};
+        hints.ai_family = AF_INET;
+        hints.ai_socktype = SOCK_STREAM;
+        addrinfo *result = nullptr;
+        if (getaddrinfo(host.c_str(), nullptr, &hints, &result) != 0 || result == nullptr) return false;
+        address = *reinterpret_cast<const sockaddr_in *>(result->ai_addr);
+        address.sin_port = htons(static_cast<uint16_t>(port));
+        freeaddrinfo(result);
+        return true;
+    }
+
+    void ensure_pools() {
+        std::call_once(m_pools_once, [this] {
+            const int threads = m_server.get_io_thread_count();
+            for (const auto &upstream: m_routes) {
+                for (const auto &server: upstream->servers) server->idle.resize(threads);
+            }
+        });
+    }
+
+    /// The server for the next request, -1 when all of them are left out. avoid, which has just
+    /// failed, is only taken when nothing else is left.
+    static int choose(Upstream &upstream, const int avoid) {
+        const int64_t now = steady_now();
+        const int count = static_cast<int>(upstream.servers.size());
+        const uint64_t start = upstream.next.fetch_add(1, std::memory_order_relaxed);
+        int best = -1;
+        for (int i = 0; i < count; i++) {
+            const int index = static_cast<int>((start + i) % count);
+            const auto &server = *upstream.servers[index];
+            if (index == avoid || server.down_until.load(std::memory_order_relaxed) > now) continue;
+            if (upstream.config.balancing == ProxyConfig::Balancing::ROUND_ROBIN) return index;
+            if (best == -1 || server.active < upstream.servers[best]->active) best = index;
+        }
+        if (best == -1 && avoid >= 0 && upstream.servers[avoid]->down_until <= now) best = avoid;
+        return best;
+    }
+
+    static void record_success(Upstream::Server &server) {
+        if (server.fails.load(std::memory_order_relaxed) != 0) server.fails = 0;
+    }
+
+    static void record_failure(const Upstream &upstream, Upstream::Server &server) {
+        Metrics::get_metrics()->add(Counter::PROXY_FAILURES);
+        const int max_fails = upstream.config.max_fails;
+        if (max_fails <= 0 || ++server.fails < max_fails) return;
+        server.fails = 0;
+        server.down_until = steady_now() + upstream.config.fail_timeout;
+        Logger::get_logger()->warn("Upstream %s failed %d times in a row, left out for %lld ms", server.name.c_str(),
+                                   max_fails, static_cast<long long>(upstream.config.fail_timeout));
+    }
+
+    /// An idle pooled connection to the server, or a new one. Only on the I/O thread of the client.
+    AsyncSocket *acquire(Upstream &upstream, Upstream::Server &server, const int thread, bool &is_reused) {
+        auto &idle = server.idle[thread];
+        while (!idle.empty()) {
+            const ConnectionHandle handle = idle.back();
+            idle.pop_back();
+            AsyncSocket *socket = handle.socket;
+            if (socket->connection_id != handle.id || socket->is_closed() || socket->is_read_closed()) continue;
+            is_reused = true;
+            Metrics::get_metrics()->add(Counter::PROXY_REUSES);
+            return socket;
+        }
+        is_reused = false;
+        AsyncSocket *socket = m_server.connect(thread, server.address, &upstream.behavior);
+        if (socket != nullptr) Metrics::get_metrics()->add(Counter::PROXY_CONNECTS);
+        return socket;
+    }
+
+    /// Keep a connection whose exchange has completed for the next request, or close it
+    void release(const Upstream &upstream, Upstream::Server &server, AsyncSocket *socket) {
+        socket->context = nullptr;
+        socket->set_phase(AsyncSocket::Phase::IDLE);
+        auto &idle = server.idle[socket->io_thread];
+        idle.erase(std::remove_if(idle.begin(), idle.end(), [](const ConnectionHandle &handle) {
+            return handle.socket->connection_id != handle.id || handle.socket->is_closed();
+        }), idle.end());
+        if (idle.size() < upstream.config.max_idle_connections && !m_server.is_stopping()) {
+            idle.emplace_back(socket);
+        } else {
+            socket->async_close();
+        }
+        // Served once more, which arms the idle deadline or closes it
+        m_server.wake(ConnectionHandle(socket));
+    }
+
+    static void on_upstream_received(AsyncSocket *socket, const SocketBuffer &buffer);
+
+    static void on_upstream_spliced(AsyncSocket *socket, const SendBuffer &moved);
+
+    static void on_upstream_drained(AsyncSocket *socket);
+
+    static void on_upstream_closed(AsyncSocket *socket);
+
+public:
+    explicit ReverseProxy(TcpServer &server)
+        : m_server(server) {
+    }
+
+    ReverseProxy(const ReverseProxy &other) = delete;
+
+    ReverseProxy &operator=(const ReverseProxy &other) = delete;
+
+    /// Forward requests whose path starts with prefix. Call before the server starts.
+    /// @return false, with the reason logged, if there is no server or one cannot be resolved
+    bool add_route(const std::string &prefix, const ProxyConfig &config) {
+        auto upstream = std::make_unique<Upstream>();
+        upstream->prefix = prefix;
+        upstream->config = config;
+        for (const auto &name: config.servers) {
+            auto server = std::make_unique<Upstream::Server>();
+            server->name = name;
+            if (!resolve(name, server->address)) {
+                Logger::get_logger()->error("Cannot resolve upstream server %s", name.c_str());
+                return false;
+            }
+            upstream->servers.emplace_back(std::move(server));
+        }
+        if (upstream->servers.empty()) {
+            Logger::get_logger()->error("Proxy route %s has no server", prefix.c_str());
+            return false;
+        }
+        auto &timeouts = upstream->behavior.timeouts;
+        timeouts.header_read = config.response_timeout;
+        timeouts.body_read = config.read_timeout;
+        timeouts.write_stall = config.read_timeout;
+        timeouts.keep_alive = config.idle_timeout;
+        auto &callbacks = upstream->behavior.callbacks;
+        callbacks.on_received = on_upstream_received;
+        callbacks.on_spliced = on_upstream_spliced;
+        callbacks.then_respond = on_upstream_drained;
+        callbacks.on_closed = on_upstream_closed;
+        m_routes.emplace_back(std::move(upstream));
+        std::stable_sort(m_routes.begin(), m_routes.end(), [](const auto &a, const auto &b) {
+            return a->prefix.size() > b->prefix.size();
+        });
+        return true;
+    }
+
+    [[nodiscard]] bool empty() const {
+        return m_routes.empty();
+    }
+
+    /// The route url is forwarded by, nullptr if none
+    [[nodiscard]] Upstream *match(const HttpRequest::string &url) const {
+        for (const auto &upstream: m_routes) {
+            if (url.starts_with(upstream->prefix)) return upstream.get();
+        }
+        return nullptr;
+    }
+
+    /// Start forwarding the request whose header parser has completed, along with as much of its
+    /// body as has arrived. Only on the I/O thread of client; the request may be reset afterwards.
+    std::shared_ptr<ProxyExchange> start(AsyncSocket *client, Upstream &upstream, HttpRequest &request,
+                                         std::string_view pending, bool keep_alive,
+                                         std::chrono::steady_clock::time_point started_at);
+};
+
+/// One request forwarded to an upstream server and its response coming back, on the I/O thread of
+/// the client. HttpServer feeds it what the client sends, and takes over again once it is finished.
+class ProxyExchange {
+    friend class ReverseProxy;
+
+    using Upstream = ReverseProxy::Upstream;
+
+    enum class State {
+        // Waiting for the response header
+        HEADER,
+        BODY,
+        DONE
+    };
+
+    enum class Framing {
+        NONE,
+        LENGTH,
+        CHUNKED,
+        // Until the server closes the connection
+        CLOSE
+    };
+
+    enum class ChunkState {
+        SIZE,
+        EXTENSION,
+        SIZE_LF,
+        DATA,
+        DATA_CR,
+        DATA_LF,
+        TRAILER_START,
+        TRAILER,
+        TRAILER_LF,
+        LAST_LF
+    };
+
+    // Response header bigger than this is a failure of the server
+    static constexpr size_t MAX_HEADER_SIZE = 64 * 1024;
+
+    ReverseProxy &m_proxy;
+    Upstream &m_upstream;
+    // nullptr once the client has gone
+    AsyncSocket *m_client;
+    // Connection to the server, nullptr while there is none
+    AsyncSocket *m_socket = nullptr;
+    int m_server = -1;
+    // Whether m_socket came from the pool, where the server may have closed it just now
+    bool m_is_reused = false;
+    int m_attempts = 0;
+
+    // The request line, and the header fields apart from Host, which depends on the server
+    std::string m_request_line{};
+    std::string m_request_fields{};
+    std::string m_client_host{};
+    // What came of the body with the header, sent again when the request is retried
+    std::shared_ptr<const std::string> m_body_start{};
+    // Bytes of the request body still to come from the client
+    uint64_t m_body_remaining = 0;
+    // Whether the body came along with the header, so the request can go to another server as it is
+    bool m_is_replayable = false;
+    // What the client sent after the request, parsed once the exchange is done
+    std::string m_leftover{};
+    bool m_is_http10 = false;
+    bool m_keep_alive = false;
+
+    State m_state = State::HEADER;
+    std::string m_header{};
+    Framing m_framing = Framing::NONE;
+    uint64_t m_length_left = 0;
+    ChunkState m_chunk_state = ChunkState::SIZE;
+    uint64_t m_chunk_left = 0;
+    // Whether the connection to the server can take the next request afterwards
+    bool m_upstream_keep_alive = false;
+    bool m_is_finished = false;
+
+    // What one read from the server turns into for the client, queued as a single buffer: a header
+    // and a small body written apart would wait for the delayed ACK of the client
+    std::shared_ptr<std::string> m_output{};
+
+    int m_status = 0;
+    int64_t m_bytes_sent = 0;
+    std::string m_method{};
+    std::string m_url{};
+    std::string m_user_agent{};
+    std::chrono::steady_clock::time_point m_started_at{};
+
+    [[nodiscard]] const ProxyConfig &config() const {
+        return m_upstream.config;
+    }
+
+    [[nodiscard]] ConnectionHandle client_handle() const {
+        return ConnectionHandle(m_client);
+    }
+
+    static bool equals_ignore_case(const std::string_view a, const std::string_view b) {
+        return a.size() == b.size() && std::equal(a.begin(), a.end(), b.begin(), [](const char x, const char y) {
+            return std::tolower(static_cast<unsigned char>(x)) == std::tolower(static_cast<unsigned char>(y));
+        });
+    }
+
+    static bool contains_token(const std::string_view value, const std::string_view token) {
+        size_t begin = 0;
+        while (begin <= value.size()) {
+            size_t end = value.find(',', begin);
+            if (end == std::string_view::npos) end = value.size();
+            std::string_view item = value.substr(begin, end - begin);
+            while (!item.empty() && item.front() == ' ') item.remove_prefix(1);
+            while (!item.empty() && item.back() == ' ') item.remove_suffix(1);
+            if (equals_ignore_case(item, token)) return true;
+            begin = end + 1;
+        }
+        return false;
+    }
+
+    // Headers that only concern one connection, not passed on in either direction (RFC 9110, 7.6.1)
+    static bool is_hop_by_hop(const std::string_view name) {
+        return equals_ignore_case(name, "Connection") || equals_ignore_case(name, "Keep-Alive")
+               || equals_ignore_case(name, "Proxy-Connection") || equals_ignore_case(name, "TE")
+               || equals_ignore_case(name, "Trailer") || equals_ignore_case(name, "Transfer-Encoding")
+               || equals_ignore_case(name, "Upgrade");
+    }
+
+    static void append_field(std::string &out, const std::string_view name, const std::string_view value) {
+        out.append(name);
+        out.append(": ");
+        out.append(value);
+        out.append("\r\n");
+    }
+
+    static SendBuffer to_buffer(const std::shared_ptr<const std::string> &bytes) {
+        return {bytes, bytes->data(), static_cast<ssize_t>(bytes->size())};
+    }
+
+    void build_request(const HttpRequest &request) {
+        m_request_line.reserve(request.url.size() + request.query.size() + 32);
+        m_request_line.append(request.method.data(), request.method.size());
+        m_request_line.push_back(' ');
+        UrlHelper::encode_path({request.url.data(), request.url.size()}, m_request_line);
+        if (!request.query.empty()) {
+            m_request_line.push_back('?');
+            m_request_line.append(request.query.data(), request.query.size());
+        }
+        m_request_line.append(" HTTP/1.1\r\n");
+        m_client_host.assign(request.host.data(), request.host.size());
+
+        // The parser keeps the common fields apart from the others
+        const std::pair<std::string_view, const HttpRequest::string *> fields[] = {
+            {"Refer", &request.refer}, {"Location", &request.location}, {"Content-Type", &request.content_type},
+            {"Accept", &request.accept}, {"Accept-Language", &request.accept_language},
+            {"Accept-Encoding", &request.accept_encoding}, {"Cookie", &request.cookie},
+            {"Set-Cookie", &request.set_cookie}, {"User-Agent", &request.user_agent},
+        };
+        std::string &out = m_request_fields;
+        for (const auto &[name, value]: fields) {
+            if (!value->empty()) append_field(out, name, {value->data(), value->size()});
+        }
+        std::string_view forwarded_for{};
+        for (const auto &[name, value]: request.headers) {
+            const std::string_view name_view(name.data(), name.size());
+            if (is_hop_by_hop(name_view)) continue;
+            if (equals_ignore_case(name_view, "X-Forwarded-For")) {
+                forwarded_for = {value.data(), value.size()};
+                continue;
+            }
+            if (equals_ignore_case(name_view, "X-Forwarded-Proto")) continue;
+            append_field(out, name_view, {value.data(), value.size()});
+        }
+        char address[INET_ADDRSTRLEN]{};
+        inet_ntop(AF_INET, &m_client->get_peer_address().sin_addr, address, sizeof(address));
+        out.append("X-Forwarded-For: ");
+        if (!forwarded_for.empty()) {
+            out.append(forwarded_for);
+            out.append(", ");
+        }
+        out.append(address);
+        out.append("\r\n");
+        append_field(out, "X-Forwarded-Proto", m_client->tls != nullptr ? "https" : "http");
+        if (request.method == "POST") append_field(out, "Content-Length", std::to_string(request.content_length));
+        out.append("Connection: keep-alive\r\n\r\n");
+    }
+
+    /// Connect to a server and send the request, as often as servers fail right away
+    void attempt(int avoid) {
+        const int max_attempts = static_cast<int>(m_upstream.servers.size()) + 1;
+        while (true) {
+            const int index = ReverseProxy::choose(m_upstream, avoid);
+            if (index < 0) {
+                respond_error(HttpStatus::SERVICE_UNAVAILABLE);
+                return;
+            }
+            auto &server = *m_upstream.servers[index];
+            m_attempts++;
+            AsyncSocket *socket = m_proxy.acquire(m_upstream, server, m_client->io_thread, m_is_reused);
+            if (socket == nullptr) {
+                ReverseProxy::record_failure(m_upstream, server);
+                avoid = index;
+                if (m_attempts < max_attempts) continue;
+                respond_error(HttpStatus::BAD_GATEWAY);
+                return;
+            }
+            m_server = index;
+            m_socket = socket;
+            socket->context = this;
+            socket->set_phase(AsyncSocket::Phase::READ_HEADER);
+            server.active++;
+
+            const std::string_view host = config().preserve_host && !m_client_host.empty()
+                                              ? std::string_view(m_client_host)
+                                              : std::string_view(server.name);
+            auto head = std::make_shared<std::string>();
+            head->reserve(m_request_line.size() + host.size() + m_request_fields.size() + 8);
+            head->append(m_request_line);
+            append_field(*head, "Host", host);
+            head->append(m_request_fields);
+            socket->async_send(to_buffer(head));
+            if (m_body_start != nullptr) socket->async_send(to_buffer(m_body_start));
+            m_proxy.m_server.wake(ConnectionHandle(socket));
+            return;
+        }
+    }
+
+    /// Let go of the connection to the server: back to the pool when it is fit for another request
+    void detach(const bool is_reusable) {
+        if (m_socket == nullptr) return;
+        auto &server = *m_upstream.servers[m_server];
+        server.active--;
+        AsyncSocket *socket = m_socket;
+        m_socket = nullptr;
+        if (is_reusable) {
+            m_proxy.release(m_upstream, server, socket);
+            return;
+        }
+        socket->context = nullptr;
+        socket->async_close();
+        m_proxy.m_server.wake(ConnectionHandle(socket));
+    }
+
+    void finish() {
+        m_state = State::DONE;
+        m_is_finished = true;
+        if (m_body_remaining > 0) {
+            // The rest of the body would be taken for the next request
+            m_keep_alive = false;
+#ifdef LINUX
+            // and is read and dropped instead of filling a pipe nobody empties
+            if (m_client != nullptr) m_client->stop_splice();
+#endif
+        }
+        detach(m_upstream_keep_alive && m_body_remaining == 0);
+        // HttpServer takes over once the client has been sent everything
+        if (m_client != nullptr) m_proxy.m_server.wake(client_handle());
+    }
+
+    /// A response of our own, when nothing has come from a server
+    void respond_error(const HttpStatus status) {
+        detach(false);
+        // The rest of the body would be taken for the next request
+        if (m_body_remaining > 0) m_keep_alive = false;
+        m_status = static_cast<int>(status);
+        if (m_client != nullptr) {
+            const std::string &reason = get_status_string(status);
+            auto response = std::make_shared<std::string>("HTTP/1.1 ");
+            response->append(std::to_string(m_status));
+            response->push_back(' ');
+            response->append(reason);
+            response->append("\r\nContent-Type: text/plain\r\nContent-Length: ");
+            response->append(std::to_string(reason.size()));
+            response->append(m_keep_alive ? "\r\nConnection: keep-alive\r\n\r\n" : "\r\nConnection: close\r\n\r\n");
+            response->append(reason);
+            m_client->async_send(to_buffer(response));
+            m_bytes_sent += static_cast<int64_t>(response->size());
+        }
+        finish();
+    }
+
+    std::string &output() {
+        if (m_output == nullptr) m_output = std::make_shared<std::string>();
+        return *m_output;
+    }
+
+    // Wait for the client to read what it has before reading more from the server
+    void throttle_server() {
+        if (m_client->queued_bytes > config().max_buffered_bytes && m_socket != nullptr && m_state != State::DONE) {
+            m_socket->pause_read();
+            m_socket->set_phase(AsyncSocket::Phase::WAITING);
+        }
+    }
+
+    void flush_to_client() {
+        if (m_output == nullptr || m_output->empty()) return;
+        m_bytes_sent += static_cast<int64_t>(m_output->size());
+        m_client->async_send(to_buffer(m_output));
+        m_output.reset();
+        throttle_server();
+    }
+
+    /// The rest of a response body that goes out as it comes is moved to the client with splice()
+    /// from here on, see on_upstream_spliced()
+    void splice_response() {
+#ifdef LINUX
+        if (!config().splice || m_client->tls != nullptr || m_socket == nullptr || m_socket->is_splicing()) return;
+        if (m_framing == Framing::LENGTH) m_socket->splice_input(m_length_left);
+        else if (m_framing == Framing::CLOSE) m_socket->splice_input(UINT64_MAX);
+#endif
+    }
+
+    /// Parse the response header and queue the one for the client.
+    /// @return false if it is malformed
+    bool start_response() {
+        const std::string_view header(m_header);
+        const size_t line_end = header.find("\r\n");
+        // "HTTP/1.1 200 OK"
+        if (line_end < 12 || header.compare(0, 7, "HTTP/1.") != 0 || header[8] != ' ') return false;
+        const bool is_http11 = header[7] == '1';
+        const auto [end, error] = std::from_chars(header.data() + 9, header.data() + 12, m_status);
+        if (error != std::errc() || end != header.data() + 12 || m_status < 100) return false;
+
+        std::string *out = &output();
+        out->reserve(header.size() + SocketBuffer::MAX_SIZE);
+        out->append("HTTP/1.1");
+        out->append(header.substr(8, line_end - 8));
+        out->append("\r\n");
+        bool is_chunked = false, has_length = false, is_close = !is_http11;
+        uint64_t length = 0;
+        // All codings of the Transfer-Encoding lines, in order
+        std::string transfer_coding{};
+        size_t begin = line_end + 2;
+        while (begin < header.size() - 2) {
+            const size_t end_of_line = header.find("\r\n", begin);
+            const std::string_view line = header.substr(begin, end_of_line - begin);
+            begin = end_of_line + 2;
+            const size_t colon = line.find(':');
+            if (colon == std::string_view::npos || colon == 0) return false;
+            const std::string_view name = line.substr(0, colon);
+            std::string_view value = line.substr(colon + 1);
+            while (!value.empty() && (value.front() == ' ' || value.front() == '\t')) value.remove_prefix(1);
+            while (!value.empty() && (value.back() == ' ' || value.back() == '\t')) value.remove_suffix(1);
+            if (equals_ignore_case(name, "Content-Length")) {
+                uint64_t value_length = 0;
+                const auto [length_end, length_error] = std::from_chars(value.data(), value.data() + value.size(),
+                                                                        value_length);
+                if (length_error != std::errc() || length_end != value.data() + value.size()) return false;
+                // Two different lengths leave no way to tell where the response ends
+                if (has_length && value_length != length) return false;
+                has_length = true;
+                length = value_length;
+                // Written below, once it is known whether a Transfer-Encoding overrides it
+                continue;
+            } else if (equals_ignore_case(name, "Transfer-Encoding")) {
+                if (!transfer_coding.empty()) transfer_coding.append(", ");
+                transfer_coding.append(value);
+                continue;
+            } else if (equals_ignore_case(name, "Connection")) {
+                if (contains_token(value, "close")) is_close = true;
+                if (!is_http11 && contains_token(value, "keep-alive")) is_close = false;
+            }
+            if (is_hop_by_hop(name)) continue;
+            out->append(line);
+            out->append("\r\n");
+        }
+
+        // A Transfer-Encoding overrides any Content-Length (RFC 9112 6.3): passing both on would let the client
+        // and the proxy disagree on where the response ends
+        const bool has_transfer_coding = !transfer_coding.empty();
+        if (has_transfer_coding) {
+            const std::string_view coding(transfer_coding);
+            is_chunked = coding.size() >= 7 && equals_ignore_case(coding.substr(coding.size() - 7), "chunked");
+            has_length = false;
+        }
+        if (has_length) {
+            out->append("Content-Length: ");
+            out->append(std::to_string(length));
+            out->append("\r\n");
+        }
+
+        if (m_status < 200 || m_status == 204 || m_status == 304) {
+            m_framing = Framing::NONE;
+        } else if (has_transfer_coding && !is_chunked) {
+            // Not chunked last, so the body ends with the connection. The client decodes the codings itself.
+            if (!m_is_http10) append_field(*out, "Transfer-Encoding", transfer_coding);
+            m_framing = Framing::CLOSE;
+            is_close = true;
+            m_keep_alive = false;
+        } else if (is_chunked) {
+            m_framing = Framing::CHUNKED;
+            m_chunk_state = ChunkState::SIZE;
+            m_chunk_left = 0;
+            // An HTTP/1.0 client gets the bare body, which then ends with the connection
+            if (m_is_http10) m_keep_alive = false;
+            else out->append("Transfer-Encoding: chunked\r\n");
+        } else if (has_length) {
+            m_framing = length > 0 ? Framing::LENGTH : Framing::NONE;
+            m_length_left = length;
+        } else {
+            m_framing = Framing::CLOSE;
+            is_close = true;
+            m_keep_alive = false;
+        }
+        m_upstream_keep_alive = !is_close;
+        out->append(m_keep_alive ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n");
+        return true;
+    }
+
+    /// Walk the chunked framing at the front of data, payload gets the body bytes when not null.
+    /// @return bytes that belong to the body, or -1 if the framing is malformed
+    int64_t consume_chunked(const char *data, const size_t size, std::string *payload) {
+        size_t idx = 0;
+        while (idx < size && m_state != State::DONE) {
+            const char ch = data[idx];
+            switch (m_chunk_state) {
+                case ChunkState::SIZE: {
+                    const int digit = ch >= '0' && ch <= '9'
+                                          ? ch - '0'
+                                          : (ch | 0x20) >= 'a' && (ch | 0x20) <= 'f'
+                                                ? (ch | 0x20) - 'a' + 10
+                                                : -1;
+                    if (digit >= 0) {
+                        if (m_chunk_left >> 60 != 0) return -1;
+                        m_chunk_left = m_chunk_left << 4 | digit;
+                    } else if (ch == ';' || ch == ' ' || ch == '\t') {
+                        m_chunk_state = ChunkState::EXTENSION;
+                    } else if (ch == '\r') {
+                        m_chunk_state = ChunkState::SIZE_LF;
+                    } else {
+                        return -1;
+                    }
+                    idx++;
+                    break;
+                }
+                case ChunkState::EXTENSION:
+                    if (ch == '\r') m_chunk_state = ChunkState::SIZE_LF;
+                    idx++;
+                    break;
+                case ChunkState::SIZE_LF:
+                    if (ch != '\n') return -1;
+                    m_chunk_state = m_chunk_left == 0 ? ChunkState::TRAILER_START : ChunkState::DATA;
+                    idx++;
+                    break;
+                case ChunkState::DATA: {
+                    const size_t length = static_cast<size_t>(std::min<uint64_t>(m_chunk_left, size - idx));
+                    if (payload != nullptr) payload->append(data + idx, length);
+                    idx += length;
+                    m_chunk_left -= length;
+                    if (m_chunk_left == 0) m_chunk_state = ChunkState::DATA_CR;
+                    break;
+                }
+                case ChunkState::DATA_CR:
+                    if (ch != '\r') return -1;
+                    m_chunk_state = ChunkState::DATA_LF;
+                    idx++;
+                    break;
+                case ChunkState::DATA_LF:
+                    if (ch != '\n') return -1;
+                    m_chunk_state = ChunkState::SIZE;
+                    idx++;
+                    break;
+                case ChunkState::TRAILER_START:
+                    m_chunk_state = ch == '\r' ? ChunkState::LAST_LF : ChunkState::TRAILER;
+                    idx++;
+                    break;
+                case ChunkState::TRAILER:
+                    if (ch == '\r') m_chunk_state = ChunkState::TRAILER_LF;
+                    idx++;
+                    break;
+                case ChunkState::TRAILER_LF:
+                    if (ch != '\n') return -1;
+                    m_chunk_state = ChunkState::TRAILER_START;
+                    idx++;
+                    break;
+                case ChunkState::LAST_LF:
+                    if (ch != '\n') return -1;
+                    m_state = State::DONE;
+                    idx++;
+                    break;
+            }
+        }
+        return static_cast<int64_t>(idx);
+    }
+
+    /// Body bytes from the server, forwarded as far as they belong to the response
+    /// @return false if the response is malformed
+    bool receive_body(const char *data, const size_t size) {
+        if (m_framing == Framing::LENGTH) {
+            const size_t length = static_cast<size_t>(std::min<uint64_t>(m_length_left, size));
+            output().append(data, length);
+            m_length_left -= length;
+            if (m_length_left == 0) m_state = State::DONE;
+            // Anything after the response is not something the connection can be trusted with
+            if (length < size) m_upstream_keep_alive = false;
+            return true;
+        }
+        if (m_framing == Framing::CLOSE) {
+            output().append(data, size);
+            return true;
+        }
+        // The framing goes out as it came, except to an HTTP/1.0 client
+        const int64_t length = consume_chunked(data, size, m_is_http10 ? &output() : nullptr);
+        if (length < 0) return false;
+        if (!m_is_http10) output().append(data, static_cast<size_t>(length));
+        if (static_cast<size_t>(length) < size) m_upstream_keep_alive = false;
+        return true;
+    }
+
+    void on_upstream_data(const char *data, const size_t size) {
+        if (m_client == nullptr || m_is_finished) {
+            detach(false);
+            return;
+        }
+        size_t idx = 0;
+        if (m_state == State::HEADER) {
+            const size_t skip = m_header.size() > 3 ? m_header.size() - 3 : 0;
+            m_header.append(data, size);
+            const size_t header_end = m_header.find("\r\n\r\n", skip);
+            if (header_end == std::string::npos) {
+                if (m_header.size() > MAX_HEADER_SIZE) fail();
+                return;
+            }
+            // Where the body starts in data
+            idx = header_end + 4 - (m_header.size() - size);
+            m_header.resize(header_end + 4);
+            const bool is_interim = m_header.size() >= 12 && m_header.compare(9, 1, "1") == 0
+                                    && m_header.compare(9, 3, "101") != 0;
+            if (is_interim) {
+                // 100 Continue and the like, the final response follows
+                m_header.clear();
+                if (idx < size) on_upstream_data(data + idx, size - idx);
+                return;
+            }
+            if (!start_response()) {
+                m_output.reset();
+                fail();
+                return;
+            }
+            ReverseProxy::record_success(*m_upstream.servers[m_server]);
+            m_header = std::string();
+            m_state = m_framing == Framing::NONE ? State::DONE : State::BODY;
+            if (m_socket != nullptr) m_socket->set_phase(AsyncSocket::Phase::READ_BODY);
+            // A response with no body cannot carry anything more
+            if (m_state == State::DONE && idx < size) m_upstream_keep_alive = false;
+        }
+        if (m_state == State::BODY && idx < size && !receive_body(data + idx, size - idx)) {
+            // Part of the response has gone out, the client can only learn by the connection closing
+            m_keep_alive = false;
+            m_upstream_keep_alive = false;
+            flush_to_client();
+            finish();
+            return;
+        }
+        flush_to_client();
+        if (m_state == State::DONE) {
+            finish();
+            return;
+        }
+        if (m_state == State::BODY) splice_response();
+        m_proxy.m_server.wake(client_handle());
+    }
+
+    /// Body bytes the server connection has moved into its pipe, queued for the client as they are
+    void on_upstream_spliced(const SendBuffer &moved) {
+        if (m_client == nullptr || m_is_finished) {
+            detach(false);
+            return;
+        }
+        Metrics::get_metrics()->add(Counter::PROXY_SPLICED_BYTES, moved.size);
+        m_bytes_sent += moved.size;
+        m_client->async_send(moved);
+        if (m_framing == Framing::LENGTH) {
+            m_length_left -= moved.size;
+            if (m_length_left == 0) {
+                finish();
+                return;
+            }
+        }
+        throttle_server();
+        m_proxy.m_server.wake(client_handle());
+    }
+
+    /// Part of the request body from the client, on its way to the server
+    void forward_body(const SendBuffer &body) {
+        m_body_remaining -= body.size;
+        if (m_socket != nullptr) {
+            m_socket->async_send(body);
+            m_proxy.m_server.wake(ConnectionHandle(m_socket));
+            // Wait for the server to take what it has before reading more from the client
+            if (m_socket->queued_bytes > config().max_buffered_bytes) {
+                m_client->pause_read();
+                m_client->set_phase(AsyncSocket::Phase::WAITING);
+            }
+        }
+        if (m_body_remaining == 0) {
+            m_client->pause_read();
+            m_client->set_phase(AsyncSocket::Phase::WAITING);
+        }
+    }
+
+    /// The server failed before the response header was complete: retry while nothing else has
+    /// been lost with it, otherwise 502
+    void fail() {
+        auto &server = *m_upstream.servers[m_server];
+        const bool was_reused = m_is_reused;
+        const bool has_response = !m_header.empty();
+        detach(false);
+        // A pooled connection the server had just closed says nothing about its health
+        if (!was_reused || has_response) ReverseProxy::record_failure(m_upstream, server);
+        const bool can_retry = m_is_replayable && !has_response
+                               && m_attempts <= static_cast<int>(m_upstream.servers.size())
+                               && !m_proxy.m_server.is_stopping();
+        m_header.clear();
+        if (can_retry) {
+            attempt(was_reused ? -1 : m_server);
+            return;
+        }
+        respond_error(HttpStatus::BAD_GATEWAY);
+    }
+
+public:
+    ProxyExchange(ReverseProxy &proxy, Upstream &upstream, AsyncSocket *client)
+        : m_proxy(proxy), m_upstream(upstream), m_client(client) {
+    }
+
+    ProxyExchange(const ProxyExchange &other) = delete;
+
+    ProxyExchange &operator=(const ProxyExchange &other) = delete;
+
+    ~ProxyExchange() {
+        detach(false);
+    }
+
+    /// Bytes from the client while the exchange runs: the rest of the request body, then whatever
+    /// follows it, which waits for the exchange to finish
+    void feed(const char *data, const size_t size) {
+        const size_t length = static_cast<size_t>(std::min<uint64_t>(m_body_remaining, size));
+        if (length > 0) forward_body(to_buffer(std::make_shared<const std::string>(data, length)));
+        if (length < size) {
+            // Dropped once the exchange has failed, the connection closes anyway
+            if (!m_is_finished || m_keep_alive) m_leftover.append(data + length, size - length);
+            m_client->pause_read();
+        }
+    }
+
+    /// Part of the request body the client connection has moved into its pipe, see
+    /// AsyncSocket::splice_input(). It never goes past the body.
+    void feed_spliced(const SendBuffer &moved) {
+        if (m_socket != nullptr) {
+            Metrics::get_metrics()->add(Counter::PROXY_SPLICED_BYTES, moved.size);
+        } else {
+#ifdef LINUX
+            // With no server to take it, the rest of the body is read and dropped
+            m_client->stop_splice();
+#endif
+        }
+        forward_body(moved);
+    }
+
+    /// The client has been sent everything queued for it
+    void on_client_drained() {
+        if (m_socket != nullptr && m_socket->is_read_paused()) {
+            m_socket->resume_read();
+            m_socket->set_phase(m_state == State::HEADER ? AsyncSocket::Phase::READ_HEADER
+                                                         : AsyncSocket::Phase::READ_BODY);
+            m_proxy.m_server.wake(ConnectionHandle(m_socket));
+        }
+    }
+
+    /// The server has been sent everything queued for it
+    void on_server_drained() {
+        if (m_client != nullptr && m_body_remaining > 0 && m_client->is_read_paused()) {
+            m_client->resume_read();
+            m_client->set_phase(AsyncSocket::Phase::READ_BODY);
+            m_proxy.m_server.wake(client_handle());
+        }
+    }
+
+    /// The connection to the server has closed, whoever closed it
+    void on_server_closed() {
+        if (m_is_finished) return;
+        if (m_state == State::HEADER) {
+            fail();
+            return;
+        }
+        // Without a length, the end of the connection is the end of the body
+        if (m_framing != Framing::CLOSE) m_keep_alive = false;
+        m_upstream_keep_alive = false;
+        if (m_socket != nullptr) {
+            m_upstream.servers[m_server]->active--;
+            m_socket->context = nullptr;
+            m_socket = nullptr;
+        }
+        finish();
+    }
+
+    /// The client connection is closing, the server connection goes with it
+    void on_client_closed() {
+        m_client = nullptr;
+        m_is_finished = true;
+        detach(false);
+    }
+
+    /// Once finished, HttpServer answers the next request of the client
+    [[nodiscard]] bool is_finished() const {
+        return m_is_finished;
+    }
+
+    /// Whether the client connection stays open after this response
+    [[nodiscard]] bool is_keep_alive() const {
+        return m_keep_alive;
+    }
+
+    std::string take_leftover() {
+        return std::move(m_leftover);
+    }
+
+    [[nodiscard]] int get_status() const {
+        return m_status;
+    }
+
+    [[nodiscard]] int64_t get_bytes_sent() const {
+        return m_bytes_sent;
+    }
+
+    [[nodiscard]] const std::string &get_method() const {
+        return m_method;
+    }
+
+    [[nodiscard]] const std::string &get_url() const {
+        return m_url;
+    }
+
+    [[nodiscard]] const std::string &get_user_agent() const {
+        return m_user_agent;
+    }
+
+    [[nodiscard]] std::chrono::steady_clock::time_point started_at() const {
+        return m_started_at;
+    }
+};
+
+inline std::shared_ptr<ProxyExchange> ReverseProxy::start(AsyncSocket *client, Upstream &upstream,
+                                                          HttpRequest &request, const std::string_view pending,
+                                                          const bool keep_alive,
+                                                          const std::chrono::steady_clock::time_point started_at) {
+    ensure_pools();
+    Metrics::get_metrics()->add(Counter::PROXY_REQUESTS);
+    auto exchange = std::make_shared<ProxyExchange>(*this, upstream, client);
+    exchange->m_keep_alive = keep_alive;
+    exchange->m_is_http10 = request.protocol == "HTTP/1.0";
+    exchange->m_method.assign(request.method.data(), request.method.size());
+    exchange->m_url.assign(request.url.data(), request.url.size());
+    exchange->m_user_agent.assign(request.user_agent.data(), request.user_agent.size());
+    exchange->m_started_at = started_at;
+    exchange->build_request(request);
+    if (request.method == "POST") {
+        if (!request.data.empty()) {
+            exchange->m_body_start = std::make_shared<const std::string>(request.data.data(), request.data.size());
+        }
+        exchange->m_body_remaining = request.content_length - request.data.size();
+    }
+    if (exchange->m_body_remaining == 0) {
+        exchange->m_is_replayable = true;
+        exchange->m_leftover.assign(pending.data(), pending.size());
+        // The next request waits until this one is answered
+        client->pause_read();
+        client->set_phase(AsyncSocket::Phase::WAITING);
+    } else {
+        client->set_phase(AsyncSocket::Phase::READ_BODY);
+#ifdef LINUX
+        // The rest of the body goes to the server as it is, unless it needs decrypting first
+        if (upstream.config.splice) client->splice_input(exchange->m_body_remaining);
+#endif
+    }
+    exchange->attempt(-1);
+    return exchange;
+}
+
+inline void ReverseProxy::on_upstream_received(AsyncSocket *socket, const SocketBuffer &buffer) {
+    auto *exchange = static_cast<ProxyExchange *>(socket->context);
+    // An idle connection has nothing to say
+    if (exchange == nullptr) {
+        socket->async_close();
+        return;
+    }
+    exchange->on_upstream_data(buffer.buffer, buffer.size);
+}
+
+inline void ReverseProxy::on_upstream_spliced(AsyncSocket *socket, const SendBuffer &moved) {
+    auto *exchange = static_cast<ProxyExchange *>(socket->context);
+    if (exchange == nullptr) {
+        socket->async_close();
+        return;
+    }
+    exchange->on_upstream_spliced(moved);
+}
+
+inline void ReverseProxy::on_upstream_drained(AsyncSocket *socket) {
+    auto *exchange = static_cast<ProxyExchange *>(socket->context);
+    if (exchange != nullptr) exchange->on_server_drained();
+    if (socket->is_read_closed()) socket->async_close();
+}
+
+inline void ReverseProxy::on_upstream_closed(AsyncSocket *socket) {
+    auto *exchange = static_cast<ProxyExchange *>(socket->context);
+    socket->context = nullptr;
+    if (exchange != nullptr) exchange->on_server_closed();
+}
+
+#endif //REVERSE_PROXY_H
@@ -0,0 +1,451 @@
+//
+// Created by Haotian on 2026/10/19.
+//
+
+#ifndef WEB_SOCKET_H
+#define WEB_SOCKET_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+
+#include "../common/Metrics.h"
+#include "../common/Sha1.h"
+#include "../tcp/TcpServer.h"
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+class WebSocket;
+
+/// What a WebSocket route does with its connections, see HttpServer::add_websocket(). The callbacks
+/// run on the I/O thread of the connection.
+struct WebSocketHandler {
+    std::function<void(const std::shared_ptr<WebSocket> &)> on_open{};
+    // A complete message, fragments put together. The bytes are only valid during the call.
+    std::function<void(const std::shared_ptr<WebSocket> &, std::string_view message, bool is_binary)> on_message{};
+    // Status code of the close frame received or sent, 1006 when the connection went away without one
+    std::function<void(const std::shared_ptr<WebSocket> &, uint16_t code)> on_close{};
+    // Larger messages close the connection with 1009
+    size_t max_message_size = 16 * 1024 * 1024;
+};
+
+/// A connection upgraded to WebSocket (RFC 6455). Frames are read incrementally, whatever the
+/// reads cut them into. Messages are sent from any thread: a frame is encoded where send is called
+/// and handed to the I/O thread of the connection, which queues it like any response.
+class WebSocket : public std::enable_shared_from_this<WebSocket> {
+public:
+    enum class Opcode : uint8_t {
+        CONTINUATION = 0x0,
+        TEXT = 0x1,
+        BINARY = 0x2,
+        CLOSE = 0x8,
+        PING = 0x9,
+        PONG = 0xA
+    };
+
+    // RFC 6455, section 1.3
+    static constexpr std::string_view ACCEPT_GUID = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+
+private:
+    // Message buffers bigger than this are given back once the message is delivered
+    static constexpr size_t MAX_KEPT_CAPACITY = 64 * 1024;
+    static constexpr size_t MAX_HEADER_SIZE = 14;
+
+    TcpServer &m_server;
+    const ConnectionHandle m_handle;
+    const std::string m_url;
+    const WebSocketHandler &m_handler;
+    // Cleared once a close frame has been sent or received, nothing is sent after that
+    std::atomic<bool> m_is_open{true};
+
+    // Frame header collected across reads
+    unsigned char m_header[MAX_HEADER_SIZE]{};
+    size_t m_header_size = 0;
+    size_t m_header_needed = 2;
+    bool m_is_reading_payload = false;
+    // Current frame
+    bool m_is_final = false;
+    Opcode m_opcode = Opcode::CONTINUATION;
+    uint64_t m_remaining = 0;
+    unsigned char m_mask[4]{};
+    // Payload bytes of the frame unmasked so far, the key is rotated by this
+    uint64_t m_masked_offset = 0;
+    // Data message being put together from its fragments, TEXT or BINARY while one is
+    Opcode m_message_opcode = Opcode::CONTINUATION;
+    std::string m_message{};
+    // Payload of the current control frame, which may come between two fragments
+    std::string m_control{};
+    uint16_t m_close_code = 1006;
+    bool m_is_close_notified = false;
+
+    /// XOR size bytes at data with the masking key, starting offset bytes into the payload.
+    /// 32 or 16 bytes at a time with AVX2 or SSE2, 8 otherwise.
+    static void unmask(char *data, const size_t size, const unsigned char mask[4], const uint64_t offset) {
+        // The key rotated to offset, twice, so every block below starts at key[0]
+        unsigned char key[8];
+        for (int i = 0; i < 8; i++) key[i] = mask[(offset + i) & 3];
+        size_t i = 0;
+#if defined(__AVX2__) || defined(__SSE2__)
+        int32_t key32;
+        memcpy(&key32, key, sizeof(key32));
+#endif
+#if defined(__AVX2__)
+        const __m256i key256 = _mm256_set1_epi32(key32);
+        for (; i + 32 <= size; i += 32) {
+            auto *p = reinterpret_cast<__m256i *>(data + i);
+            _mm256_storeu_si256(p, _mm256_xor_si256(_mm256_loadu_si256(p), key256));
+        }
+#endif
+#if defined(__SSE2__)
+        const __m128i key128 = _mm_set1_epi32(key32);
+        for (; i + 16 <= size; i += 16) {
+            auto *p = reinterpret_cast<__m128i *>(data + i);
+            _mm_storeu_si128(p, _mm_xor_si128(_mm_loadu_si128(p), key128));
+        }
+#endif
+        uint64_t key64;
+        memcpy(&key64, key, sizeof(key64));
+        for (; i + 8 <= size; i += 8) {
+            uint64_t chunk;
+            memcpy(&chunk, data + i, sizeof(chunk));
+            chunk ^= key64;
+            memcpy(data + i, &chunk, sizeof(chunk));
+        }
+        for (; i < size; i++) data[i] = static_cast<char>(data[i] ^ key[i & 3]);
+    }
+
+    static bool is_valid_close_code(const uint16_t code) {
+        return (code >= 1000 && code <= 1003) || (code >= 1007 && code <= 1011) || (code >= 3000 && code <= 4999);
+    }
+
+    static SendBuffer to_buffer(const std::shared_ptr<const std::string> &frame) {
+        return {frame, frame->data(), static_cast<ssize_t>(frame->size())};
+    }
+
+    // Send a close frame, read no further and close once it is out. 1005 (no code) sends none.
+    void close_with(const uint16_t code, const std::string_view reason = {}) {
+        if (!m_is_open.exchange(false)) return;
+        m_close_code = code;
+        char payload[125];
+        size_t size = 0;
+        if (code != 1005) {
+            payload[0] = static_cast<char>(code >> 8);
+            payload[1] = static_cast<char>(code & 0xFF);
+            size = 2 + std::min(reason.size(), sizeof(payload) - 2);
+            memcpy(payload + 2, reason.data(), size - 2);
+        }
+        m_handle.socket->async_send(to_buffer(make_frame(Opcode::CLOSE, {payload, size})));
+        m_handle.socket->close_read();
+    }
+
+    // Collect header bytes. False while the header is incomplete or when it breaks the protocol.
+    bool read_header(const char *&data, size_t &size) {
+        const size_t length = std::min(size, m_header_needed - m_header_size);
+        memcpy(m_header + m_header_size, data, length);
+        m_header_size += length;
+        data += length;
+        size -= length;
+        if (m_header_size == 2) {
+            // Checked before waiting for the rest, which a frame without a mask never sends
+            const auto opcode = static_cast<Opcode>(m_header[0] & 0x0F);
+            const bool is_valid_opcode = opcode == Opcode::CONTINUATION || opcode == Opcode::TEXT
+                                         || opcode == Opcode::BINARY || opcode == Opcode::CLOSE
+                                         || opcode == Opcode::PING || opcode == Opcode::PONG;
+            // No extension is negotiated, so no RSV bit may be set. Clients always mask.
+            if ((m_header[0] & 0x70) != 0 || !is_valid_opcode || (m_header[1] & 0x80) == 0) {
+                close_with(1002);
+                return false;
+            }
+            const unsigned char length7 = m_header[1] & 0x7F;
+            m_header_needed = 2 + (length7 == 126 ? 2 : length7 == 127 ? 8 : 0) + 4;
+        }
+        if (m_header_size < m_header_needed) return false;
+
+        m_is_final = (m_header[0] & 0x80) != 0;
+        m_opcode = static_cast<Opcode>(m_header[0] & 0x0F);
+        const bool is_control = (m_header[0] & 0x08) != 0;
+        const unsigned char length7 = m_header[1] & 0x7F;
+        const unsigned char *p = m_header + 2;
+        uint64_t length64 = length7;
+        if (length7 == 126) {
+            length64 = static_cast<uint64_t>(p[0]) << 8 | p[1];
+            p += 2;
+        } else if (length7 == 127) {
+            length64 = 0;
+            for (int i = 0; i < 8; i++) length64 = length64 << 8 | p[i];
+            p += 8;
+        }
+        memcpy(m_mask, p, sizeof(m_mask));
+        m_header_size = 0;
+        m_header_needed = 2;
+
+        // The most significant bit of a 64-bit length must be 0
+        if ((length64 >> 63) != 0) {
+            close_with(1002);
+            return false;
+        }
+        if (is_control) {
+            if (!m_is_final || length64 > 125) {
+                close_with(1002);
+                return false;
+            }
+        } else {
+            // A continuation needs a message to continue, a new message waits for the last one to end
+            const bool has_message = m_message_opcode != Opcode::CONTINUATION;
+            if (has_message != (m_opcode == Opcode::CONTINUATION)) {
+                close_with(1002);
+                return false;
+            }
+            if (length64 > m_handler.max_message_size - m_message.size()) {
+                close_with(1009);
+                return false;
+            }
+            if (!has_message) m_message_opcode = m_opcode;
+        }
+        m_remaining = length64;
+        m_masked_offset = 0;
+        m_is_reading_payload = true;
+        return true;
+    }
+
+    void read_payload(const char *&data, size_t &size) {
+        const size_t length = std::min<uint64_t>(size, m_remaining);
+        std::string &target = (static_cast<uint8_t>(m_opcode) & 0x08) != 0 ? m_control : m_message;
+        const size_t old_size = target.size();
+        target.append(data, length);
+        unmask(target.data() + old_size, length, m_mask, m_masked_offset);
+        m_masked_offset += length;
+        m_remaining -= length;
+        data += length;
+        size -= length;
+    }
+
+    void finish_frame() {
+        m_is_reading_payload = false;
+        switch (m_opcode) {
+            case Opcode::PING:
+                if (m_is_open) m_handle.socket->async_send(to_buffer(make_frame(Opcode::PONG, m_control)));
+                break;
+            case Opcode::PONG:
+                break;
+            case Opcode::CLOSE:
+                on_close_frame();
+                break;
+            default:
+                if (m_is_final) finish_message();
+                return;
+        }
+        m_control.clear();
+    }
+
+    // Answer with the same code, or without one when the peer sent none
+    void on_close_frame() {
+        if (m_control.size() == 1) {
+            close_with(1002);
+            return;
+        }
+        if (m_control.empty()) {
+            close_with(1005);
+            return;
+        }
+        const uint16_t code = static_cast<uint8_t>(m_control[0]) << 8 | static_cast<uint8_t>(m_control[1]);
+        if (!is_valid_close_code(code) || !is_valid_utf8(m_control.data() + 2, m_control.size() - 2)) {
+            close_with(1002);
+            return;
+        }
+        close_with(code);
+    }
+
+    void finish_message() {
+        const bool is_binary = m_message_opcode == Opcode::BINARY;
+        m_message_opcode = Opcode::CONTINUATION;
+        if (!is_binary && !is_valid_utf8(m_message.data(), m_message.size())) {
+            close_with(1007);
+            return;
+        }
+        Metrics::get_metrics()->add(Counter::WEBSOCKET_MESSAGES);
+        if (m_handler.on_message) m_handler.on_message(shared_from_this(), m_message, is_binary);
+        m_message.clear();
+        if (m_message.capacity() > MAX_KEPT_CAPACITY) m_message.shrink_to_fit();
+    }
+
+public:
+    WebSocket(TcpServer &server, AsyncSocket *socket, std::string url, const WebSocketHandler &handler)
+        : m_server(server), m_handle(socket), m_url(std::move(url)), m_handler(handler) {
+    }
+
+    WebSocket(const WebSocket &other) = delete;
+
+    WebSocket &operator=(const WebSocket &other) = delete;
+
+    /// Sec-WebSocket-Accept for the Sec-WebSocket-Key of a client
+    static std::string accept_key(const std::string_view key) {
+        Sha1 sha1;
+        sha1.update(key.data(), key.size());
+        sha1.update(ACCEPT_GUID.data(), ACCEPT_GUID.size());
+        unsigned char digest[Sha1::DIGEST_SIZE];
+        sha1.finish(digest);
+
+        static constexpr char ALPHABET[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+        std::string result;
+        for (size_t i = 0; i < sizeof(digest); i += 3) {
+            const uint32_t chunk = static_cast<uint32_t>(digest[i]) << 16
+                                   | (i + 1 < sizeof(digest) ? digest[i + 1] << 8 : 0)
+                                   | (i + 2 < sizeof(digest) ? digest[i + 2] : 0);
+            result += ALPHABET[chunk >> 18 & 0x3F];
+            result += ALPHABET[chunk >> 12 & 0x3F];
+            result += i + 1 < sizeof(digest) ? ALPHABET[chunk >> 6 & 0x3F] : '=';
+            result += i + 2 < sizeof(digest) ? ALPHABET[chunk & 0x3F] : '=';
+        }
+        return result;
+    }
+
+    /// Whether size bytes at data are well-formed UTF-8. ASCII is skipped 16 bytes at a time with SSE2.
+    static bool is_valid_utf8(const char *data, const size_t size) {
+        const auto *p = reinterpret_cast<const unsigned char *>(data);
+        const unsigned char *end = p + size;
+        while (p < end) {
+#if defined(__SSE2__)
+            while (end - p >= 16 && _mm_movemask_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(p))) == 0) {
+                p += 16;
+            }
+            if (p == end) break;
+#endif
+            const unsigned char c = *p;
+            if (c < 0x80) {
+                p++;
+                continue;
+            }
+            size_t length;
+            uint32_t code_point;
+            if ((c & 0xE0) == 0xC0) {
+                length = 2;
+                code_point = c & 0x1F;
+            } else if ((c & 0xF0) == 0xE0) {
+                length = 3;
+                code_point = c & 0x0F;
+            } else if ((c & 0xF8) == 0xF0) {
+                length = 4;
+                code_point = c & 0x07;
+            } else {
+                return false;
+            }
+            if (static_cast<size_t>(end - p) < length) return false;
+            for (size_t i = 1; i < length; i++) {
+                if ((p[i] & 0xC0) != 0x80) return false;
+                code_point = code_point << 6 | (p[i] & 0x3F);
+            }
+            // Overlong forms, surrogates and anything past U+10FFFF
+            static constexpr uint32_t MIN_CODE_POINT[] = {0, 0, 0x80, 0x800, 0x10000};
+            if (code_point < MIN_CODE_POINT[length] || (code_point >= 0xD800 && code_point <= 0xDFFF)
+                || code_point > 0x10FFFF) {
+                return false;
+            }
+            p += length;
+        }
+        return true;
+    }
+
+    /// An unmasked frame as the server sends it, to be passed to send() as often as needed
+    static std::shared_ptr<const std::string> make_frame(const Opcode opcode, const std::string_view payload) {
+        auto frame = std::make_shared<std::string>();
+        frame->reserve(payload.size() + 10);
+        frame->push_back(static_cast<char>(0x80 | static_cast<uint8_t>(opcode)));
+        if (payload.size() < 126) {
+            frame->push_back(static_cast<char>(payload.size()));
+        } else if (payload.size() <= 0xFFFF) {
+            frame->push_back(126);
+            frame->push_back(static_cast<char>(payload.size() >> 8));
+            frame->push_back(static_cast<char>(payload.size() & 0xFF));
+        } else {
+            frame->push_back(127);
+            for (int i = 7; i >= 0; i--) {
+                frame->push_back(static_cast<char>(static_cast<uint64_t>(payload.size()) >> (i * 8)));
+            }
+        }
+        frame->append(payload);
+        return frame;
+    }
+
+    [[nodiscard]] const std::string &get_url() const {
+        return m_url;
+    }
+
+    [[nodiscard]] const ConnectionHandle &get_handle() const {
+        return m_handle;
+    }
+
+    /// Until a close frame has been sent or received
+    [[nodiscard]] bool is_open() const {
+        return m_is_open;
+    }
+
+    /// Queue a frame made by make_frame(), from any thread. False once the connection is closing
+    /// or closed, though a frame may still be dropped if it closes before the frame is queued.
+    bool send(const std::shared_ptr<const std::string> &frame) {
+        if (!m_is_open) return false;
+        return m_server.send(m_handle, to_buffer(frame));
+    }
+
+    bool send_text(const std::string_view message) {
+        return m_is_open && send(make_frame(Opcode::TEXT, message));
+    }
+
+    bool send_binary(const std::string_view message) {
+        return m_is_open && send(make_frame(Opcode::BINARY, message));
+    }
+
+    bool ping(const std::string_view payload = {}) {
+        return m_is_open && payload.size() <= 125 && send(make_frame(Opcode::PING, payload));
+    }
+
+    /// Start the closing handshake from any thread. The connection is closed once the close frame
+    /// is out, without waiting for the client's answer.
+    bool close(const uint16_t code = 1000, const std::string_view reason = {}) {
+        if (!m_is_open) return false;
+        if (ServingScope::is_serving(m_handle.socket)) {
+            close_with(code, reason);
+            return true;
+        }
+        return m_server.post(m_handle, [self = shared_from_this(), code, text = std::string(reason)](AsyncSocket *) {
+            self->close_with(code, text);
+        });
+    }
+
+    /// Call on_open, on the I/O thread right after the 101 has been queued
+    void open() {
+        Metrics::get_metrics()->add(Counter::WEBSOCKET_UPGRADES);
+        if (m_handler.on_open) m_handler.on_open(shared_from_this());
+    }
+
+    /// Parse frames out of what has been received, on the I/O thread of the connection
+    void feed(const char *data, size_t size) {
+        while (size > 0 && !m_handle.socket->is_read_closed()) {
+            if (!m_is_reading_payload) {
+                if (!read_header(data, size)) continue;
+            } else {
+                read_payload(data, size);
+            }
+            if (m_is_reading_payload && m_remaining == 0) finish_frame();
+        }
+    }
+
+    /// The connection has closed, whoever closed it
+    void on_connection_closed() {
+        m_is_open = false;
+        if (m_is_close_notified) return;
+        m_is_close_notified = true;
+        if (m_handler.on_close) m_handler.on_close(shared_from_this(), m_close_code);
+    }
+};
+
+#endif //WEB_SOCKET_H
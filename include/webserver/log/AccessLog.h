@@ -0,0 +1,335 @@
+//
+// Created by Haotian on 2026/10/19.
+//
+
+#ifndef ACCESS_LOG_H
+#define ACCESS_LOG_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "Logger.h"
+
+struct AccessLogConfig {
+    // File to append to, "-" for stdout
+    std::string path = "access.log";
+    // The file is rotated to path.1, path.2, ... once it grows beyond this, 0 never rotates
+    int64_t max_file_size = 64 * 1024 * 1024;
+    // Rotated files kept
+    int max_files = 5;
+    // Share of successful requests (status < 400) logged, errors are always logged
+    double sample_rate = 1.0;
+};
+
+/// Access log in JSON lines, one per request.
+///
+/// The I/O threads only copy a small binary record (numbers plus the raw method, path and user
+/// agent) into a ring of their own, the same lock-free LogRing the Logger uses. A background
+/// thread turns the records into text, writes them in batches and rotates the file, so the cost
+/// on the request path is a copy of a few hundred bytes. Records that do not fit into a full
+/// ring are dropped and counted, the request is never held up.
+class AccessLog {
+    static constexpr size_t MAX_METHOD_LENGTH = 16;
+    static constexpr size_t MAX_PATH_LENGTH = 1024;
+    static constexpr size_t MAX_USER_AGENT_LENGTH = 256;
+    static constexpr auto FLUSH_INTERVAL = std::chrono::milliseconds(100);
+
+    // Followed by method, path and user agent
+    struct Record {
+        // Milliseconds since the epoch, system clock
+        int64_t time_ms;
+        int64_t latency_us;
+        int64_t bytes;
+        // Network byte order
+        uint32_t client_ip;
+        uint16_t status;
+        uint16_t method_length;
+        uint16_t path_length;
+        uint16_t user_agent_length;
+    };
+
+    // Rings of the calling thread, one per access log it has written to
+    struct ThreadRings {
+        std::vector<std::pair<uint64_t, std::shared_ptr<LogRing> > > rings{};
+
+        ~ThreadRings() {
+            for (auto &[_, ring]: rings) ring->is_orphaned = true;
+        }
+    };
+
+    AccessLogConfig m_config;
+    // Tells apart the access logs of one process in ThreadRings
+    const uint64_t m_id;
+    uint32_t m_sample_threshold;
+
+    std::mutex m_mutex{};
+    std::condition_variable m_condition{};
+    std::vector<std::shared_ptr<LogRing> > m_rings{};
+    bool m_is_stopped = false;
+    std::atomic<uint64_t> m_dropped{0};
+
+    // Only touched by the writer thread
+    FILE *m_file = nullptr;
+    int64_t m_file_size = 0;
+    std::thread m_writer{};
+
+    static uint64_t next_id() {
+        static std::atomic<uint64_t> id{0};
+        return ++id;
+    }
+
+    LogRing &get_ring() {
+        thread_local ThreadRings thread_rings{};
+        for (auto &[id, ring]: thread_rings.rings) {
+            if (id == m_id) return *ring;
+        }
+        auto ring = std::make_shared<LogRing>(); {
+            std::lock_guard lock(m_mutex);
+            m_rings.emplace_back(ring);
+        }
+        thread_rings.rings.emplace_back(m_id, ring);
+        return *ring;
+    }
+
+    // xorshift32, one sequence per thread
+    static uint32_t next_random() {
+        thread_local uint32_t state = static_cast<uint32_t>(
+            std::hash<std::thread::id>{}(std::this_thread::get_id())) | 1;
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        return state;
+    }
+
+    static void append_escaped(std::string &output, const char *data, const size_t length) {
+        static constexpr char HEX[] = "0123456789abcdef";
+        for (size_t i = 0; i < length; i++) {
+            const auto ch = static_cast<unsigned char>(data[i]);
+            if (ch == '"' || ch == '\\') {
+                output += '\\';
+                output += static_cast<char>(ch);
+            } else if (ch < 0x20 || ch == 0x7f) {
+                output += "\\u00";
+                output += HEX[ch >> 4];
+                output += HEX[ch & 0xf];
+            } else {
+                output += static_cast<char>(ch);
+            }
+        }
+    }
+
+    static void append_number(std::string &output, const int64_t value) {
+        char buffer[24];
+        const int length = snprintf(buffer, sizeof(buffer), "%lld", static_cast<long long>(value));
+        output.append(buffer, length);
+    }
+
+    // "2026-10-19T12:47:14.123Z"
+    static void append_time(std::string &output, const int64_t time_ms) {
+        thread_local char buffer[32]{};
+        thread_local int64_t cached_second = -1;
+        const int64_t second = time_ms / 1000;
+        if (second != cached_second) {
+            cached_second = second;
+            const std::time_t time = second;
+            std::tm utc{};
+            gmtime_r(&time, &utc);
+            strftime(buffer, sizeof(buffer), "%Y-%m-%dT%H:%M:%S", &utc);
+        }
+        char milliseconds[8];
+        snprintf(milliseconds, sizeof(milliseconds), ".%03dZ", static_cast<int>(time_ms % 1000));
+        output += buffer;
+        output += milliseconds;
+    }
+
+    static void format(std::string &output, const Record &record, const char *strings) {
+        const char *method = strings;
+        const char *path = method + record.method_length;
+        const char *user_agent = path + record.path_length;
+        const auto ip = reinterpret_cast<const unsigned char *>(&record.client_ip);
+        char address[16];
+        snprintf(address, sizeof(address), "%u.%u.%u.%u", ip[0], ip[1], ip[2], ip[3]);
+
+        output += "{\"time\":\"";
+        append_time(output, record.time_ms);
+        output += "\",\"client\":\"";
+        output += address;
+        output += "\",\"method\":\"";
+        append_escaped(output, method, record.method_length);
+        output += "\",\"path\":\"";
+        append_escaped(output, path, record.path_length);
+        output += "\",\"status\":";
+        append_number(output, record.status);
+        output += ",\"bytes\":";
+        append_number(output, record.bytes);
+        output += ",\"latency_us\":";
+        append_number(output, record.latency_us);
+        output += ",\"user_agent\":\"";
+        append_escaped(output, user_agent, record.user_agent_length);
+        output += "\"}\n";
+    }
+
+    bool open_file() {
+        if (m_config.path == "-") {
+            m_file = stdout;
+            return true;
+        }
+        m_file = fopen(m_config.path.c_str(), "a");
+        if (m_file == nullptr) {
+            Logger::get_logger()->error("Failed to open access log %s", m_config.path.c_str());
+            return false;
+        }
+        fseek(m_file, 0, SEEK_END);
+        m_file_size = ftell(m_file);
+        return true;
+    }
+
+    // path.(n-1) -> path.n, ..., path -> path.1
+    void rotate() {
+        fclose(m_file);
+        m_file = nullptr;
+        for (int i = m_config.max_files - 1; i >= 1; i--) {
+            const auto from = m_config.path + "." + std::to_string(i);
+            const auto to = m_config.path + "." + std::to_string(i + 1);
+            rename(from.c_str(), to.c_str());
+        }
+        if (m_config.max_files > 0) {
+            rename(m_config.path.c_str(), (m_config.path + ".1").c_str());
+        } else {
+            remove(m_config.path.c_str());
+        }
+        open_file();
+    }
+
+    // Move every record out of the rings, format and write them.
+    void flush(std::string &records, std::string &output) {
+        records.clear();
+        output.clear(); {
+            std::lock_guard lock(m_mutex);
+            for (size_t i = 0; i < m_rings.size();) {
+                const bool is_orphaned = m_rings[i]->is_orphaned;
+                m_rings[i]->drain(records);
+                if (is_orphaned && m_rings[i]->empty()) {
+                    m_rings[i] = m_rings.back();
+                    m_rings.pop_back();
+                    continue;
+                }
+                i++;
+            }
+        }
+
+        // Records are stored back to back, the ring keeps them whole
+        size_t offset = 0;
+        while (offset + sizeof(Record) <= records.size()) {
+            Record record{};
+            memcpy(&record, records.data() + offset, sizeof(Record));
+            format(output, record, records.data() + offset + sizeof(Record));
+            offset += sizeof(Record) + record.method_length + record.path_length + record.user_agent_length;
+        }
+        const auto dropped = m_dropped.exchange(0, std::memory_order_relaxed);
+        if (dropped > 0) {
+            Logger::get_logger()->warn("Access log dropped %llu records", static_cast<unsigned long long>(dropped));
+        }
+
+        if (output.empty() || m_file == nullptr) return;
+        fwrite(output.data(), 1, output.size(), m_file);
+        fflush(m_file);
+        m_file_size += static_cast<int64_t>(output.size());
+        if (m_file != stdout && m_config.max_file_size > 0 && m_file_size >= m_config.max_file_size) {
+            rotate();
+        }
+    }
+
+    void write_loop() {
+#ifdef LINUX
+        sigset_t mask;
+        sigfillset(&mask);
+        pthread_sigmask(SIG_BLOCK, &mask, nullptr);
+#endif
+        std::string records, output;
+        while (true) {
+            bool is_stopped; {
+                std::unique_lock lock(m_mutex);
+                m_condition.wait_for(lock, FLUSH_INTERVAL, [this]() {
+                    return m_is_stopped;
+                });
+                is_stopped = m_is_stopped;
+            }
+            flush(records, output);
+            if (is_stopped) return;
+        }
+    }
+
+public:
+    explicit AccessLog(AccessLogConfig config)
+        : m_config(std::move(config)), m_id(next_id()) {
+        const double rate = m_config.sample_rate < 0 ? 0 : m_config.sample_rate > 1 ? 1 : m_config.sample_rate;
+        m_sample_threshold = static_cast<uint32_t>(rate * UINT32_MAX);
+        open_file();
+        m_writer = std::thread([this]() {
+            write_loop();
+        });
+    }
+
+    AccessLog(const AccessLog &other) = delete;
+
+    AccessLog &operator=(const AccessLog &other) = delete;
+
+    ~AccessLog() {
+        {
+            std::lock_guard lock(m_mutex);
+            m_is_stopped = true;
+        }
+        m_condition.notify_one();
+        if (m_writer.joinable()) m_writer.join();
+        if (m_file != nullptr && m_file != stdout) fclose(m_file);
+    }
+
+    /// Record one request, called on the I/O thread that served it.
+    /// @param client_ip network byte order
+    void record(const std::string_view method, const std::string_view path, const int status,
+                const int64_t bytes, const int64_t latency_us, const uint32_t client_ip,
+                const std::string_view user_agent) {
+        if (status < 400 && m_sample_threshold != UINT32_MAX && next_random() > m_sample_threshold) return;
+
+        char buffer[sizeof(Record) + MAX_METHOD_LENGTH + MAX_PATH_LENGTH + MAX_USER_AGENT_LENGTH];
+        Record record{};
+        record.time_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::system_clock::now().time_since_epoch()).count();
+        record.latency_us = latency_us;
+        record.bytes = bytes;
+        record.client_ip = client_ip;
+        record.status = static_cast<uint16_t>(status);
+        record.method_length = static_cast<uint16_t>(std::min(method.size(), MAX_METHOD_LENGTH));
+        record.path_length = static_cast<uint16_t>(std::min(path.size(), MAX_PATH_LENGTH));
+        record.user_agent_length = static_cast<uint16_t>(std::min(user_agent.size(), MAX_USER_AGENT_LENGTH));
+
+        char *position = buffer;
+        memcpy(position, &record, sizeof(Record));
+        position += sizeof(Record);
+        memcpy(position, method.data(), record.method_length);
+        position += record.method_length;
+        memcpy(position, path.data(), record.path_length);
+        position += record.path_length;
+        memcpy(position, user_agent.data(), record.user_agent_length);
+        position += record.user_agent_length;
+
+        if (!get_ring().push(buffer, static_cast<uint32_t>(position - buffer))) {
+            m_dropped.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+};
+
+#endif //ACCESS_LOG_H
@@ -5,61 +5,313 @@
 #ifndef WEBSERVER_LOGGER_H
 #define WEBSERVER_LOGGER_H
 
-#include <string>
+#include <algorithm>
+#include <atomic>
 #include <chrono>
-#include <iostream>
-#include <cstring>
+#include <condition_variable>
 #include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../common/Predefined.h"
+
+#ifdef LINUX
+#include <csignal>
+#endif
+
+// Messages below this level are compiled out: 0 debug, 1 info, 2 warn, 3 error, 4 nothing.
+#ifndef WEBSERVER_LOG_LEVEL
+#define WEBSERVER_LOG_LEVEL 1
+#endif
+
+enum class LogLevel {
+    DEBUG = 0,
+    INFO = 1,
+    WARN = 2,
+    ERROR = 3
+};
+
+// Log through these on per-request paths: for a level compiled out, the arguments are not evaluated
+// either, which a call of Logger::debug() and the like cannot avoid
+#define WEBSERVER_LOG_AT(level, method, logger, ...) \
+    do { if constexpr (Logger::is_enabled<LogLevel::level>()) (logger)->method(__VA_ARGS__); } while (false)
+#define WEBSERVER_LOG_DEBUG(logger, ...) WEBSERVER_LOG_AT(DEBUG, debug, logger, __VA_ARGS__)
+#define WEBSERVER_LOG_INFO(logger, ...) WEBSERVER_LOG_AT(INFO, info, logger, __VA_ARGS__)
+#define WEBSERVER_LOG_WARN(logger, ...) WEBSERVER_LOG_AT(WARN, warn, logger, __VA_ARGS__)
+#define WEBSERVER_LOG_ERROR(logger, ...) WEBSERVER_LOG_AT(ERROR, error, logger, __VA_ARGS__)
+
+/// Bytes written by one thread and read by the flusher: single producer, single consumer, no lock.
+/// Records are a 4 byte length followed by the text and may wrap around the end.
+class LogRing {
+    static constexpr size_t CAPACITY = 1 << 18;
+    static constexpr size_t MASK = CAPACITY - 1;
+
+    char m_data[CAPACITY]{};
+    // Written by the producer only
+    alignas(64) std::atomic<uint64_t> m_head{0};
+    // Written by the consumer only
+    alignas(64) std::atomic<uint64_t> m_tail{0};
+
+    void copy_in(const uint64_t position, const void *source, const size_t length) {
+        const size_t offset = position & MASK;
+        const size_t first = std::min(length, CAPACITY - offset);
+        memcpy(m_data + offset, source, first);
+        memcpy(m_data, static_cast<const char *>(source) + first, length - first);
+    }
+
+    void copy_out(const uint64_t position, void *target, const size_t length) const {
+        const size_t offset = position & MASK;
+        const size_t first = std::min(length, CAPACITY - offset);
+        memcpy(target, m_data + offset, first);
+        memcpy(static_cast<char *>(target) + first, m_data, length - first);
+    }
+
+public:
+    // Set when the owning thread has exited, the flusher drops the ring once it is empty
+    std::atomic<bool> is_orphaned{false};
 
-static const char *get_time() {
-    static char buf[32];
-    const auto now = std::chrono::system_clock::now();
-    const std::time_t now_time = std::chrono::system_clock::to_time_t(now);
-    const auto time_str = std::ctime(&now_time);
-    strcpy(buf, time_str);
-    for (int i = strlen(time_str) - 1; i >= 0; i--) {
-        if (buf[i] == '\n') {
-            buf[i] = '\0';
+    /// @return false if there is no room, the record is dropped rather than waited for
+    bool push(const char *text, const uint32_t length) {
+        const uint64_t head = m_head.load(std::memory_order_relaxed);
+        const uint64_t tail = m_tail.load(std::memory_order_acquire);
+        if (CAPACITY - (head - tail) < sizeof(length) + length) return false;
+        copy_in(head, &length, sizeof(length));
+        copy_in(head + sizeof(length), text, length);
+        m_head.store(head + sizeof(length) + length, std::memory_order_release);
+        return true;
+    }
+
+    /// Append every record to output.
+    void drain(std::string &output) {
+        uint64_t tail = m_tail.load(std::memory_order_relaxed);
+        const uint64_t head = m_head.load(std::memory_order_acquire);
+        while (tail != head) {
+            uint32_t length;
+            copy_out(tail, &length, sizeof(length));
+            const auto size = output.size();
+            output.resize(size + length);
+            copy_out(tail + sizeof(length), output.data() + size, length);
+            tail += sizeof(length) + length;
         }
+        m_tail.store(tail, std::memory_order_release);
     }
-    return buf;
-}
 
-static void log_format(const char *type, const char *format, va_list &args) {
-    const auto m_format = std::string(get_time()) + " " + type + ": " + format + "\n";
+    // More than half full, worth waking the consumer up early
+    [[nodiscard]] bool is_filling_up() const {
+        return m_head.load(std::memory_order_relaxed) - m_tail.load(std::memory_order_relaxed) > CAPACITY / 2;
+    }
 
-    vprintf(m_format.c_str(), args);
-}
+    [[nodiscard]] bool empty() const {
+        return m_tail.load(std::memory_order_acquire) == m_head.load(std::memory_order_acquire);
+    }
+};
 
+/// Asynchronous logger. Every thread formats into its own LogRing, a background thread collects
+/// the rings and writes them to stdout in batches, so logging never waits for the terminal.
+/// A thread that outruns the flusher loses messages instead of blocking; they are counted and
+/// reported. Whatever is buffered is written at exit.
 class Logger {
-    Logger() = default;
+    static constexpr size_t MAX_RECORD_SIZE = 1024;
+    static constexpr auto FLUSH_INTERVAL = std::chrono::milliseconds(10);
+
+    std::mutex m_mutex{};
+    std::condition_variable m_condition{};
+    std::vector<std::shared_ptr<LogRing>> m_rings{};
+    std::thread m_flusher{};
+    bool m_is_stopped = false;
+    std::atomic<bool> m_is_nudged{false};
+    std::atomic<uint64_t> m_dropped{0};
+
+    Logger() {
+        m_flusher = std::thread([this]() {
+            flush_loop();
+        });
+    }
 
     ~Logger() = default;
 
+    // Holds a thread's ring, marks it orphaned when the thread exits.
+    struct RingHandle {
+        std::shared_ptr<LogRing> ring = std::make_shared<LogRing>();
+
+        ~RingHandle() {
+            ring->is_orphaned = true;
+        }
+    };
+
+    LogRing &get_ring() {
+        thread_local RingHandle handle{};
+        thread_local bool is_registered = false;
+        if (!is_registered) {
+            is_registered = true;
+            std::lock_guard lock(m_mutex);
+            m_rings.emplace_back(handle.ring);
+        }
+        return *handle.ring;
+    }
+
+    // "Mon Oct 19 12:47:14 2026", formatted once per second and thread
+    static const char *get_time() {
+        thread_local char buffer[32]{};
+        thread_local std::time_t cached_second = -1;
+        const std::time_t now = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
+        if (now != cached_second) {
+            cached_second = now;
+            std::tm local{};
+            localtime_r(&now, &local);
+            strftime(buffer, sizeof(buffer), "%a %b %e %H:%M:%S %Y", &local);
+        }
+        return buffer;
+    }
+
+    void push(const char *text, const size_t length) {
+        auto &ring = get_ring();
+        if (!ring.push(text, static_cast<uint32_t>(length))) {
+            m_dropped.fetch_add(1, std::memory_order_relaxed);
+        }
+        // Without taking the lock: at worst the flusher wakes up at its next interval
+        if (ring.is_filling_up() && !m_is_nudged.exchange(true, std::memory_order_relaxed)) {
+            m_condition.notify_one();
+        }
+    }
+
+    void log_format(const char *type, const char *format, va_list args) {
+        char record[MAX_RECORD_SIZE];
+        int length = snprintf(record, sizeof(record), "%s %s: ", get_time(), type);
+        const int text_length = vsnprintf(record + length, sizeof(record) - length - 1, format, args);
+        if (text_length > 0) {
+            length += std::min(text_length, static_cast<int>(sizeof(record)) - length - 2);
+        }
+        record[length++] = '\n';
+        push(record, length);
+    }
+
+    // Collect every ring into one buffer, drop the rings of finished threads.
+    void collect(std::string &output) {
+        std::lock_guard lock(m_mutex);
+        for (size_t i = 0; i < m_rings.size();) {
+            const bool is_orphaned = m_rings[i]->is_orphaned;
+            m_rings[i]->drain(output);
+            if (is_orphaned && m_rings[i]->empty()) {
+                m_rings[i] = m_rings.back();
+                m_rings.pop_back();
+                continue;
+            }
+            i++;
+        }
+        const auto dropped = m_dropped.exchange(0, std::memory_order_relaxed);
+        if (dropped > 0) {
+            output += "Logger dropped " + std::to_string(dropped) + " messages\n";
+        }
+    }
+
+    static void write_out(const std::string &output) {
+        if (output.empty()) return;
+        fwrite(output.data(), 1, output.size(), stdout);
+        fflush(stdout);
+    }
+
+    void flush_loop() {
+#ifdef LINUX
+        // Signals are for the server threads, which may wait for them on a signalfd
+        sigset_t mask;
+        sigfillset(&mask);
+        pthread_sigmask(SIG_BLOCK, &mask, nullptr);
+#endif
+        std::string output;
+        while (true) {
+            {
+                std::unique_lock lock(m_mutex);
+                m_condition.wait_for(lock, FLUSH_INTERVAL, [this]() {
+                    return m_is_stopped || m_is_nudged.load(std::memory_order_relaxed);
+                });
+                if (m_is_stopped) return;
+            }
+            m_is_nudged.store(false, std::memory_order_relaxed);
+            output.clear();
+            collect(output);
+            write_out(output);
+        }
+    }
+
+    // Runs at exit: stop the flusher and write what is left
+    static void shutdown() {
+        auto *logger = get_logger();
+        {
+            std::lock_guard lock(logger->m_mutex);
+            logger->m_is_stopped = true;
+        }
+        logger->m_condition.notify_one();
+        if (logger->m_flusher.joinable()) logger->m_flusher.join();
+        std::string output;
+        logger->collect(output);
+        write_out(output);
+    }
+
 public:
-    void error(const char *format, ...) {
+    template<LogLevel Level>
+    static constexpr bool is_enabled() {
+        return static_cast<int>(Level) >= WEBSERVER_LOG_LEVEL;
+    }
+
+    void debug(const char *format, ...) {
+        if constexpr (!is_enabled<LogLevel::DEBUG>()) return;
         va_list args;
         va_start(args, format);
-        log_format("Error", format, args);
+        log_format("Debug", format, args);
         va_end(args);
     }
 
     void info(const char *format, ...) {
+        if constexpr (!is_enabled<LogLevel::INFO>()) return;
         va_list args;
         va_start(args, format);
         log_format("Info", format, args);
         va_end(args);
     }
 
-    void log(const char *format) {
-        std::cout << format;
+    void warn(const char *format, ...) {
+        if constexpr (!is_enabled<LogLevel::WARN>()) return;
+        va_list args;
+        va_start(args, format);
+        log_format("Warn", format, args);
+        va_end(args);
     }
 
-    static Logger *get_logger() {
-        static Logger *instance = nullptr;
-        if (!instance) {
-            instance = new Logger();
+    void error(const char *format, ...) {
+        if constexpr (!is_enabled<LogLevel::ERROR>()) return;
+        va_list args;
+        va_start(args, format);
+        log_format("Error", format, args);
+        va_end(args);
+    }
+
+    // Raw text, longer messages are split over several records
+    void log(const char *text) {
+        size_t length = strlen(text);
+        while (length > 0) {
+            const size_t part = std::min(length, MAX_RECORD_SIZE);
+            push(text, part);
+            text += part;
+            length -= part;
         }
+    }
+
+    static Logger *get_logger() {
+        // Never destroyed, threads may still log while static objects are torn down.
+        static Logger *instance = []() {
+            auto *logger = new Logger();
+            std::atexit(shutdown);
+            return logger;
+        }();
         return instance;
     }
 };
@@ -0,0 +1,155 @@
+//
+// Created by Haotian on 2026/10/19.
+//
+
+#ifndef BROADCASTER_H
+#define BROADCASTER_H
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "TcpServer.h"
+#include "../common/Metrics.h"
+
+/// What happens to a subscriber that does not keep up, see Broadcaster
+struct BroadcastConfig {
+    enum class SlowSubscriber {
+        // Skip messages until it has caught up
+        DROP,
+        // Close the connection
+        DISCONNECT
+    };
+
+    // A subscriber with more than this queued and not sent yet is slow
+    int64_t max_queued_bytes = 1024 * 1024;
+    SlowSubscriber slow_subscriber = SlowSubscriber::DROP;
+};
+
+/// Topic based fan-out of one message to many connections. A message is encoded once, for the
+/// protocol its subscribers speak (WebSocket::make_frame(), an SSE event), and every subscriber
+/// queues a reference to the same bytes.
+///
+/// Subscriptions are sharded by I/O thread and only touched on their own thread: publish() posts
+/// the message once to every I/O thread, each of which walks its own subscribers of the topic.
+/// Subscribers are dropped once their connection has closed.
+class Broadcaster {
+    using Subscribers = std::vector<ConnectionHandle>;
+
+    // Subscriptions of the connections of one I/O thread
+    struct Shard {
+        std::unordered_map<std::string, Subscribers> topics{};
+    };
+
+    TcpServer &m_server;
+    BroadcastConfig m_config{};
+    std::once_flag m_shards_once{};
+    std::vector<Shard> m_shards{};
+
+    bool ensure_shards() {
+        const int threads = m_server.get_io_thread_count();
+        if (threads == 0) return false;
+        std::call_once(m_shards_once, [this, threads] { m_shards.resize(threads); });
+        return true;
+    }
+
+    void fan_out(Shard &shard, const std::string &topic, const SendBuffer &message, Subscribers &touched) const {
+        const auto it = shard.topics.find(topic);
+        if (it == shard.topics.end()) return;
+        Subscribers &subscribers = it->second;
+        int64_t deliveries = 0, drops = 0, disconnects = 0;
+        for (size_t i = 0; i < subscribers.size();) {
+            const ConnectionHandle &handle = subscribers[i];
+            AsyncSocket *socket = handle.socket;
+            // Gone, or on its way out: swap the last one in
+            if (socket->connection_id != handle.id || socket->is_closed() || socket->is_read_closed()) {
+                subscribers[i] = subscribers.back();
+                subscribers.pop_back();
+                continue;
+            }
+            if (socket->queued_bytes > m_config.max_queued_bytes) {
+                if (m_config.slow_subscriber == BroadcastConfig::SlowSubscriber::DISCONNECT) {
+                    socket->async_close();
+                    touched.emplace_back(handle);
+                    disconnects++;
+                } else {
+                    drops++;
+                }
+                i++;
+                continue;
+            }
+            socket->async_send(message);
+            touched.emplace_back(handle);
+            deliveries++;
+            i++;
+        }
+        if (subscribers.empty()) shard.topics.erase(it);
+
+        auto *metrics = Metrics::get_metrics();
+        if (deliveries > 0) metrics->add(Counter::BROADCAST_DELIVERIES, deliveries);
+        if (drops > 0) metrics->add(Counter::BROADCAST_DROPS, drops);
+        if (disconnects > 0) metrics->add(Counter::BROADCAST_DISCONNECTS, disconnects);
+    }
+
+public:
+    explicit Broadcaster(TcpServer &server)
+        : m_server(server) {
+    }
+
+    Broadcaster(const Broadcaster &other) = delete;
+
+    Broadcaster &operator=(const Broadcaster &other) = delete;
+
+    /// Call before start_server()
+    void set_config(const BroadcastConfig &config) {
+        m_config = config;
+    }
+
+    /// Add a connection to topic, from any thread once the server runs. Subscribing twice delivers twice.
+    bool subscribe(const ConnectionHandle &handle, const std::string &topic) {
+        if (!ensure_shards()) return false;
+        return m_server.post(handle, [this, topic](AsyncSocket *socket) {
+            m_shards[socket->io_thread].topics[topic].emplace_back(socket);
+        });
+    }
+
+    /// Remove a connection from topic, from any thread. Closing the connection does it too.
+    bool unsubscribe(const ConnectionHandle &handle, const std::string &topic) {
+        if (!ensure_shards()) return false;
+        return m_server.post(handle, [this, topic, id = handle.id](AsyncSocket *socket) {
+            auto &topics = m_shards[socket->io_thread].topics;
+            const auto it = topics.find(topic);
+            if (it == topics.end()) return;
+            auto &subscribers = it->second;
+            for (size_t i = 0; i < subscribers.size(); i++) {
+                if (subscribers[i].socket == socket && subscribers[i].id == id) {
+                    subscribers[i] = subscribers.back();
+                    subscribers.pop_back();
+                    break;
+                }
+            }
+            if (subscribers.empty()) topics.erase(it);
+        });
+    }
+
+    /// Queue message on every subscriber of topic, from any thread. Returns once the message has
+    /// been handed to the I/O threads, false if that failed for one of them.
+    bool publish(const std::string &topic, const SendBuffer &message) {
+        if (!ensure_shards()) return false;
+        bool is_successful = true;
+        for (int thread = 0; thread < static_cast<int>(m_shards.size()); thread++) {
+            is_successful &= m_server.post(thread, [this, thread, topic, message](Subscribers &touched) {
+                fan_out(m_shards[thread], topic, message, touched);
+            });
+        }
+        return is_successful;
+    }
+
+    bool publish(const std::string &topic, const std::shared_ptr<const std::string> &message) {
+        return publish(topic, SendBuffer(message, message->data(), static_cast<ssize_t>(message->size())));
+    }
+};
+
+#endif //BROADCASTER_H
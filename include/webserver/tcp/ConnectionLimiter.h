@@ -0,0 +1,90 @@
+//
+// Created by Haotian on 2026/10/19.
+//
+
+#ifndef CONNECTION_LIMITER_H
+#define CONNECTION_LIMITER_H
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <unordered_map>
+
+/// Concurrent connection limits (limit_conn), 0 means unlimited.
+struct ConnectionLimits {
+    // Connections open at the same time over all clients
+    int64_t max_connections = 0;
+    // Connections open at the same time from one client address
+    int64_t max_connections_per_ip = 0;
+};
+
+/// Counts open connections globally and per client address. The acceptor asks for a slot before a
+/// connection is handed to an I/O thread, and the I/O thread gives it back when the connection closes.
+/// Per-address counters are split over shards with their own lock, so the I/O threads releasing
+/// connections rarely meet on the same lock. Limits must be set before the server starts.
+class ConnectionLimiter {
+    static constexpr int SHARD_BITS = 6;
+    static constexpr int SHARD_COUNT = 1 << SHARD_BITS;
+
+    // Padded to a cache line, so neighbouring shards do not invalidate each other
+    struct alignas(64) Shard {
+        std::mutex mutex{};
+        // Only addresses with at least one open connection are present
+        std::unordered_map<uint32_t, int64_t> counts{};
+    };
+
+    ConnectionLimits m_limits{};
+    Shard m_shards[SHARD_COUNT]{};
+    std::atomic<int64_t> m_total{0};
+
+    Shard &get_shard(const uint32_t address) {
+        // Fibonacci hashing, the high bits of the product are well mixed
+        return m_shards[(address * 2654435761u) >> (32 - SHARD_BITS)];
+    }
+
+public:
+    void set_limits(const ConnectionLimits &limits) {
+        m_limits = limits;
+    }
+
+    /// Take a slot for a new connection from address (network byte order).
+    /// @return false if a limit is reached, the connection should be closed right away. Refusals are
+    ///         counted by the caller, as Counter::CONNECTIONS_REJECTED.
+    bool try_acquire(const uint32_t address) {
+        const auto total = m_total.fetch_add(1, std::memory_order_relaxed);
+        if (m_limits.max_connections > 0 && total >= m_limits.max_connections) {
+            m_total.fetch_sub(1, std::memory_order_relaxed);
+            return false;
+        }
+        if (m_limits.max_connections_per_ip > 0) {
+            auto &shard = get_shard(address);
+            std::lock_guard lock(shard.mutex);
+            auto &count = shard.counts[address];
+            if (count >= m_limits.max_connections_per_ip) {
+                m_total.fetch_sub(1, std::memory_order_relaxed);
+                return false;
+            }
+            count++;
+        }
+        return true;
+    }
+
+    /// Give back the slot of a connection accepted by try_acquire
+    void release(const uint32_t address) {
+        m_total.fetch_sub(1, std::memory_order_relaxed);
+        if (m_limits.max_connections_per_ip > 0) {
+            auto &shard = get_shard(address);
+            std::lock_guard lock(shard.mutex);
+            const auto it = shard.counts.find(address);
+            if (it != shard.counts.end() && --it->second <= 0) {
+                shard.counts.erase(it);
+            }
+        }
+    }
+
+    [[nodiscard]] int64_t get_connection_count() const {
+        return m_total.load(std::memory_order_relaxed);
+    }
+};
+
+#endif //CONNECTION_LIMITER_H
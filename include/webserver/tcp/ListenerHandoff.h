@@ -0,0 +1,247 @@
+//
+// Created by Haotian on 2026/10/19.
+//
+
+#ifndef LISTENER_HANDOFF_H
+#define LISTENER_HANDOFF_H
+
+#include "../common/Predefined.h"
+
+#ifdef LINUX
+
+#include <cerrno>
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+extern char **environ;
+
+/// Passing the listening socket from a running server to its successor, so a new binary can take
+/// over without refusing a single connection (nginx style). Both processes accept on the same
+/// socket for a moment, then the old one stops accepting and drains.
+///
+/// Two ways to get the socket across:
+/// - spawn_successor() forks and execs this binary with the socket at LISTEN_FD_ENV. Once the new
+///   process is serving, it sends SIGTERM to PARENT_PID_ENV, which makes the old one drain.
+/// - A server started on its own connects to the handoff path of the running one, named by
+///   HANDOFF_PATH_ENV, and receives the socket as SCM_RIGHTS. The old one drains as soon as the
+///   socket is sent.
+class ListenerHandoff {
+public:
+    static constexpr auto LISTEN_FD_ENV = "WEBSERVER_LISTEN_FD";
+    static constexpr auto PARENT_PID_ENV = "WEBSERVER_PARENT_PID";
+    static constexpr auto HANDOFF_PATH_ENV = "WEBSERVER_HANDOFF_PATH";
+
+private:
+    // Descriptor the successor finds the socket at
+    static constexpr int SUCCESSOR_FD = 3;
+
+    static bool is_listening_socket(const int fd) {
+        int accepting = 0;
+        socklen_t length = sizeof(accepting);
+        return getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &accepting, &length) == 0 && accepting != 0;
+    }
+
+    static bool make_address(const std::string &path, sockaddr_un &address) {
+        if (path.empty() || path.size() >= sizeof(address.sun_path)) return false;
+        address = {};
+        address.sun_family = AF_UNIX;
+        memcpy(address.sun_path, path.c_str(), path.size());
+        return true;
+    }
+
+    static std::vector<std::string> read_command_line() {
+        std::ifstream stream("/proc/self/cmdline", std::ios::binary);
+        std::vector<std::string> arguments;
+        std::string argument;
+        while (std::getline(stream, argument, '\0')) {
+            arguments.emplace_back(std::move(argument));
+        }
+        return arguments;
+    }
+
+    // Path of the binary on disk. When a deploy has replaced it, /proc/self/exe still points at the
+    // old (deleted) file, so exec the path rather than the link.
+    static std::string read_executable_path() {
+        char path[4096];
+        const auto length = readlink("/proc/self/exe", path, sizeof(path) - 1);
+        if (length <= 0) return {};
+        std::string result(path, length);
+        constexpr std::string_view deleted = " (deleted)";
+        if (result.size() > deleted.size() && result.compare(result.size() - deleted.size(), deleted.size(), deleted) == 0) {
+            result.resize(result.size() - deleted.size());
+        }
+        return result;
+    }
+
+public:
+    /// The listening socket this process was started with, either inherited at LISTEN_FD_ENV or
+    /// received from the server at HANDOFF_PATH_ENV. The variables are cleared so that they do not
+    /// leak into processes started later.
+    /// @return the socket, -1 if there is none
+    static int take_inherited() {
+        int fd = -1;
+        if (const char *value = getenv(LISTEN_FD_ENV)) {
+            fd = static_cast<int>(strtol(value, nullptr, 10));
+            if (fd <= 2 || !is_listening_socket(fd)) fd = -1;
+            if (fd != -1) fcntl(fd, F_SETFD, FD_CLOEXEC);
+            unsetenv(LISTEN_FD_ENV);
+        } else if (const char *path = getenv(HANDOFF_PATH_ENV)) {
+            fd = receive(path);
+            unsetenv(HANDOFF_PATH_ENV);
+        }
+        return fd;
+    }
+
+    /// Tell the process that spawned this one that the socket is being served here now.
+    static void notify_parent() {
+        const char *value = getenv(PARENT_PID_ENV);
+        if (value == nullptr) return;
+        const auto pid = static_cast<pid_t>(strtol(value, nullptr, 10));
+        unsetenv(PARENT_PID_ENV);
+        if (pid > 1 && pid == getppid()) kill(pid, SIGTERM);
+    }
+
+    /// Start the binary at the path of this one again with the same arguments, handing over listen_fd.
+    /// @return pid of the new process, -1 on failure
+    static pid_t spawn_successor(const int listen_fd) {
+        // Everything exec needs is built before fork: the child of a threaded process may only
+        // call async-signal-safe functions.
+        const auto executable = read_executable_path();
+        const auto arguments = read_command_line();
+        if (executable.empty() || arguments.empty()) return -1;
+        std::vector<char *> argv;
+        for (const auto &argument: arguments) argv.emplace_back(const_cast<char *>(argument.c_str()));
+        argv.emplace_back(nullptr);
+
+        const std::string fd_entry = std::string(LISTEN_FD_ENV) + "=" + std::to_string(SUCCESSOR_FD);
+        const std::string pid_entry = std::string(PARENT_PID_ENV) + "=" + std::to_string(getpid());
+        std::vector<char *> envp;
+        for (char **entry = environ; *entry != nullptr; entry++) {
+            const std::string_view view(*entry);
+            if (view.rfind(LISTEN_FD_ENV, 0) == 0 || view.rfind(PARENT_PID_ENV, 0) == 0 ||
+                view.rfind(HANDOFF_PATH_ENV, 0) == 0) {
+                continue;
+            }
+            envp.emplace_back(*entry);
+        }
+        envp.emplace_back(const_cast<char *>(fd_entry.c_str()));
+        envp.emplace_back(const_cast<char *>(pid_entry.c_str()));
+        envp.emplace_back(nullptr);
+
+        const pid_t pid = fork();
+        if (pid != 0) return pid;
+
+        // Child: only the listening socket may survive exec, client sockets and epoll
+        // descriptors of the old process must not be kept open by the new one.
+        sigset_t mask;
+        sigemptyset(&mask);
+        sigprocmask(SIG_SETMASK, &mask, nullptr);
+        if (listen_fd != SUCCESSOR_FD && dup2(listen_fd, SUCCESSOR_FD) == -1) _exit(127);
+        fcntl(SUCCESSOR_FD, F_SETFD, 0);
+#ifdef SYS_close_range
+        if (syscall(SYS_close_range, SUCCESSOR_FD + 1, ~0u, 0) != 0)
+#endif
+        {
+            const long max_fd = sysconf(_SC_OPEN_MAX);
+            for (long fd = SUCCESSOR_FD + 1; fd < max_fd; fd++) close(static_cast<int>(fd));
+        }
+        execve(executable.c_str(), argv.data(), envp.data());
+        _exit(127);
+    }
+
+    /// Listen for successors on a UNIX socket at path, replacing a stale socket file.
+    /// @return the socket, -1 on failure
+    static int listen_at(const std::string &path) {
+        sockaddr_un address{};
+        if (!make_address(path, address)) return -1;
+        const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd == -1) return -1;
+        unlink(path.c_str());
+        if (bind(fd, reinterpret_cast<sockaddr *>(&address), sizeof(address)) == -1 || listen(fd, 1) == -1) {
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    /// Send listen_fd over a connection accepted from listen_at().
+    static bool send(const int connection, const int listen_fd) {
+        char payload = 'L';
+        iovec io{&payload, 1};
+        alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))]{};
+        msghdr message{};
+        message.msg_iov = &io;
+        message.msg_iovlen = 1;
+        message.msg_control = control;
+        message.msg_controllen = sizeof(control);
+        cmsghdr *header = CMSG_FIRSTHDR(&message);
+        header->cmsg_level = SOL_SOCKET;
+        header->cmsg_type = SCM_RIGHTS;
+        header->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(header), &listen_fd, sizeof(int));
+        ssize_t ret;
+        do {
+            ret = sendmsg(connection, &message, MSG_NOSIGNAL);
+        } while (ret == -1 && errno == EINTR);
+        return ret == 1;
+    }
+
+    /// Ask the server listening at path for its socket. Returns once the sender has closed the
+    /// connection, by then it no longer owns path and this process may listen there itself.
+    /// @return the socket, -1 on failure
+    static int receive(const std::string &path) {
+        sockaddr_un address{};
+        if (!make_address(path, address)) return -1;
+        const int connection = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (connection == -1) return -1;
+        if (connect(connection, reinterpret_cast<sockaddr *>(&address), sizeof(address)) == -1) {
+            close(connection);
+            return -1;
+        }
+
+        char payload = 0;
+        iovec io{&payload, 1};
+        alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))]{};
+        msghdr message{};
+        message.msg_iov = &io;
+        message.msg_iovlen = 1;
+        message.msg_control = control;
+        message.msg_controllen = sizeof(control);
+        ssize_t ret;
+        do {
+            ret = recvmsg(connection, &message, MSG_CMSG_CLOEXEC);
+        } while (ret == -1 && errno == EINTR);
+
+        int fd = -1;
+        const cmsghdr *header = ret == 1 ? CMSG_FIRSTHDR(&message) : nullptr;
+        if (header != nullptr && header->cmsg_level == SOL_SOCKET && header->cmsg_type == SCM_RIGHTS) {
+            memcpy(&fd, CMSG_DATA(header), sizeof(int));
+        }
+        // Wait for the sender to let go of path
+        while (true) {
+            ret = recv(connection, &payload, 1, 0);
+            if (ret == 0 || (ret < 0 && errno != EINTR)) break;
+        }
+        close(connection);
+        if (fd != -1 && !is_listening_socket(fd)) {
+            close(fd);
+            fd = -1;
+        }
+        return fd;
+    }
+};
+
+#endif
+
+#endif //LISTENER_HANDOFF_H
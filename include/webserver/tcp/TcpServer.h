@@ -21,13 +21,15 @@ typedef int socket_type;
 typedef socklen_t socket_len_type;
 #endif
 
+#include <atomic>
 #include <memory>
 #include <sstream>
 #include <cstring>
+#include <thread>
 #include "../log/Logger.h"
 
 class TcpServer {
-    // Only for test
+    // Listen backlog and default limit of concurrent connections
     static constexpr int MAX_CONNECTIONS = 20000;
     static constexpr size_t BUFFER_SIZE = 30720;
 
@@ -47,8 +49,26 @@ class TcpServer {
 
     // Send, Receive Callback
     ConnectionBehavior m_behavior{};
-
-    bool m_is_shutdown = false;
+    ConnectionTimeouts m_timeouts{};
+    ConnectionLimits m_connection_limits{MAX_CONNECTIONS, 0};
+    ThreadTopology m_thread_topology{};
+    std::shared_ptr<TlsContext> m_tls{};
+
+    // Set by close_server(), read by the I/O threads through is_stopping()
+    std::atomic<bool> m_is_shutdown{false};
+    bool m_handle_signals = false;
+
+    // Hot upgrade
+    bool m_hot_upgrade = false;
+    // Whether m_listen_socket came from the previous process
+    bool m_is_inherited = false;
+    std::string m_handoff_path{};
+    socket_type m_handoff_socket = -1;
+    std::thread m_handoff_thread{};
+#ifdef LINUX
+    // The binary spawn_successor() started, until it has been reaped. -1 if there is none.
+    pid_t m_successor_pid = -1;
+#endif
 
     // Create sockets, bind port, and more
     void setup();
@@ -57,16 +77,72 @@ class TcpServer {
 
     void exit_with_error(const std::string &message) const;
 
+    // Start the next binary with the listening socket, it tells this process to drain once it runs.
+    // Ignored while the one started before is still alive.
+    void spawn_successor();
+
+    // Collect the exit status of the successor once it has ended, so it does not linger as a zombie
+    void reap_successor();
+
+    // Listen on m_handoff_path and give the listening socket to the first process that asks
+    void start_handoff();
+
+    void handoff_loop();
+
+    void stop_handoff();
+
 public:
     explicit TcpServer(std::string &&ip_address = "0.0.0.0", int ip_port = 8080);
 
     // Bind callback
     void set_callback(const ConnectionBehavior &behavior);
 
+    void set_timeouts(const ConnectionTimeouts &timeouts);
+
+    // Defaults to MAX_CONNECTIONS in total and no limit per client address
+    void set_connection_limits(const ConnectionLimits &limits);
+
+    // Defaults to one unpinned I/O thread per CPU
+    void set_thread_topology(const ThreadTopology &topology);
+
+    // Speak TLS on the listener. False, with the reason logged, if the certificate or key cannot
+    // be loaded or the server was built without OpenSSL.
+    bool enable_tls(const TlsConfig &config);
+
+    // SIGTERM/SIGINT start a graceful shutdown, the second one forces it
+    void enable_signal_handling();
+
+    // Zero-downtime deploys: SIGUSR2 starts this binary again, and a server started with
+    // WEBSERVER_HANDOFF_PATH set asks handoff_path for the socket (Linux only). Either way the new
+    // process inherits the listening socket and the old one drains, so this enables signal handling.
+    void enable_hot_upgrade(const std::string &handoff_path = "");
+
     int start_server();
 
+    // Stop accepting and let in-flight requests finish within ConnectionTimeouts::drain
     void close_server();
 
+    [[nodiscard]] bool is_stopping() const;
+
+    // Run task on the I/O thread of a connection, see Multiplexing::post(). Callable from any thread.
+    bool post(const ConnectionHandle &handle, std::function<void(AsyncSocket *)> &&task);
+
+    // Queue data on a connection from any thread: right away from its own callbacks, through post() otherwise.
+    // False if the connection is known to be gone.
+    bool send(const ConnectionHandle &handle, const SendBuffer &data);
+
+    // Run task on I/O thread io_thread, see Multiplexing::post(). Callable from any thread.
+    bool post(int io_thread, ThreadTask &&task);
+
+    // Open an outgoing connection served by io_thread, see Multiplexing::connect(). Only on that thread.
+    AsyncSocket *connect(int io_thread, const sockaddr_in &address, const OutboundBehavior *behavior);
+
+    // Serve a connection again soon, see Multiplexing::wake(). Callable from any thread.
+    bool wake(const ConnectionHandle &handle);
+
+    // 0 until the server has started
+    [[nodiscard]] int get_io_thread_count() const;
+
     // Only for test
     void accept_connection();
 };
@@ -0,0 +1,96 @@
+//
+// Created by Haotian on 2026/10/19.
+//
+
+#ifndef THREAD_TOPOLOGY_H
+#define THREAD_TOPOLOGY_H
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../common/Predefined.h"
+
+#ifdef LINUX
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+/// How many I/O threads serve connections and where they run.
+///
+/// With pin_threads, I/O thread i is bound to cpus[i % cpus.size()] and the acceptor to
+/// acceptor_cpu. Each thread allocates its epoll events, receive buffer, arena and header buffers
+/// itself once it is bound, so under the default first-touch policy they land on the NUMA node of
+/// that CPU. To keep a server on one node, take its CPUs from cpus_of_node().
+struct ThreadTopology {
+    // I/O threads, 0 for one per CPU the process may run on
+    int io_threads = 0;
+    // epoll events taken per wakeup by each thread
+    int events_per_wait = 3000;
+    bool pin_threads = false;
+    // CPUs to pin to, in order. Empty for every CPU the process may run on.
+    std::vector<int> cpus{};
+    // CPU of the acceptor, -1 for the first of cpus. The acceptor is the thread calling start_server().
+    int acceptor_cpu = -1;
+
+    /// CPUs the process may run on (its affinity mask, so taskset and cpusets are respected)
+    static std::vector<int> allowed_cpus() {
+        std::vector<int> cpus{};
+#ifdef LINUX
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+            for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+                if (CPU_ISSET(cpu, &set)) cpus.emplace_back(cpu);
+            }
+        }
+#endif
+        if (cpus.empty()) {
+            const int count = static_cast<int>(std::max(1u, std::thread::hardware_concurrency()));
+            for (int cpu = 0; cpu < count; cpu++) cpus.emplace_back(cpu);
+        }
+        return cpus;
+    }
+
+    /// CPUs of a NUMA node as the kernel lists them, e.g. "0-3,8-11". Empty if there is no such node.
+    static std::vector<int> cpus_of_node(const int node) {
+        std::vector<int> cpus{};
+#ifdef LINUX
+        const std::string path = "/sys/devices/system/node/node" + std::to_string(node) + "/cpulist";
+        FILE *file = fopen(path.c_str(), "r");
+        if (file == nullptr) return cpus;
+        char list[4096]{};
+        const bool has_list = fgets(list, sizeof(list), file) != nullptr;
+        fclose(file);
+        if (!has_list) return cpus;
+        char *p = list;
+        while (*p >= '0' && *p <= '9') {
+            const int first = static_cast<int>(strtol(p, &p, 10));
+            int last = first;
+            if (*p == '-') last = static_cast<int>(strtol(p + 1, &p, 10));
+            for (int cpu = first; cpu <= last; cpu++) cpus.emplace_back(cpu);
+            if (*p == ',') p++;
+        }
+#endif
+        return cpus;
+    }
+
+    /// Bind the calling thread to one CPU.
+    /// @return false if the CPU does not exist or is outside of the affinity mask of the process
+    static bool pin_current_thread(const int cpu) {
+#ifdef LINUX
+        if (cpu < 0 || cpu >= CPU_SETSIZE) return false;
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+        return false;
+#endif
+    }
+};
+
+#endif //THREAD_TOPOLOGY_H
@@ -0,0 +1,245 @@
+//
+// Created by Haotian on 2026/10/19.
+//
+
+#ifndef TLS_CONTEXT_H
+#define TLS_CONTEXT_H
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <string>
+#include <vector>
+
+#include "../common/Predefined.h"
+#include "../log/Logger.h"
+
+#ifdef WEBSERVER_TLS
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <unistd.h>
+#endif
+
+/// Certificate and session handling of a TLS listener, see TcpServer::enable_tls()
+struct TlsConfig {
+    // PEM files. The certificate file may carry the chain after the server certificate.
+    std::string certificate_file{};
+    std::string private_key_file{};
+    // Sessions kept for resumption by session id, 0 turns the cache off
+    long session_cache_size = 20480;
+    // Seconds a session can be resumed for
+    long session_timeout = 300;
+    // Resumption with session tickets, which keeps no state on the server
+    bool session_tickets = true;
+    // Hand the keys to the kernel after the handshake (kTLS), so files still go out with sendfile.
+    // Needs the tls module and a cipher the kernel supports, OpenSSL encrypts whenever it is not there.
+    bool ktls = true;
+    // Protocols offered with ALPN, most preferred first. Empty skips ALPN.
+    std::vector<std::string> alpn_protocols{};
+};
+
+#ifdef WEBSERVER_TLS
+using TlsSession = SSL;
+#else
+using TlsSession = void;
+#endif
+
+/// The SSL_CTX of a listener: certificate, session cache and ticket keys, shared by every I/O thread.
+/// The static functions drive a TlsSession on a non-blocking socket with the conventions of
+/// recv() and send(): -1 with errno EAGAIN while it waits for the socket.
+class TlsContext {
+#ifdef WEBSERVER_TLS
+    // Largest chunk of a file encrypted at once when the kernel does not do it
+    static constexpr size_t FILE_CHUNK_SIZE = 16384;
+
+    SSL_CTX *m_context = nullptr;
+    // ALPN protocols in wire format, each prefixed by its length
+    std::string m_alpn{};
+
+    static void log_errors(const char *what) {
+        char message[256];
+        unsigned long error;
+        while ((error = ERR_get_error()) != 0) {
+            ERR_error_string_n(error, message, sizeof(message));
+            Logger::get_logger()->error("%s: %s", what, message);
+        }
+    }
+
+    static int select_alpn(SSL *, const unsigned char **out, unsigned char *out_length, const unsigned char *in,
+                           const unsigned int in_length, void *arg) {
+        const auto *self = static_cast<const TlsContext *>(arg);
+        unsigned char *selected = nullptr;
+        if (SSL_select_next_proto(&selected, out_length, reinterpret_cast<const unsigned char *>(self->m_alpn.data()),
+                                  static_cast<unsigned int>(self->m_alpn.size()), in, in_length)
+            != OPENSSL_NPN_NEGOTIATED) {
+            return SSL_TLSEXT_ERR_NOACK;
+        }
+        *out = selected;
+        return SSL_TLSEXT_ERR_OK;
+    }
+
+    // Turn the result of a failed call into errno. 0 when the peer has closed the connection.
+    static ssize_t to_errno(SSL *session, const int ret) {
+        const int error = SSL_get_error(session, ret);
+        if (error == SSL_ERROR_WANT_READ || error == SSL_ERROR_WANT_WRITE) {
+            errno = EAGAIN;
+            return -1;
+        }
+        if (error == SSL_ERROR_ZERO_RETURN) return 0;
+        // The system call failed, errno already tells why; a connection cut without close_notify leaves it 0
+        if (error != SSL_ERROR_SYSCALL || errno == 0) errno = error == SSL_ERROR_SYSCALL ? ECONNRESET : EPROTO;
+        ERR_clear_error();
+        return -1;
+    }
+#endif
+
+public:
+    TlsContext() = default;
+
+    TlsContext(const TlsContext &other) = delete;
+
+    TlsContext &operator=(const TlsContext &other) = delete;
+
+    ~TlsContext() {
+#ifdef WEBSERVER_TLS
+        SSL_CTX_free(m_context);
+#endif
+    }
+
+    /// Load the certificate and key and set up session resumption.
+    /// @return false, with the reason logged, if they cannot be used or TLS is not built in
+    bool load(const TlsConfig &config) {
+#ifdef WEBSERVER_TLS
+        m_context = SSL_CTX_new(TLS_server_method());
+        if (m_context == nullptr) {
+            log_errors("Failed to create the TLS context");
+            return false;
+        }
+        SSL_CTX_set_min_proto_version(m_context, TLS1_2_VERSION);
+        uint64_t options = SSL_OP_NO_RENEGOTIATION | SSL_OP_CIPHER_SERVER_PREFERENCE;
+        if (config.ktls) options |= SSL_OP_ENABLE_KTLS;
+        if (!config.session_tickets) options |= SSL_OP_NO_TICKET;
+        SSL_CTX_set_options(m_context, options);
+        // Writes return once a record is out, and a retry may pass the same bytes from elsewhere
+        // (a file chunk is read again). Idle connections give their buffers back.
+        SSL_CTX_set_mode(m_context, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER
+                                    | SSL_MODE_RELEASE_BUFFERS);
+        if (SSL_CTX_use_certificate_chain_file(m_context, config.certificate_file.c_str()) != 1
+            || SSL_CTX_use_PrivateKey_file(m_context, config.private_key_file.c_str(), SSL_FILETYPE_PEM) != 1
+            || SSL_CTX_check_private_key(m_context) != 1) {
+            log_errors("Failed to load the TLS certificate");
+            return false;
+        }
+
+        static constexpr unsigned char SESSION_ID_CONTEXT[] = "webserver";
+        SSL_CTX_set_session_id_context(m_context, SESSION_ID_CONTEXT, sizeof(SESSION_ID_CONTEXT) - 1);
+        if (config.session_cache_size > 0) {
+            SSL_CTX_set_session_cache_mode(m_context, SSL_SESS_CACHE_SERVER);
+            SSL_CTX_sess_set_cache_size(m_context, config.session_cache_size);
+        } else {
+            SSL_CTX_set_session_cache_mode(m_context, SSL_SESS_CACHE_OFF);
+        }
+        SSL_CTX_set_timeout(m_context, config.session_timeout);
+        // One ticket per handshake is enough for a client to resume
+        if (config.session_tickets) SSL_CTX_set_num_tickets(m_context, 1);
+
+        m_alpn.clear();
+        for (const auto &protocol: config.alpn_protocols) {
+            if (protocol.empty() || protocol.size() > 255) continue;
+            m_alpn += static_cast<char>(protocol.size());
+            m_alpn += protocol;
+        }
+        if (!m_alpn.empty()) SSL_CTX_set_alpn_select_cb(m_context, select_alpn, this);
+        return true;
+#else
+        Logger::get_logger()->error("TLS is not available, the server was built without OpenSSL");
+        return false;
+#endif
+    }
+
+    /// A server session on an accepted socket, nullptr on failure. The handshake runs in handshake().
+    [[nodiscard]] TlsSession *new_session(const int fd) const {
+#ifdef WEBSERVER_TLS
+        SSL *session = SSL_new(m_context);
+        if (session == nullptr) return nullptr;
+        if (SSL_set_fd(session, fd) != 1) {
+            SSL_free(session);
+            return nullptr;
+        }
+        SSL_set_accept_state(session);
+        return session;
+#else
+        return nullptr;
+#endif
+    }
+
+#ifdef WEBSERVER_TLS
+    /// Continue the handshake.
+    /// @return 1 once it is done, 0 while it waits for the socket, -1 if it failed
+    static int handshake(SSL *session) {
+        ERR_clear_error();
+        const int ret = SSL_do_handshake(session);
+        if (ret == 1) return 1;
+        return to_errno(session, ret) < 0 && errno == EAGAIN ? 0 : -1;
+    }
+
+    [[nodiscard]] static bool is_resumed(SSL *session) {
+        return SSL_session_reused(session) == 1;
+    }
+
+    /// Whether the kernel encrypts what is written, so sendfile works on the socket
+    [[nodiscard]] static bool is_ktls_send(SSL *session) {
+        return BIO_get_ktls_send(SSL_get_wbio(session)) > 0;
+    }
+
+    /// Like recv(): bytes read, 0 once the peer has closed, -1 with errno otherwise
+    static ssize_t read(SSL *session, char *data, const size_t size) {
+        ERR_clear_error();
+        const int ret = SSL_read(session, data, static_cast<int>(std::min<size_t>(size, INT_MAX)));
+        if (ret > 0) return ret;
+        return to_errno(session, ret);
+    }
+
+    /// Like send(): bytes written or -1 with errno. After EAGAIN, the same bytes have to be passed again.
+    static ssize_t write(SSL *session, const char *data, const size_t size) {
+        ERR_clear_error();
+        const int ret = SSL_write(session, data, static_cast<int>(std::min<size_t>(size, INT_MAX)));
+        if (ret > 0) return ret;
+        const ssize_t result = to_errno(session, ret);
+        if (result == 0) errno = EPIPE;
+        return -1;
+    }
+
+    /// Like sendfile(). With kTLS the pages go to the kernel as they are, otherwise a chunk at a
+    /// time is read and encrypted by OpenSSL.
+    static ssize_t send_file(SSL *session, const int fd, const int64_t offset, const size_t size) {
+        if (is_ktls_send(session)) {
+            ERR_clear_error();
+            const ossl_ssize_t ret = SSL_sendfile(session, fd, offset, size, 0);
+            if (ret > 0) return ret;
+            if (to_errno(session, static_cast<int>(ret)) == 0) errno = EPIPE;
+            return -1;
+        }
+        thread_local char chunk[FILE_CHUNK_SIZE];
+        const ssize_t length = pread(fd, chunk, std::min(size, FILE_CHUNK_SIZE), offset);
+        if (length <= 0) {
+            // The file has been truncated since it was stat'ed, the rest will never come
+            if (length == 0) errno = EIO;
+            return -1;
+        }
+        return write(session, chunk, length);
+    }
+
+    /// Send close_notify if the connection got that far, and free the session
+    static void close(SSL *session) {
+        if (SSL_is_init_finished(session)) {
+            // Non-blocking: with the socket buffer full, the peer just does not get it
+            SSL_shutdown(session);
+        }
+        ERR_clear_error();
+        SSL_free(session);
+    }
+#endif
+};
+
+#endif //TLS_CONTEXT_H
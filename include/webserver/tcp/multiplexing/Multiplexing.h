@@ -5,6 +5,8 @@
 #ifndef MULTIPLEXING_H
 #define MULTIPLEXING_H
 
+#include <algorithm>
+#include <atomic>
 #include <functional>
 #include <cstdlib>
 #include <cstring>
@@ -13,11 +15,18 @@
 #include "../../common/Predefined.h"
 #include "../../common/SafeQueue.h"
 #include "../../common/SendQueue.h"
+#include "../../common/TimerWheel.h"
+#include "../ConnectionLimiter.h"
+#include "../ThreadTopology.h"
+#include "../TlsContext.h"
 
 #ifdef LINUX
 #include <unistd.h>
 #include <sys/epoll.h>
 #include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
 #define INVALID_SOCKET (-1)
 #endif
 
@@ -79,6 +88,89 @@ struct SocketBuffer {
     }
 };
 
+/// A run of bytes queued for sending. The bytes are kept alive by `owner`, which may be a composed
+/// SocketBuffer, a response body or the pages of a mapped file, so a body is referenced instead of
+/// being copied into SocketBuffers. A file segment has no bytes in memory at all: it names a range
+/// of a descriptor that `owner` keeps open, and is sent with sendfile. A pipe segment is the next
+/// bytes waiting in a pipe (see SplicePipe), sent with splice.
+struct SendBuffer {
+    std::shared_ptr<const void> owner{};
+    const char *data = nullptr;
+    ssize_t size = 0;
+    // How many bytes have been written to the socket. Each queued copy keeps its own progress.
+    ssize_t sent = 0;
+    // Set for a file segment, which starts at file_offset of file_fd; data is unused then
+    int file_fd = -1;
+    int64_t file_offset = 0;
+    // Set for a pipe segment, whose bytes are read from pipe_fd; data is unused then
+    int pipe_fd = -1;
+    // More follows at once: lets a header share its packet with the file segment after it (MSG_MORE)
+    bool more = false;
+
+    SendBuffer() = default;
+
+    SendBuffer(std::shared_ptr<const void> owner, const char *data, const ssize_t size)
+        : owner(std::move(owner)), data(data), size(size) {
+    }
+
+    explicit SendBuffer(const std::shared_ptr<SocketBuffer> &buffer)
+        : owner(buffer), data(buffer->buffer), size(buffer->size) {
+    }
+
+    static SendBuffer from_file(std::shared_ptr<const void> owner, const int fd, const int64_t offset,
+                                const ssize_t size) {
+        SendBuffer buffer(std::move(owner), nullptr, size);
+        buffer.file_fd = fd;
+        buffer.file_offset = offset;
+        return buffer;
+    }
+
+    static SendBuffer from_pipe(std::shared_ptr<const void> owner, const int fd, const ssize_t size) {
+        SendBuffer buffer(std::move(owner), nullptr, size);
+        buffer.pipe_fd = fd;
+        return buffer;
+    }
+
+    [[nodiscard]] bool is_file() const {
+        return file_fd >= 0;
+    }
+
+    [[nodiscard]] bool is_pipe() const {
+        return pipe_fd >= 0;
+    }
+
+    [[nodiscard]] bool is_finished() const {
+        return sent >= size;
+    }
+};
+
+/// Per-connection deadlines in milliseconds, 0 disables one.
+struct ConnectionTimeouts {
+    // From the first byte (or the end of the previous request) until the request header is complete.
+    // Not extended by partial reads, so a client cannot keep the connection by trickling bytes.
+    int64_t header_read = 10000;
+    // Between two reads of a request body
+    int64_t body_read = 30000;
+    // Idle time between two requests on a keep-alive connection
+    int64_t keep_alive = 15000;
+    // Between two writes while a response is waiting for the client to read it
+    int64_t write_stall = 30000;
+    // How long stop() lets in-flight requests finish before every connection is closed
+    int64_t drain = 30000;
+    // Without traffic either way on a connection taken over by a long-lived protocol (WebSocket).
+    // Off by default, such connections may rightly stay quiet for long.
+    int64_t upgraded_idle = 0;
+};
+
+enum class TimeoutKind {
+    NONE,
+    HEADER_READ,
+    BODY_READ,
+    KEEP_ALIVE,
+    WRITE_STALL,
+    UPGRADED_IDLE
+};
+
 #ifdef WINDOWS
 
 // struct WSAHelper {
@@ -88,6 +180,50 @@ struct SocketBuffer {
 
 #endif
 
+struct OutboundBehavior;
+
+#ifdef LINUX
+/// A pipe that bytes of one connection pass through on their way to another with splice(), so they
+/// are never copied to user space. Held by the connection they come from and by every queued pipe
+/// segment, the last of which closes it.
+struct SplicePipe {
+    static constexpr int CAPACITY = 1 << 20;
+
+    int read_fd = -1;
+    int write_fd = -1;
+
+    SplicePipe() {
+        int fds[2];
+        if (pipe2(fds, O_CLOEXEC | O_NONBLOCK) == 0) {
+            read_fd = fds[0];
+            write_fd = fds[1];
+            // Fewer round trips than with the default 64 KiB; the limit of the system may refuse it
+            fcntl(write_fd, F_SETPIPE_SZ, CAPACITY);
+        }
+    }
+
+    SplicePipe(const SplicePipe &other) = delete;
+
+    SplicePipe &operator=(const SplicePipe &other) = delete;
+
+    ~SplicePipe() {
+        if (read_fd >= 0) close(read_fd);
+        if (write_fd >= 0) close(write_fd);
+    }
+
+    [[nodiscard]] bool is_valid() const {
+        return read_fd >= 0;
+    }
+
+    /// Bytes in the pipe that have not been sent on yet
+    [[nodiscard]] int pending() const {
+        int bytes = 0;
+        ioctl(read_fd, FIONREAD, &bytes);
+        return bytes;
+    }
+};
+#endif
+
 struct AsyncSocket {
 public:
 #ifdef WINDOWS
@@ -105,15 +241,63 @@ public:
         CLIENT_WRITE
     };
 
+    /// What the protocol on top is waiting for, decides which deadline applies.
+    enum class Phase {
+        // Nothing received yet
+        CONNECTED,
+        READ_HEADER,
+        READ_BODY,
+        // Between two requests
+        IDLE,
+        // Taken over by a long-lived protocol such as WebSocket
+        UPGRADED,
+        // The response comes from elsewhere (an upstream server), whose deadlines apply instead
+        WAITING
+    };
+
 private:
     IOType m_type;
     socket_type m_socket;
+    sockaddr_in m_peer_address{};
+    Phase m_phase = Phase::CONNECTED;
 
     bool m_is_closed = false;
     bool m_is_read_closed = false;
+    bool m_is_read_paused = false;
+#ifdef LINUX
+    // Input still to be moved into m_splice_pipe instead of being read, see splice_input()
+    uint64_t m_splice_left = 0;
+    std::shared_ptr<SplicePipe> m_splice_pipe{};
+#endif
 
 public:
-    SendQueue<std::shared_ptr<SocketBuffer> > send_queue{};
+    SendQueue<SendBuffer> send_queue{};
+    // Owned by the I/O thread serving this socket
+    TimerNode timer{};
+    TimeoutKind timeout_kind = TimeoutKind::NONE;
+    // Position in the connection list of that thread, -1 while not served by any
+    int live_index = -1;
+    // Input is left unread because the read budget ran out: edge-triggered epoll will not report
+    // it again, so the socket waits in the ready list of its thread instead
+    bool has_pending_input = false;
+    bool is_in_ready_list = false;
+    // Metrics::now() when accepted, and when the send queue last went from empty to busy
+    int64_t accepted_at = 0;
+    int64_t send_started_at = 0;
+    // State of the protocol on top, left alone here apart from being cleared when the socket is reused
+    void *context = nullptr;
+    // Unique per accepted connection and 0 while the socket is unused, see ConnectionHandle.
+    // Atomic because a task posted to the previous owner of a reused socket reads it.
+    std::atomic<uint64_t> connection_id{0};
+    // I/O thread serving the connection
+    int io_thread = -1;
+    // Bytes queued and not sent yet, what a client that reads slowly lets pile up
+    int64_t queued_bytes = 0;
+    // Set on a TLS listener: reads and writes go through the session once its handshake is done
+    TlsSession *tls = nullptr;
+    bool is_tls_established = false;
+    // Set on a connection opened by this side with Multiplexing::connect(), nullptr for accepted ones
+    const OutboundBehavior *outbound = nullptr;
 
     AsyncSocket()
         : m_type(IOType::ACCEPT), m_socket(INVALID_SOCKET) {
@@ -123,16 +307,118 @@ public:
         : m_type(type), m_socket(socket) {
     }
 #ifdef LINUX
-    [[nodiscard]] ssize_t async_write(const SocketBuffer &buffer) const {
-        const auto has_sent = buffer.p_current - buffer.buffer;
-        return write(m_socket, buffer.p_current, buffer.size - has_sent);
+    /// Like recv()
+    [[nodiscard]] ssize_t async_read(char *data, const size_t size) const {
+#ifdef WEBSERVER_TLS
+        if (tls != nullptr) return TlsContext::read(tls, data, size);
+#endif
+        return recv(m_socket, data, size, 0);
+    }
+
+    [[nodiscard]] ssize_t async_write(const SendBuffer &buffer) const {
+#ifdef WEBSERVER_TLS
+        if (tls != nullptr) {
+            // The bytes of a pipe would go out as they are, unencrypted
+            if (buffer.is_pipe()) {
+                errno = EINVAL;
+                return -1;
+            }
+            if (buffer.is_file()) {
+                return TlsContext::send_file(tls, buffer.file_fd, buffer.file_offset + buffer.sent,
+                                             buffer.size - buffer.sent);
+            }
+            return TlsContext::write(tls, buffer.data + buffer.sent, buffer.size - buffer.sent);
+        }
+#endif
+        if (buffer.is_file()) {
+            off_t offset = buffer.file_offset + buffer.sent;
+            const ssize_t ret = sendfile(m_socket, buffer.file_fd, &offset, buffer.size - buffer.sent);
+            if (ret == 0) {
+                // The file has been truncated since it was stat'ed, the rest will never come
+                errno = EIO;
+                return -1;
+            }
+            return ret;
+        }
+        if (buffer.is_pipe()) {
+            const ssize_t ret = splice(buffer.pipe_fd, nullptr, m_socket, nullptr, buffer.size - buffer.sent,
+                                       SPLICE_F_MOVE | SPLICE_F_NONBLOCK | (buffer.more ? SPLICE_F_MORE : 0));
+            if (ret == 0) {
+                // The pipe holds fewer bytes than were queued, the rest will never come
+                errno = EIO;
+                return -1;
+            }
+            return ret;
+        }
+        // MSG_NOSIGNAL: a peer that has gone away is reported as EPIPE instead of killing us with SIGPIPE.
+        return send(m_socket, buffer.data + buffer.sent, buffer.size - buffer.sent,
+                    MSG_NOSIGNAL | (buffer.more ? MSG_MORE : 0));
     }
 
     void reset() {
         m_is_closed = false;
         m_is_read_closed = false;
+        m_phase = Phase::CONNECTED;
+        timeout_kind = TimeoutKind::NONE;
+        has_pending_input = false;
+        is_in_ready_list = false;
+        context = nullptr;
+        connection_id = 0;
+        queued_bytes = 0;
+#ifdef WEBSERVER_TLS
+        if (tls != nullptr) TlsContext::close(tls);
+#endif
+        tls = nullptr;
+        is_tls_established = false;
+        outbound = nullptr;
+        m_is_read_paused = false;
+        m_splice_left = 0;
+        m_splice_pipe.reset();
         send_queue.clear();
     }
+
+    /// Move the next `bytes` bytes of input (UINT64_MAX: until the peer closes) into a pipe instead
+    /// of reading them. Each part reaches ConnectionBehavior::on_spliced as a pipe segment, to be
+    /// queued on another plain connection of the same I/O thread, which passes it on with splice()
+    /// again. While the pipe is full, reading stops as with pause_read() in the WAITING phase, and
+    /// is resumed by whoever the segments go to once it has sent them.
+    /// @return false for a TLS connection, whose input needs decrypting, and input is read as usual
+    bool splice_input(const uint64_t bytes) {
+        if (tls != nullptr) return false;
+        // Bytes of an earlier splice still in the pipe belong to the queue of another connection
+        if (m_splice_pipe == nullptr || m_splice_pipe->pending() > 0) {
+            auto pipe = std::make_shared<SplicePipe>();
+            if (!pipe->is_valid()) return false;
+            m_splice_pipe = std::move(pipe);
+        }
+        m_splice_left = bytes;
+        return true;
+    }
+
+    void stop_splice() {
+        m_splice_left = 0;
+    }
+
+    [[nodiscard]] bool is_splicing() const {
+        return m_splice_left > 0;
+    }
+
+    /// Like recv(), but into the pipe of splice_input(): moved describes the bytes moved
+    [[nodiscard]] ssize_t async_splice(SendBuffer &moved) {
+        const size_t size = static_cast<size_t>(std::min<uint64_t>(m_splice_left, SplicePipe::CAPACITY));
+        const ssize_t ret = splice(m_socket, nullptr, m_splice_pipe->write_fd, nullptr, size,
+                                   SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (ret > 0) {
+            if (m_splice_left != UINT64_MAX) m_splice_left -= ret;
+            moved = SendBuffer::from_pipe(m_splice_pipe, m_splice_pipe->read_fd, ret);
+        }
+        return ret;
+    }
+
+    /// Whether bytes moved by async_splice() still wait in the pipe for the connection they went to
+    [[nodiscard]] bool has_spliced_pending() const {
+        return m_splice_pipe != nullptr && m_splice_pipe->pending() > 0;
+    }
 #endif
 #ifdef WINDOWS
     void reset(const IOType type, const socket_type socket) {
@@ -140,6 +426,10 @@ public:
         m_socket = socket;
         m_is_closed = false;
         m_is_read_closed = false;
+        context = nullptr;
+        queued_bytes = 0;
+        outbound = nullptr;
+        m_is_read_paused = false;
         send_queue.clear();
         read_buffer.wsaBuf.len = SocketBuffer::MAX_SIZE;
         write_buffer.wsaBuf.len = SocketBuffer::MAX_SIZE;
@@ -149,16 +439,26 @@ public:
     void reset() {
         m_is_closed = false;
         m_is_read_closed = false;
+        context = nullptr;
+        queued_bytes = 0;
+        outbound = nullptr;
+        m_is_read_paused = false;
         send_queue.clear();
         read_buffer.wsaBuf.len = SocketBuffer::MAX_SIZE;
         write_buffer.wsaBuf.len = SocketBuffer::MAX_SIZE;
         memset(&overlapped, 0, sizeof(OVERLAPPED));
     }
 #endif
-    void async_send(const std::vector<std::shared_ptr<SocketBuffer> > &data) {
+    void async_send(const std::vector<SendBuffer> &data) {
+        for (const auto &buffer: data) queued_bytes += buffer.size;
         send_queue.add_range(data);
     }
 
+    void async_send(const SendBuffer &data) {
+        queued_bytes += data.size;
+        send_queue.add_data(data);
+    }
+
     void async_close() {
         m_is_closed = true;
     }
@@ -167,6 +467,21 @@ public:
         m_is_read_closed = true;
     }
 
+    /// Leave input unread until resume_read(), while whatever it goes to cannot take more
+    void pause_read() {
+        m_is_read_paused = true;
+    }
+
+    /// Read again on the next turn of the connection, see Multiplexing::wake()
+    void resume_read() {
+        m_is_read_paused = false;
+        has_pending_input = true;
+    }
+
+    [[nodiscard]] bool is_read_paused() const {
+        return m_is_read_paused;
+    }
+
     void set_socket(socket_type socket) {
         m_socket = socket;
     }
@@ -175,6 +490,22 @@ public:
         m_type = type;
     }
 
+    void set_peer_address(const sockaddr_in &address) {
+        m_peer_address = address;
+    }
+
+    [[nodiscard]] const sockaddr_in &get_peer_address() const {
+        return m_peer_address;
+    }
+
+    void set_phase(const Phase phase) {
+        m_phase = phase;
+    }
+
+    [[nodiscard]] Phase get_phase() const {
+        return m_phase;
+    }
+
     [[nodiscard]] bool is_closed() const {
         return m_is_closed;
     }
@@ -192,9 +523,65 @@ public:
     }
 };
 
+/// Names a connection from outside its I/O thread. The socket behind it is reused once the
+/// connection closes, the id tells whether it is still the same connection.
+struct ConnectionHandle {
+    AsyncSocket *socket = nullptr;
+    uint64_t id = 0;
+    int io_thread = -1;
+
+    ConnectionHandle() = default;
+
+    /// Only on the I/O thread serving socket
+    explicit ConnectionHandle(AsyncSocket *socket)
+        : socket(socket), id(socket->connection_id), io_thread(socket->io_thread) {
+    }
+};
+
+/// Marks the connection whose callbacks run on this thread right now. What is queued on it is sent
+/// once they return, so sending to it needs no post().
+class ServingScope {
+    inline static thread_local const AsyncSocket *s_serving = nullptr;
+    const AsyncSocket *m_previous;
+
+public:
+    explicit ServingScope(const AsyncSocket *socket)
+        : m_previous(s_serving) {
+        s_serving = socket;
+    }
+
+    ServingScope(const ServingScope &other) = delete;
+
+    ServingScope &operator=(const ServingScope &other) = delete;
+
+    ~ServingScope() {
+        s_serving = m_previous;
+    }
+
+    [[nodiscard]] static bool is_serving(const AsyncSocket *socket) {
+        return s_serving == socket;
+    }
+};
+
+/// Work posted to an I/O thread. It appends the connections it queued data on to touched, which
+/// are sent to right after it.
+using ThreadTask = std::function<void(std::vector<ConnectionHandle> &touched)>;
+
 struct ConnectionBehavior {
     std::function<void(AsyncSocket *, SocketBuffer &)> on_received{};
+    // Called once everything queued on the socket has been sent
     std::function<void(AsyncSocket *)> then_respond{};
+    // Called right before the socket is closed, for whatever reason
+    std::function<void(AsyncSocket *)> on_closed{};
+    // Called with each part of the input that AsyncSocket::splice_input() has moved into a pipe
+    std::function<void(AsyncSocket *, const SendBuffer &)> on_spliced{};
+};
+
+/// Callbacks and deadlines of the connections opened with Multiplexing::connect(). Phases mean the
+/// same as on accepted connections: READ_HEADER waits for a response header, IDLE for the next request.
+struct OutboundBehavior {
+    ConnectionBehavior callbacks{};
+    ConnectionTimeouts timeouts{};
 };
 
 class Multiplexing {
@@ -205,6 +592,67 @@ public:
 
     virtual void set_callback(const ConnectionBehavior &behavior) = 0;
 
+    // Only enforced by implementations that support it
+    virtual void set_timeouts(const ConnectionTimeouts &/*timeouts*/) {
+    }
+
+    virtual void set_connection_limits(const ConnectionLimits &/*limits*/) {
+    }
+
+    virtual void set_thread_topology(const ThreadTopology &/*topology*/) {
+    }
+
+    // Serve every connection of the listener over TLS
+    virtual void set_tls_context(const std::shared_ptr<TlsContext> &/*context*/) {
+    }
+
+    // Let SIGTERM/SIGINT stop the server gracefully, a second signal stops it at once
+    virtual void enable_signal_handling() {
+    }
+
+    // Called on SIGUSR2, to start the next binary of a hot upgrade
+    virtual void set_upgrade_handler(const std::function<void()> &/*handler*/) {
+    }
+
+    // Called on SIGCHLD, to reap the binary the upgrade handler started
+    virtual void set_child_exit_handler(const std::function<void()> &/*handler*/) {
+    }
+
+    // Run task on the I/O thread of a connection, from any thread. It is dropped if the connection
+    // has closed by then, and what it queues is sent right after it. False if it cannot be delivered.
+    virtual bool post(const ConnectionHandle &/*handle*/, std::function<void(AsyncSocket *)> &&/*task*/) {
+        return false;
+    }
+
+    // Run task on I/O thread io_thread, from any thread. False if it cannot be delivered.
+    virtual bool post(int /*io_thread*/, ThreadTask &&/*task*/) {
+        return false;
+    }
+
+    // Open a connection to address, served by I/O thread io_thread with behavior, which has to outlive
+    // it. Only on that thread; what is queued before the connection is established goes out once it
+    // is, and a failure to connect shows up as a close. nullptr if it cannot even be started.
+    virtual AsyncSocket *connect(int /*io_thread*/, const sockaddr_in &/*address*/,
+                                 const OutboundBehavior */*behavior*/) {
+        return nullptr;
+    }
+
+    // Serve a connection again soon: send what has been queued on it, read what a paused read left.
+    // Cheap on the I/O thread of the connection, through post() from any other.
+    virtual bool wake(const ConnectionHandle &/*handle*/) {
+        return false;
+    }
+
+    // Number of I/O threads, known once the server has been set up
+    [[nodiscard]] virtual int get_io_thread_count() const {
+        return 0;
+    }
+
+    // Whether stop() has been requested, the server may still be finishing in-flight requests
+    [[nodiscard]] virtual bool is_stopping() const {
+        return false;
+    }
+
     virtual void start() = 0;
 
     virtual void stop() = 0;
@@ -5,11 +5,15 @@
 #ifndef MULTIPLEXING_LINUX_H
 #define MULTIPLEXING_LINUX_H
 
+#include <atomic>
 #include <condition_variable>
+#include <memory>
+#include <mutex>
 #include <thread>
 
 #include "Multiplexing.h"
 #include "SocketPool.h"
+#include "../ConnectionLimiter.h"
 #include "../../common/Predefined.h"
 
 #ifdef LINUX
@@ -22,26 +26,82 @@
 #include "../../log/Logger.h"
 
 class MultiplexingLinux final : public Multiplexing {
+    // recv calls per connection and turn. Each reads up to SocketBuffer::MAX_SIZE, so one client
+    // streaming an upload holds its thread for at most 256 KiB before the others get a turn.
+    static constexpr int READ_BUDGET = 8;
+
+    /// State of one receive/write thread, only touched by that thread
+    struct IoContext {
+        int id = -1;
+        int epoll_fd = -1;
+        TimerWheel wheel{};
+        // Every connection the thread serves, AsyncSocket::live_index is the position in here
+        std::vector<AsyncSocket *> connections{};
+        // Connections with input left over from their last turn, served again after the next events
+        std::vector<AsyncSocket *> ready{};
+        // The ready list being worked through, swapped with ready every turn
+        std::vector<AsyncSocket *> serving{};
+        bool is_draining = false;
+        // Posted tasks being run, swapped with the inbox of the thread
+        std::vector<ThreadTask> posted{};
+        // Connections the posted tasks have queued data on
+        std::vector<ConnectionHandle> touched{};
+        // Connections of this thread woken by another one (see wake()), served after the current events
+        std::vector<ConnectionHandle> woken{};
+        std::vector<ConnectionHandle> serving_woken{};
+    };
+
+    // Context of the I/O thread running on this thread, nullptr anywhere else
+    inline static thread_local IoContext *s_context = nullptr;
+
+    /// Tasks posted to an I/O thread by other threads. The eventfd wakes the thread up when the
+    /// inbox goes from empty to not empty.
+    struct Inbox {
+        std::mutex mutex{};
+        std::vector<ThreadTask> tasks{};
+        int event_fd = -1;
+    };
+
     std::mutex m_mutex{}, m_assign_mutex{};
     std::condition_variable m_condition{};
 
     sockaddr_in m_address{};
     socket_len_type m_address_len;
     int m_main_epoll_fd{};
-    int m_shutdown_event_fd{};
-    int m_pipe[2]{};
+    int m_shutdown_event_fd = -1;
+    int m_pipe[2]{-1, -1};
+    int m_signal_fd = -1;
+    bool m_handle_signals = false;
 
     int m_socket_listen;
-    int number_of_events;
-    int number_of_threads;
-    volatile bool m_is_shutdown = false;
+    // Resolved from m_topology by setup()
+    int number_of_events = 0;
+    int number_of_threads = 0;
+    ThreadTopology m_topology{};
+    // CPU of each I/O thread, empty when not pinned
+    std::vector<int> m_thread_cpus{};
+    int m_acceptor_cpu = -1;
+    std::atomic<bool> m_is_shutdown{false};
+    // Steady clock milliseconds at which draining gives up and closes whatever is left
+    std::atomic<int64_t> m_drain_deadline{0};
+    std::atomic<int> m_running_threads{0};
+    std::atomic<bool> m_is_accepting{false};
 
     std::vector<std::thread> m_working_thread;
     std::vector<int> m_epoll_list;
+    // One per I/O thread, same order as m_epoll_list
+    std::vector<std::unique_ptr<Inbox> > m_inboxes{};
+    std::atomic<uint64_t> m_next_connection_id{1};
 
     SocketPool m_socket_pool{};
+    ConnectionLimiter m_connection_limiter{};
 
     ConnectionBehavior m_behavior;
+    std::function<void()> m_upgrade_handler{};
+    std::function<void()> m_child_exit_handler{};
+    // Set when the listener speaks TLS
+    std::shared_ptr<TlsContext> m_tls{};
+    ConnectionTimeouts m_timeouts{};
 
     Logger *m_logger = nullptr;
 
@@ -52,8 +112,9 @@ class MultiplexingLinux final : public Multiplexing {
     /// Hand over socket_fd to epoll_fd and set socket_fd to non-block mode
     /// @param epoll_fd epoll file descriptor
     /// @param socket_fd socket file descriptor
-    /// @return whether succeed
-    [[nodiscard]] bool add_to_epoll(int epoll_fd, int socket_fd) const;
+    /// @param events events to watch
+    /// @return whether succeed, socket_fd is left open for the caller to close otherwise
+    [[nodiscard]] bool add_to_epoll(int epoll_fd, int socket_fd, uint32_t events = EPOLLIN | EPOLLET) const;
 
     /// Create an epoll file descriptor
     /// @return epoll file descriptor
@@ -62,31 +123,101 @@ class MultiplexingLinux final : public Multiplexing {
     /// The main thread listens to all connections. If a new connection is to be established, it accepts the connection and automatically assigns the accepted connection to the receiving/writing thread to process the data.
     void main_accept_loop();
 
+    /// Work out thread count, events per wakeup and CPUs from m_topology
+    void resolve_topology();
+
     /// Only responsible for reading and writing data
     /// @param id The index of epoll_fd
     void thread_receive_write_loop(int id);
 
-    bool async_accept(int epoll_fd);
+    /// Accept what is pending and hand it to I/O thread thread_id
+    bool async_accept(int thread_id);
 
+    /// Read until EAGAIN or until the read budget runs out, see AsyncSocket::has_pending_input
+    /// @return false on a connection error
     bool async_receive(AsyncSocket *socket, SocketBuffer &buffer);
 
     bool async_send(AsyncSocket *socket);
 
-    void notify_stop();
+    /// Continue the TLS handshake of socket
+    /// @return 1 once it is done, 0 while it waits for the client, -1 if it failed
+    static int continue_handshake(AsyncSocket *socket);
+
+    /// Serve the events of one connection: read, send, then close it or arm its timer
+    void serve_connection(IoContext &context, AsyncSocket *socket, uint32_t events, SocketBuffer &buffer);
+
+    /// Give each connection of the ready list another turn
+    void serve_ready_list(IoContext &context, SocketBuffer &buffer);
+
+    /// Run the tasks posted to thread id, and send what they queued
+    void serve_inbox(IoContext &context, int id, SocketBuffer &buffer);
+
+    /// Serve the connections woken since the last turn
+    void serve_woken(IoContext &context, SocketBuffer &buffer);
+
+    /// Callbacks of socket: its own for an outgoing connection, the server's otherwise
+    [[nodiscard]] const ConnectionBehavior &behavior_of(const AsyncSocket *socket) const {
+        return socket->outbound != nullptr ? socket->outbound->callbacks : m_behavior;
+    }
+
+    /// Arm the timer of socket for whatever it is waiting for now
+    void update_deadline(IoContext &context, AsyncSocket *socket) const;
+
+    /// Add socket to the connections of the calling I/O thread, on its first event
+    static void track_connection(IoContext &context, AsyncSocket *socket);
+
+    /// Close a client connection owned by the calling I/O thread
+    void close_connection(IoContext &context, AsyncSocket *socket);
+
+    /// Whether socket has no request in flight, so closing it loses nothing
+    static bool is_idle(const AsyncSocket *socket);
+
+    /// Close every connection of the thread that is idle
+    void close_idle_connections(IoContext &context);
+
+    /// epoll_wait timeout of an I/O thread: the next timer, or the drain deadline when sooner
+    [[nodiscard]] int next_timeout(const IoContext &context) const;
+
+    /// Read the pending signals of m_signal_fd and stop accordingly
+    void handle_signals();
+
+    [[nodiscard]] static int64_t steady_now();
 
     void wait_for_thread();
 
 public:
-    explicit MultiplexingLinux(
-        socket_type socket_listen,
-        int number_of_threads = 12,
-        int number_of_events = 3000
-    );
+    explicit MultiplexingLinux(socket_type socket_listen);
 
     ~MultiplexingLinux() override;
 
     void set_callback(const ConnectionBehavior &behavior) override;
 
+    void set_timeouts(const ConnectionTimeouts &timeouts) override;
+
+    void set_connection_limits(const ConnectionLimits &limits) override;
+
+    void set_thread_topology(const ThreadTopology &topology) override;
+
+    void set_tls_context(const std::shared_ptr<TlsContext> &context) override;
+
+    void enable_signal_handling() override;
+
+    void set_upgrade_handler(const std::function<void()> &handler) override;
+
+    void set_child_exit_handler(const std::function<void()> &handler) override;
+
+    bool post(const ConnectionHandle &handle, std::function<void(AsyncSocket *)> &&task) override;
+
+    bool post(int io_thread, ThreadTask &&task) override;
+
+    AsyncSocket *connect(int io_thread, const sockaddr_in &address, const OutboundBehavior *behavior) override;
+
+    bool wake(const ConnectionHandle &handle) override;
+
+    [[nodiscard]] int get_io_thread_count() const override;
+
+    [[nodiscard]] bool is_stopping() const override;
+
     void setup() override;
 
     void start() override;
@@ -7,10 +7,14 @@
 #include "Multiplexing.h"
 #include "../../log/Logger.h"
 #ifdef WINDOWS
-[[nodiscard]] static ssize_t async_write(AsyncSocket *async_socket, SocketBuffer &buffer) {
+// Post the next chunk of buffer (at most SocketBuffer::MAX_SIZE bytes) and mark it as sent.
+[[nodiscard]] static ssize_t async_write(AsyncSocket *async_socket, SendBuffer &buffer) {
     DWORD bytes_sent = 0;
-    async_socket->write_buffer = buffer;
     auto &write_buffer = async_socket->write_buffer;
+    const auto chunk_size = std::min(buffer.size - buffer.sent, SocketBuffer::MAX_SIZE);
+    memcpy(write_buffer.buffer, buffer.data + buffer.sent, chunk_size);
+    write_buffer.size = chunk_size;
+    buffer.sent += chunk_size;
     write_buffer.wsaBuf.len = write_buffer.size;
     write_buffer.wsaBuf.buf = write_buffer.buffer;
     const int ret = WSASend(async_socket->get_socket(), &write_buffer.wsaBuf, 1, &bytes_sent, 0,
@@ -120,10 +124,13 @@ class MultiplexingWindows : public Multiplexing {
         }
         socket->set_type(AsyncSocket::IOType::CLIENT_WRITE);
         // Post a send request to iocp
-        const auto firstBuffer = socket->send_queue.get_next_data();
-        socket->send_queue.move_next_data();
+        auto &firstBuffer = socket->send_queue.get_next_data();
         // Get the first buffer and send to the client
-        const auto ret = async_write(socket, *firstBuffer);
+        const auto ret = async_write(socket, firstBuffer);
+        if (firstBuffer.is_finished()) {
+            socket->queued_bytes -= firstBuffer.size;
+            socket->send_queue.move_next_data();
+        }
         if (ret < 0) {
             m_logger->error(
                 "Failed to send data. Error no: %d",
@@ -173,14 +180,17 @@ class MultiplexingWindows : public Multiplexing {
         if (!queue.empty()) {
             auto &send_buffer = queue.get_next_data();
             // Try to write buffer to client
-            const auto ret = async_write(socket, *send_buffer);
+            const auto ret = async_write(socket, send_buffer);
             // If failed, close socket
             if (ret < 0) {
                 // m_logger->error("Failed to post iocp overlapped call");
                 queue.clear();
                 return false;
             }
-            queue.move_next_data();
+            if (send_buffer.is_finished()) {
+                socket->queued_bytes -= send_buffer.size;
+                queue.move_next_data();
+            }
         } else {
             m_behavior.then_respond(socket);
         }
@@ -210,6 +220,7 @@ class MultiplexingWindows : public Multiplexing {
                     break;
             }
             if (!success || socket->is_closed()) {
+                if (m_behavior.on_closed) m_behavior.on_closed(socket);
                 closesocket(socket->get_socket());
                 delete socket;
             }
@@ -1,13 +1,11 @@
 #include "http/HttpResponse.h"
 #include "http/HttpServer.h"
 
-int get_or_default(std::unordered_map<sz::string, sz::string> &map, const sz::string &key) {
-    sz::string value = "0";
-    if (map.count(key) > 0) {
-        value = map[key];
-    }
+int get_or_default(const HttpRequest::string_map &map, const HttpRequest::string &key) {
+    const auto it = map.find(key);
+    if (it == map.end()) return 0;
     char *ptr = nullptr;
-    return strtol(value.c_str(), &ptr, 10);
+    return strtol(it->second.c_str(), &ptr, 10);
 }
 
 int main() {
@@ -20,13 +18,61 @@ int main() {
         response.insert("Content-Type", "text/html");
     });
     server.set_callback([&server](HttpRequest &request, HttpResponse &response) {
-        std::cout << request.url << std::endl;
         if (request.url.ends_with(".json")) {
             response.set_body("{'name': 'Hello World!'}");
         } else {
             server.default_callback(request, response);
         }
     });
+    AccessLogConfig access_log{};
+    access_log.path = "-";
+    server.enable_access_log(access_log);
+    server.enable_metrics();
+    server.enable_http2();
+    WebSocketHandler echo{};
+    echo.on_message = [](const std::shared_ptr<WebSocket> &socket, const std::string_view message,
+                         const bool is_binary) {
+        if (is_binary) socket->send_binary(message);
+        else socket->send_text(message);
+    };
+    server.add_websocket("/ws/echo", std::move(echo));
+    // Every message goes to everyone in the room
+    WebSocketHandler chat{};
+    chat.on_open = [&server](const std::shared_ptr<WebSocket> &socket) {
+        server.get_broadcaster().subscribe(socket->get_handle(), "chat");
+    };
+    chat.on_message = [&server](const std::shared_ptr<WebSocket> &, const std::string_view message, bool) {
+        server.get_broadcaster().publish("chat", WebSocket::make_frame(WebSocket::Opcode::TEXT, message));
+        server.get_broadcaster().publish("chat-events", EventStream::make_event(message, "chat"));
+    };
+    server.add_websocket("/ws/chat", std::move(chat));
+    // The same room, read-only over Server-Sent Events
+    EventStreamHandler chat_events{};
+    chat_events.on_open = [&server](const std::shared_ptr<EventStream> &stream, HttpRequest &) {
+        server.get_broadcaster().subscribe(stream->get_handle(), "chat-events");
+    };
+    server.add_event_stream("/events/chat", std::move(chat_events));
+    // HTTPS when given a certificate, e.g. WEBSERVER_TLS_CERT=cert.pem WEBSERVER_TLS_KEY=key.pem
+    if (const char *certificate = getenv("WEBSERVER_TLS_CERT")) {
+        TlsConfig tls{};
+        tls.certificate_file = certificate;
+        const char *key = getenv("WEBSERVER_TLS_KEY");
+        tls.private_key_file = key != nullptr ? key : certificate;
+        if (!server.enable_tls(tls)) return 1;
+    }
+    // Forward /app/ to other servers, e.g. WEBSERVER_UPSTREAMS=127.0.0.1:9000,127.0.0.1:9001
+    if (const char *upstreams = getenv("WEBSERVER_UPSTREAMS")) {
+        ProxyConfig proxy{};
+        std::string_view list(upstreams);
+        while (!list.empty()) {
+            const size_t comma = list.find(',');
+            proxy.servers.emplace_back(list.substr(0, comma));
+            list.remove_prefix(comma == std::string_view::npos ? list.size() : comma + 1);
+        }
+        if (!server.add_proxy("/app/", proxy)) return 1;
+    }
+    server.enable_signal_handling();
+    server.enable_hot_upgrade();
     server.start_server();
     server.stop_server();
     return 0;
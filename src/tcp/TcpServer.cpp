@@ -4,9 +4,9 @@
 
 #include "tcp/TcpServer.h"
 
+#include "tcp/ListenerHandoff.h"
 #include "tcp/multiplexing/MultiplexingLinux.h"
 #include "tcp/multiplexing/MultiplexingWindows.h"
-#include "tcp/multiplexing/MultiplexingWindows.h"
 
 void TcpServer::exit_with_error(const std::string &message) const {
     m_logger->error(message.c_str());
@@ -17,6 +17,126 @@ void TcpServer::set_callback(const ConnectionBehavior &behavior) {
     m_behavior = behavior;
 }
 
+void TcpServer::set_timeouts(const ConnectionTimeouts &timeouts) {
+    m_timeouts = timeouts;
+}
+
+void TcpServer::set_connection_limits(const ConnectionLimits &limits) {
+    m_connection_limits = limits;
+}
+
+void TcpServer::set_thread_topology(const ThreadTopology &topology) {
+    m_thread_topology = topology;
+}
+
+bool TcpServer::enable_tls(const TlsConfig &config) {
+#ifdef WINDOWS
+    m_logger->error("TLS is only supported on Linux");
+    return false;
+#endif
+    auto tls = std::make_shared<TlsContext>();
+    if (!tls->load(config)) return false;
+    m_tls = std::move(tls);
+    return true;
+}
+
+void TcpServer::enable_signal_handling() {
+    m_handle_signals = true;
+}
+
+void TcpServer::enable_hot_upgrade(const std::string &handoff_path) {
+    m_hot_upgrade = true;
+    m_handle_signals = true;
+    m_handoff_path = handoff_path;
+}
+
+void TcpServer::spawn_successor() {
+#ifdef LINUX
+    reap_successor();
+    // Two successors would race for the listening socket
+    if (m_successor_pid > 0) {
+        m_logger->warn("The new binary is still starting as process %d, upgrade ignored", m_successor_pid);
+        return;
+    }
+    const auto pid = ListenerHandoff::spawn_successor(m_listen_socket);
+    if (pid < 0) {
+        m_logger->error("Failed to start the new binary, errno: %d", errno);
+        return;
+    }
+    m_successor_pid = pid;
+    m_logger->info("Started the new binary as process %d", pid);
+#endif
+}
+
+void TcpServer::reap_successor() {
+#ifdef LINUX
+    if (m_successor_pid <= 0) return;
+    int status = 0;
+    const pid_t pid = waitpid(m_successor_pid, &status, WNOHANG);
+    // Still running
+    if (pid == 0) return;
+    if (pid == m_successor_pid) {
+        if (WIFSIGNALED(status)) {
+            m_logger->error("The new binary (process %d) was killed by signal %d", pid, WTERMSIG(status));
+        } else if (WIFEXITED(status) && WEXITSTATUS(status) != 0) {
+            m_logger->error("The new binary (process %d) exited with status %d", pid, WEXITSTATUS(status));
+        }
+    }
+    m_successor_pid = -1;
+#endif
+}
+
+void TcpServer::start_handoff() {
+#ifdef LINUX
+    if (!m_hot_upgrade || m_handoff_path.empty()) return;
+    m_handoff_socket = ListenerHandoff::listen_at(m_handoff_path);
+    if (m_handoff_socket == -1) {
+        m_logger->error("Failed to listen for successors at %s", m_handoff_path.c_str());
+        return;
+    }
+    m_handoff_thread = std::thread([this]() {
+        handoff_loop();
+    });
+#endif
+}
+
+void TcpServer::handoff_loop() {
+#ifdef LINUX
+    while (true) {
+        const int connection = accept4(m_handoff_socket, nullptr, nullptr, SOCK_CLOEXEC);
+        if (connection == -1) {
+            if (errno == EINTR) continue;
+            // Shut down by stop_handoff
+            return;
+        }
+        if (!ListenerHandoff::send(connection, m_listen_socket)) {
+            m_logger->error("Failed to hand over the listening socket, errno: %d", errno);
+            close(connection);
+            continue;
+        }
+        // The successor takes over the path once the connection closes
+        unlink(m_handoff_path.c_str());
+        m_handoff_path.clear();
+        close(connection);
+        m_logger->info("Listening socket handed over, draining.");
+        if (!m_multiplexing->is_stopping()) m_multiplexing->stop();
+        return;
+    }
+#endif
+}
+
+void TcpServer::stop_handoff() {
+#ifdef LINUX
+    if (m_handoff_socket == -1) return;
+    // Wakes up accept4 in the handoff thread
+    shutdown(m_handoff_socket, SHUT_RDWR);
+    if (m_handoff_thread.joinable()) m_handoff_thread.join();
+    close(m_handoff_socket);
+    m_handoff_socket = -1;
+    if (!m_handoff_path.empty()) unlink(m_handoff_path.c_str());
+#endif
+}
+
 TcpServer::TcpServer(std::string &&ip_address, const int ip_port)
     : m_socket_address(),
       m_ip_address(std::move(ip_address)),
@@ -36,22 +156,64 @@ int TcpServer::start_server() {
     start_listening();
 
     m_multiplexing->setup();
+    start_handoff();
+#ifdef LINUX
+    // Serving from here on, the previous process can drain now
+    if (m_is_inherited) ListenerHandoff::notify_parent();
+#endif
     m_multiplexing->start();
+    stop_handoff();
 
     m_logger->info("Server closed.");
     return 0;
 }
 
 void TcpServer::close_server() {
-    if (m_is_shutdown) return;
-    m_is_shutdown = true;
-    m_multiplexing->stop();
+    if (m_is_shutdown.exchange(true)) return;
+    // A signal may have stopped the multiplexing already
+    if (m_multiplexing != nullptr && !m_multiplexing->is_stopping()) {
+        m_multiplexing->stop();
+    }
 #ifdef WINDOWS
     WSACleanup();
 #endif
     close_socket(m_listen_socket);
 }
 
+bool TcpServer::is_stopping() const {
+    return m_is_shutdown || (m_multiplexing != nullptr && m_multiplexing->is_stopping());
+}
+
+bool TcpServer::post(const ConnectionHandle &handle, std::function<void(AsyncSocket *)> &&task) {
+    return m_multiplexing != nullptr && m_multiplexing->post(handle, std::move(task));
+}
+
+bool TcpServer::send(const ConnectionHandle &handle, const SendBuffer &data) {
+    if (ServingScope::is_serving(handle.socket)) {
+        handle.socket->async_send(data);
+        return true;
+    }
+    return post(handle, [data](AsyncSocket *socket) {
+        socket->async_send(data);
+    });
+}
+
+bool TcpServer::post(const int io_thread, ThreadTask &&task) {
+    return m_multiplexing != nullptr && m_multiplexing->post(io_thread, std::move(task));
+}
+
+AsyncSocket *TcpServer::connect(const int io_thread, const sockaddr_in &address, const OutboundBehavior *behavior) {
+    return m_multiplexing != nullptr ? m_multiplexing->connect(io_thread, address, behavior) : nullptr;
+}
+
+bool TcpServer::wake(const ConnectionHandle &handle) {
+    return m_multiplexing != nullptr && m_multiplexing->wake(handle);
+}
+
+int TcpServer::get_io_thread_count() const {
+    return m_multiplexing != nullptr ? m_multiplexing->get_io_thread_count() : 0;
+}
+
 void TcpServer::setup() {
 #ifdef WINDOWS
     // Require Windows Socket Api 2.0
@@ -64,12 +226,40 @@ void TcpServer::setup() {
 
     m_multiplexing = new MultiplexingWindows(m_listen_socket);
     m_multiplexing->set_callback(m_behavior);
+    m_multiplexing->set_timeouts(m_timeouts);
+    m_multiplexing->set_connection_limits(m_connection_limits);
+    m_multiplexing->set_thread_topology(m_thread_topology);
+    if (m_handle_signals) m_multiplexing->enable_signal_handling();
 #elif defined(LINUX)
-    // Create the socket with ipv4 and automatic protocol
-    m_listen_socket = socket(AF_INET, SOCK_STREAM, 0);
+    // Take over the socket of the previous process on a hot upgrade, it is bound already.
+    m_listen_socket = ListenerHandoff::take_inherited();
+    m_is_inherited = m_listen_socket != -1;
+    if (!m_is_inherited) {
+        // Create the socket with ipv4 and automatic protocol
+        m_listen_socket = socket(AF_INET, SOCK_STREAM, 0);
+    }
 
     m_multiplexing = new MultiplexingLinux(m_listen_socket);
     m_multiplexing->set_callback(m_behavior);
+    m_multiplexing->set_timeouts(m_timeouts);
+    m_multiplexing->set_connection_limits(m_connection_limits);
+    m_multiplexing->set_thread_topology(m_thread_topology);
+    if (m_tls != nullptr) m_multiplexing->set_tls_context(m_tls);
+    if (m_handle_signals) m_multiplexing->enable_signal_handling();
+    if (m_hot_upgrade) {
+        m_multiplexing->set_upgrade_handler([this]() {
+            spawn_successor();
+        });
+        m_multiplexing->set_child_exit_handler([this]() {
+            reap_successor();
+        });
+    }
+    if (m_is_inherited) {
+        socket_len_type length = sizeof(m_socket_address);
+        getsockname(m_listen_socket, reinterpret_cast<sockaddr *>(&m_socket_address), &length);
+        m_logger->info("Inherited the listening socket from the previous process.");
+        return;
+    }
     int reuse = 1;
     setsockopt(m_listen_socket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
 #endif
@@ -4,8 +4,14 @@
 
 #include "tcp/multiplexing/MultiplexingLinux.h"
 #ifdef LINUX
-#include "../../http/HttpResponse.h"
+#include "common/Metrics.h"
+#include "http/HttpResponse.h"
+#include <chrono>
+#include <csignal>
 #include <fstream>
+#include <netinet/tcp.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
 
 bool MultiplexingLinux::close_socket(const int epoll_fd, const socket_type client_fd) const {
     if (epoll_ctl(epoll_fd, EPOLL_CTL_DEL, client_fd, nullptr) == -1) {
@@ -24,25 +30,24 @@ void MultiplexingLinux::exit_with_error(const std::string &message) const {
     exit(-1);
 }
 
-bool MultiplexingLinux::add_to_epoll(const int epoll_fd, const int socket_fd) const {
+bool MultiplexingLinux::add_to_epoll(const int epoll_fd, const int socket_fd, const uint32_t events) const {
+    // Set socket_fd to non-block mode. This has to happen first: another thread may get an event
+    // for it as soon as it is in the epoll set.
+    if (fcntl(socket_fd, F_SETFL, O_NONBLOCK)) {
+        m_logger->error("Failed to set nonblocking mode");
+        return false;
+    }
+
     epoll_event ev{};
-    ev.events = EPOLLIN | EPOLLET;
+    ev.events = events;
     ev.data.fd = socket_fd;
 
     // Hand over socket_fd to epoll_fd for management
     int a = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, socket_fd, &ev);
     if (a == -1) {
-        close(epoll_fd);
         m_logger->error("Failed to add socket to epoll file descriptor");
         return false;
     }
-
-    // Set socket_fd to non-block mode
-    if (fcntl(socket_fd, F_SETFL, O_NONBLOCK)) {
-        close(socket_fd);
-        m_logger->error("Failed to set nonblocking mode");
-        return false;
-    }
     // m_logger->info("Socket fd: %d", socket_fd);
     return true;
 }
@@ -56,10 +61,13 @@ int MultiplexingLinux::create_epoll_fd() const {
     return epoll_fd;
 }
 
-bool MultiplexingLinux::async_accept(const int epoll_fd) {
+bool MultiplexingLinux::async_accept(const int thread_id) {
+    const int epoll_fd = m_epoll_list[thread_id];
     // m_logger->info("Accepting new connection.");
     while (true) {
-        const int client_fd = accept(m_socket_listen, (sockaddr *) &m_address, &m_address_len);
+        sockaddr_in client_address{};
+        socket_len_type client_address_len = sizeof(client_address);
+        const int client_fd = accept(m_socket_listen, (sockaddr *) &client_address, &client_address_len);
         if (client_fd < 0) {
             if (errno != EAGAIN && errno != EWOULDBLOCK) {
                 return false;
@@ -68,9 +76,41 @@ bool MultiplexingLinux::async_accept(const int epoll_fd) {
             }
         }
 
-        if (!add_to_epoll(epoll_fd, client_fd)) {
-            return false;
+        // Over the limit: drop it before anything is allocated for it.
+        const auto client_ip = client_address.sin_addr.s_addr;
+        if (!m_connection_limiter.try_acquire(client_ip)) {
+            close(client_fd);
+            Metrics::get_metrics()->add(Counter::CONNECTIONS_REJECTED);
+            continue;
         }
+        // The socket of a reused fd has been reset by its previous thread before the fd was closed.
+        AsyncSocket *socket = m_socket_pool.get_or_default(client_fd);
+        socket->set_peer_address(client_address);
+        socket->accepted_at = Metrics::now();
+        socket->connection_id = m_next_connection_id++;
+        socket->io_thread = thread_id;
+        if (m_tls != nullptr) {
+            socket->tls = m_tls->new_session(client_fd);
+            if (socket->tls == nullptr) {
+                m_logger->error("Failed to create a TLS session");
+                socket->reset();
+                close(client_fd);
+                m_connection_limiter.release(client_ip);
+                continue;
+            }
+        }
+
+        // EPOLLOUT fires once right away, which lets the I/O thread arm the header timeout of a
+        // client that never sends anything, and then whenever a stalled send may continue.
+        if (!add_to_epoll(epoll_fd, client_fd, EPOLLIN | EPOLLOUT | EPOLLET)) {
+            // Only this connection is lost, the rest of the backlog is still accepted. Reset before
+            // the descriptor is released, as in close_connection(); it frees the TLS session too.
+            socket->reset();
+            close(client_fd);
+            m_connection_limiter.release(client_ip);
+            continue;
+        }
+        Metrics::get_metrics()->add(Counter::CONNECTIONS_ACCEPTED);
     }
     return true;
 }
@@ -78,49 +118,396 @@ bool MultiplexingLinux::async_accept(const int epoll_fd) {
 bool MultiplexingLinux::async_receive(
     AsyncSocket *socket,
     SocketBuffer &buffer) {
-    auto ret = recv(socket->get_socket(), buffer.buffer, sizeof(buffer.buffer), 0);
-    // Read util ret <= 0. Epoll only notice once while receiving data, so we need to read them all from buffer.
-    while (ret > 0) {
-        buffer.size = ret;
-        m_behavior.on_received(socket, buffer);
-        ret = recv(socket->get_socket(), buffer.buffer, sizeof(buffer.buffer), 0);
+    // Epoll only notices once while receiving data, so we need to read them all from buffer: until
+    // EAGAIN, or until the budget is spent and the socket goes to the ready list for the rest.
+    socket->has_pending_input = false;
+    const ConnectionBehavior &behavior = behavior_of(socket);
+    for (int reads = 0; ; reads++) {
+        // Left in the socket buffer, resume_read() puts the socket in the ready list again
+        if (socket->is_read_paused()) return true;
+        if (reads == READ_BUDGET) {
+            socket->has_pending_input = true;
+            Metrics::get_metrics()->add(Counter::READ_YIELDS);
+            return true;
+        }
+        if (socket->is_splicing()) {
+            // Input goes through a pipe to another connection instead of through buffer
+            SendBuffer moved{};
+            const auto ret = socket->async_splice(moved);
+            if (ret > 0) {
+                ServingScope scope(socket);
+                behavior.on_spliced(socket, moved);
+                if (socket->is_closed()) return true;
+                continue;
+            }
+            if (ret == 0) {
+                socket->close_read();
+                return true;
+            }
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) return false;
+            // The socket is empty or the pipe is full. While the pipe holds bytes, whoever they went to
+            // resumes reading once it has sent them, which covers the second case.
+            if (socket->has_spliced_pending()) {
+                socket->pause_read();
+                socket->set_phase(AsyncSocket::Phase::WAITING);
+            }
+            return true;
+        }
+        const auto ret = socket->async_read(buffer.buffer, sizeof(buffer.buffer));
+        if (ret > 0) {
+            buffer.size = ret;
+            ServingScope scope(socket);
+            behavior.on_received(socket, buffer);
+            // Closed by the protocol, what is left will not be read anyway
+            if (socket->is_closed()) return true;
+            continue;
+        }
+        if (ret == 0) {
+            // The client will send nothing more, but may still be waiting for the response.
+            socket->close_read();
+            return true;
+        }
+        if (errno == EINTR) continue;
+        return errno == EAGAIN || errno == EWOULDBLOCK;
     }
-    return errno == EAGAIN || errno == EWOULDBLOCK;
 }
 
 bool MultiplexingLinux::async_send(AsyncSocket *socket) {
     auto &queue = socket->send_queue;
-    if (queue.has_uncommitted_data()) {
-        queue.submit();
-    }
-    while (!queue.empty()) {
-        auto &send_buffer = queue.get_next_data();
-        auto ret = socket->async_write(*send_buffer);
-        while (ret > 0) {
-            send_buffer->p_current += ret;
-            if (send_buffer->p_current - send_buffer->buffer == send_buffer->size) break;
-            ret = socket->async_write(*send_buffer);
+    while (true) {
+        if (queue.has_uncommitted_data()) {
+            if (queue.empty()) socket->send_started_at = Metrics::now();
+            queue.submit();
         }
-        if (ret == -1) {
-            if (errno != EAGAIN && errno != EWOULDBLOCK) {
-                m_logger->error("Error while sending message. errno: %d", errno);
-                return false;
+        const bool was_busy = !queue.empty();
+        while (!queue.empty()) {
+            auto &send_buffer = queue.get_next_data();
+            while (!send_buffer.is_finished()) {
+                const auto ret = socket->async_write(send_buffer);
+                if (ret < 0) {
+                    if (errno == EINTR) continue;
+                    // The socket buffer is full, carry on when EPOLLOUT reports it writable again.
+                    // Sent entries (and the broadcast frames they share) would otherwise wait for a full drain,
+                    // unseen by queued_bytes, so a subscriber that stays a little behind would grow without bound.
+                    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                        queue.compact();
+                        return true;
+                    }
+                    m_logger->error("Error while sending message. errno: %d", errno);
+                    return false;
+                }
+                send_buffer.sent += ret;
+                socket->queued_bytes -= ret;
             }
-        }
-        if (send_buffer->p_current - send_buffer->buffer == send_buffer->size) {
             queue.move_next_data();
         }
+        queue.release_sent();
+        if (was_busy) Metrics::get_metrics()->record_since(Latency::SEND, socket->send_started_at);
+        {
+            ServingScope scope(socket);
+            behavior_of(socket).then_respond(socket);
+        }
+        // A protocol that paces its output (HTTP/2 bodies) queues the next part once the last one is out
+        if (!queue.has_uncommitted_data() || socket->is_closed()) {
+            // Keep-alive connections mostly wait, and the next response may be a while
+            if (socket->get_phase() == AsyncSocket::Phase::IDLE) queue.release_memory();
+            return true;
+        }
+    }
+}
+
+int MultiplexingLinux::continue_handshake(AsyncSocket *socket) {
+#ifdef WEBSERVER_TLS
+    const int state = TlsContext::handshake(socket->tls);
+    auto *metrics = Metrics::get_metrics();
+    if (state < 0) {
+        metrics->add(Counter::TLS_HANDSHAKE_FAILURES);
+        return -1;
+    }
+    if (state == 0) return 0;
+    socket->is_tls_established = true;
+    metrics->add(Counter::TLS_HANDSHAKES);
+    if (TlsContext::is_resumed(socket->tls)) metrics->add(Counter::TLS_RESUMPTIONS);
+    if (TlsContext::is_ktls_send(socket->tls)) metrics->add(Counter::KTLS_CONNECTIONS);
+    return 1;
+#else
+    return -1;
+#endif
+}
+
+void MultiplexingLinux::update_deadline(IoContext &context, AsyncSocket *socket) const {
+    const ConnectionTimeouts &timeouts = socket->outbound != nullptr ? socket->outbound->timeouts : m_timeouts;
+    TimeoutKind kind;
+    int64_t timeout;
+    if (!socket->send_queue.empty()) {
+        kind = TimeoutKind::WRITE_STALL;
+        timeout = timeouts.write_stall;
+    } else if (socket->get_phase() == AsyncSocket::Phase::READ_BODY) {
+        kind = TimeoutKind::BODY_READ;
+        timeout = timeouts.body_read;
+    } else if (socket->get_phase() == AsyncSocket::Phase::IDLE) {
+        kind = TimeoutKind::KEEP_ALIVE;
+        timeout = timeouts.keep_alive;
+    } else if (socket->get_phase() == AsyncSocket::Phase::UPGRADED) {
+        kind = TimeoutKind::UPGRADED_IDLE;
+        timeout = timeouts.upgraded_idle;
+    } else if (socket->get_phase() == AsyncSocket::Phase::WAITING) {
+        kind = TimeoutKind::NONE;
+        timeout = 0;
+    } else {
+        kind = TimeoutKind::HEADER_READ;
+        timeout = timeouts.header_read;
+    }
+    // Body reads and writes are timed between two events, the other deadlines start when the phase does.
+    const bool restart = kind != socket->timeout_kind
+                         || kind == TimeoutKind::BODY_READ
+                         || kind == TimeoutKind::WRITE_STALL
+                         || kind == TimeoutKind::UPGRADED_IDLE;
+    if (!restart) return;
+    socket->timeout_kind = kind;
+    if (timeout <= 0) {
+        context.wheel.cancel(&socket->timer);
+        return;
+    }
+    socket->timer.owner = socket;
+    context.wheel.arm(&socket->timer, timeout);
+}
+
+void MultiplexingLinux::track_connection(IoContext &context, AsyncSocket *socket) {
+    socket->live_index = static_cast<int>(context.connections.size());
+    context.connections.emplace_back(socket);
+    if (socket->outbound == nullptr) Metrics::get_metrics()->record_since(Latency::ACCEPT, socket->accepted_at);
+}
+
+void MultiplexingLinux::serve_connection(IoContext &context, AsyncSocket *socket, const uint32_t events,
+                                         SocketBuffer &buffer) {
+    if (socket->live_index < 0) {
+        track_connection(context, socket);
+    }
+    bool should_close = (events & EPOLLERR) != 0;
+    // Nothing is read or sent on a TLS connection before its handshake is done. The header
+    // timeout covers a client that never finishes it.
+    if (!should_close && socket->tls != nullptr && !socket->is_tls_established) {
+        const int state = continue_handshake(socket);
+        if (state == 0) {
+            update_deadline(context, socket);
+            return;
+        }
+        should_close = state < 0;
+    }
+    if (!should_close && (events & (EPOLLIN | EPOLLHUP)) && !async_receive(socket, buffer)) {
+        WEBSERVER_LOG_INFO(m_logger, "Client accidentally disconnected");
+        should_close = true;
+    }
+    if (!should_close && !async_send(socket)) {
+        WEBSERVER_LOG_INFO(m_logger, "Client disconnected while sending data");
+        should_close = true;
+    }
+    should_close |= socket->is_closed();
+    should_close |= context.is_draining && is_idle(socket);
+    if (should_close) {
+        close_connection(context, socket);
+        return;
+    }
+    if (socket->has_pending_input && !socket->is_in_ready_list) {
+        socket->is_in_ready_list = true;
+        context.ready.emplace_back(socket);
+    }
+    update_deadline(context, socket);
+}
+
+void MultiplexingLinux::serve_ready_list(IoContext &context, SocketBuffer &buffer) {
+    // Connections that run out of budget again go to the back, behind the next events
+    std::swap(context.ready, context.serving);
+    for (AsyncSocket *socket: context.serving) {
+        socket->is_in_ready_list = false;
+        // Drained by an event in the meantime
+        if (!socket->has_pending_input) continue;
+        serve_connection(context, socket, EPOLLIN, buffer);
+    }
+    context.serving.clear();
+}
+
+void MultiplexingLinux::serve_inbox(IoContext &context, const int id, SocketBuffer &buffer) {
+    Inbox &inbox = *m_inboxes[id];
+    uint64_t count;
+    while (read(inbox.event_fd, &count, sizeof(count)) == sizeof(count)) {
+    }
+    {
+        std::lock_guard lock(inbox.mutex);
+        std::swap(inbox.tasks, context.posted);
+    }
+    for (auto &task: context.posted) task(context.touched);
+    context.posted.clear();
+    for (const auto &handle: context.touched) {
+        // Listed twice, and closed the first time
+        if (handle.socket->connection_id != handle.id) continue;
+        serve_connection(context, handle.socket, 0, buffer);
+    }
+    context.touched.clear();
+}
+
+void MultiplexingLinux::serve_woken(IoContext &context, SocketBuffer &buffer) {
+    // Woken again while being served: that waits for the next turn
+    std::swap(context.woken, context.serving_woken);
+    for (const auto &handle: context.serving_woken) {
+        if (handle.socket->connection_id != handle.id) continue;
+        serve_connection(context, handle.socket, 0, buffer);
+    }
+    context.serving_woken.clear();
+}
+
+bool MultiplexingLinux::post(const ConnectionHandle &handle, std::function<void(AsyncSocket *)> &&task) {
+    if (handle.socket == nullptr) return false;
+    return post(handle.io_thread, [handle, task = std::move(task)](std::vector<ConnectionHandle> &touched) {
+        // Closed in the meantime, and maybe serving another connection already
+        if (handle.socket->connection_id != handle.id) return;
+        ServingScope scope(handle.socket);
+        task(handle.socket);
+        touched.emplace_back(handle);
+    });
+}
+
+bool MultiplexingLinux::post(const int io_thread, ThreadTask &&task) {
+    if (io_thread < 0 || io_thread >= static_cast<int>(m_inboxes.size())) return false;
+    Inbox &inbox = *m_inboxes[io_thread];
+    bool was_empty;
+    {
+        std::lock_guard lock(inbox.mutex);
+        was_empty = inbox.tasks.empty();
+        inbox.tasks.emplace_back(std::move(task));
+    }
+    if (was_empty) {
+        constexpr uint64_t one = 1;
+        if (write(inbox.event_fd, &one, sizeof(one)) < 0 && errno != EAGAIN) return false;
+    }
+    return true;
+}
+
+AsyncSocket *MultiplexingLinux::connect(const int io_thread, const sockaddr_in &address,
+                                        const OutboundBehavior *behavior) {
+    if (io_thread < 0 || io_thread >= static_cast<int>(m_epoll_list.size()) || behavior == nullptr) return nullptr;
+    const int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        m_logger->error("Failed to create an outgoing socket, errno: %d", errno);
+        return nullptr;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    // Non-blocking before connect(), which then returns at once and reports through EPOLLOUT
+    if (fcntl(fd, F_SETFL, O_NONBLOCK) == -1
+        || (::connect(fd, reinterpret_cast<const sockaddr *>(&address), sizeof(address)) == -1
+            && errno != EINPROGRESS)) {
+        close(fd);
+        return nullptr;
+    }
+    AsyncSocket *socket = m_socket_pool.get_or_default(fd);
+    socket->set_peer_address(address);
+    socket->connection_id = m_next_connection_id++;
+    socket->io_thread = io_thread;
+    socket->outbound = behavior;
+    epoll_event event{};
+    event.events = EPOLLIN | EPOLLOUT | EPOLLET;
+    event.data.fd = fd;
+    if (epoll_ctl(m_epoll_list[io_thread], EPOLL_CTL_ADD, fd, &event) == -1) {
+        socket->reset();
+        close(fd);
+        return nullptr;
+    }
+    return socket;
+}
+
+bool MultiplexingLinux::wake(const ConnectionHandle &handle) {
+    if (handle.socket == nullptr) return false;
+    IoContext *context = s_context;
+    if (context == nullptr || context->id != handle.io_thread) {
+        return post(handle, [](AsyncSocket *) {
+        });
     }
-    m_behavior.then_respond(socket);
+    context->woken.emplace_back(handle);
     return true;
 }
 
+int MultiplexingLinux::get_io_thread_count() const {
+    return static_cast<int>(m_inboxes.size());
+}
+
+void MultiplexingLinux::close_connection(IoContext &context, AsyncSocket *socket) {
+    const auto client_fd = socket->get_socket();
+    context.wheel.cancel(&socket->timer);
+    if (socket->is_in_ready_list) {
+        const auto it = std::find(context.ready.begin(), context.ready.end(), socket);
+        if (it != context.ready.end()) context.ready.erase(it);
+    }
+    // Swap with the last one, so the list stays dense
+    if (socket->live_index >= 0) {
+        AsyncSocket *last = context.connections.back();
+        context.connections[socket->live_index] = last;
+        last->live_index = socket->live_index;
+        context.connections.pop_back();
+        socket->live_index = -1;
+    }
+    const ConnectionBehavior &behavior = behavior_of(socket);
+    if (behavior.on_closed) behavior.on_closed(socket);
+    // Outgoing connections were never counted
+    if (socket->outbound == nullptr) {
+        Metrics::get_metrics()->add(Counter::CONNECTIONS_CLOSED);
+        m_connection_limiter.release(socket->get_peer_address().sin_addr.s_addr);
+    }
+    // Reset before the descriptor is released: once closed, the acceptor may hand the same fd
+    // (and so the same AsyncSocket) to another thread.
+    socket->reset();
+    if (!close_socket(context.epoll_fd, client_fd)) {
+        m_logger->error("Failed to close socket");
+    }
+}
+
+bool MultiplexingLinux::is_idle(const AsyncSocket *socket) {
+    const auto phase = socket->get_phase();
+    // Long-lived protocols have no point at which they are done, they are closed like idle connections
+    return (phase == AsyncSocket::Phase::CONNECTED || phase == AsyncSocket::Phase::IDLE
+            || phase == AsyncSocket::Phase::UPGRADED)
+           && socket->send_queue.empty()
+           && !socket->send_queue.has_uncommitted_data();
+}
+
+void MultiplexingLinux::close_idle_connections(IoContext &context) {
+    // Backwards, closing swaps the last connection into the current position
+    for (auto i = static_cast<int>(context.connections.size()) - 1; i >= 0; i--) {
+        if (is_idle(context.connections[i])) {
+            close_connection(context, context.connections[i]);
+        }
+    }
+}
+
+int MultiplexingLinux::next_timeout(const IoContext &context) const {
+    const int timeout = context.wheel.next_timeout();
+    if (!context.is_draining) return timeout;
+    // Nothing left, only wait for the acceptor to stop handing out connections
+    if (context.connections.empty()) return 10;
+    const auto remaining = std::max<int64_t>(m_drain_deadline - steady_now(), 0);
+    if (timeout >= 0 && timeout < remaining) return timeout;
+    return static_cast<int>(remaining);
+}
+
+int64_t MultiplexingLinux::steady_now() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
 void MultiplexingLinux::thread_receive_write_loop(const int id) {
     std::vector<epoll_event> events(number_of_events);
     SocketBuffer buffer{};
-    const int epoll_fd = m_epoll_list[id];
-    while (!m_is_shutdown) {
-        const int num_events = epoll_wait(epoll_fd, events.data(), number_of_events, -1);
+    IoContext context{};
+    context.id = id;
+    context.epoll_fd = m_epoll_list[id];
+    s_context = &context;
+    while (true) {
+        // Connections with unread input cannot wait for an event that will not come
+        const bool has_work = !context.ready.empty() || !context.woken.empty();
+        const int num_events = epoll_wait(context.epoll_fd, events.data(), number_of_events,
+                                          has_work ? 0 : next_timeout(context));
 
         if (num_events < 0) {
             if (errno == EINTR) {
@@ -134,43 +521,56 @@ void MultiplexingLinux::thread_receive_write_loop(const int id) {
         for (int i = 0; i < num_events; i++) {
             auto &event = events[i];
             const int current_fd = event.data.fd;
-            // Shutdown
+            // Shutdown: stop taking new requests, let the ones in flight finish
             if (current_fd == m_shutdown_event_fd) {
-                return;
+                context.is_draining = true;
+                close_idle_connections(context);
+                continue;
+            }
+
+            if (current_fd == m_inboxes[id]->event_fd) {
+                serve_inbox(context, id, buffer);
+                continue;
             }
 
-            if (!(event.events & EPOLLIN)) continue;
             if (current_fd == m_socket_listen) {
                 m_logger->info("Impossible");
-            } else {
-                AsyncSocket *socket = m_socket_pool.get_or_default(current_fd);
-                bool should_close = false;
-                if (!async_receive(socket, buffer)) {
-                    m_logger->info("Client accidentally disconnected");
-                    should_close = true;
-                }
-                if (!async_send(socket)) {
-                    m_logger->info("Client disconnected while sending data");
-                    should_close = true;
-                }
-                should_close |= socket->is_closed();
-                if (should_close) {
-                    if (!close_socket(epoll_fd, current_fd)) {
-                        m_logger->error("Failed to close socket");
-                    }
-                    socket->reset();
+                continue;
+            }
+            serve_connection(context, m_socket_pool.get_or_default(current_fd), event.events, buffer);
+        }
+        serve_woken(context, buffer);
+        serve_ready_list(context, buffer);
+
+        context.wheel.advance([this, &context](TimerNode *node) {
+            Metrics::get_metrics()->add(Counter::CONNECTIONS_TIMED_OUT);
+            close_connection(context, static_cast<AsyncSocket *>(node->owner));
+        });
+
+        if (context.is_draining) {
+            if (!context.connections.empty() && steady_now() >= m_drain_deadline) {
+                m_logger->info("Drain timeout, closing %d connections",
+                               static_cast<int>(context.connections.size()));
+                while (!context.connections.empty()) {
+                    close_connection(context, context.connections.back());
                 }
             }
+            // A connection accepted right before the acceptor stopped shows up as an event first.
+            if (context.connections.empty() && num_events == 0 && !m_is_accepting) break;
         }
     }
-    close(epoll_fd);
+    s_context = nullptr;
+    close(context.epoll_fd);
+    m_running_threads--;
 }
 
 void MultiplexingLinux::main_accept_loop() {
     std::vector<epoll_event> events(number_of_events);
     int assign_index = 0;
-    while (!m_is_shutdown) {
-        const int num_events = epoll_wait(m_main_epoll_fd, events.data(), number_of_events, -1);
+    while (true) {
+        // While draining, wake up now and then to see whether the I/O threads are done
+        const int timeout = m_is_shutdown ? 100 : -1;
+        const int num_events = epoll_wait(m_main_epoll_fd, events.data(), number_of_events, timeout);
 
         if (num_events < 0) {
             if (errno == EINTR) {
@@ -178,13 +578,22 @@ void MultiplexingLinux::main_accept_loop() {
             }
             exit_with_error("Polling failed");
         }
+        if (m_is_shutdown && m_running_threads == 0) {
+            break;
+        }
 
         for (int i = 0; i < num_events; i++) {
             auto &event = events[i];
-            // Shutdown
+            // Shutdown: stop accepting, the listen socket stays open for the owner to close
             if (event.data.fd == m_shutdown_event_fd) {
-                close(m_main_epoll_fd);
-                return;
+                epoll_ctl(m_main_epoll_fd, EPOLL_CTL_DEL, m_socket_listen, nullptr);
+                m_is_accepting = false;
+                continue;
+            }
+
+            if (event.data.fd == m_signal_fd) {
+                handle_signals();
+                continue;
             }
 
             if (!(event.events & EPOLLIN)) continue;
@@ -193,9 +602,10 @@ void MultiplexingLinux::main_accept_loop() {
                 m_logger->error("Impossible");
                 continue;
             }
+            if (!m_is_accepting) continue;
 
             // Round-robin
-            if (!async_accept(m_epoll_list[assign_index++])) {
+            if (!async_accept(assign_index++)) {
                 m_logger->info("Failed to accept connection");
             }
             if (assign_index >= number_of_threads) {
@@ -206,12 +616,80 @@ void MultiplexingLinux::main_accept_loop() {
     close(m_main_epoll_fd);
 }
 
+void MultiplexingLinux::handle_signals() {
+    signalfd_siginfo info{};
+    while (read(m_signal_fd, &info, sizeof(info)) == sizeof(info)) {
+        m_logger->info("Received signal %d", info.ssi_signo);
+        if (info.ssi_signo == SIGUSR2) {
+            if (!m_is_shutdown) m_upgrade_handler();
+            continue;
+        }
+        if (info.ssi_signo == SIGCHLD) {
+            if (m_child_exit_handler) m_child_exit_handler();
+            continue;
+        }
+        stop();
+    }
+}
+
 void MultiplexingLinux::set_callback(const ConnectionBehavior &behavior) {
     m_behavior = behavior;
 }
 
-void MultiplexingLinux::notify_stop() {
-    m_is_shutdown = true;
+void MultiplexingLinux::set_timeouts(const ConnectionTimeouts &timeouts) {
+    m_timeouts = timeouts;
+}
+
+void MultiplexingLinux::set_connection_limits(const ConnectionLimits &limits) {
+    m_connection_limiter.set_limits(limits);
+}
+
+void MultiplexingLinux::set_thread_topology(const ThreadTopology &topology) {
+    m_topology = topology;
+}
+
+void MultiplexingLinux::resolve_topology() {
+    const auto allowed = ThreadTopology::allowed_cpus();
+    number_of_threads = m_topology.io_threads > 0 ? m_topology.io_threads : static_cast<int>(allowed.size());
+    number_of_events = std::max(1, m_topology.events_per_wait);
+    m_thread_cpus.clear();
+    m_acceptor_cpu = -1;
+    if (!m_topology.pin_threads) {
+        m_logger->info("%d I/O threads", number_of_threads);
+        return;
+    }
+    const auto &cpus = m_topology.cpus.empty() ? allowed : m_topology.cpus;
+    for (int i = 0; i < number_of_threads; ++i) {
+        m_thread_cpus.emplace_back(cpus[i % cpus.size()]);
+    }
+    m_acceptor_cpu = m_topology.acceptor_cpu >= 0 ? m_topology.acceptor_cpu : cpus.front();
+    std::string layout{};
+    for (const int cpu: m_thread_cpus) {
+        if (!layout.empty()) layout += ",";
+        layout += std::to_string(cpu);
+    }
+    m_logger->info("%d I/O threads on CPUs %s, acceptor on CPU %d", number_of_threads, layout.c_str(),
+                   m_acceptor_cpu);
+}
+
+void MultiplexingLinux::set_tls_context(const std::shared_ptr<TlsContext> &context) {
+    m_tls = context;
+}
+
+void MultiplexingLinux::enable_signal_handling() {
+    m_handle_signals = true;
+}
+
+void MultiplexingLinux::set_upgrade_handler(const std::function<void()> &handler) {
+    m_upgrade_handler = handler;
+}
+
+void MultiplexingLinux::set_child_exit_handler(const std::function<void()> &handler) {
+    m_child_exit_handler = handler;
+}
+
+bool MultiplexingLinux::is_stopping() const {
+    return m_is_shutdown;
 }
 
 void MultiplexingLinux::wait_for_thread() {
@@ -222,6 +700,9 @@ void MultiplexingLinux::wait_for_thread() {
 
 void MultiplexingLinux::setup() {
     m_logger->info("I/O multiplexing setup");
+    // sendfile has no MSG_NOSIGNAL, a peer gone in the middle of a file must show up as EPIPE
+    signal(SIGPIPE, SIG_IGN);
+    resolve_topology();
     m_main_epoll_fd = create_epoll_fd();
     if (!add_to_epoll(m_main_epoll_fd, m_socket_listen)) {
         exit_with_error("Failed to add socket to epoll file descriptor");
@@ -229,6 +710,15 @@ void MultiplexingLinux::setup() {
     for (int i = 0; i < number_of_threads; ++i) {
         const auto fd = create_epoll_fd();
         m_epoll_list.emplace_back(fd);
+        auto inbox = std::make_unique<Inbox>();
+        inbox->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        epoll_event inbox_event{};
+        inbox_event.events = EPOLLIN | EPOLLET;
+        inbox_event.data.fd = inbox->event_fd;
+        if (inbox->event_fd == -1 || epoll_ctl(fd, EPOLL_CTL_ADD, inbox->event_fd, &inbox_event) == -1) {
+            exit_with_error("Failed to setup the inbox of an I/O thread");
+        }
+        m_inboxes.emplace_back(std::move(inbox));
     }
 
     // For shutdown epoll_wait
@@ -249,15 +739,52 @@ void MultiplexingLinux::setup() {
             exit_with_error("Failed to setup quit event");
         }
     }
+
+    if (m_handle_signals || m_upgrade_handler || m_child_exit_handler) {
+        // Blocked before any thread is created, so every thread inherits the mask and the
+        // signals can only be picked up through the signalfd by the acceptor.
+        sigset_t mask;
+        sigemptyset(&mask);
+        if (m_handle_signals) {
+            sigaddset(&mask, SIGTERM);
+            sigaddset(&mask, SIGINT);
+        }
+        if (m_upgrade_handler) {
+            sigaddset(&mask, SIGUSR2);
+        }
+        if (m_child_exit_handler) {
+            sigaddset(&mask, SIGCHLD);
+        }
+        pthread_sigmask(SIG_BLOCK, &mask, nullptr);
+        m_signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+        if (m_signal_fd == -1) {
+            exit_with_error("Failed to setup signal handling");
+        }
+        epoll_event signal_event{};
+        signal_event.events = EPOLLIN;
+        signal_event.data.fd = m_signal_fd;
+        if (epoll_ctl(m_main_epoll_fd, EPOLL_CTL_ADD, m_signal_fd, &signal_event) == -1) {
+            exit_with_error("Failed to setup signal handling");
+        }
+    }
 }
 
 void MultiplexingLinux::start() {
     m_logger->info("I/O multiplexing start.");
+    m_running_threads = number_of_threads;
+    m_is_accepting = true;
     for (int i = 0; i < number_of_threads; ++i) {
         m_working_thread.emplace_back([this, i]() {
+            // Bound before the loop allocates anything, so its memory is local to the CPU
+            if (!m_thread_cpus.empty() && !ThreadTopology::pin_current_thread(m_thread_cpus[i])) {
+                m_logger->warn("Failed to pin I/O thread %d to CPU %d", i, m_thread_cpus[i]);
+            }
             thread_receive_write_loop(i);
         });
     }
+    if (m_acceptor_cpu >= 0 && !ThreadTopology::pin_current_thread(m_acceptor_cpu)) {
+        m_logger->warn("Failed to pin the acceptor to CPU %d", m_acceptor_cpu);
+    }
     main_accept_loop();
 
     m_logger->info("Waiting for thread...");
@@ -267,7 +794,16 @@ void MultiplexingLinux::start() {
 }
 
 void MultiplexingLinux::stop() {
-    notify_stop();
+    if (m_pipe[0] == -1) return;
+    if (m_is_shutdown.exchange(true)) {
+        // Asked again while draining: do not wait any longer
+        m_drain_deadline = steady_now();
+        m_logger->info("Shutdown forced, closing all connections.");
+    } else {
+        m_drain_deadline = steady_now() + m_timeouts.drain;
+        m_logger->info("Shutdown requested, draining connections for at most %lld ms.",
+                       static_cast<long long>(m_timeouts.drain));
+    }
 
     const auto signal_str = "Shutdown";
     const auto ret = write(m_pipe[0], signal_str, strlen(signal_str));
@@ -275,21 +811,21 @@ void MultiplexingLinux::stop() {
         exit_with_error("Failed while shutdown the server. Abort with -1.");
     }
     m_logger->info("Shutdown signal sent. Size of written: %d", ret);
-    m_logger->info("Epoll closed.");
 }
 
-MultiplexingLinux::MultiplexingLinux(
-    const int socket_listen,
-    const int number_of_threads,
-    const int number_of_events)
-    : m_socket_listen(socket_listen),
-      number_of_threads(number_of_threads),
-      number_of_events(number_of_events) {
+MultiplexingLinux::MultiplexingLinux(const int socket_listen)
+    : m_socket_listen(socket_listen) {
     m_logger = Logger::get_logger();
     m_address_len = sizeof(sockaddr_in);
     getsockname(m_socket_listen, (sockaddr *) &m_address, &m_address_len);
 }
 
 MultiplexingLinux::~MultiplexingLinux() {
+    for (const auto &inbox: m_inboxes) {
+        if (inbox->event_fd != -1) close(inbox->event_fd);
+    }
+    if (m_signal_fd != -1) close(m_signal_fd);
+    if (m_pipe[0] != -1) close(m_pipe[0]);
+    if (m_pipe[1] != -1) close(m_pipe[1]);
 }
 #endif